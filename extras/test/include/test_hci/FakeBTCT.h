@@ -0,0 +1,41 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _FAKE_BTCT_H_
+#define _FAKE_BTCT_H_
+
+#include "btct.h"
+
+// AES-CMAC without the controller: records the input and returns a known MAC
+class FakeBTCT : public BluetoothCryptoToolbox {
+  public:
+    FakeBTCT();
+    virtual ~FakeBTCT();
+
+    void AES_CMAC(unsigned char* key, unsigned char* input, int length, unsigned char* mac);
+
+    uint8_t key[16];
+    uint8_t input[256];
+    int length;
+    uint8_t mac[16];
+};
+
+extern FakeBTCT FakeBTCTObj;
+
+#endif
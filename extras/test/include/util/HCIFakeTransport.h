@@ -1,19 +1,71 @@
 //#include "Common.h"
 #pragma once
 
+#include <string.h>
+
 #include "HCITransport.h"
 
+#define FAKE_TRANSPORT_BUFFER_SIZE 1024
+
 class HCIFakeTransportClass : public HCITransportInterface
 {
 public:
-    HCIFakeTransportClass() {};
+    HCIFakeTransportClass() : rxLength(0), rxIndex(0), txLength(0), replyLength(0), replyIndex(0), replyCount(0), replyNext(0) {};
     ~HCIFakeTransportClass() {};
 
     int begin() {return 0;}
     void end() {return;}
     void wait(unsigned long timeout) {return;}
-    int available() {return 0;}
-    int peek() {return 0;}
-    int read() {return 0;}
-    size_t write(const uint8_t* data, size_t length) {return 0;}
-};
\ No newline at end of file
+    int available() {return rxLength - rxIndex;}
+    int peek() {return available() ? rxBuffer[rxIndex] : -1;}
+    int read() {return available() ? rxBuffer[rxIndex++] : -1;}
+    size_t write(const uint8_t* data, size_t length) {
+        if (length > sizeof(txBuffer) - txLength) {
+            length = sizeof(txBuffer) - txLength;
+        }
+        memcpy(&txBuffer[txLength], data, length);
+        txLength += length;
+
+        if (replyNext < replyCount) {
+            push(&replyBuffer[replyIndex], replyLengths[replyNext]);
+            replyIndex += replyLengths[replyNext];
+            replyNext++;
+        }
+        return length;
+    }
+
+    // Queue bytes to be received by the host
+    void push(const uint8_t* data, size_t length) {
+        if (rxIndex == rxLength) {
+            rxIndex = rxLength = 0;
+        }
+        memcpy(&rxBuffer[rxLength], data, length);
+        rxLength += length;
+    }
+    // Queue bytes to be received by the host after the next packet it writes
+    void reply(const uint8_t* data, size_t length) {
+        memcpy(&replyBuffer[replyLength], data, length);
+        replyLength += length;
+        replyLengths[replyCount++] = length;
+    }
+    void clear() {
+        rxLength = rxIndex = txLength = 0;
+        replyLength = replyIndex = replyCount = replyNext = 0;
+    }
+
+    uint8_t rxBuffer[FAKE_TRANSPORT_BUFFER_SIZE];
+    int rxLength;
+    int rxIndex;
+
+    uint8_t txBuffer[FAKE_TRANSPORT_BUFFER_SIZE];
+    size_t txLength;
+
+    uint8_t replyBuffer[FAKE_TRANSPORT_BUFFER_SIZE];
+    size_t replyLengths[16];
+    size_t replyLength;
+    size_t replyIndex;
+    size_t replyCount;
+    size_t replyNext;
+};
+
+extern HCIFakeTransportClass HCIFakeTransport;
@@ -0,0 +1,283 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <catch2/catch_test_macros.hpp>
+
+#define private public
+#define protected public
+
+#include "HCI.h"
+#include "HCIFakeTransport.h"
+
+#define ACL_PKT_SIZE 10 // H4 type, ACL header, L2CAP header, 1 byte payload
+
+static void connect(uint16_t handle)
+{
+  uint8_t connectionComplete[] = {
+    0x04, 0x3e, 0x13, 0x01, 0x00, (uint8_t)handle, (uint8_t)(handle >> 8), 0x01, 0x00,
+    0x11, 0x22, 0x33, 0x44, 0x55, (uint8_t)handle, 0x18, 0x00, 0x00, 0x00, 0xc8, 0x00, 0x00
+  };
+
+  HCIFakeTransport.push(connectionComplete, sizeof(connectionComplete));
+  HCI.poll();
+}
+
+static void completePackets(uint16_t handle, uint16_t numPkts)
+{
+  uint8_t numCompPkts[] = {0x04, 0x13, 0x05, 0x01, (uint8_t)handle, (uint8_t)(handle >> 8), (uint8_t)numPkts, (uint8_t)(numPkts >> 8)};
+
+  HCIFakeTransport.push(numCompPkts, sizeof(numCompPkts));
+  HCI.poll();
+}
+
+static uint16_t sentHandle(int index)
+{
+  uint8_t* pkt = &HCIFakeTransport.txBuffer[index * ACL_PKT_SIZE];
+
+  return pkt[1] | (pkt[2] << 8);
+}
+
+TEST_CASE("ACL flow control", "[ArduinoBLE::HCI]")
+{
+  HCIFakeTransport.clear();
+  HCI.begin();
+  HCI._maxPkt = 2;
+
+  connect(0x0040);
+  connect(0x0041);
+  HCIFakeTransport.clear();
+
+  uint8_t data = 0x42;
+
+  WHEN("The controller buffers are full")
+  {
+    HCI.sendAclPkt(0x0040, ATT_CID, sizeof(data), &data);
+    HCI.sendAclPkt(0x0040, ATT_CID, sizeof(data), &data);
+    HCI.sendAclPkt(0x0040, ATT_CID, sizeof(data), &data);
+    HCI.sendAclPkt(0x0041, ATT_CID, sizeof(data), &data);
+
+    // Two packets are sent, the others are queued per connection
+    REQUIRE(HCIFakeTransport.txLength == 2 * ACL_PKT_SIZE);
+    REQUIRE(HCI.aclPendingPackets(0x0040) == 2);
+    REQUIRE(HCI.aclQueueDepth(0x0040) == 1);
+    REQUIRE(HCI.aclQueueDepth(0x0041) == 1);
+
+    completePackets(0x0040, 2);
+
+    // Each connection gets one of the freed buffers
+    REQUIRE(HCIFakeTransport.txLength == 4 * ACL_PKT_SIZE);
+    REQUIRE(sentHandle(2) != sentHandle(3));
+    REQUIRE(HCI.aclQueueDepth(0x0040) == 0);
+    REQUIRE(HCI.aclQueueDepth(0x0041) == 0);
+    REQUIRE(HCI.aclPendingPackets(0x0040) == 1);
+    REQUIRE(HCI.aclPendingPackets(0x0041) == 1);
+  }
+
+  WHEN("One connection never completes its packets")
+  {
+    HCI._maxPkt = 4;
+
+    for (int i = 0; i < 4; i++) {
+      HCI.sendAclPkt(0x0040, ATT_CID, sizeof(data), &data);
+      HCI.sendAclPkt(0x0041, ATT_CID, sizeof(data), &data);
+    }
+
+    // Each connection sending holds its share of the controller buffers
+    REQUIRE(HCI.aclPendingPackets(0x0040) == 2);
+    REQUIRE(HCI.aclPendingPackets(0x0041) == 2);
+
+    completePackets(0x0041, 2);
+
+    // The freed buffers go to the connection that completes, the slow one stays capped
+    REQUIRE(HCI.aclPendingPackets(0x0040) == 2);
+    REQUIRE(HCI.aclPendingPackets(0x0041) == 2);
+    REQUIRE(HCI.aclQueueDepth(0x0040) == 2);
+    REQUIRE(HCI.aclQueueDepth(0x0041) == 0);
+
+    completePackets(0x0041, 2);
+
+    // Once the other connection is idle, the buffers it left are used
+    REQUIRE(HCI.aclPendingPackets(0x0040) == 4);
+    REQUIRE(HCI.aclQueueDepth(0x0040) == 0);
+    REQUIRE(HCI._pendingPkt == 4);
+  }
+
+  WHEN("A connection with queued packets is closed")
+  {
+    HCI.sendAclPkt(0x0040, ATT_CID, sizeof(data), &data);
+    HCI.sendAclPkt(0x0040, ATT_CID, sizeof(data), &data);
+    HCI.sendAclPkt(0x0040, ATT_CID, sizeof(data), &data);
+    HCI.sendAclPkt(0x0041, ATT_CID, sizeof(data), &data);
+
+    uint8_t disconnectionComplete[] = {0x04, 0x05, 0x04, 0x00, 0x40, 0x00, 0x13};
+    HCIFakeTransport.push(disconnectionComplete, sizeof(disconnectionComplete));
+    HCI.poll();
+
+    // The buffers of the closed connection are released to the other one
+    REQUIRE(HCIFakeTransport.txLength == 3 * ACL_PKT_SIZE);
+    REQUIRE(sentHandle(2) == 0x0041);
+    REQUIRE(HCI.aclQueueDepth(0x0040) == 0);
+    REQUIRE(HCI._pendingPkt == 1);
+  }
+
+  WHEN("The queue of a connection is full")
+  {
+    HCI.sendAclPkt(0x0040, ATT_CID, sizeof(data), &data);
+    HCI.sendAclPkt(0x0040, ATT_CID, sizeof(data), &data);
+
+    for (int i = 0; i < HCI_ACL_TX_QUEUE_SIZE; i++) {
+      HCI.sendAclPkt(0x0041, ATT_CID, sizeof(data), &data);
+    }
+    REQUIRE(HCI.aclQueueDepth(0x0041) == HCI_ACL_TX_QUEUE_SIZE);
+    REQUIRE(HCI.aclStallCount(0x0041) == 0);
+
+    // The next packet blocks until the controller has room for a queued one
+    uint8_t numCompPkts[] = {0x04, 0x13, 0x05, 0x01, 0x40, 0x00, 0x01, 0x00};
+    HCIFakeTransport.push(numCompPkts, sizeof(numCompPkts));
+
+    HCI.sendAclPkt(0x0041, ATT_CID, sizeof(data), &data);
+
+    REQUIRE(HCI.aclStallCount(0x0041) == 1);
+    REQUIRE(HCI.aclQueueDepth(0x0041) == HCI_ACL_TX_QUEUE_SIZE);
+    REQUIRE(HCIFakeTransport.txLength == 3 * ACL_PKT_SIZE);
+  }
+
+  WHEN("A PDU is larger than the controller buffers")
+  {
+    HCI._aclPktLen = 27;
+
+    uint8_t value[60];
+    memset(value, 0x42, sizeof(value));
+
+    // 64 bytes L2CAP PDU in fragments of 27, 27 and 10 bytes
+    HCI.sendAclPkt(0x0040, ATT_CID, sizeof(value), value);
+
+    REQUIRE(HCIFakeTransport.txLength == 2 * (5 + 27));
+    REQUIRE(HCI.aclQueueDepth(0x0040) == 1);
+
+    uint8_t* first = &HCIFakeTransport.txBuffer[0];
+    uint8_t* second = &HCIFakeTransport.txBuffer[5 + 27];
+    REQUIRE((first[1] | (first[2] << 8)) == 0x0040);
+    REQUIRE((first[5] | (first[6] << 8)) == sizeof(value));
+    REQUIRE((second[1] | (second[2] << 8)) == 0x1040);
+    REQUIRE((second[3] | (second[4] << 8)) == 27);
+
+    completePackets(0x0040, 1);
+
+    uint8_t* last = &HCIFakeTransport.txBuffer[2 * (5 + 27)];
+    REQUIRE(HCIFakeTransport.txLength == 2 * (5 + 27) + 5 + 10);
+    REQUIRE((last[1] | (last[2] << 8)) == 0x1040);
+    REQUIRE((last[3] | (last[4] << 8)) == 10);
+    REQUIRE(HCI.aclQueueDepth(0x0040) == 0);
+
+    HCI._aclPktLen = 0;
+  }
+}
+
+void set_millis(unsigned long const millis);
+
+static void receive(const uint8_t pkt[], size_t length)
+{
+  HCIFakeTransport.push(pkt, length);
+  HCI.poll();
+}
+
+TEST_CASE("L2CAP reassembly", "[ArduinoBLE::HCI]")
+{
+  HCIFakeTransport.clear();
+  HCI.begin();
+  HCI._maxPkt = 2;
+  set_millis(0);
+
+  connect(0x0040);
+  connect(0x0041);
+  HCIFakeTransport.clear();
+
+  // 6 bytes SDU to CID 0x0040 in two fragments, the host rejects the unknown CID once it is complete
+  uint8_t start40[] = {0x02, 0x40, 0x20, 0x06, 0x00, 0x06, 0x00, 0x40, 0x00, 0x01, 0x02};
+  uint8_t continue40[] = {0x02, 0x40, 0x10, 0x04, 0x00, 0x03, 0x04, 0x05, 0x06};
+  uint8_t start41[] = {0x02, 0x41, 0x20, 0x06, 0x00, 0x06, 0x00, 0x40, 0x00, 0x01, 0x02};
+  uint8_t continue41[] = {0x02, 0x41, 0x10, 0x04, 0x00, 0x03, 0x04, 0x05, 0x06};
+
+  WHEN("Fragments of two connections are interleaved")
+  {
+    receive(start40, sizeof(start40));
+    receive(start41, sizeof(start41));
+    REQUIRE(HCIFakeTransport.txLength == 0);
+
+    receive(continue41, sizeof(continue41));
+    REQUIRE(HCIFakeTransport.txLength > 0);
+    REQUIRE((HCIFakeTransport.txBuffer[1] | (HCIFakeTransport.txBuffer[2] << 8)) == 0x0041);
+    size_t rejectLength = HCIFakeTransport.txLength;
+
+    receive(continue40, sizeof(continue40));
+    REQUIRE(HCIFakeTransport.txLength == 2 * rejectLength);
+    REQUIRE((HCIFakeTransport.txBuffer[rejectLength + 1] | (HCIFakeTransport.txBuffer[rejectLength + 2] << 8)) == 0x0040);
+
+    REQUIRE(HCI.l2capDropCount(0x0040) == 0);
+    REQUIRE(HCI.l2capDropCount(0x0041) == 0);
+  }
+
+  WHEN("The rest of a PDU never arrives")
+  {
+    receive(start40, sizeof(start40));
+
+    set_millis(HCI_L2CAP_REASSEMBLY_TIMEOUT);
+    HCI.poll();
+    REQUIRE(HCI.l2capDropCount(0x0040) == 1);
+
+    // a late fragment is ignored
+    receive(continue40, sizeof(continue40));
+    REQUIRE(HCIFakeTransport.txLength == 0);
+    set_millis(0);
+  }
+
+  WHEN("A PDU is larger than the MTU of the connection")
+  {
+    uint8_t start[] = {0x02, 0x40, 0x20, 0x06, 0x00, 0x2c, 0x01, 0x04, 0x00, 0x01, 0x02};
+    receive(start, sizeof(start));
+
+    REQUIRE(HCI.l2capDropCount(0x0040) == 1);
+    REQUIRE(HCI._aclConnections[HCI.aclConnectionIndex(0x0040)].rxPool == -1);
+  }
+
+  WHEN("A start fragment is longer than the PDU it announces")
+  {
+    // 2 bytes SDU announced in a fragment of 100 bytes, more than any reassembly buffer
+    uint8_t start[5 + 100];
+    uint8_t header[] = {0x02, 0x40, 0x20, 0x64, 0x00, 0x02, 0x00, 0x40, 0x00};
+    memset(start, 0x42, sizeof(start));
+    memcpy(start, header, sizeof(header));
+    receive(start, sizeof(start));
+
+    REQUIRE(HCI.l2capDropCount(0x0040) == 1);
+    REQUIRE(HCI._aclConnections[HCI.aclConnectionIndex(0x0040)].rxPool == -1);
+    REQUIRE(HCIFakeTransport.txLength == 0);
+  }
+
+  WHEN("A new PDU starts before the previous one is complete")
+  {
+    receive(start40, sizeof(start40));
+    receive(start40, sizeof(start40));
+    receive(continue40, sizeof(continue40));
+
+    REQUIRE(HCI.l2capDropCount(0x0040) == 1);
+    REQUIRE(HCIFakeTransport.txLength > 0);
+  }
+}
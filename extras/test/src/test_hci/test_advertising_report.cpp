@@ -0,0 +1,194 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <catch2/catch_test_macros.hpp>
+
+#define private public
+#define protected public
+
+#include "HCI.h"
+#include "GAP.h"
+#include "HCIFakeTransport.h"
+
+static int discoveredCount = 0;
+static int discoveredRssi[4];
+static int discoveredDataLength = 0;
+static uint8_t discoveredData[16];
+
+static void discoveredHandler(BLEDevice device)
+{
+  if (discoveredCount < 4) {
+    discoveredRssi[discoveredCount] = device.rssi();
+  }
+  discoveredDataLength = device.manufacturerData(discoveredData, sizeof(discoveredData));
+  discoveredCount++;
+}
+
+TEST_CASE("LE Advertising Report", "[ArduinoBLE::HCI]")
+{
+  HCIFakeTransport.clear();
+  HCI.begin();
+
+  discoveredCount = 0;
+  GAP._scanning = true;
+  GAP.setEventHandler(BLEDiscovered, discoveredHandler);
+
+  WHEN("An event holds several reports")
+  {
+    uint8_t advertisingReport[] = {
+      0x04, 0x3e, 0x19, 0x02, 0x02,
+      // non connectable advertising with flags, RSSI -60
+      0x03, 0x00, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x03, 0x02, 0x01, 0x06, 0xc4,
+      // non connectable advertising without data, RSSI -70
+      0x03, 0x01, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0x00, 0xba
+    };
+    HCIFakeTransport.push(advertisingReport, sizeof(advertisingReport));
+    HCI.poll();
+
+    REQUIRE(discoveredCount == 2);
+    REQUIRE(discoveredRssi[0] == -60);
+    REQUIRE(discoveredRssi[1] == -70);
+  }
+
+  WHEN("The last report is truncated")
+  {
+    uint8_t advertisingReport[] = {
+      0x04, 0x3e, 0x17, 0x02, 0x02,
+      0x03, 0x00, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x03, 0x02, 0x01, 0x06, 0xc4,
+      0x03, 0x01, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6
+    };
+    HCIFakeTransport.push(advertisingReport, sizeof(advertisingReport));
+    HCI.poll();
+
+    REQUIRE(discoveredCount == 1);
+    REQUIRE(discoveredRssi[0] == -60);
+  }
+
+  GAP.setEventHandler(BLEDiscovered, NULL);
+  GAP._scanning = false;
+}
+
+TEST_CASE("LE Extended Advertising Report", "[ArduinoBLE::HCI]")
+{
+  HCIFakeTransport.clear();
+  HCI.begin();
+
+  discoveredCount = 0;
+  GAP._scanning = true;
+  GAP.setEventHandler(BLEDiscovered, discoveredHandler);
+
+  WHEN("The advertising data is split in several reports")
+  {
+    // connectable advertising on 1M/2M, RSSI -60, data incomplete and more to come
+    uint8_t firstReport[] = {
+      0x04, 0x3e, 0x1f, 0x0d, 0x01,
+      0x21, 0x00, 0x00, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x01, 0x02, 0x00, 0x7f, 0xc4,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x05, 0x0b, 0xff, 0x01, 0x02, 0x03
+    };
+    // data complete, RSSI -62
+    uint8_t lastReport[] = {
+      0x04, 0x3e, 0x21, 0x0d, 0x01,
+      0x01, 0x00, 0x00, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x01, 0x02, 0x00, 0x7f, 0xc2,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x07, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a
+    };
+
+    HCIFakeTransport.push(firstReport, sizeof(firstReport));
+    HCI.poll();
+    REQUIRE(discoveredCount == 0);
+
+    HCIFakeTransport.push(lastReport, sizeof(lastReport));
+    HCI.poll();
+
+    uint8_t goldenData[] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a};
+    REQUIRE(discoveredCount == 1);
+    REQUIRE(discoveredRssi[0] == -62);
+    REQUIRE(discoveredDataLength == sizeof(goldenData));
+    REQUIRE(memcmp(discoveredData, goldenData, sizeof(goldenData)) == 0);
+  }
+
+  WHEN("The chains of two advertising sets interleave")
+  {
+    // SID 1 and SID 2 of the same advertiser, data incomplete and more to come
+    uint8_t firstReport1[] = {
+      0x04, 0x3e, 0x1f, 0x0d, 0x01,
+      0x21, 0x00, 0x00, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x01, 0x02, 0x01, 0x7f, 0xc4,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x05, 0x0b, 0xff, 0x01, 0x02, 0x03
+    };
+    uint8_t firstReport2[] = {
+      0x04, 0x3e, 0x1f, 0x0d, 0x01,
+      0x21, 0x00, 0x00, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x01, 0x02, 0x02, 0x7f, 0xc4,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x05, 0x0b, 0xff, 0x11, 0x12, 0x13
+    };
+    uint8_t lastReport1[] = {
+      0x04, 0x3e, 0x21, 0x0d, 0x01,
+      0x01, 0x00, 0x00, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x01, 0x02, 0x01, 0x7f, 0xc2,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x07, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a
+    };
+    uint8_t lastReport2[] = {
+      0x04, 0x3e, 0x21, 0x0d, 0x01,
+      0x01, 0x00, 0x00, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x01, 0x02, 0x02, 0x7f, 0xc2,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x07, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a
+    };
+
+    HCIFakeTransport.push(firstReport1, sizeof(firstReport1));
+    HCI.poll();
+    HCIFakeTransport.push(firstReport2, sizeof(firstReport2));
+    HCI.poll();
+    HCIFakeTransport.push(lastReport1, sizeof(lastReport1));
+    HCI.poll();
+
+    uint8_t goldenData1[] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a};
+    REQUIRE(discoveredCount == 1);
+    REQUIRE(discoveredDataLength == sizeof(goldenData1));
+    REQUIRE(memcmp(discoveredData, goldenData1, sizeof(goldenData1)) == 0);
+
+    HCIFakeTransport.push(lastReport2, sizeof(lastReport2));
+    HCI.poll();
+
+    uint8_t goldenData2[] = {0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a};
+    REQUIRE(discoveredCount == 2);
+    REQUIRE(discoveredDataLength == sizeof(goldenData2));
+    REQUIRE(memcmp(discoveredData, goldenData2, sizeof(goldenData2)) == 0);
+  }
+
+  WHEN("A legacy PDU is reported by extended scanning")
+  {
+    // ADV_NONCONN_IND with flags, RSSI -70
+    uint8_t advertisingReport[] = {
+      0x04, 0x3e, 0x1d, 0x0d, 0x01,
+      0x10, 0x00, 0x01, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0x01, 0x00, 0xff, 0x7f, 0xba,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x03, 0x02, 0x01, 0x06
+    };
+    HCIFakeTransport.push(advertisingReport, sizeof(advertisingReport));
+    HCI.poll();
+
+    REQUIRE(discoveredCount == 1);
+    REQUIRE(discoveredRssi[0] == -70);
+  }
+
+  GAP.setEventHandler(BLEDiscovered, NULL);
+  GAP._scanning = false;
+}
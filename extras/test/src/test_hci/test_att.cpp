@@ -0,0 +1,1617 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <catch2/catch_test_macros.hpp>
+
+#define private public
+#define protected public
+
+#include "HCI.h"
+#include "ATT.h"
+#include "HCIFakeTransport.h"
+#include "FakeBTCT.h"
+
+#include "BLEProperty.h"
+#include "GATT.h"
+#include "remote/BLERemoteDevice.h"
+#include "remote/BLERemoteService.h"
+
+void set_millis(unsigned long const millis);
+
+// a peripheral connection with the peer 55:44:33:22:11:<addressByte>
+static void connect(uint16_t handle, uint8_t addressByte)
+{
+  uint8_t event[] = {
+    0x04, 0x3e, 0x13, 0x01, 0x00, (uint8_t)handle, (uint8_t)(handle >> 8), 0x00, 0x00,
+    0x11, 0x22, 0x33, 0x44, 0x55, addressByte, 0x18, 0x00, 0x00, 0x00, 0xc8, 0x00, 0x00
+  };
+
+  HCIFakeTransport.push(event, sizeof(event));
+  HCI.poll();
+}
+
+static void disconnectionComplete(uint16_t handle)
+{
+  uint8_t event[] = {0x04, 0x05, 0x04, 0x00, (uint8_t)handle, (uint8_t)(handle >> 8), 0x13};
+
+  HCIFakeTransport.push(event, sizeof(event));
+  HCI.poll();
+}
+
+// a started host without connections, no Number Of Completed Packets events are sent to return the credits
+struct ATTTestHost {
+  ATTTestHost()
+  {
+    HCIFakeTransport.clear();
+    HCI.begin();
+    HCI._maxPkt = 16;
+    HCI._pendingPkt = 0;
+    set_millis(0);
+
+    forgetPeers();
+  }
+
+  ~ATTTestHost()
+  {
+    forgetPeers();
+    set_millis(0);
+  }
+
+  // forget the connections a test left behind
+  static void forgetPeers()
+  {
+    for (int i = 0; i < ATT_MAX_PEERS; i++) {
+      ATT._peers[i].connectionHandle = 0xffff;
+      ATT._peers[i].mtu = 23;
+      ATT._peers[i].pendingResp.op = 0x00;
+
+      if (ATT._peers[i].device) {
+        delete ATT._peers[i].device;
+        ATT._peers[i].device = NULL;
+      }
+    }
+  }
+};
+
+static int completions = 0;
+static bool lastSuccess = false;
+
+static void characteristicCompleted(BLEDevice /*device*/, BLECharacteristic /*characteristic*/, bool success)
+{
+  completions++;
+  lastSuccess = success;
+}
+
+static void deviceCompleted(BLEDevice /*device*/, bool success)
+{
+  completions++;
+  lastSuccess = success;
+}
+
+static void receive(uint8_t pkt[], int length)
+{
+  HCIFakeTransport.clear();
+  HCIFakeTransport.push(pkt, length);
+  HCI.poll();
+}
+
+// opcode of the last ATT PDU sent
+static uint8_t sentOpcode()
+{
+  return (HCIFakeTransport.txLength >= 10) ? HCIFakeTransport.txBuffer[9] : 0x00;
+}
+
+// ATT PDU received on connection 0x0040 after the next packet sent
+static void replyAtt(const uint8_t pdu[], uint16_t length)
+{
+  uint8_t pkt[9 + length];
+  uint8_t header[] = {0x02, 0x40, 0x20, (uint8_t)(length + 4), (uint8_t)((length + 4) >> 8), (uint8_t)length, (uint8_t)(length >> 8), 0x04, 0x00};
+
+  memcpy(pkt, header, sizeof(header));
+  memcpy(&pkt[9], pdu, length);
+
+  HCIFakeTransport.reply(pkt, sizeof(pkt));
+}
+
+TEST_CASE_METHOD(ATTTestHost, "ATT transactions on several connections", "[ArduinoBLE::ATT]")
+{
+  connect(0x0040, 0x40);
+  connect(0x0041, 0x41);
+
+  uint8_t response40[ATT_MAX_MTU];
+  uint8_t response41[ATT_MAX_MTU];
+
+  REQUIRE(ATT.readReqAsync(0x0040, 0x0003, response40) == 1);
+  REQUIRE(ATT.readReqAsync(0x0041, 0x0003, response41) == 1);
+
+  // a single request can be outstanding per connection
+  REQUIRE(ATT.readReqAsync(0x0040, 0x0005, response40) == 0);
+
+  REQUIRE(ATT.reqPending(0x0040));
+  REQUIRE(ATT.reqPending(0x0041));
+
+  WHEN("The responses arrive out of order")
+  {
+    uint8_t readResp41[] = {0x02, 0x41, 0x20, 0x07, 0x00, 0x03, 0x00, 0x04, 0x00, 0x0b, 0xaa, 0xbb};
+    HCIFakeTransport.push(readResp41, sizeof(readResp41));
+
+    REQUIRE(!ATT.reqPending(0x0041));
+    REQUIRE(ATT.reqPending(0x0040));
+    REQUIRE(ATT.reqResult(0x0041) == 3);
+    REQUIRE(response41[0] == 0x0b);
+    REQUIRE(response41[1] == 0xaa);
+    REQUIRE(response41[2] == 0xbb);
+
+    // an error completes the request it refers to
+    uint8_t errorResp40[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x01, 0x0a, 0x03, 0x00, 0x0a};
+    HCIFakeTransport.push(errorResp40, sizeof(errorResp40));
+
+    REQUIRE(!ATT.reqPending(0x0040));
+    REQUIRE(ATT.reqResult(0x0040) == 5);
+    REQUIRE(response40[0] == 0x01);
+    REQUIRE(response40[1] == 0x0a);
+  }
+
+  WHEN("A transaction times out")
+  {
+    set_millis(ATT._timeout);
+
+    REQUIRE(!ATT.reqPending(0x0040));
+    REQUIRE(ATT.reqResult(0x0040) == 0);
+
+    // a late response is dropped
+    uint8_t readResp40[] = {0x02, 0x40, 0x20, 0x06, 0x00, 0x02, 0x00, 0x04, 0x00, 0x0b, 0xaa};
+    HCIFakeTransport.push(readResp40, sizeof(readResp40));
+    HCI.poll();
+
+    REQUIRE(ATT.reqResult(0x0040) == 0);
+    REQUIRE(ATT.readReqAsync(0x0040, 0x0005, response40) == 1);
+  }
+
+}
+
+TEST_CASE_METHOD(ATTTestHost, "Queued ATT client operations", "[ArduinoBLE::ATT]")
+{
+  connect(0x0040, 0x40);
+  completions = 0;
+
+  WHEN("A read and a write are queued on a connection")
+  {
+    uint8_t uuid[] = {0x19, 0x2a};
+    BLERemoteCharacteristic* characteristic = new BLERemoteCharacteristic(uuid, sizeof(uuid), 0x0040, 0x0002, BLERead | BLEWrite, 0x0003);
+    BLECharacteristic bleCharacteristic(characteristic);
+    uint8_t value[] = {0x01, 0x02};
+
+    HCIFakeTransport.clear();
+    REQUIRE(bleCharacteristic.readAsync(characteristicCompleted));
+    REQUIRE(bleCharacteristic.writeAsync(value, sizeof(value), characteristicCompleted));
+
+    // the write waits for the read response
+    REQUIRE(sentOpcode() == 0x0a);
+    REQUIRE(HCIFakeTransport.txLength == 12);
+    REQUIRE(ATT.operationsPending(0x0040));
+
+    uint8_t readResp[] = {0x02, 0x40, 0x20, 0x06, 0x00, 0x02, 0x00, 0x04, 0x00, 0x0b, 0x64};
+    receive(readResp, sizeof(readResp));
+
+    REQUIRE(completions == 1);
+    REQUIRE(lastSuccess);
+    REQUIRE(bleCharacteristic.valueLength() == 1);
+    REQUIRE(bleCharacteristic.value()[0] == 0x64);
+    REQUIRE(sentOpcode() == 0x12);
+
+    uint8_t writeError[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x01, 0x12, 0x03, 0x00, 0x03};
+    receive(writeError, sizeof(writeError));
+
+    REQUIRE(completions == 2);
+    REQUIRE(!lastSuccess);
+    REQUIRE(!ATT.operationsPending(0x0040));
+  }
+
+  WHEN("The attributes are discovered asynchronously")
+  {
+    HCIFakeTransport.clear();
+    REQUIRE(ATT.discoverAttributesAsync(ATT._peers[0].addressType, ATT._peers[0].address, NULL, deviceCompleted));
+    REQUIRE(sentOpcode() == 0x02);
+
+    uint8_t mtuResp[] = {0x02, 0x40, 0x20, 0x07, 0x00, 0x03, 0x00, 0x04, 0x00, 0x03, 0x17, 0x00};
+    receive(mtuResp, sizeof(mtuResp));
+    REQUIRE(sentOpcode() == 0x10);
+
+    uint8_t servicesResp[] = {0x02, 0x40, 0x20, 0x0c, 0x00, 0x08, 0x00, 0x04, 0x00, 0x11, 0x06, 0x01, 0x00, 0x05, 0x00, 0x0f, 0x18};
+    receive(servicesResp, sizeof(servicesResp));
+    REQUIRE(sentOpcode() == 0x10);
+
+    uint8_t servicesEnd[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x01, 0x10, 0x06, 0x00, 0x0a};
+    receive(servicesEnd, sizeof(servicesEnd));
+    REQUIRE(sentOpcode() == 0x08);
+
+    uint8_t characteristicsResp[] = {0x02, 0x40, 0x20, 0x0d, 0x00, 0x09, 0x00, 0x04, 0x00, 0x09, 0x07, 0x02, 0x00, 0x12, 0x03, 0x00, 0x19, 0x2a};
+    receive(characteristicsResp, sizeof(characteristicsResp));
+    REQUIRE(sentOpcode() == 0x08);
+
+    uint8_t characteristicsEnd[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x01, 0x08, 0x04, 0x00, 0x0a};
+    receive(characteristicsEnd, sizeof(characteristicsEnd));
+    REQUIRE(sentOpcode() == 0x04);
+
+    uint8_t descriptorsResp[] = {0x02, 0x40, 0x20, 0x0a, 0x00, 0x06, 0x00, 0x04, 0x00, 0x05, 0x01, 0x04, 0x00, 0x02, 0x29};
+    receive(descriptorsResp, sizeof(descriptorsResp));
+    REQUIRE(sentOpcode() == 0x04);
+    REQUIRE(completions == 0);
+
+    uint8_t descriptorsEnd[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x01, 0x04, 0x05, 0x00, 0x0a};
+    receive(descriptorsEnd, sizeof(descriptorsEnd));
+
+    REQUIRE(completions == 1);
+    REQUIRE(lastSuccess);
+
+    BLERemoteDevice* device = ATT._peers[0].device;
+    REQUIRE(device->serviceCount() == 1);
+    REQUIRE(device->service(0)->characteristicCount() == 1);
+    REQUIRE(device->service(0)->characteristic(0)->valueHandle() == 0x0003);
+    REQUIRE(device->service(0)->characteristic(0)->descriptorCount() == 1);
+    REQUIRE(device->service(0)->characteristic(0)->cccdHandle() == 0x0004);
+  }
+
+  WHEN("The connection is lost")
+  {
+    REQUIRE(ATT.discoverAttributesAsync(ATT._peers[0].addressType, ATT._peers[0].address, NULL, deviceCompleted));
+
+    uint8_t disconnComplete[] = {0x04, 0x05, 0x04, 0x00, 0x40, 0x00, 0x13};
+    receive(disconnComplete, sizeof(disconnComplete));
+
+    REQUIRE(completions == 1);
+    REQUIRE(!lastSuccess);
+    REQUIRE(!ATT.operationsPending(0x0040));
+  }
+
+  WHEN("The connections are closed")
+  {
+    REQUIRE(ATT.discoverAttributesAsync(ATT._peers[0].addressType, ATT._peers[0].address, NULL, deviceCompleted));
+
+    uint8_t disconnectStatus[] = {0x04, 0x0f, 0x04, 0x00, 0x01, 0x06, 0x04};
+    HCIFakeTransport.clear();
+    HCIFakeTransport.reply(disconnectStatus, sizeof(disconnectStatus));
+
+    REQUIRE(ATT.disconnect());
+
+    // the discovery fails and its request is dropped
+    REQUIRE(completions == 1);
+    REQUIRE(!lastSuccess);
+    REQUIRE(!ATT.operationsPending(0x0040));
+    REQUIRE(ATT._peers[0].pendingResp.op == 0x00);
+  }
+
+  WHEN("A read is waited for behind a queued write")
+  {
+    uint8_t uuid[] = {0x19, 0x2a};
+    BLERemoteCharacteristic* characteristic = new BLERemoteCharacteristic(uuid, sizeof(uuid), 0x0040, 0x0002, BLERead | BLEWrite, 0x0003);
+    BLECharacteristic bleCharacteristic(characteristic);
+    uint8_t value[] = {0x01, 0x02};
+    uint8_t writeResp[] = {0x13};
+    uint8_t readResp[] = {0x0b, 0x64};
+
+    HCIFakeTransport.clear();
+    replyAtt(writeResp, sizeof(writeResp));
+    replyAtt(readResp, sizeof(readResp));
+
+    REQUIRE(bleCharacteristic.writeAsync(value, sizeof(value), characteristicCompleted));
+    REQUIRE(bleCharacteristic.read());
+
+    // the Read Request is sent once the write is answered
+    REQUIRE(completions == 1);
+    REQUIRE(lastSuccess);
+    REQUIRE(HCIFakeTransport.txLength == (9 + 5) + (9 + 3));
+    REQUIRE(HCIFakeTransport.txBuffer[9] == 0x12);
+    REQUIRE(HCIFakeTransport.txBuffer[9 + 5 + 9] == 0x0a);
+    REQUIRE(bleCharacteristic.valueLength() == 1);
+    REQUIRE(bleCharacteristic.value()[0] == 0x64);
+  }
+
+  WHEN("A response has not been read by its requester")
+  {
+    uint8_t resp[ATT_MAX_MTU];
+
+    REQUIRE(ATT.readReqAsync(0x0040, 0x0003, resp));
+
+    uint8_t readResp[] = {0x02, 0x40, 0x20, 0x06, 0x00, 0x02, 0x00, 0x04, 0x00, 0x0b, 0x64};
+    receive(readResp, sizeof(readResp));
+
+    // the response is kept, even past the transaction timeout
+    set_millis(60000);
+    REQUIRE(!ATT.readReqAsync(0x0040, 0x0004, resp));
+    REQUIRE(ATT.reqResult(0x0040) == 2);
+    REQUIRE(resp[1] == 0x64);
+    REQUIRE(ATT.readReqAsync(0x0040, 0x0004, resp));
+  }
+}
+
+TEST_CASE_METHOD(ATTTestHost, "ATT Read Multiple", "[ArduinoBLE::ATT]")
+{
+  connect(0x0040, 0x40);
+
+  WHEN("A peer reads the device name and appearance at once")
+  {
+    // Generic Access service: device name value at 0x0003, appearance value at 0x0005
+    GATT.begin();
+
+    uint8_t readMultipleVariable[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x20, 0x03, 0x00, 0x05, 0x00};
+    receive(readMultipleVariable, sizeof(readMultipleVariable));
+
+    uint8_t expectedVariable[] = {0x21, 0x07, 0x00, 'A', 'r', 'd', 'u', 'i', 'n', 'o', 0x02, 0x00, 0x00, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedVariable));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedVariable, sizeof(expectedVariable)) == 0);
+
+    uint8_t readMultiple[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x0e, 0x03, 0x00, 0x05, 0x00};
+    receive(readMultiple, sizeof(readMultiple));
+
+    uint8_t expected[] = {0x0f, 'A', 'r', 'd', 'u', 'i', 'n', 'o', 0x00, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expected));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expected, sizeof(expected)) == 0);
+
+    // every handle has to be readable
+    uint8_t readUnknown[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x0e, 0x03, 0x00, 0x99, 0x00};
+    receive(readUnknown, sizeof(readUnknown));
+
+    uint8_t expectedError[] = {0x01, 0x0e, 0x99, 0x00, 0x0a};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedError));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedError, sizeof(expectedError)) == 0);
+
+    GATT.end();
+  }
+
+  WHEN("Several remote characteristics are read at once")
+  {
+    uint8_t uuid[] = {0x19, 0x2a};
+    BLERemoteCharacteristic* first = new BLERemoteCharacteristic(uuid, sizeof(uuid), 0x0040, 0x0002, BLERead, 0x0003);
+    BLERemoteCharacteristic* second = new BLERemoteCharacteristic(uuid, sizeof(uuid), 0x0040, 0x0004, BLERead, 0x0005);
+    BLERemoteCharacteristic* characteristics[] = { first, second };
+
+    // the response is received as soon as the request is sent
+    uint8_t readMultipleResp[] = {0x02, 0x40, 0x20, 0x0c, 0x00, 0x08, 0x00, 0x04, 0x00, 0x21, 0x01, 0x00, 0x64, 0x02, 0x00, 0x01, 0x02};
+    HCIFakeTransport.clear();
+    HCIFakeTransport.push(readMultipleResp, sizeof(readMultipleResp));
+
+    REQUIRE(ATT.readMultiple(0x0040, characteristics, 2));
+
+    uint8_t expectedReq[] = {0x20, 0x03, 0x00, 0x05, 0x00};
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedReq, sizeof(expectedReq)) == 0);
+
+    REQUIRE(first->valueLength() == 1);
+    REQUIRE(first->value()[0] == 0x64);
+    REQUIRE(second->valueLength() == 2);
+    REQUIRE(second->value()[1] == 0x02);
+
+    delete first;
+    delete second;
+  }
+}
+
+TEST_CASE_METHOD(ATTTestHost, "GATT attribute table", "[ArduinoBLE::GATT]")
+{
+  connect(0x0040, 0x40);
+
+  // Generic Access at 0x0001 - 0x0005, Generic Attribute at 0x0006 - 0x000d
+  GATT.begin();
+
+  BLEService service("19b10000-e8f2-537e-4f6c-d104768a1214");
+  BLECharacteristic characteristic("2a19", BLERead | BLENotify, 2);
+  BLEDescriptor descriptor("2901", "level");
+
+  characteristic.addDescriptor(descriptor);
+  service.addCharacteristic(characteristic);
+  GATT.addService(service);
+
+  WHEN("Attributes are looked up by handle")
+  {
+    REQUIRE(GATT.attributeCount() == 18);
+    REQUIRE(GATT.attributeEntry(0x0000) == NULL);
+    REQUIRE(GATT.attributeEntry(0x0013) == NULL);
+
+    REQUIRE(GATT.attributeEntry(0x000e)->kind == GATT_ATTRIBUTE_SERVICE);
+    REQUIRE(GATT.attributeEntry(0x000f)->kind == GATT_ATTRIBUTE_CHARACTERISTIC);
+
+    const GATTAttributeEntry* value = GATT.attributeEntry(0x0010);
+    REQUIRE(value->kind == GATT_ATTRIBUTE_CHARACTERISTIC_VALUE);
+    REQUIRE(value->serviceHandle == 0x000e);
+    REQUIRE(value->characteristicHandle == 0x000f);
+    REQUIRE(value->properties == (BLERead | BLENotify));
+
+    const GATTAttributeEntry* userDescription = GATT.attributeEntry(0x0012);
+    REQUIRE(userDescription->kind == GATT_ATTRIBUTE_DESCRIPTOR);
+    REQUIRE(userDescription->characteristicHandle == 0x000f);
+  }
+
+  WHEN("Services are discovered from the middle of a service")
+  {
+    uint8_t readByGroup[] = {0x02, 0x40, 0x20, 0x0b, 0x00, 0x07, 0x00, 0x04, 0x00, 0x10, 0x02, 0x00, 0xff, 0xff, 0x00, 0x28};
+    receive(readByGroup, sizeof(readByGroup));
+
+    // the 128-bit service does not fit in the same response
+    uint8_t expected[] = {0x11, 0x06, 0x06, 0x00, 0x0d, 0x00, 0x01, 0x18};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expected));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expected, sizeof(expected)) == 0);
+  }
+
+  WHEN("The same discovery request is served again after the services changed")
+  {
+    uint8_t readByGroup[] = {0x02, 0x40, 0x20, 0x0b, 0x00, 0x07, 0x00, 0x04, 0x00, 0x10, 0x13, 0x00, 0xff, 0xff, 0x00, 0x28};
+    receive(readByGroup, sizeof(readByGroup));
+
+    uint8_t expectedError[] = {0x01, 0x10, 0x13, 0x00, 0x0a};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedError));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedError, sizeof(expectedError)) == 0);
+    REQUIRE(ATT._discoveryCache[0].opcode == 0x10);
+    REQUIRE(ATT._discoveryCache[0].length == 0);
+
+    BLEService batteryService("180f");
+    GATT.addService(batteryService);
+
+    receive(readByGroup, sizeof(readByGroup));
+
+    uint8_t expected[] = {0x11, 0x06, 0x13, 0x00, 0x13, 0x00, 0x0f, 0x18};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expected));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expected, sizeof(expected)) == 0);
+
+    // served from the cache
+    receive(readByGroup, sizeof(readByGroup));
+
+    REQUIRE(ATT._discoveryCacheNext == 1);
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expected));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expected, sizeof(expected)) == 0);
+  }
+
+  WHEN("The CCCD of a characteristic is written")
+  {
+    uint8_t writeCccd[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x12, 0x11, 0x00, 0x01, 0x00};
+    receive(writeCccd, sizeof(writeCccd));
+
+    REQUIRE(sentOpcode() == 0x13);
+    REQUIRE(characteristic.subscribed());
+
+    // a characteristic declaration is not writable
+    uint8_t writeDeclaration[] = {0x02, 0x40, 0x20, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x52, 0x0f, 0x00, 0x01};
+    receive(writeDeclaration, sizeof(writeDeclaration));
+
+    REQUIRE(HCIFakeTransport.txLength == 0);
+  }
+
+  GATT.end();
+}
+
+static int fakeGetLTK(uint8_t* /*address*/, uint8_t* /*LTK*/)
+{
+  return 1;
+}
+
+TEST_CASE_METHOD(ATTTestHost, "Per-connection CCCD values", "[ArduinoBLE::ATT]")
+{
+  // Generic Access at 0x0001 - 0x0005, Generic Attribute at 0x0006 - 0x000d
+  GATT.begin();
+
+  // characteristic declaration at 0x000f, value at 0x0010, CCCD at 0x0011
+  BLEService service("180f");
+  BLECharacteristic characteristic("2a19", BLERead | BLENotify, 2);
+
+  service.addCharacteristic(characteristic);
+  GATT.addService(service);
+
+  connect(0x0040, 0x40);
+  connect(0x0041, 0x41);
+
+  uint8_t address40[6] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x40};
+  uint8_t address41[6] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x41};
+  BLEDevice central40(0x00, address40);
+  BLEDevice central41(0x00, address41);
+
+  uint8_t subscribe41[] = {0x02, 0x41, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x12, 0x11, 0x00, 0x01, 0x00};
+  receive(subscribe41, sizeof(subscribe41));
+  REQUIRE(sentOpcode() == 0x13);
+
+  WHEN("Only one of the centrals subscribed")
+  {
+    REQUIRE(characteristic.subscribed());
+    REQUIRE(characteristic.subscribed(central41));
+    REQUIRE_FALSE(characteristic.subscribed(central40));
+
+    // each central reads its own CCCD value
+    uint8_t readCccd40[] = {0x02, 0x40, 0x20, 0x07, 0x00, 0x03, 0x00, 0x04, 0x00, 0x0a, 0x11, 0x00};
+    receive(readCccd40, sizeof(readCccd40));
+    uint8_t expected40[] = {0x0b, 0x00, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expected40));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expected40, sizeof(expected40)) == 0);
+
+    uint8_t readCccd41[] = {0x02, 0x41, 0x20, 0x07, 0x00, 0x03, 0x00, 0x04, 0x00, 0x0a, 0x11, 0x00};
+    receive(readCccd41, sizeof(readCccd41));
+    uint8_t expected41[] = {0x0b, 0x01, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expected41));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expected41, sizeof(expected41)) == 0);
+
+    // also when read by type
+    uint8_t readByType40[] = {0x02, 0x40, 0x20, 0x0b, 0x00, 0x07, 0x00, 0x04, 0x00, 0x08, 0x11, 0x00, 0x11, 0x00, 0x02, 0x29};
+    receive(readByType40, sizeof(readByType40));
+    uint8_t expectedByType40[] = {0x09, 0x04, 0x11, 0x00, 0x00, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedByType40));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedByType40, sizeof(expectedByType40)) == 0);
+
+    uint8_t readByType41[] = {0x02, 0x41, 0x20, 0x0b, 0x00, 0x07, 0x00, 0x04, 0x00, 0x08, 0x11, 0x00, 0x11, 0x00, 0x02, 0x29};
+    receive(readByType41, sizeof(readByType41));
+    uint8_t expectedByType41[] = {0x09, 0x04, 0x11, 0x00, 0x01, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedByType41));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedByType41, sizeof(expectedByType41)) == 0);
+
+    // the notification only goes to the subscribed central
+    uint8_t value[] = {0x64, 0x00};
+    HCIFakeTransport.clear();
+    REQUIRE(characteristic.writeValue(value, sizeof(value)) == 2);
+
+    uint8_t notification[] = {0x02, 0x41, 0x00, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x1b, 0x10, 0x00, 0x64, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(notification));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, notification, sizeof(notification)) == 0);
+
+    disconnectionComplete(0x0041);
+
+    REQUIRE_FALSE(characteristic.subscribed());
+    REQUIRE(characteristic.local()->_cccdValues.size() == 0);
+  }
+
+  WHEN("A CCCD value is not two bytes long")
+  {
+    uint8_t subscribe40[] = {0x02, 0x40, 0x20, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x12, 0x11, 0x00, 0x01};
+    receive(subscribe40, sizeof(subscribe40));
+
+    uint8_t expected[] = {0x01, 0x12, 0x11, 0x00, 0x0d};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expected));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expected, sizeof(expected)) == 0);
+    REQUIRE_FALSE(characteristic.subscribed(central40));
+
+    disconnectionComplete(0x0041);
+  }
+
+  WHEN("A bonded central reconnects")
+  {
+    HCI._getLTK = fakeGetLTK;
+
+    disconnectionComplete(0x0041);
+
+    REQUIRE_FALSE(characteristic.subscribed());
+    REQUIRE(characteristic.local()->_cccdValues.size() == 1);
+
+    connect(0x0042, 0x41);
+
+    REQUIRE(characteristic.subscribed());
+    REQUIRE(characteristic.subscribed(central41));
+
+    HCI._getLTK = 0;
+    disconnectionComplete(0x0042);
+  }
+
+  disconnectionComplete(0x0040);
+
+  GATT.end();
+}
+
+static int confirmations = 0;
+static uint8_t confirmedAddress = 0x00;
+
+static void indicationConfirmed(BLEDevice device, BLECharacteristic /*characteristic*/)
+{
+  confirmations++;
+  confirmedAddress = device._address[5];
+}
+
+TEST_CASE_METHOD(ATTTestHost, "Queued indications", "[ArduinoBLE::ATT]")
+{
+  GATT.begin();
+
+  // characteristic declaration at 0x000f, value at 0x0010, CCCD at 0x0011
+  BLEService service("1802");
+  BLECharacteristic alert("2a06", BLERead | BLEIndicate, 1);
+
+  service.addCharacteristic(alert);
+  GATT.addService(service);
+
+  alert.setEventHandler(BLEIndicationConfirmed, indicationConfirmed);
+  confirmations = 0;
+
+  connect(0x0040, 0x40);
+  connect(0x0041, 0x41);
+
+  uint8_t subscribe40[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x12, 0x11, 0x00, 0x02, 0x00};
+  receive(subscribe40, sizeof(subscribe40));
+  uint8_t subscribe41[] = {0x02, 0x41, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x12, 0x11, 0x00, 0x02, 0x00};
+  receive(subscribe41, sizeof(subscribe41));
+
+  WHEN("Values are indicated faster than the centrals confirm them")
+  {
+    uint8_t first = 0x01;
+    uint8_t second = 0x02;
+
+    // both connections get the first value without waiting for a confirmation
+    HCIFakeTransport.clear();
+    REQUIRE(alert.writeValue(&first, 1) == 1);
+
+    uint8_t indications[] = {
+      0x02, 0x40, 0x00, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x1d, 0x10, 0x00, 0x01,
+      0x02, 0x41, 0x00, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x1d, 0x10, 0x00, 0x01
+    };
+    REQUIRE(HCIFakeTransport.txLength == sizeof(indications));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, indications, sizeof(indications)) == 0);
+
+    // the second value waits for the confirmations
+    HCIFakeTransport.clear();
+    REQUIRE(alert.writeValue(&second, 1) == 1);
+    REQUIRE(HCIFakeTransport.txLength == 0);
+    REQUIRE(ATT.indicationsPending(0x0040));
+    REQUIRE(ATT.indicationsPending(0x0041));
+
+    // the connection confirming first progresses on its own
+    uint8_t confirm41[] = {0x02, 0x41, 0x20, 0x05, 0x00, 0x01, 0x00, 0x04, 0x00, 0x1e};
+    receive(confirm41, sizeof(confirm41));
+
+    uint8_t next41[] = {0x02, 0x41, 0x00, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x1d, 0x10, 0x00, 0x02};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(next41));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, next41, sizeof(next41)) == 0);
+    REQUIRE(confirmations == 1);
+    REQUIRE(confirmedAddress == 0x41);
+
+    receive(confirm41, sizeof(confirm41));
+
+    REQUIRE(HCIFakeTransport.txLength == 0);
+    REQUIRE(confirmations == 2);
+    REQUIRE_FALSE(ATT.indicationsPending(0x0041));
+
+    // a confirmation without an indication is dropped
+    receive(confirm41, sizeof(confirm41));
+    REQUIRE(confirmations == 2);
+
+    // the indications of a connection are dropped on disconnect
+    disconnectionComplete(0x0040);
+
+    REQUIRE(ATT._peers[0].indications.size() == 0);
+    REQUIRE(confirmations == 2);
+  }
+
+  WHEN("A central never confirms an indication")
+  {
+    uint8_t value = 0x01;
+
+    REQUIRE(alert.writeValue(&value, 1) == 1);
+    REQUIRE(alert.writeValue(&value, 1) == 1);
+
+    // the second value goes out later to the central confirming the first one
+    uint8_t confirm41[] = {0x02, 0x41, 0x20, 0x05, 0x00, 0x01, 0x00, 0x04, 0x00, 0x1e};
+    set_millis(1000);
+    receive(confirm41, sizeof(confirm41));
+
+    set_millis(ATT_INDICATION_TIMEOUT - 1);
+    HCI.poll();
+    REQUIRE(ATT.indicationsPending(0x0040));
+
+    // the transaction times out, the central is disconnected
+    uint8_t disconnectStatus[] = {0x04, 0x0f, 0x04, 0x00, 0x01, 0x06, 0x04};
+    HCIFakeTransport.clear();
+    HCIFakeTransport.reply(disconnectStatus, sizeof(disconnectStatus));
+    set_millis(ATT_INDICATION_TIMEOUT);
+    HCI.poll();
+
+    uint8_t disconnect40[] = {0x01, 0x06, 0x04, 0x03, 0x40, 0x00, 0x13};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(disconnect40));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, disconnect40, sizeof(disconnect40)) == 0);
+    REQUIRE_FALSE(ATT.indicationsPending(0x0040));
+
+    // the second indication to the other central is not late yet
+    REQUIRE(ATT.indicationsPending(0x0041));
+  }
+
+  disconnectionComplete(0x0040);
+  disconnectionComplete(0x0041);
+
+  GATT.end();
+}
+
+TEST_CASE_METHOD(ATTTestHost, "Coalesced notifications", "[ArduinoBLE::ATT]")
+{
+  GATT.begin();
+
+  // characteristic declaration at 0x000f, value at 0x0010, CCCD at 0x0011
+  BLEService service("181a");
+  BLECharacteristic sample("2a6e", BLERead | BLENotify, 1);
+
+  service.addCharacteristic(sample);
+  GATT.addService(service);
+
+  sample.setNotifyCoalescing(true);
+
+  connect(0x0040, 0x40);
+
+  uint8_t subscribe[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x12, 0x11, 0x00, 0x01, 0x00};
+  receive(subscribe, sizeof(subscribe));
+
+  WHEN("Values are written faster than the controller takes them")
+  {
+    // a single controller buffer, taken by the first notification
+    HCI._maxPkt = 1;
+    HCI._pendingPkt = 0;
+    HCI._aclConnections[HCI.aclConnectionIndex(0x0040)].pendingPkt = 0;
+    HCIFakeTransport.clear();
+
+    for (uint8_t value = 1; value <= 4; value++) {
+      REQUIRE(sample.writeValue(&value, 1) == 1);
+    }
+
+    // the second waits in the ACL queue, the third was replaced by the fourth
+    uint8_t first[] = {0x02, 0x40, 0x00, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x1b, 0x10, 0x00, 0x01};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(first));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, first, sizeof(first)) == 0);
+    REQUIRE(HCI.aclQueueDepth(0x0040) == 1);
+    REQUIRE(sample.coalescedNotifications() == 1);
+
+    // each completed packet lets the next one go
+    uint8_t numCompPkts[] = {0x04, 0x13, 0x05, 0x01, 0x40, 0x00, 0x01, 0x00};
+    receive(numCompPkts, sizeof(numCompPkts));
+
+    uint8_t second[] = {0x02, 0x40, 0x00, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x1b, 0x10, 0x00, 0x02};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(second));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, second, sizeof(second)) == 0);
+
+    receive(numCompPkts, sizeof(numCompPkts));
+
+    uint8_t latest[] = {0x02, 0x40, 0x00, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x1b, 0x10, 0x00, 0x04};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(latest));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, latest, sizeof(latest)) == 0);
+    REQUIRE(ATT._peers[0].notifications.size() == 0);
+
+    // a value still pending on disconnect is counted as dropped
+    uint8_t value = 5;
+    sample.writeValue(&value, 1);
+    sample.writeValue(&value, 1);
+    REQUIRE(ATT._peers[0].notifications.size() == 1);
+
+    disconnectionComplete(0x0040);
+
+    REQUIRE(sample.droppedNotifications() == 1);
+  }
+
+  HCI._maxPkt = 16;
+  HCI._pendingPkt = 0;
+  disconnectionComplete(0x0040);
+
+  GATT.end();
+}
+
+TEST_CASE_METHOD(ATTTestHost, "Multiple handle value notifications", "[ArduinoBLE::ATT]")
+{
+  GATT.begin();
+
+  // values at 0x0010 and 0x0013, CCCDs at 0x0011 and 0x0014
+  BLEService service("181a");
+  BLECharacteristic temperature("2a6e", BLERead | BLENotify, 1);
+  BLECharacteristic humidity("2a6f", BLERead | BLENotify, 1);
+
+  service.addCharacteristic(temperature);
+  service.addCharacteristic(humidity);
+  GATT.addService(service);
+
+  connect(0x0040, 0x40);
+
+  uint8_t subscribeTemperature[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x12, 0x11, 0x00, 0x01, 0x00};
+  receive(subscribeTemperature, sizeof(subscribeTemperature));
+  uint8_t subscribeHumidity[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x12, 0x14, 0x00, 0x01, 0x00};
+  receive(subscribeHumidity, sizeof(subscribeHumidity));
+
+  uint8_t first = 0x01, second = 0x02, third = 0x03;
+
+  WHEN("The peer supports multiple handle value notifications")
+  {
+    ATT._peers[0].multipleNotifications = true;
+    HCIFakeTransport.clear();
+
+    ATT.beginNotificationBatch();
+
+    REQUIRE(temperature.writeValue(&first, 1) == 1);
+    REQUIRE(humidity.writeValue(&second, 1) == 1);
+    REQUIRE(temperature.writeValue(&third, 1) == 1);
+
+    // nothing is sent until the batch ends
+    REQUIRE(HCIFakeTransport.txLength == 0);
+
+    ATT.endNotificationBatch();
+
+    // one PDU, the temperature with its latest value
+    uint8_t expected[] = {0x02, 0x40, 0x00, 0x0f, 0x00, 0x0b, 0x00, 0x04, 0x00, 0x23,
+                          0x10, 0x00, 0x01, 0x00, 0x03, 0x13, 0x00, 0x01, 0x00, 0x02};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(expected));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, expected, sizeof(expected)) == 0);
+    REQUIRE(ATT._peers[0].batch.size() == 0);
+  }
+
+  WHEN("The peer does not support them")
+  {
+    HCIFakeTransport.clear();
+
+    ATT.beginNotificationBatch();
+    temperature.writeValue(&first, 1);
+    humidity.writeValue(&second, 1);
+    ATT.endNotificationBatch();
+
+    uint8_t expected[] = {0x02, 0x40, 0x00, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x1b, 0x10, 0x00, 0x01,
+                          0x02, 0x40, 0x00, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x1b, 0x13, 0x00, 0x02};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(expected));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, expected, sizeof(expected)) == 0);
+  }
+
+  disconnectionComplete(0x0040);
+
+  GATT.end();
+
+  WHEN("A server sends several values at once")
+  {
+    connect(0x0041, 0x41);
+
+    uint8_t uuid[] = {0x6e, 0x2a};
+    BLERemoteService* remoteService = new BLERemoteService(uuid, sizeof(uuid), 0x000a, 0x0010);
+    BLERemoteCharacteristic* remoteTemperature = new BLERemoteCharacteristic(uuid, sizeof(uuid), 0x0041, 0x000b, BLENotify, 0x000c);
+    BLERemoteCharacteristic* remoteHumidity = new BLERemoteCharacteristic(uuid, sizeof(uuid), 0x0041, 0x000e, BLENotify, 0x000f);
+
+    remoteService->addCharacteristic(remoteTemperature);
+    remoteService->addCharacteristic(remoteHumidity);
+    // discovery normally creates the remote device
+    ATT._peers[0].device = new BLERemoteDevice();
+    ATT._peers[0].device->addService(remoteService);
+
+    uint8_t multipleNotify[] = {0x02, 0x41, 0x20, 0x10, 0x00, 0x0c, 0x00, 0x04, 0x00, 0x23,
+                                0x0c, 0x00, 0x01, 0x00, 0x15, 0x0f, 0x00, 0x02, 0x00, 0x2a, 0x2b};
+    receive(multipleNotify, sizeof(multipleNotify));
+
+    REQUIRE(remoteTemperature->valueLength() == 1);
+    REQUIRE(remoteTemperature->value()[0] == 0x15);
+    REQUIRE(remoteHumidity->valueLength() == 2);
+    REQUIRE(remoteHumidity->value()[1] == 0x2b);
+
+    // a truncated tuple is dropped, the ones before it are kept
+    uint8_t truncated[] = {0x02, 0x41, 0x20, 0x0e, 0x00, 0x0a, 0x00, 0x04, 0x00, 0x23,
+                           0x0c, 0x00, 0x01, 0x00, 0x16, 0x0f, 0x00, 0x02, 0x00, 0x2c};
+    receive(truncated, sizeof(truncated));
+
+    REQUIRE(remoteTemperature->value()[0] == 0x16);
+    REQUIRE(remoteHumidity->value()[0] == 0x2a);
+
+    // notifications need no response
+    REQUIRE(HCIFakeTransport.txLength == 0);
+
+    disconnectionComplete(0x0041);
+  }
+}
+
+// ATT PDU received on connection 0x0040 after the next packet is sent
+TEST_CASE_METHOD(ATTTestHost, "Long reads and writes", "[ArduinoBLE::ATT]")
+{
+  connect(0x0040, 0x40);
+
+  // 63 bytes per read response, 59 per prepared write, requests are not fragmented
+  ATT._peers[0].mtu = 64;
+  uint16_t aclPktLen = HCI._aclPktLen;
+  HCI._aclPktLen = 251;
+
+  uint8_t uuid[] = {0x19, 0x2a};
+  BLERemoteCharacteristic* characteristic = new BLERemoteCharacteristic(uuid, sizeof(uuid), 0x0040, 0x0002, BLERead | BLEWrite, 0x0003);
+
+  uint8_t value[100];
+  for (int i = 0; i < (int)sizeof(value); i++) {
+    value[i] = i;
+  }
+
+  uint8_t readResp[64] = {0x0b};
+  memcpy(&readResp[1], value, 63);
+  uint8_t readBlobResp[38] = {0x0d};
+  memcpy(&readBlobResp[1], &value[63], 37);
+
+  WHEN("A value is longer than a read response")
+  {
+    HCIFakeTransport.clear();
+    replyAtt(readResp, sizeof(readResp));
+    replyAtt(readBlobResp, sizeof(readBlobResp));
+
+    REQUIRE(characteristic->read());
+
+    // a Read Request, then a Read Blob Request from where it stopped
+    uint8_t expected[] = {0x0a, 0x03, 0x00};
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expected, sizeof(expected)) == 0);
+    uint8_t expectedBlob[] = {0x0c, 0x03, 0x00, 0x3f, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == 12 + 9 + sizeof(expectedBlob));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[21], expectedBlob, sizeof(expectedBlob)) == 0);
+
+    REQUIRE(characteristic->valueLength() == 100);
+    REQUIRE(memcmp(characteristic->value(), value, sizeof(value)) == 0);
+  }
+
+  WHEN("A value is read into a buffer")
+  {
+    HCIFakeTransport.clear();
+    replyAtt(readResp, sizeof(readResp));
+    replyAtt(readBlobResp, sizeof(readBlobResp));
+
+    uint8_t buffer[80];
+
+    REQUIRE(characteristic->read(buffer, sizeof(buffer)) == 80);
+    REQUIRE(memcmp(buffer, value, sizeof(buffer)) == 0);
+    REQUIRE(characteristic->valueLength() == 0);
+  }
+
+  WHEN("A part is read straight into a buffer")
+  {
+    HCIFakeTransport.clear();
+    replyAtt(readBlobResp, sizeof(readBlobResp));
+
+    uint8_t part[40];
+
+    REQUIRE(ATT.readBlobReq(0x0040, 0x0003, 63, part, sizeof(part)) == 37);
+    REQUIRE(memcmp(part, &value[63], 37) == 0);
+    REQUIRE(ATT._peers[0].pendingResp.value == NULL);
+  }
+
+  WHEN("A value ends with a read response")
+  {
+    HCIFakeTransport.clear();
+    replyAtt(readResp, sizeof(readResp));
+    uint8_t notLong[] = {0x01, 0x0c, 0x03, 0x00, 0x0b};
+    replyAtt(notLong, sizeof(notLong));
+
+    REQUIRE(characteristic->read());
+    REQUIRE(characteristic->valueLength() == 63);
+  }
+
+  WHEN("A value is longer than a write request")
+  {
+    HCIFakeTransport.clear();
+
+    uint8_t prepWriteResp1[64] = {0x17, 0x03, 0x00, 0x00, 0x00};
+    memcpy(&prepWriteResp1[5], value, 59);
+    uint8_t prepWriteResp2[46] = {0x17, 0x03, 0x00, 0x3b, 0x00};
+    memcpy(&prepWriteResp2[5], &value[59], 41);
+    uint8_t execWriteResp[] = {0x19};
+
+    replyAtt(prepWriteResp1, sizeof(prepWriteResp1));
+    replyAtt(prepWriteResp2, sizeof(prepWriteResp2));
+    replyAtt(execWriteResp, sizeof(execWriteResp));
+
+    REQUIRE(characteristic->writeValue(value, sizeof(value)) == 1);
+
+    uint8_t expectedPrep[] = {0x16, 0x03, 0x00, 0x3b, 0x00, 0x3b, 0x3c};
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9 + 64 + 9], expectedPrep, sizeof(expectedPrep)) == 0);
+
+    uint8_t expectedExec[] = {0x18, 0x01};
+    REQUIRE(HCIFakeTransport.txLength == (9 + 64) + (9 + 46) + (9 + sizeof(expectedExec)));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[HCIFakeTransport.txLength - 2], expectedExec, sizeof(expectedExec)) == 0);
+
+    REQUIRE(characteristic->valueLength() == 100);
+  }
+
+  WHEN("A prepared part comes back altered")
+  {
+    HCIFakeTransport.clear();
+
+    uint8_t prepWriteResp[64] = {0x17, 0x03, 0x00, 0x00, 0x00};
+    uint8_t execWriteResp[] = {0x19};
+
+    replyAtt(prepWriteResp, sizeof(prepWriteResp));
+    replyAtt(execWriteResp, sizeof(execWriteResp));
+
+    REQUIRE(characteristic->writeValue(value, sizeof(value)) == 0);
+
+    // the queued parts are cancelled
+    uint8_t expectedCancel[] = {0x18, 0x00};
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[HCIFakeTransport.txLength - 2], expectedCancel, sizeof(expectedCancel)) == 0);
+  }
+
+  delete characteristic;
+
+  HCIFakeTransport.clear();
+  HCI._pendingPkt = 0;
+  HCI._aclPktLen = aclPktLen;
+}
+
+static uint8_t gattCache[ATT_GATT_CACHE_SIZE];
+static int gattCacheLength = 0;
+static uint8_t gattCacheAddress[6];
+
+static int storeGattCache(uint8_t* address, uint8_t* data, int length)
+{
+  memcpy(gattCacheAddress, address, sizeof(gattCacheAddress));
+  memcpy(gattCache, data, length);
+  gattCacheLength = length;
+
+  return 1;
+}
+
+static int getGattCache(uint8_t* address, uint8_t* data, int size)
+{
+  if (gattCacheLength == 0 || gattCacheLength > size || memcmp(address, gattCacheAddress, sizeof(gattCacheAddress)) != 0) {
+    return 0;
+  }
+
+  memcpy(data, gattCache, gattCacheLength);
+
+  return gattCacheLength;
+}
+
+TEST_CASE_METHOD(ATTTestHost, "Client GATT cache", "[ArduinoBLE::ATT]")
+{
+  ATT._storeGattCache = storeGattCache;
+  ATT._getGattCache = getGattCache;
+  gattCacheLength = 0;
+  completions = 0;
+
+  connect(0x0040, 0x40);
+
+  uint8_t mtuResp[] = {0x02, 0x40, 0x20, 0x07, 0x00, 0x03, 0x00, 0x04, 0x00, 0x03, 0x17, 0x00};
+  uint8_t hashResp[] = {0x02, 0x40, 0x20, 0x18, 0x00, 0x14, 0x00, 0x04, 0x00, 0x09, 0x12, 0x0f, 0x00,
+                        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+
+  // the first discovery reads the Database Hash before the services
+  HCIFakeTransport.clear();
+  REQUIRE(ATT.discoverAttributesAsync(ATT._peers[0].addressType, ATT._peers[0].address, NULL, deviceCompleted));
+  receive(mtuResp, sizeof(mtuResp));
+
+  uint8_t expectedHashReq[] = {0x08, 0x01, 0x00, 0xff, 0xff, 0x2a, 0x2b};
+  REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedHashReq));
+  REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedHashReq, sizeof(expectedHashReq)) == 0);
+
+  receive(hashResp, sizeof(hashResp));
+  REQUIRE(sentOpcode() == 0x10);
+
+  uint8_t servicesResp[] = {0x02, 0x40, 0x20, 0x0c, 0x00, 0x08, 0x00, 0x04, 0x00, 0x11, 0x06, 0x10, 0x00, 0x14, 0x00, 0x0f, 0x18};
+  receive(servicesResp, sizeof(servicesResp));
+  uint8_t servicesEnd[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x01, 0x10, 0x15, 0x00, 0x0a};
+  receive(servicesEnd, sizeof(servicesEnd));
+  uint8_t characteristicsResp[] = {0x02, 0x40, 0x20, 0x0d, 0x00, 0x09, 0x00, 0x04, 0x00, 0x09, 0x07, 0x11, 0x00, 0x12, 0x12, 0x00, 0x19, 0x2a};
+  receive(characteristicsResp, sizeof(characteristicsResp));
+  uint8_t characteristicsEnd[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x01, 0x08, 0x13, 0x00, 0x0a};
+  receive(characteristicsEnd, sizeof(characteristicsEnd));
+  uint8_t descriptorsResp[] = {0x02, 0x40, 0x20, 0x0a, 0x00, 0x06, 0x00, 0x04, 0x00, 0x05, 0x01, 0x13, 0x00, 0x02, 0x29};
+  receive(descriptorsResp, sizeof(descriptorsResp));
+  uint8_t descriptorsEnd[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x01, 0x04, 0x14, 0x00, 0x0a};
+  receive(descriptorsEnd, sizeof(descriptorsEnd));
+
+  REQUIRE(completions == 1);
+  REQUIRE(lastSuccess);
+
+  // stored under the identity address with the hash
+  uint8_t identity[] = {0x40, 0x55, 0x44, 0x33, 0x22, 0x11};
+  REQUIRE(gattCacheLength > 17);
+  REQUIRE(memcmp(gattCacheAddress, identity, sizeof(identity)) == 0);
+  REQUIRE(memcmp(&gattCache[1], &hashResp[13], 16) == 0);
+
+  disconnectionComplete(0x0040);
+  connect(0x0040, 0x40);
+
+  WHEN("The peer reconnects with the same database")
+  {
+    HCIFakeTransport.clear();
+    REQUIRE(ATT.discoverAttributesAsync(ATT._peers[0].addressType, ATT._peers[0].address, NULL, deviceCompleted));
+    receive(mtuResp, sizeof(mtuResp));
+    receive(hashResp, sizeof(hashResp));
+
+    // no further requests
+    REQUIRE(HCIFakeTransport.txLength == 0);
+    REQUIRE(completions == 2);
+    REQUIRE(lastSuccess);
+
+    BLERemoteDevice* device = ATT._peers[0].device;
+    REQUIRE(device->serviceCount() == 1);
+    REQUIRE(strcmp(device->service(0)->uuid(), "180f") == 0);
+    REQUIRE(device->service(0)->endHandle() == 0x0014);
+    REQUIRE(device->service(0)->characteristicCount() == 1);
+    REQUIRE(device->service(0)->characteristic(0)->properties() == 0x12);
+    REQUIRE(device->service(0)->characteristic(0)->valueHandle() == 0x0012);
+    REQUIRE(device->service(0)->characteristic(0)->cccdHandle() == 0x0013);
+  }
+
+  WHEN("The database of the peer changed")
+  {
+    hashResp[13] = 0xff;
+
+    HCIFakeTransport.clear();
+    REQUIRE(ATT.discoverAttributesAsync(ATT._peers[0].addressType, ATT._peers[0].address, NULL, deviceCompleted));
+    receive(mtuResp, sizeof(mtuResp));
+    receive(hashResp, sizeof(hashResp));
+
+    // discovered again
+    REQUIRE(sentOpcode() == 0x10);
+    REQUIRE(completions == 1);
+  }
+
+  disconnectionComplete(0x0040);
+
+  ATT._storeGattCache = NULL;
+  ATT._getGattCache = NULL;
+}
+
+TEST_CASE_METHOD(ATTTestHost, "Robust caching", "[ArduinoBLE::GATT]")
+{
+  // Client Supported Features value at 0x000b, Database Hash value at 0x000d
+  GATT.begin();
+
+  connect(0x0040, 0x40);
+
+  uint8_t enableRobustCaching[] = {0x02, 0x40, 0x20, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x12, 0x0b, 0x00, 0x01};
+  uint8_t readName[] = {0x02, 0x40, 0x20, 0x07, 0x00, 0x03, 0x00, 0x04, 0x00, 0x0a, 0x03, 0x00};
+
+  WHEN("The Database Hash input is built")
+  {
+    uint8_t expected[] = {
+      0x01, 0x00, 0x00, 0x28, 0x00, 0x18,
+      0x02, 0x00, 0x03, 0x28, 0x02, 0x03, 0x00, 0x00, 0x2a,
+      0x04, 0x00, 0x03, 0x28, 0x02, 0x05, 0x00, 0x01, 0x2a,
+      0x06, 0x00, 0x00, 0x28, 0x01, 0x18,
+      0x07, 0x00, 0x03, 0x28, 0x20, 0x08, 0x00, 0x05, 0x2a,
+      0x09, 0x00, 0x02, 0x29,
+      0x0a, 0x00, 0x03, 0x28, 0x0a, 0x0b, 0x00, 0x29, 0x2b,
+      0x0c, 0x00, 0x03, 0x28, 0x02, 0x0d, 0x00, 0x2a, 0x2b
+    };
+    uint8_t data[sizeof(expected)];
+
+    REQUIRE(GATT.databaseHashInput(NULL, 0) == sizeof(expected));
+    REQUIRE(GATT.databaseHashInput(data, sizeof(data)) == sizeof(expected));
+    REQUIRE(memcmp(data, expected, sizeof(expected)) == 0);
+  }
+
+  WHEN("A central enables client features")
+  {
+    uint8_t enableFeatures[] = {0x02, 0x40, 0x20, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x12, 0x0b, 0x00, 0x07};
+    receive(enableFeatures, sizeof(enableFeatures));
+
+    REQUIRE(sentOpcode() == 0x13);
+    REQUIRE(ATT._peers[0].multipleNotifications);
+
+    // each central reads its own features, without the unsupported ones
+    uint8_t readFeatures[] = {0x02, 0x40, 0x20, 0x07, 0x00, 0x03, 0x00, 0x04, 0x00, 0x0a, 0x0b, 0x00};
+    receive(readFeatures, sizeof(readFeatures));
+
+    uint8_t expected[] = {0x0b, 0x05};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expected));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expected, sizeof(expected)) == 0);
+
+    // a Read By Type Request agrees with the Read Request
+    uint8_t readFeaturesByType[] = {0x02, 0x40, 0x20, 0x0b, 0x00, 0x07, 0x00, 0x04, 0x00, 0x08, 0x01, 0x00, 0xff, 0xff, 0x29, 0x2b};
+    receive(readFeaturesByType, sizeof(readFeaturesByType));
+
+    uint8_t expectedByType[] = {0x09, 0x03, 0x0b, 0x00, 0x05};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedByType));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedByType, sizeof(expectedByType)) == 0);
+
+    // features can't be disabled
+    uint8_t disableFeatures[] = {0x02, 0x40, 0x20, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x12, 0x0b, 0x00, 0x04};
+    receive(disableFeatures, sizeof(disableFeatures));
+
+    uint8_t expectedError[] = {0x01, 0x12, 0x0b, 0x00, 0x13};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedError));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedError, sizeof(expectedError)) == 0);
+  }
+
+  WHEN("The database changes under a central with robust caching")
+  {
+    receive(enableRobustCaching, sizeof(enableRobustCaching));
+
+    BLEService batteryService("180f");
+    GATT.addService(batteryService);
+
+    // the first request is refused
+    receive(readName, sizeof(readName));
+
+    uint8_t expectedError[] = {0x01, 0x0a, 0x00, 0x00, 0x12};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedError));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedError, sizeof(expectedError)) == 0);
+
+    // commands are ignored
+    uint8_t writeCmd[] = {0x02, 0x40, 0x20, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x52, 0x03, 0x00, 0x41};
+    receive(writeCmd, sizeof(writeCmd));
+    REQUIRE(HCIFakeTransport.txLength == 0);
+
+    // the next request makes it change-aware
+    receive(readName, sizeof(readName));
+    REQUIRE(sentOpcode() == 0x0b);
+    REQUIRE(ATT._peers[0].databaseVersion == GATT.version());
+  }
+
+  WHEN("A change-unaware central reads the Database Hash")
+  {
+    receive(enableRobustCaching, sizeof(enableRobustCaching));
+
+    BLEService batteryService("180f");
+    GATT.addService(batteryService);
+
+    // the stubbed CMAC, sent least significant octet first
+    uint8_t mac[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+    uint8_t hash[16] = {0x0f, 0x0e, 0x0d, 0x0c, 0x0b, 0x0a, 0x09, 0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01, 0x00};
+    memcpy(FakeBTCTObj.mac, mac, sizeof(mac));
+
+    uint8_t readHash[] = {0x02, 0x40, 0x20, 0x0b, 0x00, 0x07, 0x00, 0x04, 0x00, 0x08, 0x01, 0x00, 0xff, 0xff, 0x2a, 0x2b};
+    receive(readHash, sizeof(readHash));
+
+    // by its value handle
+    uint8_t expected[] = {0x09, 0x12, 0x0d, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expected) + sizeof(hash));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expected, sizeof(expected)) == 0);
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9 + sizeof(expected)], hash, sizeof(hash)) == 0);
+
+    receive(readName, sizeof(readName));
+    REQUIRE(sentOpcode() == 0x0b);
+  }
+
+  WHEN("The database changes under a subscribed central")
+  {
+    receive(enableRobustCaching, sizeof(enableRobustCaching));
+
+    uint8_t subscribe[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x12, 0x09, 0x00, 0x02, 0x00};
+    receive(subscribe, sizeof(subscribe));
+    REQUIRE(sentOpcode() == 0x13);
+
+    // Battery at 0x000e
+    HCIFakeTransport.clear();
+    BLEService batteryService("180f");
+    GATT.addService(batteryService);
+
+    uint8_t expectedIndication[] = {0x1d, 0x08, 0x00, 0x0e, 0x00, 0x0e, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedIndication));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedIndication, sizeof(expectedIndication)) == 0);
+    REQUIRE(ATT._peers[0].databaseVersion != GATT.version());
+
+    // the confirmation makes it change-aware
+    uint8_t confirm[] = {0x02, 0x40, 0x20, 0x05, 0x00, 0x01, 0x00, 0x04, 0x00, 0x1e};
+    receive(confirm, sizeof(confirm));
+    REQUIRE(ATT._peers[0].databaseVersion == GATT.version());
+
+    receive(readName, sizeof(readName));
+    REQUIRE(sentOpcode() == 0x0b);
+  }
+
+  disconnectionComplete(0x0040);
+
+  GATT.end();
+}
+
+TEST_CASE_METHOD(ATTTestHost, "Database Hash", "[ArduinoBLE::GATT]")
+{
+  // Core Specification Vol 3, Part G, Appendix B: the Generic Access and Generic Attribute services
+  // of the example database, its other services use declarations the library can't add
+  BLEService genericAccess("1800");
+  BLECharacteristic deviceName("2a00", BLERead | BLEWrite, 20);
+  BLECharacteristic appearance("2a01", BLERead, 2);
+  BLEService genericAttribute("1801");
+  BLECharacteristic servicesChanged("2a05", BLEIndicate, 4);
+
+  genericAccess.addCharacteristic(deviceName);
+  genericAccess.addCharacteristic(appearance);
+  genericAttribute.addCharacteristic(servicesChanged);
+
+  GATT.addService(genericAccess);
+  GATT.addService(genericAttribute);
+
+  GATT._databaseHashCharacteristic = new BLELocalCharacteristic("2b2a", BLERead, 16);
+  GATT._databaseHashCharacteristic->retain();
+
+  uint8_t mac[16] = {0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f};
+  memcpy(FakeBTCTObj.mac, mac, sizeof(mac));
+
+  WHEN("The Database Hash is computed")
+  {
+    GATT.updateDatabaseHash();
+
+    uint8_t expectedInput[] = {
+      0x01, 0x00, 0x00, 0x28, 0x00, 0x18,
+      0x02, 0x00, 0x03, 0x28, 0x0a, 0x03, 0x00, 0x00, 0x2a,
+      0x04, 0x00, 0x03, 0x28, 0x02, 0x05, 0x00, 0x01, 0x2a,
+      0x06, 0x00, 0x00, 0x28, 0x01, 0x18,
+      0x07, 0x00, 0x03, 0x28, 0x20, 0x08, 0x00, 0x05, 0x2a,
+      0x09, 0x00, 0x02, 0x29
+    };
+    uint8_t zeroKey[16] = {0x00};
+
+    REQUIRE(FakeBTCTObj.length == sizeof(expectedInput));
+    REQUIRE(memcmp(FakeBTCTObj.input, expectedInput, sizeof(expectedInput)) == 0);
+    REQUIRE(memcmp(FakeBTCTObj.key, zeroKey, sizeof(zeroKey)) == 0);
+
+    // the CMAC is most significant octet first, the value least significant octet first
+    uint8_t expectedHash[16] = {0x1f, 0x1e, 0x1d, 0x1c, 0x1b, 0x1a, 0x19, 0x18, 0x17, 0x16, 0x15, 0x14, 0x13, 0x12, 0x11, 0x10};
+
+    REQUIRE(GATT._databaseHashCharacteristic->valueLength() == 16);
+    REQUIRE(memcmp(GATT._databaseHashCharacteristic->value(), expectedHash, sizeof(expectedHash)) == 0);
+  }
+
+  GATT.end();
+}
+
+TEST_CASE_METHOD(ATTTestHost, "Discovery pipeline", "[ArduinoBLE::ATT]")
+{
+  uint16_t maxMtu = ATT._maxMtu;
+  completions = 0;
+
+  connect(0x0040, 0x40);
+
+  // Battery at 0x0001 - 0x0006: level at 0x0003 with its CCCD, then a characteristic without descriptors
+  // Environmental Sensing at 0x0007 - 0x000a: temperature at 0x0009 with its CCCD
+  uint8_t servicesResp[] = {0x11, 0x06, 0x01, 0x00, 0x06, 0x00, 0x0f, 0x18, 0x07, 0x00, 0x0a, 0x00, 0x1a, 0x18};
+  uint8_t servicesEnd[] = {0x01, 0x10, 0x0b, 0x00, 0x0a};
+
+  WHEN("The whole database is discovered")
+  {
+    ATT.setMaxMtu(64);
+
+    HCIFakeTransport.clear();
+    REQUIRE(ATT.discoverAttributesAsync(ATT._peers[0].addressType, ATT._peers[0].address, NULL, deviceCompleted));
+    REQUIRE(sentOpcode() == 0x02);
+
+    uint8_t mtuResp[] = {0x02, 0x40, 0x20, 0x07, 0x00, 0x03, 0x00, 0x04, 0x00, 0x03, 0x40, 0x00};
+    receive(mtuResp, sizeof(mtuResp));
+    REQUIRE(sentOpcode() == 0x10);
+
+    uint8_t servicesPkt[9 + sizeof(servicesResp)] = {0x02, 0x40, 0x20, 4 + sizeof(servicesResp), 0x00, sizeof(servicesResp), 0x00, 0x04, 0x00};
+    memcpy(&servicesPkt[9], servicesResp, sizeof(servicesResp));
+    receive(servicesPkt, sizeof(servicesPkt));
+    uint8_t servicesEndPkt[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x01, 0x10, 0x0b, 0x00, 0x0a};
+    receive(servicesEndPkt, sizeof(servicesEndPkt));
+
+    // one sweep over both services
+    uint8_t expectedCharacteristicsReq[] = {0x08, 0x01, 0x00, 0x0a, 0x00, 0x03, 0x28};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedCharacteristicsReq));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedCharacteristicsReq, sizeof(expectedCharacteristicsReq)) == 0);
+
+    uint8_t characteristicsResp[] = {0x02, 0x40, 0x20, 0x1b, 0x00, 0x17, 0x00, 0x04, 0x00, 0x09, 0x07,
+                                     0x02, 0x00, 0x12, 0x03, 0x00, 0x19, 0x2a,
+                                     0x05, 0x00, 0x02, 0x06, 0x00, 0x29, 0x2a,
+                                     0x08, 0x00, 0x12, 0x09, 0x00, 0x6e, 0x2a};
+    receive(characteristicsResp, sizeof(characteristicsResp));
+    uint8_t characteristicsEnd[] = {0x02, 0x40, 0x20, 0x09, 0x00, 0x05, 0x00, 0x04, 0x00, 0x01, 0x08, 0x0a, 0x00, 0x0a};
+    receive(characteristicsEnd, sizeof(characteristicsEnd));
+
+    // the descriptors of both services fit in a single response
+    uint8_t expectedDescriptorsReq[] = {0x04, 0x04, 0x00, 0x0a, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedDescriptorsReq));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedDescriptorsReq, sizeof(expectedDescriptorsReq)) == 0);
+
+    uint8_t descriptorsResp[] = {0x02, 0x40, 0x20, 0x22, 0x00, 0x1e, 0x00, 0x04, 0x00, 0x05, 0x01,
+                                 0x04, 0x00, 0x02, 0x29, 0x05, 0x00, 0x03, 0x28, 0x06, 0x00, 0x29, 0x2a,
+                                 0x07, 0x00, 0x00, 0x28, 0x08, 0x00, 0x03, 0x28, 0x09, 0x00, 0x6e, 0x2a,
+                                 0x0a, 0x00, 0x02, 0x29};
+    receive(descriptorsResp, sizeof(descriptorsResp));
+
+    REQUIRE(HCIFakeTransport.txLength == 0);
+    REQUIRE(completions == 1);
+    REQUIRE(lastSuccess);
+
+    BLERemoteDevice* device = ATT._peers[0].device;
+    REQUIRE(device->serviceCount() == 2);
+    REQUIRE(device->service(0)->characteristicCount() == 2);
+    REQUIRE(device->service(0)->characteristic(0)->cccdHandle() == 0x0004);
+    REQUIRE(device->service(0)->characteristic(1)->descriptorCount() == 0);
+    REQUIRE(device->service(1)->characteristicCount() == 1);
+    REQUIRE(device->service(1)->characteristic(0)->descriptorCount() == 1);
+    REQUIRE(device->service(1)->characteristic(0)->cccdHandle() == 0x000a);
+
+    // the MTU is only exchanged once
+    HCIFakeTransport.clear();
+    REQUIRE(ATT.discoverAttributesAsync(ATT._peers[0].addressType, ATT._peers[0].address, "181a", deviceCompleted));
+
+    // services with the UUID are found by value
+    uint8_t expectedServiceReq[] = {0x06, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28, 0x1a, 0x18};
+    REQUIRE(HCIFakeTransport.txLength == 9 + sizeof(expectedServiceReq));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[9], expectedServiceReq, sizeof(expectedServiceReq)) == 0);
+
+    ATT.failOperations(0x0040);
+  }
+
+  WHEN("A characteristic is looked for with lazy discovery")
+  {
+    ATT.setLazyDiscovery(true);
+
+    uint8_t mtuResp[] = {0x03, 0x17, 0x00};
+    replyAtt(mtuResp, sizeof(mtuResp));
+    replyAtt(servicesResp, sizeof(servicesResp));
+    replyAtt(servicesEnd, sizeof(servicesEnd));
+    // the characteristics of the Battery service
+    uint8_t batteryCharacteristics[] = {0x09, 0x07, 0x02, 0x00, 0x12, 0x03, 0x00, 0x19, 0x2a, 0x05, 0x00, 0x02, 0x06, 0x00, 0x29, 0x2a};
+    replyAtt(batteryCharacteristics, sizeof(batteryCharacteristics));
+    uint8_t batteryDescriptors[] = {0x05, 0x01, 0x04, 0x00, 0x02, 0x29};
+    replyAtt(batteryDescriptors, sizeof(batteryDescriptors));
+    // then the ones of Environmental Sensing
+    uint8_t sensingCharacteristics[] = {0x09, 0x07, 0x08, 0x00, 0x12, 0x09, 0x00, 0x6e, 0x2a};
+    replyAtt(sensingCharacteristics, sizeof(sensingCharacteristics));
+    uint8_t sensingCharacteristicsEnd[] = {0x01, 0x08, 0x0a, 0x00, 0x0a};
+    replyAtt(sensingCharacteristicsEnd, sizeof(sensingCharacteristicsEnd));
+    uint8_t sensingDescriptors[] = {0x05, 0x01, 0x0a, 0x00, 0x02, 0x29};
+    replyAtt(sensingDescriptors, sizeof(sensingDescriptors));
+
+    BLEDevice peripheral(ATT._peers[0].addressType, ATT._peers[0].address);
+    BLECharacteristic temperature = peripheral.characteristic("2a6e");
+
+    REQUIRE(temperature);
+    REQUIRE(HCIFakeTransport.replyNext == HCIFakeTransport.replyCount);
+
+    BLERemoteDevice* device = ATT._peers[0].device;
+    REQUIRE(device->serviceCount() == 2);
+    REQUIRE(device->service(0)->characteristicCount() == 2);
+    REQUIRE(device->service(1)->characteristic(0)->cccdHandle() == 0x000a);
+
+    // already discovered, no requests
+    HCIFakeTransport.clear();
+    REQUIRE(peripheral.characteristic("2a19"));
+    REQUIRE_FALSE(peripheral.characteristic("2a1c"));
+    REQUIRE(HCIFakeTransport.txLength == 0);
+
+    ATT.setLazyDiscovery(false);
+  }
+
+  disconnectionComplete(0x0040);
+
+  ATT.setMaxMtu(maxMtu);
+}
+
+TEST_CASE_METHOD(ATTTestHost, "Notification dispatch by value handle", "[ArduinoBLE::ATT]")
+{
+  connect(0x0040, 0x40);
+
+  WHEN("Characteristics are discovered after the index was built")
+  {
+    ATT.setLazyDiscovery(true);
+
+    // Battery at 0x0001 - 0x0006, Environmental Sensing at 0x0007 - 0x000a
+    uint8_t mtuResp[] = {0x03, 0x17, 0x00};
+    replyAtt(mtuResp, sizeof(mtuResp));
+    uint8_t servicesResp[] = {0x11, 0x06, 0x01, 0x00, 0x06, 0x00, 0x0f, 0x18, 0x07, 0x00, 0x0a, 0x00, 0x1a, 0x18};
+    replyAtt(servicesResp, sizeof(servicesResp));
+    uint8_t servicesEnd[] = {0x01, 0x10, 0x0b, 0x00, 0x0a};
+    replyAtt(servicesEnd, sizeof(servicesEnd));
+    uint8_t batteryCharacteristics[] = {0x09, 0x07, 0x02, 0x00, 0x12, 0x03, 0x00, 0x19, 0x2a, 0x05, 0x00, 0x02, 0x06, 0x00, 0x29, 0x2a};
+    replyAtt(batteryCharacteristics, sizeof(batteryCharacteristics));
+    uint8_t batteryDescriptors[] = {0x05, 0x01, 0x04, 0x00, 0x02, 0x29};
+    replyAtt(batteryDescriptors, sizeof(batteryDescriptors));
+
+    BLEDevice peripheral(ATT._peers[0].addressType, ATT._peers[0].address);
+    REQUIRE(peripheral.characteristic("2a19"));
+
+    BLERemoteDevice* device = ATT._peers[0].device;
+    BLERemoteCharacteristic* level = device->service(0)->characteristic(0);
+
+    REQUIRE(device->characteristicForValueHandle(0x0003) == level);
+    REQUIRE(device->characteristicForValueHandle(0x0004) == NULL);
+    REQUIRE(device->characteristicForValueHandle(0x0009) == NULL);
+
+    // the Environmental Sensing characteristics are added to the indexed device
+    uint8_t sensingCharacteristics[] = {0x09, 0x07, 0x08, 0x00, 0x12, 0x09, 0x00, 0x6e, 0x2a};
+    replyAtt(sensingCharacteristics, sizeof(sensingCharacteristics));
+    uint8_t sensingCharacteristicsEnd[] = {0x01, 0x08, 0x0a, 0x00, 0x0a};
+    replyAtt(sensingCharacteristicsEnd, sizeof(sensingCharacteristicsEnd));
+    uint8_t sensingDescriptors[] = {0x05, 0x01, 0x0a, 0x00, 0x02, 0x29};
+    replyAtt(sensingDescriptors, sizeof(sensingDescriptors));
+
+    REQUIRE(peripheral.characteristic("2a6e"));
+
+    BLERemoteCharacteristic* temperature = device->service(1)->characteristic(0);
+
+    REQUIRE(device->characteristicForValueHandle(0x0009) == temperature);
+    REQUIRE(device->characteristicForValueHandle(0x0003) == level);
+    REQUIRE(device->characteristicForValueHandle(0x0006) == device->service(0)->characteristic(1));
+
+    // and their notifications reach them
+    uint8_t notify[] = {0x02, 0x40, 0x20, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x1b, 0x09, 0x00, 0x2a};
+    receive(notify, sizeof(notify));
+
+    REQUIRE(temperature->valueLength() == 1);
+    REQUIRE(temperature->value()[0] == 0x2a);
+
+    ATT.setLazyDiscovery(false);
+  }
+
+  disconnectionComplete(0x0040);
+}
+
+TEST_CASE_METHOD(ATTTestHost, "Queued remote values", "[ArduinoBLE::ATT]")
+{
+  connect(0x0040, 0x40);
+
+  // a temperature with its value at 0x000c, discovery normally creates the remote device
+  uint8_t uuid[] = {0x6e, 0x2a};
+  BLERemoteService* remoteService = new BLERemoteService(uuid, sizeof(uuid), 0x000a, 0x0010);
+  BLERemoteCharacteristic* remoteTemperature = new BLERemoteCharacteristic(uuid, sizeof(uuid), 0x0040, 0x000b, BLENotify, 0x000c);
+
+  remoteService->addCharacteristic(remoteTemperature);
+  ATT._peers[0].device = new BLERemoteDevice();
+  ATT._peers[0].device->addService(remoteService);
+
+  uint8_t first[] = {0x02, 0x40, 0x20, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x1b, 0x0c, 0x00, 0x15};
+  uint8_t second[] = {0x02, 0x40, 0x20, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x1b, 0x0c, 0x00, 0x16};
+  uint8_t third[] = {0x02, 0x40, 0x20, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x1b, 0x0c, 0x00, 0x17};
+  uint8_t value[4];
+  unsigned long timestamp = 0;
+
+  WHEN("Values are notified between two reads")
+  {
+    REQUIRE(remoteTemperature->setValueQueue(2, 4));
+
+    set_millis(100);
+    receive(first, sizeof(first));
+    set_millis(200);
+    receive(second, sizeof(second));
+
+    // queued in order with their time
+    REQUIRE(remoteTemperature->valuesQueued() == 2);
+    REQUIRE(remoteTemperature->readNext(value, sizeof(value), &timestamp) == 1);
+    REQUIRE(value[0] == 0x15);
+    REQUIRE(timestamp == 100);
+
+    // a full queue drops its oldest value
+    receive(third, sizeof(third));
+    receive(third, sizeof(third));
+
+    REQUIRE(remoteTemperature->droppedValues() == 1);
+    REQUIRE(remoteTemperature->truncatedValues() == 0);
+    REQUIRE(remoteTemperature->readNext(value, sizeof(value), &timestamp) == 1);
+    REQUIRE(value[0] == 0x17);
+    REQUIRE(timestamp == 200);
+    REQUIRE(remoteTemperature->readNext(value, sizeof(value)) == 1);
+    REQUIRE(remoteTemperature->readNext(value, sizeof(value)) == -1);
+
+    // the latest value is kept as before
+    REQUIRE(remoteTemperature->valueLength() == 1);
+    REQUIRE(remoteTemperature->value()[0] == 0x17);
+  }
+
+  WHEN("A value is longer than the queue keeps")
+  {
+    REQUIRE(remoteTemperature->setValueQueue(2, 2));
+
+    uint8_t notify[] = {0x02, 0x40, 0x20, 0x0b, 0x00, 0x07, 0x00, 0x04, 0x00, 0x1b, 0x0c, 0x00, 0x01, 0x02, 0x03, 0x04};
+    receive(notify, sizeof(notify));
+
+    memset(value, 0x00, sizeof(value));
+    REQUIRE(remoteTemperature->readNext(value, sizeof(value)) == 2);
+    REQUIRE(value[0] == 0x01);
+    REQUIRE(value[1] == 0x02);
+    REQUIRE(value[2] == 0x00);
+    REQUIRE(remoteTemperature->valueLength() == 4);
+    REQUIRE(remoteTemperature->truncatedValues() == 1);
+
+    // values that fit are not counted
+    receive(first, sizeof(first));
+    REQUIRE(remoteTemperature->truncatedValues() == 1);
+
+    // and values longer than an attribute can't be queued
+    REQUIRE_FALSE(remoteTemperature->setValueQueue(2, 513));
+  }
+
+  WHEN("The queue is removed")
+  {
+    REQUIRE(remoteTemperature->setValueQueue(2, 4));
+    receive(first, sizeof(first));
+    REQUIRE(remoteTemperature->valuesQueued() == 1);
+
+    REQUIRE(remoteTemperature->setValueQueue(0, 4));
+    REQUIRE(remoteTemperature->valuesQueued() == 0);
+    REQUIRE(remoteTemperature->readNext(value, sizeof(value)) == -1);
+
+    // later values only update the characteristic
+    receive(second, sizeof(second));
+    REQUIRE(remoteTemperature->valuesQueued() == 0);
+    REQUIRE(remoteTemperature->value()[0] == 0x16);
+  }
+
+  disconnectionComplete(0x0040);
+}
@@ -0,0 +1,142 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <catch2/catch_test_macros.hpp>
+
+#define private public
+#define protected public
+
+#include "HCI.h"
+#include "HCIFakeTransport.h"
+
+static int completeCount;
+static uint16_t completeOpcode;
+static int completeStatus;
+
+static void onCommandComplete(uint16_t opcode, int status, uint8_t /*responseLen*/, uint8_t /*response*/[], void* /*context*/)
+{
+  completeCount++;
+  completeOpcode = opcode;
+  completeStatus = status;
+}
+
+TEST_CASE("HCI command engine", "[ArduinoBLE::HCI]")
+{
+  HCIFakeTransport.clear();
+  HCI.begin();
+  completeCount = 0;
+
+  WHEN("Sending more commands than the controller can accept")
+  {
+    uint8_t enable = 0x01;
+    uint8_t scanEnable[] = {0x01, 0x00};
+
+    REQUIRE(HCI.sendCommandAsync(0x200a, sizeof(enable), &enable, onCommandComplete) == 0);
+    REQUIRE(HCI.sendCommandAsync(0x200c, sizeof(scanEnable), scanEnable, onCommandComplete) == 0);
+
+    // Only the first command is sent, the second one waits for a credit
+    uint8_t firstCommand[] = {0x01, 0x0a, 0x20, 0x01, 0x01};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(firstCommand));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, firstCommand, sizeof(firstCommand)) == 0);
+    REQUIRE(HCI.pendingCommands() == 2);
+    REQUIRE(HCI.commandCredits() == 0);
+
+    // Command Complete for the first command, the controller accepts one more
+    uint8_t commandComplete[] = {0x04, 0x0e, 0x04, 0x01, 0x0a, 0x20, 0x00};
+    HCIFakeTransport.push(commandComplete, sizeof(commandComplete));
+    HCI.poll();
+
+    REQUIRE(completeCount == 1);
+    REQUIRE(completeOpcode == 0x200a);
+    REQUIRE(completeStatus == 0x00);
+
+    uint8_t secondCommand[] = {0x01, 0x0c, 0x20, 0x02, 0x01, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(firstCommand) + sizeof(secondCommand));
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[sizeof(firstCommand)], secondCommand, sizeof(secondCommand)) == 0);
+    REQUIRE(HCI.pendingCommands() == 1);
+
+    // Command Status for the second command
+    uint8_t commandStatus[] = {0x04, 0x0f, 0x04, 0x0c, 0x01, 0x0c, 0x20};
+    HCIFakeTransport.push(commandStatus, sizeof(commandStatus));
+    HCI.poll();
+
+    REQUIRE(completeCount == 2);
+    REQUIRE(completeOpcode == 0x200c);
+    REQUIRE(completeStatus == 0x0c);
+    REQUIRE(HCI.pendingCommands() == 0);
+    REQUIRE(HCI.commandCredits() == 1);
+  }
+
+  WHEN("Sending a blocking command")
+  {
+    uint8_t commandComplete[] = {0x04, 0x0e, 0x0a, 0x01, 0x09, 0x10, 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+    HCIFakeTransport.push(commandComplete, sizeof(commandComplete));
+
+    uint8_t addr[6];
+    uint8_t goldenAddr[] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+
+    REQUIRE(HCI.readBdAddr(addr) == 0);
+    REQUIRE(memcmp(addr, goldenAddr, sizeof(goldenAddr)) == 0);
+    REQUIRE(HCI.pendingCommands() == 0);
+  }
+}
+
+TEST_CASE("HCI packet reception", "[ArduinoBLE::HCI]")
+{
+  HCIFakeTransport.clear();
+  HCI.begin();
+  completeCount = 0;
+
+  uint8_t enable = 0x01;
+  uint8_t commandComplete[] = {0x04, 0x0e, 0x04, 0x01, 0x0a, 0x20, 0x00};
+
+  WHEN("A packet is received in several chunks")
+  {
+    REQUIRE(HCI.sendCommandAsync(0x200a, sizeof(enable), &enable, onCommandComplete) == 0);
+
+    HCIFakeTransport.push(commandComplete, 2);
+    HCI.poll();
+    REQUIRE(completeCount == 0);
+
+    HCIFakeTransport.push(&commandComplete[2], 3);
+    HCI.poll();
+    REQUIRE(completeCount == 0);
+
+    HCIFakeTransport.push(&commandComplete[5], 2);
+    HCI.poll();
+    REQUIRE(completeCount == 1);
+    REQUIRE(completeOpcode == 0x200a);
+  }
+
+  WHEN("Several packets are received at once")
+  {
+    REQUIRE(HCI.sendCommandAsync(0x200a, sizeof(enable), &enable, onCommandComplete) == 0);
+    REQUIRE(HCI.sendCommandAsync(0x200a, sizeof(enable), &enable, onCommandComplete) == 0);
+
+    // unknown bytes in between packets are skipped
+    uint8_t garbage = 0xff;
+    HCIFakeTransport.push(commandComplete, sizeof(commandComplete));
+    HCIFakeTransport.push(&garbage, sizeof(garbage));
+    HCIFakeTransport.push(commandComplete, sizeof(commandComplete));
+    HCI.poll();
+
+    REQUIRE(completeCount == 2);
+    REQUIRE(HCI.pendingCommands() == 0);
+  }
+}
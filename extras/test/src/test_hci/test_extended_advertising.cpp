@@ -0,0 +1,268 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <catch2/catch_test_macros.hpp>
+
+#define private public
+#define protected public
+
+#include "HCI.h"
+#include "ATT.h"
+#include "GAP.h"
+#include "BLEAdvertisingSet.h"
+#include "HCIFakeTransport.h"
+
+TEST_CASE("Extended advertising", "[ArduinoBLE::HCI]")
+{
+  HCIFakeTransport.clear();
+  HCI.begin();
+
+  WHEN("The advertising data does not fit in one command")
+  {
+    uint8_t data[600];
+    for (int i = 0; i < (int)sizeof(data); i++) {
+      data[i] = i;
+    }
+
+    // one Command Complete per fragment
+    uint8_t commandComplete[] = {0x04, 0x0e, 0x04, 0x01, 0x37, 0x20, 0x00};
+    for (int i = 0; i < 3; i++) {
+      HCIFakeTransport.push(commandComplete, sizeof(commandComplete));
+    }
+
+    REQUIRE(HCI.leSetExtendedAdvertisingData(0x01, sizeof(data), data) == 0);
+    REQUIRE(HCI.pendingCommands() == 0);
+
+    // first, intermediate and last fragments of 251, 251 and 98 bytes
+    uint8_t firstFragment[] = {0x01, 0x37, 0x20, 0xff, 0x01, 0x01, 0x01, 0xfb};
+    uint8_t intermediateFragment[] = {0x01, 0x37, 0x20, 0xff, 0x01, 0x00, 0x01, 0xfb};
+    uint8_t lastFragment[] = {0x01, 0x37, 0x20, 0x66, 0x01, 0x02, 0x01, 0x62};
+
+    REQUIRE(HCIFakeTransport.txLength == 259 + 259 + 106);
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, firstFragment, sizeof(firstFragment)) == 0);
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[259], intermediateFragment, sizeof(intermediateFragment)) == 0);
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[518], lastFragment, sizeof(lastFragment)) == 0);
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[8], data, 251) == 0);
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[267], &data[251], 251) == 0);
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[526], &data[502], 98) == 0);
+  }
+
+  WHEN("A connectable set was stopped by a connection")
+  {
+    BLEAdvertisingSet advertisingSet;
+
+    GAP._advertisingSets[0] = &advertisingSet;
+    advertisingSet._handle = 0;
+    advertisingSet._enabled = true;
+
+    uint8_t advertisingSetTerminated[] = {0x04, 0x3e, 0x06, 0x12, 0x00, 0x00, 0x40, 0x00, 0x01};
+    HCIFakeTransport.push(advertisingSetTerminated, sizeof(advertisingSetTerminated));
+    HCI.poll();
+
+    REQUIRE(advertisingSet.advertising() == false);
+
+    // the set is enabled again once the connection ends
+    uint8_t disconnectionComplete[] = {0x04, 0x05, 0x04, 0x00, 0x40, 0x00, 0x13};
+    HCIFakeTransport.push(disconnectionComplete, sizeof(disconnectionComplete));
+    HCI.poll();
+
+    uint8_t enableCommand[] = {0x01, 0x39, 0x20, 0x06, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(enableCommand));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, enableCommand, sizeof(enableCommand)) == 0);
+    REQUIRE(advertisingSet.advertising() == true);
+
+    // forget the set without talking to the controller
+    GAP._advertisingSets[0] = NULL;
+    advertisingSet._handle = -1;
+  }
+
+  WHEN("A set advertises with a random address")
+  {
+    BLEAdvertisingSet advertisingSet;
+    BLEAdvertisingSet* advertisingSets[] = { &advertisingSet };
+    uint8_t randomAddress[6] = {0xc0, 0x11, 0x22, 0x33, 0x44, 0x55};
+
+    advertisingSet.setRandomAddress(randomAddress);
+    GAP._maxAdvertisingSets = 0;
+
+    uint8_t readNumberOfSets[] = {0x04, 0x0e, 0x05, 0x01, 0x3b, 0x20, 0x00, 0x04};
+    uint8_t setParameters[] = {0x04, 0x0e, 0x05, 0x01, 0x36, 0x20, 0x00, 0x00};
+    uint8_t setRandomAddress[] = {0x04, 0x0e, 0x04, 0x01, 0x35, 0x20, 0x00};
+    uint8_t setData[] = {0x04, 0x0e, 0x04, 0x01, 0x37, 0x20, 0x00};
+    uint8_t enable[] = {0x04, 0x0e, 0x04, 0x01, 0x39, 0x20, 0x00};
+    HCIFakeTransport.reply(readNumberOfSets, sizeof(readNumberOfSets));
+    HCIFakeTransport.reply(setParameters, sizeof(setParameters));
+    HCIFakeTransport.reply(setRandomAddress, sizeof(setRandomAddress));
+    HCIFakeTransport.reply(setData, sizeof(setData));
+    HCIFakeTransport.reply(enable, sizeof(enable));
+
+    REQUIRE(GAP.advertise(advertisingSets, 1) == 1);
+
+    // random own address type in the parameters, then the address of the set
+    uint8_t randomAddressCommand[] = {0x01, 0x35, 0x20, 0x07, 0x00, 0x55, 0x44, 0x33, 0x22, 0x11, 0xc0};
+    REQUIRE(HCIFakeTransport.txBuffer[1] == 0x3b);
+    REQUIRE(HCIFakeTransport.txBuffer[4 + 1] == 0x36);
+    REQUIRE(HCIFakeTransport.txBuffer[4 + 14] == 0x01);
+    REQUIRE(memcmp(&HCIFakeTransport.txBuffer[4 + 29], randomAddressCommand, sizeof(randomAddressCommand)) == 0);
+    REQUIRE(HCI.extendedCommands() == true);
+
+    // only the extended commands are used from now on
+    HCIFakeTransport.clear();
+    HCIFakeTransport.reply(enable, sizeof(enable));
+    GAP.stopAdvertise();
+
+    uint8_t disableCommand[] = {0x01, 0x39, 0x20, 0x02, 0x00, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(disableCommand));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, disableCommand, sizeof(disableCommand)) == 0);
+
+    // the connection is created by the command status, then the connection complete event
+    uint8_t peerAddress[6] = {0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6};
+    uint8_t createConnection[] = {
+      0x04, 0x0f, 0x04, 0x00, 0x01, 0x43, 0x20,
+      0x04, 0x3e, 0x13, 0x01, 0x00, 0x40, 0x00, 0x00, 0x00,
+      0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x18, 0x00, 0x00, 0x00, 0xc8, 0x00, 0x00
+    };
+    HCIFakeTransport.clear();
+    HCIFakeTransport.reply(createConnection, sizeof(createConnection));
+
+    REQUIRE(ATT.connect(0x00, peerAddress) == true);
+
+    uint8_t extendedCreateConnection[] = {0x01, 0x43, 0x20, 0x1a, 0x00, 0x00, 0x00, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x01};
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, extendedCreateConnection, sizeof(extendedCreateConnection)) == 0);
+
+    uint8_t disconnectionComplete[] = {0x04, 0x05, 0x04, 0x00, 0x40, 0x00, 0x13};
+    HCIFakeTransport.push(disconnectionComplete, sizeof(disconnectionComplete));
+    HCI.poll();
+
+    GAP._advertisingSets[0] = NULL;
+    GAP._maxAdvertisingSets = 0;
+    advertisingSet._handle = -1;
+  }
+}
+
+static int periodicEventCount[3];
+static int periodicDataLength;
+static uint8_t periodicData[8];
+static BLEDevice periodicDevice;
+
+static void periodicSyncEstablishedHandler(BLEDevice device)
+{
+  periodicEventCount[0]++;
+  periodicDevice = device;
+}
+
+static void periodicReportHandler(BLEDevice device)
+{
+  periodicEventCount[1]++;
+  periodicDataLength = device.manufacturerData(periodicData, sizeof(periodicData));
+}
+
+static void periodicSyncLostHandler(BLEDevice /*device*/)
+{
+  periodicEventCount[2]++;
+}
+
+TEST_CASE("Periodic advertising sync", "[ArduinoBLE::HCI]")
+{
+  HCIFakeTransport.clear();
+  HCI.begin();
+
+  memset(periodicEventCount, 0x00, sizeof(periodicEventCount));
+  GAP.setEventHandler(BLEPeriodicSyncEstablished, periodicSyncEstablishedHandler);
+  GAP.setEventHandler(BLEPeriodicReport, periodicReportHandler);
+  GAP.setEventHandler(BLEPeriodicSyncLost, periodicSyncLostHandler);
+
+  WHEN("Receiving a periodic advertising train")
+  {
+    uint8_t address[6] = {0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6};
+    BLEDevice device(0x00, address);
+
+    uint8_t commandStatus[] = {0x04, 0x0f, 0x04, 0x00, 0x01, 0x44, 0x20};
+    HCIFakeTransport.push(commandStatus, sizeof(commandStatus));
+
+    REQUIRE(GAP.syncToPeriodic(device, 0x02) == 1);
+
+    // SID 2, public address, no skip, 10 s timeout
+    uint8_t createSync[] = {0x01, 0x44, 0x20, 0x0e, 0x00, 0x02, 0x00, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x00, 0x00, 0xe8, 0x03, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(createSync));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, createSync, sizeof(createSync)) == 0);
+
+    // a second sync can't be created while the first one is pending
+    REQUIRE(GAP.syncToPeriodic(device, 0x03) == 0);
+
+    uint8_t syncEstablished[] = {0x04, 0x3e, 0x10, 0x0e, 0x00, 0x01, 0x00, 0x02, 0x00, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x02, 0x50, 0x00, 0x00};
+    HCIFakeTransport.push(syncEstablished, sizeof(syncEstablished));
+    HCI.poll();
+    REQUIRE(periodicEventCount[0] == 1);
+
+    // manufacturer data split in two reports
+    uint8_t firstReport[] = {0x04, 0x3e, 0x0c, 0x0f, 0x01, 0x00, 0x7f, 0xc4, 0xff, 0x01, 0x04, 0x05, 0xff, 0x01, 0x02};
+    uint8_t lastReport[] = {0x04, 0x3e, 0x0a, 0x0f, 0x01, 0x00, 0x7f, 0xc4, 0xff, 0x00, 0x02, 0x03, 0x04};
+    HCIFakeTransport.push(firstReport, sizeof(firstReport));
+    HCI.poll();
+    REQUIRE(periodicEventCount[1] == 0);
+
+    HCIFakeTransport.push(lastReport, sizeof(lastReport));
+    HCI.poll();
+
+    uint8_t goldenData[] = {0x01, 0x02, 0x03, 0x04};
+    REQUIRE(periodicEventCount[1] == 1);
+    REQUIRE(periodicDataLength == sizeof(goldenData));
+    REQUIRE(memcmp(periodicData, goldenData, sizeof(goldenData)) == 0);
+
+    uint8_t syncLost[] = {0x04, 0x3e, 0x03, 0x10, 0x01, 0x00};
+    HCIFakeTransport.push(syncLost, sizeof(syncLost));
+    HCI.poll();
+    REQUIRE(periodicEventCount[2] == 1);
+    REQUIRE(GAP._periodicSyncs[0].device == NULL);
+  }
+
+  WHEN("Stopping a sync established with the identity address type")
+  {
+    uint8_t address[6] = {0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6};
+    BLEDevice device(0x00, address);
+
+    uint8_t commandStatus[] = {0x04, 0x0f, 0x04, 0x00, 0x01, 0x44, 0x20};
+    HCIFakeTransport.push(commandStatus, sizeof(commandStatus));
+
+    REQUIRE(GAP.syncToPeriodic(device, 0x02) == 1);
+
+    // sync handle 0x0003, public identity address
+    uint8_t syncEstablished[] = {0x04, 0x3e, 0x10, 0x0e, 0x00, 0x03, 0x00, 0x02, 0x02, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0x02, 0x50, 0x00, 0x00};
+    HCIFakeTransport.push(syncEstablished, sizeof(syncEstablished));
+    HCI.poll();
+    REQUIRE(periodicEventCount[0] == 1);
+
+    // the device of the event is stopped by its sync handle
+    uint8_t terminateSyncComplete[] = {0x04, 0x0e, 0x04, 0x01, 0x46, 0x20, 0x00};
+    HCIFakeTransport.clear();
+    HCIFakeTransport.reply(terminateSyncComplete, sizeof(terminateSyncComplete));
+
+    GAP.stopPeriodicSync(periodicDevice);
+
+    uint8_t terminateSync[] = {0x01, 0x46, 0x20, 0x02, 0x03, 0x00};
+    REQUIRE(HCIFakeTransport.txLength == sizeof(terminateSync));
+    REQUIRE(memcmp(HCIFakeTransport.txBuffer, terminateSync, sizeof(terminateSync)) == 0);
+    REQUIRE(GAP._periodicSyncs[0].device == NULL);
+  }
+
+  GAP.setEventHandler(BLEPeriodicSyncEstablished, NULL);
+  GAP.setEventHandler(BLEPeriodicReport, NULL);
+  GAP.setEventHandler(BLEPeriodicSyncLost, NULL);
+}
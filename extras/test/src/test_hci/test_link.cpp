@@ -0,0 +1,106 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <catch2/catch_test_macros.hpp>
+
+#define private public
+#define protected public
+
+#include "HCI.h"
+#include "ATT.h"
+#include "HCIFakeTransport.h"
+
+static int phyUpdates = 0;
+static int dataLengthChanges = 0;
+
+static void phyUpdatedHandler(BLEDevice /*device*/)
+{
+  phyUpdates++;
+}
+
+static void dataLengthChangedHandler(BLEDevice /*device*/)
+{
+  dataLengthChanges++;
+}
+
+TEST_CASE("LE link layer updates", "[ArduinoBLE::HCI]")
+{
+  HCIFakeTransport.clear();
+  HCI.begin();
+
+  // forget the connections other tests left behind
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    ATT._peers[i].connectionHandle = 0xffff;
+  }
+
+  uint8_t connectionComplete[] = {
+    0x04, 0x3e, 0x13, 0x01, 0x00, 0x40, 0x00, 0x01, 0x00,
+    0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x18, 0x00, 0x00, 0x00, 0xc8, 0x00, 0x00
+  };
+  HCIFakeTransport.push(connectionComplete, sizeof(connectionComplete));
+  HCI.poll();
+
+  phyUpdates = 0;
+  dataLengthChanges = 0;
+  ATT.setEventHandler(BLEPhyUpdated, phyUpdatedHandler);
+  ATT.setEventHandler(BLEDataLengthChanged, dataLengthChangedHandler);
+
+  REQUIRE(ATT.txPhy(0x0040) == BLEPhy1M);
+  REQUIRE(ATT.txDataLength(0x0040) == 27);
+
+  WHEN("The PHY is updated")
+  {
+    uint8_t phyUpdateComplete[] = {0x04, 0x3e, 0x06, 0x0c, 0x00, 0x40, 0x00, 0x02, 0x03};
+    HCIFakeTransport.push(phyUpdateComplete, sizeof(phyUpdateComplete));
+    HCI.poll();
+
+    REQUIRE(phyUpdates == 1);
+    REQUIRE(ATT.txPhy(0x0040) == BLEPhy2M);
+    REQUIRE(ATT.rxPhy(0x0040) == BLEPhyCoded);
+  }
+
+  WHEN("The PHY update fails")
+  {
+    uint8_t phyUpdateComplete[] = {0x04, 0x3e, 0x06, 0x0c, 0x1a, 0x40, 0x00, 0x00, 0x00};
+    HCIFakeTransport.push(phyUpdateComplete, sizeof(phyUpdateComplete));
+    HCI.poll();
+
+    REQUIRE(phyUpdates == 1);
+    REQUIRE(ATT.txPhy(0x0040) == BLEPhy1M);
+    REQUIRE(ATT.rxPhy(0x0040) == BLEPhy1M);
+  }
+
+  WHEN("The data length changes")
+  {
+    uint8_t dataLengthChange[] = {0x04, 0x3e, 0x0b, 0x07, 0x40, 0x00, 0xfb, 0x00, 0x48, 0x08, 0x1b, 0x00, 0x48, 0x01};
+    HCIFakeTransport.push(dataLengthChange, sizeof(dataLengthChange));
+    HCI.poll();
+
+    REQUIRE(dataLengthChanges == 1);
+    REQUIRE(ATT.txDataLength(0x0040) == 251);
+    REQUIRE(ATT.rxDataLength(0x0040) == 27);
+  }
+
+  ATT.setEventHandler(BLEPhyUpdated, NULL);
+  ATT.setEventHandler(BLEDataLengthChanged, NULL);
+
+  uint8_t disconnectionComplete[] = {0x04, 0x05, 0x04, 0x00, 0x40, 0x00, 0x13};
+  HCIFakeTransport.push(disconnectionComplete, sizeof(disconnectionComplete));
+  HCI.poll();
+}
@@ -22,6 +22,8 @@
 #define AD_FIELD_OVERHEAD (2)
 
 BLEAdvertisingData::BLEAdvertisingData() :
+  _data(_legacyData),
+  _maxLength(MAX_AD_DATA_LENGTH),
   _dataLength(0),
   _remainingLength(MAX_AD_DATA_LENGTH),
   _rawData(NULL),
@@ -40,6 +42,35 @@ BLEAdvertisingData::BLEAdvertisingData() :
 {
 }
 
+BLEAdvertisingData::BLEAdvertisingData(uint8_t* data, int maxLength) :
+  _data(data),
+  _maxLength(data ? maxLength : 0),
+  _dataLength(0),
+  _remainingLength(_maxLength),
+  _rawData(NULL),
+  _rawDataLength(0),
+  _flags(0),
+  _hasFlags(false),
+  _localName(NULL),
+  _manufacturerData(NULL),
+  _manufacturerDataLength(0),
+  _manufacturerCompanyId(0),
+  _hasManufacturerCompanyId(false),
+  _advertisedServiceUuid(NULL),
+  _advertisedServiceUuidLength(0),
+  _serviceData(NULL),
+  _serviceDataLength(0)
+{
+}
+
+BLEAdvertisingData::BLEAdvertisingData(const BLEAdvertisingData& other) :
+  _data(_legacyData),
+  _maxLength(MAX_AD_DATA_LENGTH),
+  _dataLength(0)
+{
+  copy(other);
+}
+
 BLEAdvertisingData::~BLEAdvertisingData()
 {
 }
@@ -68,7 +99,7 @@ int BLEAdvertisingData::availableForWrite()
 
 void BLEAdvertisingData::clear()
 {
-  _remainingLength = MAX_AD_DATA_LENGTH;
+  _remainingLength = _maxLength;
   _rawData = NULL;
   _rawDataLength = 0;
   _hasFlags = false;
@@ -84,7 +115,8 @@ void BLEAdvertisingData::clear()
 
 void BLEAdvertisingData::copy(const BLEAdvertisingData& adv)
 {
-  _remainingLength = adv._remainingLength;
+  // the fields take the same room, whatever the size of the two buffers
+  _remainingLength = adv._remainingLength - (adv._maxLength - _maxLength);
   _rawData = adv._rawData;
   _rawDataLength = adv._rawDataLength;
   _flags = adv._flags;
@@ -185,7 +217,7 @@ bool BLEAdvertisingData::setLocalName(const char *localName)
 
 bool BLEAdvertisingData::setRawData(const uint8_t* data, int length)
 {
-  if (length > MAX_AD_DATA_LENGTH) {
+  if (length > _maxLength) {
     return false;
   }
   _rawData = data;
@@ -195,7 +227,7 @@ bool BLEAdvertisingData::setRawData(const uint8_t* data, int length)
 
 bool BLEAdvertisingData::setRawData(const BLEAdvertisingRawData& rawData)
 {
-  if (rawData.length > MAX_AD_DATA_LENGTH) {
+  if (rawData.length > _maxLength) {
     return false;
   }
   _rawData = rawData.data;
@@ -269,8 +301,8 @@ bool BLEAdvertisingData::hasFlags() const
 bool BLEAdvertisingData::addLocalName(const char *localName)
 {
   bool success = false;
-  if (strlen(localName) > (MAX_AD_DATA_LENGTH - AD_FIELD_OVERHEAD)) {
-    success = addField(BLEFieldShortLocalName, (uint8_t*)localName, (MAX_AD_DATA_LENGTH - AD_FIELD_OVERHEAD));
+  if (strlen(localName) > (unsigned int)(_maxLength - AD_FIELD_OVERHEAD)) {
+    success = addField(BLEFieldShortLocalName, (uint8_t*)localName, (_maxLength - AD_FIELD_OVERHEAD));
   } else {
     success = addField(BLEFieldCompleteLocalName, localName);
   }
@@ -298,7 +330,7 @@ bool BLEAdvertisingData::addManufacturerData(const uint8_t manufacturerData[], i
 bool BLEAdvertisingData::addManufacturerData(const uint16_t companyId, const uint8_t manufacturerData[], int manufacturerDataLength)
 {
   int tempDataLength = manufacturerDataLength + sizeof(companyId);
-  uint8_t tempData[MAX_AD_DATA_LENGTH];
+  uint8_t tempData[tempDataLength];
   memcpy(tempData, &companyId, sizeof(companyId));
   memcpy(&tempData[sizeof(companyId)], manufacturerData, manufacturerDataLength);
   return addField(BLEFieldManufacturerData, tempData, tempDataLength);
@@ -307,7 +339,7 @@ bool BLEAdvertisingData::addManufacturerData(const uint16_t companyId, const uin
 bool BLEAdvertisingData::addAdvertisedServiceData(uint16_t uuid, const uint8_t data[], int length)
 {
   int tempDataLength = length + sizeof(uuid);
-  uint8_t tempData[MAX_AD_DATA_LENGTH];
+  uint8_t tempData[tempDataLength];
   memcpy(tempData, &uuid, sizeof(uuid));
   memcpy(&tempData[sizeof(uuid)], data, length);
   return addField(BLEFieldServiceData, tempData, tempDataLength);
@@ -316,7 +348,7 @@ bool BLEAdvertisingData::addAdvertisedServiceData(uint16_t uuid, const uint8_t d
 bool BLEAdvertisingData::addRawData(const uint8_t* data, int length)
 {
   // Bypass addField to add the integral raw data
-  if (length > (MAX_AD_DATA_LENGTH - _dataLength)) {
+  if (length > (_maxLength - _dataLength)) {
     // Not enough space 
     return false;
   }
@@ -339,8 +371,8 @@ bool BLEAdvertisingData::addField(BLEAdField field, const char* data)
 bool BLEAdvertisingData::addField(BLEAdField field, const uint8_t* data, int length)
 {
   int fieldLength = length + AD_FIELD_OVERHEAD; // Considering data TYPE and LENGTH fields
-  if (fieldLength > (MAX_AD_DATA_LENGTH - _dataLength)) {
-    // Not enough space for storing this field
+  if (fieldLength > (_maxLength - _dataLength) || (length + 1) > 0xff) {
+    // Not enough space for storing this field, or too long for its length byte
     return false;
   }
   // Insert field into advertising data of the instance
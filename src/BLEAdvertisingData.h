@@ -54,6 +54,7 @@ struct BLEAdvertisingRawData {
 class BLEAdvertisingData {
 public:
   BLEAdvertisingData(); 
+  BLEAdvertisingData(const BLEAdvertisingData& other);
   virtual ~BLEAdvertisingData();
 
   int availableForWrite(); 
@@ -73,6 +74,10 @@ public:
 
 protected:
   friend class BLELocalDevice;
+  friend class GAPClass;
+  // Advertising data built in a buffer of maxLength bytes, for the extended advertising sets
+  BLEAdvertisingData(uint8_t* data, int maxLength);
+
   bool updateData();
   uint8_t* data();
   int dataLength() const;
@@ -93,7 +98,9 @@ private:
   bool addField(BLEAdField field, const char* data);
   bool addField(BLEAdField field, const uint8_t* data, int length);
 
-  uint8_t _data[MAX_AD_DATA_LENGTH];
+  uint8_t _legacyData[MAX_AD_DATA_LENGTH];
+  uint8_t* _data;
+  int _maxLength;
   int _dataLength;
 
   int _remainingLength;
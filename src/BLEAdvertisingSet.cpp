@@ -0,0 +1,105 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "utility/GAP.h"
+
+#include "BLEAdvertisingSet.h"
+
+BLEAdvertisingSet::BLEAdvertisingSet(int maxDataLength) :
+  BLEAdvertisingData((uint8_t*)malloc(constrain(maxDataLength, MAX_AD_DATA_LENGTH, MAX_EXTENDED_AD_DATA_LENGTH)),
+                     constrain(maxDataLength, MAX_AD_DATA_LENGTH, MAX_EXTENDED_AD_DATA_LENGTH)),
+  _minInterval(160),
+  _maxInterval(160),
+  _connectable(true),
+  _legacy(false),
+  _primaryPhy(BLEPhy1M),
+  _secondaryPhy(BLEPhy1M),
+  _txPower(127),
+  _randomAddress(false),
+  _periodicMinInterval(0),
+  _periodicMaxInterval(0),
+  _periodicData(NULL),
+  _handle(-1),
+  _enabled(false),
+  _terminated(false)
+{
+}
+
+BLEAdvertisingSet::~BLEAdvertisingSet()
+{
+  if (_handle >= 0) {
+    GAP.removeAdvertisingSet(*this);
+  }
+
+  if (data()) {
+    free(data());
+  }
+}
+
+void BLEAdvertisingSet::setInterval(uint32_t minimumInterval, uint32_t maximumInterval)
+{
+  _minInterval = minimumInterval;
+  _maxInterval = maximumInterval;
+}
+
+void BLEAdvertisingSet::setConnectable(bool connectable)
+{
+  _connectable = connectable;
+}
+
+void BLEAdvertisingSet::setLegacy(bool legacy)
+{
+  _legacy = legacy;
+}
+
+void BLEAdvertisingSet::setPhy(uint8_t primaryPhy, uint8_t secondaryPhy)
+{
+  _primaryPhy = primaryPhy;
+  _secondaryPhy = secondaryPhy;
+}
+
+void BLEAdvertisingSet::setTxPower(int8_t txPower)
+{
+  _txPower = txPower;
+}
+
+void BLEAdvertisingSet::setRandomAddress(const uint8_t address[6])
+{
+  for (int i = 0; i < 6; i++) {
+    _address[i] = address[5 - i];
+  }
+
+  _randomAddress = true;
+}
+
+void BLEAdvertisingSet::setPeriodicInterval(uint16_t minimumInterval, uint16_t maximumInterval)
+{
+  _periodicMinInterval = minimumInterval;
+  _periodicMaxInterval = maximumInterval;
+}
+
+void BLEAdvertisingSet::setPeriodicData(BLEAdvertisingData& periodicData)
+{
+  _periodicData = &periodicData;
+}
+
+bool BLEAdvertisingSet::advertising() const
+{
+  return (_enabled && !_terminated);
+}
@@ -0,0 +1,85 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _BLE_ADVERTISING_SET_H_
+#define _BLE_ADVERTISING_SET_H_
+
+#include "BLEAdvertisingData.h"
+#include "BLEDevice.h"
+
+// Largest advertising data of an extended advertising set
+#define MAX_EXTENDED_AD_DATA_LENGTH (1650)
+// Largest advertising data that fits in a single HCI command
+#define DEFAULT_EXTENDED_AD_DATA_LENGTH (251)
+
+// An extended advertising set: its own data, PDU type, interval and PHYs.
+// Several sets are advertised at once with BLE.advertise(sets, count).
+class BLEAdvertisingSet : public BLEAdvertisingData {
+public:
+  BLEAdvertisingSet(int maxDataLength = DEFAULT_EXTENDED_AD_DATA_LENGTH);
+  virtual ~BLEAdvertisingSet();
+
+  // interval in units of 0.625 ms
+  void setInterval(uint32_t minimumInterval, uint32_t maximumInterval);
+  void setConnectable(bool connectable);
+  // Use legacy advertising PDUs, seen by Bluetooth 4.x scanners but limited to 31 bytes of data
+  void setLegacy(bool legacy);
+  // primaryPhy is BLEPhy1M or BLEPhyCoded, secondaryPhy any BLEPhy
+  void setPhy(uint8_t primaryPhy, uint8_t secondaryPhy);
+  // in dBm, 127 lets the controller choose
+  void setTxPower(int8_t txPower);
+  // Advertise with a random address instead of the public one, most significant byte first
+  void setRandomAddress(const uint8_t address[6]);
+  // Periodic advertising alongside the set, interval in units of 1.25 ms, 0 to disable.
+  // The set must be non connectable and not legacy.
+  void setPeriodicInterval(uint16_t minimumInterval, uint16_t maximumInterval);
+  void setPeriodicData(BLEAdvertisingData& periodicData);
+
+  bool advertising() const;
+
+private:
+  friend class GAPClass;
+  friend class BLELocalCharacteristic;
+
+  BLEAdvertisingSet(const BLEAdvertisingSet&);
+  BLEAdvertisingSet& operator=(const BLEAdvertisingSet&);
+
+  uint32_t _minInterval;
+  uint32_t _maxInterval;
+  bool _connectable;
+  bool _legacy;
+  uint8_t _primaryPhy;
+  uint8_t _secondaryPhy;
+  int8_t _txPower;
+  bool _randomAddress;
+  // in the byte order of the HCI commands
+  uint8_t _address[6];
+
+  uint16_t _periodicMinInterval;
+  uint16_t _periodicMaxInterval;
+  BLEAdvertisingData* _periodicData;
+
+  // advertising handle in the controller, -1 until the set is advertised
+  int _handle;
+  bool _enabled;
+  // stopped by the controller when a connection was created, resumed on disconnection
+  bool _terminated;
+};
+
+#endif
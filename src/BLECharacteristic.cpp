@@ -17,6 +17,7 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include "BLEDevice.h"
 #include "BLEProperty.h"
 
 #include "local/BLELocalCharacteristic.h"
@@ -306,6 +307,15 @@ int BLECharacteristic::broadcast()
   return 0;
 }
 
+int BLECharacteristic::broadcast(BLEAdvertisingSet& advertisingSet)
+{
+  if (_local) {
+    return _local->broadcast(advertisingSet);
+  }
+
+  return 0;
+}
+
 bool BLECharacteristic::written()
 {
   if (_local) {
@@ -324,6 +334,89 @@ bool BLECharacteristic::subscribed()
   return false;
 }
 
+bool BLECharacteristic::subscribed(BLEDevice device)
+{
+  if (_local) {
+    return _local->subscribed(device);
+  }
+
+  return false;
+}
+
+void BLECharacteristic::setNotifyCoalescing(bool enabled)
+{
+  if (_local) {
+    _local->setNotifyCoalescing(enabled);
+  }
+}
+
+unsigned long BLECharacteristic::coalescedNotifications() const
+{
+  if (_local) {
+    return _local->coalescedNotifications();
+  }
+
+  return 0;
+}
+
+unsigned long BLECharacteristic::droppedNotifications() const
+{
+  if (_local) {
+    return _local->droppedNotifications();
+  }
+
+  if (_remote) {
+    return _remote->droppedValues();
+  }
+
+  return 0;
+}
+
+bool BLECharacteristic::setValueQueue(int depth, int valueSize)
+{
+  if (_remote) {
+    return _remote->setValueQueue(depth, valueSize);
+  }
+
+  return false;
+}
+
+int BLECharacteristic::valuesQueued()
+{
+  if (_remote) {
+    return _remote->valuesQueued();
+  }
+
+  return 0;
+}
+
+int BLECharacteristic::readNext(uint8_t value[], int length)
+{
+  if (_remote) {
+    return _remote->readNext(value, length);
+  }
+
+  return -1;
+}
+
+int BLECharacteristic::readNext(uint8_t value[], int length, unsigned long& timestamp)
+{
+  if (_remote) {
+    return _remote->readNext(value, length, &timestamp);
+  }
+
+  return -1;
+}
+
+unsigned long BLECharacteristic::truncatedValues() const
+{
+  if (_remote) {
+    return _remote->truncatedValues();
+  }
+
+  return 0;
+}
+
 bool BLECharacteristic::valueUpdated()
 {
   if (_remote) {
@@ -451,6 +544,15 @@ bool BLECharacteristic::read()
   return false;
 }
 
+int BLECharacteristic::read(uint8_t buffer[], int length)
+{
+  if (_remote) {
+    return _remote->read(buffer, length);
+  }
+
+  return -1;
+}
+
 bool BLECharacteristic::canWrite()
 {
   if (_remote) {
@@ -491,3 +593,39 @@ bool BLECharacteristic::unsubscribe()
 
   return false;
 }
+
+bool BLECharacteristic::readAsync(BLECharacteristicCompletionHandler handler)
+{
+  if (_remote) {
+    return _remote->readAsync(handler);
+  }
+
+  return false;
+}
+
+bool BLECharacteristic::writeAsync(const uint8_t value[], int length, BLECharacteristicCompletionHandler handler, bool withResponse)
+{
+  if (_remote) {
+    return _remote->writeValueAsync(value, length, handler, withResponse);
+  }
+
+  return false;
+}
+
+bool BLECharacteristic::subscribeAsync(BLECharacteristicCompletionHandler handler)
+{
+  if (_remote) {
+    return _remote->writeCccdAsync((properties() & BLEIndicate) ? 0x0002 : 0x0001, handler);
+  }
+
+  return false;
+}
+
+bool BLECharacteristic::unsubscribeAsync(BLECharacteristicCompletionHandler handler)
+{
+  if (_remote) {
+    return _remote->writeCccdAsync(0x0000, handler);
+  }
+
+  return false;
+}
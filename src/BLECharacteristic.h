@@ -30,14 +30,17 @@ enum BLECharacteristicEvent {
 //BLERead = 2, // defined in BLEProperties.h
   BLEWritten = 3,
   BLEUpdated = BLEWritten, // alias
+  BLEIndicationConfirmed = 4,
 
   BLECharacteristicEventLast
 };
 
+class BLEAdvertisingSet;
 class BLECharacteristic;
 class BLEDevice;
 
 typedef void (*BLECharacteristicEventHandler)(BLEDevice device, BLECharacteristic characteristic);
+typedef void (*BLECharacteristicCompletionHandler)(BLEDevice device, BLECharacteristic characteristic, bool success);
 
 class BLELocalCharacteristic;
 class BLERemoteCharacteristic;
@@ -83,11 +86,25 @@ public:
   int setValue(const char* value) { return writeValue(value); }
 
   int broadcast();
+  int broadcast(BLEAdvertisingSet& advertisingSet);
 
   bool written();
   bool subscribed();
+  bool subscribed(BLEDevice device);
   bool valueUpdated();
 
+  // Only notify the latest value when the link does not keep up, for high rate local characteristics
+  void setNotifyCoalescing(bool enabled);
+  unsigned long coalescedNotifications() const;
+  unsigned long droppedNotifications() const;
+
+  // Keep every notified value of a remote characteristic in a ring of depth values, drained with readNext(...)
+  bool setValueQueue(int depth, int valueSize);
+  int valuesQueued();
+  int readNext(uint8_t value[], int length);
+  int readNext(uint8_t value[], int length, unsigned long& timestamp);
+  unsigned long truncatedValues() const;
+
   void addDescriptor(BLEDescriptor& descriptor);
 
   operator bool() const;
@@ -103,12 +120,19 @@ public:
 
   bool canRead();
   bool read();
+  int read(uint8_t buffer[], int length);
   bool canWrite();
   bool canSubscribe();
   bool subscribe();
   bool canUnsubscribe();
   bool unsubscribe();
 
+  // queued on the connection, the handler is called when the operation completes
+  bool readAsync(BLECharacteristicCompletionHandler handler);
+  bool writeAsync(const uint8_t value[], int length, BLECharacteristicCompletionHandler handler, bool withResponse = true);
+  bool subscribeAsync(BLECharacteristicCompletionHandler handler);
+  bool unsubscribeAsync(BLECharacteristicCompletionHandler handler);
+
 protected:
   friend class BLELocalCharacteristic;
   friend class BLELocalService;
@@ -118,6 +142,7 @@ protected:
   BLELocalCharacteristic* local();
 
 protected:
+  friend class ATTClass;
   friend class BLEDevice;
   friend class BLEService;
   friend class BLERemoteCharacteristic;
@@ -30,7 +30,10 @@ extern "C" int strcasecmp(char const *a, char const *b);
 BLEDevice::BLEDevice() :
   _advertisementTypeMask(0),
   _eirDataLength(0),
-  _rssi(127)
+  _rssi(127),
+  _extendedDataPending(false),
+  _advertisingSid(0xff),
+  _periodicSyncHandle(0xffff)
 {
   memset(_address, 0x00, sizeof(_address));
 }
@@ -39,7 +42,10 @@ BLEDevice::BLEDevice(uint8_t addressType, uint8_t address[6]) :
   _addressType(addressType),
   _advertisementTypeMask(0),
   _eirDataLength(0),
-  _rssi(127)
+  _rssi(127),
+  _extendedDataPending(false),
+  _advertisingSid(0xff),
+  _periodicSyncHandle(0xffff)
 {
   memcpy(_address, address, sizeof(_address));
 }
@@ -101,7 +107,7 @@ int BLEDevice::advertisedServiceUuidCount() const
 {
   int advertisedServiceCount = 0;
 
-  for (unsigned char i = 0; i < _eirDataLength;) {
+  for (int i = 0; i < _eirDataLength;) {
     int eirLength = _eirData[i++];
     int eirType = _eirData[i++];
 
@@ -158,7 +164,7 @@ String BLEDevice::advertisedServiceUuid(int index) const
   String serviceUuid;
   int uuidIndex = 0;
 
-  for (unsigned char i = 0; i < _eirDataLength;) {
+  for (int i = 0; i < _eirDataLength;) {
     int eirLength = _eirData[i++];
     int eirType = _eirData[i++];
 
@@ -250,6 +256,12 @@ int BLEDevice::manufacturerData(uint8_t value[], int length) const
   return length;
 }
 
+int BLEDevice::advertisingSid() const
+{
+  // 0xff: no ADI field
+  return (_advertisingSid <= 0x0f) ? _advertisingSid : -1;
+}
+
 int BLEDevice::rssi()
 {
   uint16_t handle = ATT.connectionHandle(_addressType, _address);
@@ -261,6 +273,97 @@ int BLEDevice::rssi()
   return _rssi;
 }
 
+bool BLEDevice::setPhy(uint8_t phys)
+{
+  return setPhy(phys, phys);
+}
+
+bool BLEDevice::setPhy(uint8_t txPhys, uint8_t rxPhys)
+{
+  uint16_t handle = ATT.connectionHandle(_addressType, _address);
+
+  if (handle == 0xffff) {
+    return false;
+  }
+
+  return (HCI.leSetPhy(handle, 0x00, txPhys, rxPhys, 0x0000) == 0);
+}
+
+int BLEDevice::txPhy() const
+{
+  uint16_t handle = ATT.connectionHandle(_addressType, _address);
+
+  if (handle == 0xffff) {
+    return 0;
+  }
+
+  return ATT.txPhy(handle);
+}
+
+int BLEDevice::rxPhy() const
+{
+  uint16_t handle = ATT.connectionHandle(_addressType, _address);
+
+  if (handle == 0xffff) {
+    return 0;
+  }
+
+  return ATT.rxPhy(handle);
+}
+
+bool BLEDevice::setDataLength(uint16_t txOctets)
+{
+  uint16_t handle = ATT.connectionHandle(_addressType, _address);
+
+  if (handle == 0xffff) {
+    return false;
+  }
+
+  txOctets = constrain(txOctets, 27, 251);
+
+  // time to send txOctets on the PHY of the link: preamble, access address, header, MIC and CRC included
+  uint16_t txTime;
+
+  switch (ATT.txPhy(handle)) {
+    case BLEPhy1M:
+      txTime = (txOctets + 14) * 8;
+      break;
+
+    case BLEPhy2M:
+      txTime = (txOctets + 15) * 4;
+      break;
+
+    default:
+      // Coded, with S=8 coding as the worst case, or not known yet
+      txTime = 976 + txOctets * 64;
+      break;
+  }
+
+  return (HCI.leSetDataLength(handle, txOctets, constrain(txTime, 0x0148, 0x4290)) == 0);
+}
+
+int BLEDevice::txDataLength() const
+{
+  uint16_t handle = ATT.connectionHandle(_addressType, _address);
+
+  if (handle == 0xffff) {
+    return 0;
+  }
+
+  return ATT.txDataLength(handle);
+}
+
+int BLEDevice::rxDataLength() const
+{
+  uint16_t handle = ATT.connectionHandle(_addressType, _address);
+
+  if (handle == 0xffff) {
+    return 0;
+  }
+
+  return ATT.rxDataLength(handle);
+}
+
 bool BLEDevice::connect()
 {
   return ATT.connect(_addressType, _address);
@@ -271,6 +374,32 @@ bool BLEDevice::discoverAttributes()
   return ATT.discoverAttributes(_addressType, _address, NULL);
 }
 
+bool BLEDevice::discoverAttributesAsync(BLEDeviceCompletionHandler handler)
+{
+  return ATT.discoverAttributesAsync(_addressType, _address, NULL, handler);
+}
+
+bool BLEDevice::readMultiple(BLECharacteristic characteristics[], int count)
+{
+  uint16_t connectionHandle = ATT.connectionHandle(_addressType, _address);
+
+  if (connectionHandle == 0xffff || count <= 0) {
+    return false;
+  }
+
+  BLERemoteCharacteristic* remoteCharacteristics[count];
+
+  for (int i = 0; i < count; i++) {
+    remoteCharacteristics[i] = characteristics[i]._remote;
+
+    if (remoteCharacteristics[i] == NULL) {
+      return false;
+    }
+  }
+
+  return ATT.readMultiple(connectionHandle, remoteCharacteristics, count);
+}
+
 bool BLEDevice::discoverService(const char* serviceUuid)
 {
   return ATT.discoverAttributes(_addressType, _address, serviceUuid);
@@ -409,23 +538,30 @@ BLEService BLEDevice::service(const char * uuid) const
 
 BLEService BLEDevice::service(const char * uuid, int index) const
 {
-  BLERemoteDevice* device = ATT.device(_addressType, _address);
+  // with lazy discovery, looked for again once the service is discovered
+  for (int attempt = 0; attempt < 2; attempt++) {
+    BLERemoteDevice* device = ATT.device(_addressType, _address);
 
-  if (device) {
-    int count = 0;
-    int numServices = device->serviceCount();
+    if (device) {
+      int count = 0;
+      int numServices = device->serviceCount();
 
-    for (int i = 0; i < numServices; i++) {
-      BLERemoteService* s = device->service(i);
+      for (int i = 0; i < numServices; i++) {
+        BLERemoteService* s = device->service(i);
 
-      if (strcasecmp(uuid, s->uuid()) == 0) {
-        if (count == index) {
-          return BLEService(s);
-        }
+        if (strcasecmp(uuid, s->uuid()) == 0) {
+          if (count == index) {
+            return BLEService(s);
+          }
 
-        count++;
+          count++;
+        }
       }
     }
+
+    if (attempt == 0 && !ATT.discoverLazily(_addressType, _address, uuid, NULL)) {
+      break;
+    }
   }
 
   return BLEService();
@@ -520,30 +656,37 @@ BLECharacteristic BLEDevice::characteristic(const char * uuid) const
 
 BLECharacteristic BLEDevice::characteristic(const char * uuid, int index) const
 {
-  BLERemoteDevice* device = ATT.device(_addressType, _address);
+  // with lazy discovery, looked for again once the service holding it is discovered
+  for (int attempt = 0; attempt < 2; attempt++) {
+    BLERemoteDevice* device = ATT.device(_addressType, _address);
 
-  if (device) {
-    int count = 0;
-    int numServices = device->serviceCount();
+    if (device) {
+      int count = 0;
+      int numServices = device->serviceCount();
 
-    for (int i = 0; i < numServices; i++) {
-      BLERemoteService* s = device->service(i);
+      for (int i = 0; i < numServices; i++) {
+        BLERemoteService* s = device->service(i);
 
-      int numCharacteristics = s->characteristicCount();
+        int numCharacteristics = s->characteristicCount();
 
-      for (int j = 0; j < numCharacteristics; j++) {
-        BLERemoteCharacteristic* c = s->characteristic(j);
+        for (int j = 0; j < numCharacteristics; j++) {
+          BLERemoteCharacteristic* c = s->characteristic(j);
 
-        if (strcasecmp(c->uuid(), uuid) == 0) {
-          if (count == index) {
+          if (strcasecmp(c->uuid(), uuid) == 0) {
+            if (count == index) {
 
-            return BLECharacteristic(c);
-          }
+              return BLECharacteristic(c);
+            }
 
-          count++;
+            count++;
+          }
         }
       }
     }
+
+    if (attempt == 0 && !ATT.discoverLazily(_addressType, _address, NULL, uuid)) {
+      break;
+    }
   }
 
   return BLECharacteristic();
@@ -564,12 +707,53 @@ void BLEDevice::setAdvertisementData(uint8_t type, uint8_t eirDataLength, uint8_
 
 void BLEDevice::setScanResponseData(uint8_t eirDataLength, uint8_t eirData[], int8_t rssi)
 {
+  if (eirDataLength > (sizeof(_eirData) - _eirDataLength)) {
+    eirDataLength = sizeof(_eirData) - _eirDataLength;
+  }
+
   _advertisementTypeMask |= (1 << 0x04);
   memcpy(&_eirData[_eirDataLength], eirData, eirDataLength);
   _eirDataLength += eirDataLength;
   _rssi = rssi;
 }
 
+void BLEDevice::setExtendedAdvertisementData(uint16_t eventType, uint8_t sid, uint8_t eirDataLength, uint8_t eirData[], int8_t rssi)
+{
+  bool scanResponse = (eventType & 0x0008) != 0;
+
+  if (_extendedDataPending && !scanResponse && sid != _advertisingSid) {
+    // not the continuation of the pending chain, its partial data is dropped
+    _extendedDataPending = false;
+  }
+
+  // a report that neither continues a chain nor is a scan response starts a new advertisement
+  if (!_extendedDataPending && !scanResponse) {
+    _advertisementTypeMask = 0;
+    _eirDataLength = 0;
+  }
+
+  if (eirDataLength > (sizeof(_eirData) - _eirDataLength)) {
+    eirDataLength = sizeof(_eirData) - _eirDataLength;
+  }
+
+  memcpy(&_eirData[_eirDataLength], eirData, eirDataLength);
+  _eirDataLength += eirDataLength;
+  _rssi = rssi;
+  _advertisingSid = sid;
+
+  // data status: complete, incomplete with more to come or truncated
+  _extendedDataPending = (((eventType >> 5) & 0x03) == 0x01);
+
+  if (!_extendedDataPending) {
+    if (scanResponse) {
+      _advertisementTypeMask |= (1 << 0x04);
+    } else if ((eventType & 0x0002) == 0) {
+      // complete and not scannable, discovered like legacy non connectable advertising
+      _advertisementTypeMask |= (1 << 0x03);
+    }
+  }
+}
+
 bool BLEDevice::discovered()
 {
   // expect, 0x03 or 0x04 flag to be set
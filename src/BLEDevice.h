@@ -24,17 +24,39 @@
 
 #include "BLEService.h"
 
+// Advertising data kept for a discovered device: legacy advertising and scan response,
+// or the reassembled data of an extended advertisement, truncated to this size
+#ifndef BLE_MAX_EIR_DATA_LENGTH
+#ifdef __AVR__
+#define BLE_MAX_EIR_DATA_LENGTH (31 * 2)
+#else
+#define BLE_MAX_EIR_DATA_LENGTH 256
+#endif
+#endif
+
 enum BLEDeviceEvent {
   BLEConnected = 0,
   BLEDisconnected = 1,
   BLEDiscovered = 2,
+  BLEPhyUpdated = 3,
+  BLEDataLengthChanged = 4,
+  BLEPeriodicSyncEstablished = 5,
+  BLEPeriodicReport = 6,
+  BLEPeriodicSyncLost = 7,
 
   BLEDeviceLastEvent
 };
 
+enum BLEPhy {
+  BLEPhy1M    = 0x01,
+  BLEPhy2M    = 0x02,
+  BLEPhyCoded = 0x04
+};
+
 class BLEDevice;
 
 typedef void (*BLEDeviceEventHandler)(BLEDevice device);
+typedef void (*BLEDeviceCompletionHandler)(BLEDevice device, bool success);
 
 class BLEDevice {
 public:
@@ -67,10 +89,26 @@ public:
   int manufacturerDataLength() const;
   int manufacturerData(uint8_t value[], int length) const;
 
+  // Advertising SID of an extended advertisement, -1 for legacy advertising
+  int advertisingSid() const;
+
   virtual int rssi();
 
+  // Request PHYs for the connection, phys are BLEPhy masks, the result is reported with BLEPhyUpdated
+  bool setPhy(uint8_t phys);
+  bool setPhy(uint8_t txPhys, uint8_t rxPhys);
+  int txPhy() const;
+  int rxPhy() const;
+  // Request link layer payloads of up to txOctets (27 - 251) bytes, reported with BLEDataLengthChanged
+  bool setDataLength(uint16_t txOctets);
+  int txDataLength() const;
+  int rxDataLength() const;
+
   bool connect();
   bool discoverAttributes();
+  bool discoverAttributesAsync(BLEDeviceCompletionHandler handler);
+
+  bool readMultiple(BLECharacteristic characteristics[], int count);
   bool discoverService(const char* serviceUuid);
 
   virtual operator bool() const;
@@ -106,6 +144,8 @@ protected:
 
   void setAdvertisementData(uint8_t type, uint8_t eirDataLength, uint8_t eirData[], int8_t rssi);
   void setScanResponseData(uint8_t eirDataLength, uint8_t eirData[], int8_t rssi);
+  // eventType as in the LE Extended Advertising Report, chained reports are appended
+  void setExtendedAdvertisementData(uint16_t eventType, uint8_t sid, uint8_t eirDataLength, uint8_t eirData[], int8_t rssi);
 
   bool discovered();
 
@@ -113,9 +153,14 @@ private:
   uint8_t _addressType;
   uint8_t _address[6];
   uint8_t _advertisementTypeMask;
-  uint8_t _eirDataLength;
-  uint8_t _eirData[31 * 2];
+  uint16_t _eirDataLength;
+  uint8_t _eirData[BLE_MAX_EIR_DATA_LENGTH];
   int8_t _rssi;
+  // more reports of the same extended advertisement are expected
+  bool _extendedDataPending;
+  uint8_t _advertisingSid;
+  // handle of the periodic advertising sync the device was reported by, 0xffff if none
+  uint16_t _periodicSyncHandle;
 };
 
 #endif
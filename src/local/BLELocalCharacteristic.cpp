@@ -29,6 +29,9 @@
 
 #include "BLELocalCharacteristic.h"
 
+// CCCD value read by peers that did not subscribe, the value of each peer is served by ATT
+static const uint16_t defaultCccdValue = 0x0000;
+
 BLELocalCharacteristic::BLELocalCharacteristic(const char* uuid, uint16_t permissions, int valueSize, bool fixedLength) :
   BLELocalAttribute(uuid),
   _properties((uint8_t)(permissions&0x000FF)),
@@ -38,13 +41,16 @@ BLELocalCharacteristic::BLELocalCharacteristic(const char* uuid, uint16_t permis
   _fixedLength(fixedLength),
   _handle(0x0000),
   _broadcast(false),
+  _broadcastSet(NULL),
   _written(false),
-  _cccdValue(0x0000)
+  _notifyCoalescing(false),
+  _coalescedNotifications(0),
+  _droppedNotifications(0)
 {
   memset(_eventHandlers, 0x00, sizeof(_eventHandlers));
 
   if (permissions & (BLENotify | BLEIndicate)) {
-    BLELocalDescriptor* cccd = new BLELocalDescriptor("2902", (uint8_t*)&_cccdValue, sizeof(_cccdValue));
+    BLELocalDescriptor* cccd = new BLELocalDescriptor("2902", (uint8_t*)&defaultCccdValue, sizeof(defaultCccdValue));
   
     cccd->retain();
     _descriptors.add(cccd);
@@ -70,6 +76,11 @@ BLELocalCharacteristic::~BLELocalCharacteristic()
 
   _descriptors.clear();
 
+  for (unsigned int i = 0; i < _cccdValues.size(); i++) {
+    delete _cccdValues.get(i);
+  }
+  _cccdValues.clear();
+
   if (_value) {
     free(_value);
   }
@@ -118,13 +129,28 @@ int BLELocalCharacteristic::writeValue(const uint8_t value[], int length)
     _valueLength = _valueSize;
   }
 
-  if ((_properties & BLEIndicate) && (_cccdValue & 0x0002)) {
-    return ATT.handleInd(valueHandle(), _value, _valueLength);
-  } else if ((_properties & BLENotify) && (_cccdValue & 0x0001)) {
-    return ATT.handleNotify(valueHandle(), _value, _valueLength);
+  if ((_properties & (BLEIndicate | BLENotify)) && subscribed()) {
+    // ATT only sends to the peers that subscribed to each of them
+    int result = 0;
+
+    if (_properties & BLEIndicate) {
+      result = ATT.handleInd(valueHandle(), _value, _valueLength);
+    }
+
+    if (_properties & BLENotify) {
+      result = max(result, ATT.handleNotify(valueHandle(), _value, _valueLength));
+    }
+
+    return result;
   }
 
-  if (_broadcast) {
+  if (_broadcast && _broadcastSet) {
+    uint16_t serviceUuid = GATT.serviceUuidForCharacteristic(this);
+    BLEAdvertisingData* broadcastData = _broadcastSet->_periodicData ? _broadcastSet->_periodicData : _broadcastSet;
+
+    broadcastData->setAdvertisedServiceData(serviceUuid, _value, _valueLength);
+    GAP.updateAdvertisingSetData(*_broadcastSet);
+  } else if (_broadcast) {
     uint16_t serviceUuid = GATT.serviceUuidForCharacteristic(this);
     BLE.setAdvertisedServiceData(serviceUuid, value, _valueLength);
     if (!ATT.connected() && GAP.advertising()) {
@@ -151,6 +177,18 @@ int BLELocalCharacteristic::broadcast()
   return 0;
 }
 
+int BLELocalCharacteristic::broadcast(BLEAdvertisingSet& advertisingSet)
+{
+  if (_properties & BLEBroadcast) {
+    _broadcast = true;
+    _broadcastSet = &advertisingSet;
+
+    return 1;
+  }
+
+  return 0;
+}
+
 bool BLELocalCharacteristic::written()
 {
   bool written = _written;
@@ -162,7 +200,39 @@ bool BLELocalCharacteristic::written()
 
 bool BLELocalCharacteristic::subscribed()
 {
-  return (_cccdValue != 0x0000);
+  for (unsigned int i = 0; i < _cccdValues.size(); i++) {
+    BLELocalCccdValue* cccdValue = _cccdValues.get(i);
+
+    if (cccdValue->active && cccdValue->value) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool BLELocalCharacteristic::subscribed(BLEDevice device)
+{
+  uint8_t identity[6];
+
+  ATT.deviceIdentity(device, identity);
+
+  return (cccdValue(identity) != 0x0000);
+}
+
+void BLELocalCharacteristic::setNotifyCoalescing(bool enabled)
+{
+  _notifyCoalescing = enabled;
+}
+
+unsigned long BLELocalCharacteristic::coalescedNotifications() const
+{
+  return _coalescedNotifications;
+}
+
+unsigned long BLELocalCharacteristic::droppedNotifications() const
+{
+  return _droppedNotifications;
 }
 
 void BLELocalCharacteristic::addDescriptor(BLEDescriptor& descriptor)
@@ -228,17 +298,100 @@ void BLELocalCharacteristic::writeValue(BLEDevice device, const uint8_t value[],
   }
 }
 
+uint16_t BLELocalCharacteristic::cccdValue(const uint8_t identity[6]) const
+{
+  for (unsigned int i = 0; i < _cccdValues.size(); i++) {
+    BLELocalCccdValue* cccdValue = _cccdValues.get(i);
+
+    if (cccdValue->active && memcmp(cccdValue->identity, identity, sizeof(cccdValue->identity)) == 0) {
+      return cccdValue->value;
+    }
+  }
+
+  return 0x0000;
+}
+
 void BLELocalCharacteristic::writeCccdValue(BLEDevice device, uint16_t value)
+{
+  uint8_t identity[6];
+
+  ATT.deviceIdentity(device, identity);
+
+  writeCccdValue(device, identity, value);
+}
+
+void BLELocalCharacteristic::writeCccdValue(BLEDevice device, const uint8_t identity[6], uint16_t value)
 {
   value &= 0x0003;
 
-  if (_cccdValue != value) {
-    _cccdValue = value;
+  uint16_t previousValue = 0x0000;
+  BLELocalCccdValue* cccdValue = NULL;
+
+  for (unsigned int i = 0; i < _cccdValues.size(); i++) {
+    BLELocalCccdValue* entry = _cccdValues.get(i);
 
-    BLECharacteristicEvent event = (_cccdValue) ? BLESubscribed : BLEUnsubscribed;
+    if (memcmp(entry->identity, identity, sizeof(entry->identity)) == 0) {
+      cccdValue = entry;
+
+      if (cccdValue->active) {
+        previousValue = cccdValue->value;
+      }
+
+      if (value == 0x0000) {
+        // peers that did not subscribe take no space
+        delete _cccdValues.remove(i);
+        cccdValue = NULL;
+      }
+      break;
+    }
+  }
+
+  if (value && cccdValue == NULL) {
+    cccdValue = new BLELocalCccdValue;
+
+    memcpy(cccdValue->identity, identity, sizeof(cccdValue->identity));
+    _cccdValues.add(cccdValue);
+  }
+
+  if (cccdValue) {
+    cccdValue->value = value;
+    cccdValue->active = true;
+  }
+
+  if ((previousValue != 0x0000) != (value != 0x0000)) {
+    BLECharacteristicEvent event = (value) ? BLESubscribed : BLEUnsubscribed;
 
     if (_eventHandlers[event]) {
       _eventHandlers[event](device, BLECharacteristic(this));
     }
   }
 }
+
+void BLELocalCharacteristic::indicationConfirmed(BLEDevice device)
+{
+  if (_eventHandlers[BLEIndicationConfirmed]) {
+    _eventHandlers[BLEIndicationConfirmed](device, BLECharacteristic(this));
+  }
+}
+
+void BLELocalCharacteristic::setCccdActive(BLEDevice device, const uint8_t identity[6], bool active)
+{
+  for (unsigned int i = 0; i < _cccdValues.size(); i++) {
+    BLELocalCccdValue* cccdValue = _cccdValues.get(i);
+
+    if (memcmp(cccdValue->identity, identity, sizeof(cccdValue->identity)) != 0) {
+      continue;
+    }
+
+    if (cccdValue->active != active) {
+      cccdValue->active = active;
+
+      BLECharacteristicEvent event = (active) ? BLESubscribed : BLEUnsubscribed;
+
+      if (_eventHandlers[event]) {
+        _eventHandlers[event](device, BLECharacteristic(this));
+      }
+    }
+    break;
+  }
+}
@@ -29,8 +29,16 @@
 
 #include "utility/BLELinkedList.h"
 
+class BLEAdvertisingSet;
 class BLELocalDescriptor;
 
+// CCCD value written by a peer, kept by the peer's identity address
+struct BLELocalCccdValue {
+  uint8_t identity[6];
+  uint16_t value;
+  bool active; // false while a bonded peer is disconnected
+};
+
 class BLELocalCharacteristic : public BLELocalAttribute {
 public:
   BLELocalCharacteristic(const char* uuid, uint16_t permissions, int valueSize, bool fixedLength = false);
@@ -51,9 +59,17 @@ public:
   int writeValue(const char* value);
 
   int broadcast();
+  // Broadcast the value in an advertising set, in its periodic data if it has some
+  int broadcast(BLEAdvertisingSet& advertisingSet);
 
   bool written();
   bool subscribed();
+  bool subscribed(BLEDevice device);
+
+  // keep at most one pending notification per connection, replaced by newer values
+  void setNotifyCoalescing(bool enabled);
+  unsigned long coalescedNotifications() const;
+  unsigned long droppedNotifications() const;
 
   void addDescriptor(BLEDescriptor& descriptor);
 
@@ -72,7 +88,11 @@ protected:
 
   void readValue(BLEDevice device, uint16_t offset, uint8_t value[], int length);
   void writeValue(BLEDevice device, const uint8_t value[], int length);
+  uint16_t cccdValue(const uint8_t identity[6]) const;
   void writeCccdValue(BLEDevice device, uint16_t value);
+  void writeCccdValue(BLEDevice device, const uint8_t identity[6], uint16_t value);
+  void setCccdActive(BLEDevice device, const uint8_t identity[6], bool active);
+  void indicationConfirmed(BLEDevice device);
 
 private:
   uint8_t  _properties;
@@ -85,9 +105,14 @@ private:
   uint16_t _handle;
 
   bool _broadcast;
+  BLEAdvertisingSet* _broadcastSet;
   bool _written;
 
-  uint16_t _cccdValue;
+  bool _notifyCoalescing;
+  unsigned long _coalescedNotifications;
+  unsigned long _droppedNotifications;
+
+  BLELinkedList<BLELocalCccdValue*> _cccdValues;
   BLELinkedList<BLELocalDescriptor*> _descriptors;
 
   BLECharacteristicEventHandler _eventHandlers[BLECharacteristicEventLast];
@@ -128,7 +128,7 @@ int BLELocalDevice::begin()
     end();
     return 0;
   }
-  if (HCI.setLeEventMask(0x00000000000003FF) != 0) {
+  if (HCI.setLeEventMask(0x000000000002FBFF) != 0) {
     end();
     return 0;
   }
@@ -334,6 +334,16 @@ void BLELocalDevice::addService(BLEService& service)
   GATT.addService(service);
 }
 
+void BLELocalDevice::beginNotificationBatch()
+{
+  ATT.beginNotificationBatch();
+}
+
+void BLELocalDevice::endNotificationBatch()
+{
+  ATT.endNotificationBatch();
+}
+
 int BLELocalDevice::advertise()
 {
   _advertisingData.updateData();
@@ -347,6 +357,23 @@ void BLELocalDevice::stopAdvertise()
   GAP.stopAdvertise();
 }
 
+int BLELocalDevice::advertise(BLEAdvertisingSet& advertisingSet)
+{
+  BLEAdvertisingSet* advertisingSets[] = { &advertisingSet };
+
+  return GAP.advertise(advertisingSets, 1);
+}
+
+int BLELocalDevice::advertise(BLEAdvertisingSet* advertisingSets[], int numAdvertisingSets)
+{
+  return GAP.advertise(advertisingSets, numAdvertisingSets);
+}
+
+void BLELocalDevice::stopAdvertise(BLEAdvertisingSet& advertisingSet)
+{
+  GAP.stopAdvertise(advertisingSet);
+}
+
 int BLELocalDevice::scan(bool withDuplicates)
 {
   return GAP.scan(withDuplicates);
@@ -372,6 +399,16 @@ void BLELocalDevice::stopScan()
   GAP.stopScan();
 }
 
+int BLELocalDevice::syncToPeriodic(const BLEDevice& device, uint8_t sid)
+{
+  return GAP.syncToPeriodic(device, sid);
+}
+
+void BLELocalDevice::stopPeriodicSync(const BLEDevice& device)
+{
+  GAP.stopPeriodicSync(device);
+}
+
 BLEDevice BLELocalDevice::central()
 {
   HCI.poll();
@@ -388,7 +425,8 @@ BLEDevice BLELocalDevice::available()
 
 void BLELocalDevice::setEventHandler(BLEDeviceEvent event, BLEDeviceEventHandler eventHandler)
 {
-  if (event == BLEDiscovered) {
+  if (event == BLEDiscovered || event == BLEPeriodicSyncEstablished ||
+      event == BLEPeriodicReport || event == BLEPeriodicSyncLost) {
     GAP.setEventHandler(event, eventHandler);
   } else {
     ATT.setEventHandler(event, eventHandler);
@@ -415,6 +453,23 @@ void BLELocalDevice::setConnectable(bool connectable)
   GAP.setConnectable(connectable);
 }
 
+void BLELocalDevice::setScanPhy(uint8_t scanPhys)
+{
+  GAP.setScanPhy(scanPhys);
+}
+
+int BLELocalDevice::setDefaultPhy(uint8_t txPhys, uint8_t rxPhys)
+{
+  return (HCI.leSetDefaultPhy(0x00, txPhys, rxPhys) == 0);
+}
+
+int BLELocalDevice::setDefaultDataLength(uint16_t txOctets)
+{
+  txOctets = constrain(txOctets, 27, 251);
+
+  return (HCI.leWriteSuggestedDefaultDataLength(txOctets, (txOctets + 14) * 8) == 0);
+}
+
 void BLELocalDevice::setTimeout(unsigned long timeout)
 {
   ATT.setTimeout(timeout);
@@ -449,6 +504,15 @@ void BLELocalDevice::setStoreLTK(int (*storeLTK)(uint8_t*, uint8_t*)){
 void BLELocalDevice::setStoreIRK(int (*storeIRK)(uint8_t*, uint8_t*)){
   HCI._storeIRK = storeIRK;
 }
+void BLELocalDevice::setStoreGattCache(int (*storeGattCache)(uint8_t*, uint8_t*, int)){
+  ATT._storeGattCache = storeGattCache;
+}
+void BLELocalDevice::setGetGattCache(int (*getGattCache)(uint8_t*, uint8_t*, int)){
+  ATT._getGattCache = getGattCache;
+}
+void BLELocalDevice::setLazyDiscovery(bool lazyDiscovery){
+  ATT.setLazyDiscovery(lazyDiscovery);
+}
 void BLELocalDevice::setDisplayCode(void (*displayCode)(uint32_t confirmationCode)){
   HCI._displayCode = displayCode;
 }
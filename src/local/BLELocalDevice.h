@@ -23,6 +23,7 @@
 #include "BLEDevice.h"
 #include "BLEService.h"
 #include "BLEAdvertisingData.h"
+#include "BLEAdvertisingSet.h"
 
 enum Pairable {
   NO = 0,
@@ -63,8 +64,15 @@ public:
 
   virtual void addService(BLEService& service);
 
+  // notifications written until endNotificationBatch are sent together
+  virtual void beginNotificationBatch();
+  virtual void endNotificationBatch();
+
   virtual int advertise();
   virtual void stopAdvertise();
+  virtual int advertise(BLEAdvertisingSet& advertisingSet);
+  virtual int advertise(BLEAdvertisingSet* advertisingSets[], int numAdvertisingSets);
+  virtual void stopAdvertise(BLEAdvertisingSet& advertisingSet);
 
   virtual int scan(bool withDuplicates = false);
   virtual int scanForName(String name, bool withDuplicates = false);
@@ -72,6 +80,9 @@ public:
   virtual int scanForAddress(String address, bool withDuplicates = false);
   virtual void stopScan();
 
+  virtual int syncToPeriodic(const BLEDevice& device, uint8_t sid);
+  virtual void stopPeriodicSync(const BLEDevice& device);
+
   virtual BLEDevice central();
   virtual BLEDevice available();
 
@@ -79,6 +90,10 @@ public:
   virtual void setConnectionInterval(uint16_t minimumConnectionInterval, uint16_t maximumConnectionInterval);
   virtual void setSupervisionTimeout(uint16_t supervisionTimeout);
   virtual void setConnectable(bool connectable); 
+  // PHYs and link layer payload size the controller uses for new connections
+  virtual int setDefaultPhy(uint8_t txPhys, uint8_t rxPhys);
+  virtual void setScanPhy(uint8_t scanPhys);
+  virtual int setDefaultDataLength(uint16_t txOctets);
 
   virtual void setEventHandler(BLEDeviceEvent event, BLEDeviceEventHandler eventHandler);
 
@@ -104,6 +119,14 @@ public:
   // address - The mac address needing its LTK
   // LTK - 16 octet LTK for the mac address
   virtual void setGetLTK(int (*getLTK)(uint8_t* address, uint8_t* LTK));
+  // address - the identity address of the peer [6 bytes]
+  // data, length - image of its discovered attributes to store
+  virtual void setStoreGattCache(int (*storeGattCache)(uint8_t* address, uint8_t* data, int length));
+  // address - the identity address of the peer [6 bytes]
+  // data, size - buffer for the stored image, returns its length or 0 when there is none
+  virtual void setGetGattCache(int (*getGattCache)(uint8_t* address, uint8_t* data, int size));
+  // discover services and characteristics of peers when they are first looked for
+  virtual void setLazyDiscovery(bool lazyDiscovery);
 
   virtual void setDisplayCode(void (*displayCode)(uint32_t confirmationCode));
   virtual void setBinaryConfirmPairing(bool (*binaryConfirmPairing)());
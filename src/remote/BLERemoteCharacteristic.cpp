@@ -23,6 +23,14 @@
 
 #include "BLERemoteCharacteristic.h"
 
+// attribute values are at most 512 bytes long
+#define BLE_REMOTE_MAX_VALUE_LENGTH 512
+
+struct __attribute__ ((packed)) QueuedValue {
+  uint32_t timestamp;
+  uint16_t length;
+};
+
 BLERemoteCharacteristic::BLERemoteCharacteristic(const uint8_t uuid[], uint8_t uuidLen, uint16_t connectionHandle,
                                                   uint16_t startHandle, uint16_t permissions, uint16_t valueHandle) :
   BLERemoteAttribute(uuid, uuidLen),
@@ -35,6 +43,13 @@ BLERemoteCharacteristic::BLERemoteCharacteristic(const uint8_t uuid[], uint8_t u
   _valueLength(0),
   _valueUpdated(false),
   _updatedValueRead(true),
+  _queue(NULL),
+  _queueDepth(0),
+  _queueValueSize(0),
+  _queueHead(0),
+  _queueCount(0),
+  _droppedValues(0),
+  _truncatedValues(0),
   _valueUpdatedEventHandler(NULL)
 {
 }
@@ -55,6 +70,11 @@ BLERemoteCharacteristic::~BLERemoteCharacteristic()
     free(_value);
     _value = NULL;
   }
+
+  if (_queue) {
+    free(_queue);
+    _queue = NULL;
+  }
 }
 
 uint16_t BLERemoteCharacteristic::startHandle() const
@@ -94,41 +114,16 @@ int BLERemoteCharacteristic::writeValue(const uint8_t value[], int length, bool
 
   uint16_t maxLength = ATT.mtu(_connectionHandle) - 3;
 
-  if (length > (int)maxLength) {
-    // cap to MTU max length
-    length = maxLength;
-  }
-
-  _value = (uint8_t*)realloc(_value, length);
-  if (_value == NULL) {
-    // realloc failed
-    return 0;
-  }
-
   if ((_properties & BLEWrite) && withResponse) {
-    uint8_t resp[4];
-    int respLength = ATT.writeReq(_connectionHandle, _valueHandle, value, length, resp);
-
-    if (!respLength) {
-      return 0;
-    }
-
-    if (resp[0] == 0x01) {
-      // error
-      return 0;
-    }
-
-    memcpy(_value, value, length);
-    _valueLength = length;
-
-    return 1;
+    // values too long for a Write Request are written with prepared writes
+    return ATT.writeValue(_connectionHandle, _valueHandle, this, value, length, true);
   } else if (_properties & BLEWriteWithoutResponse) {
-    ATT.writeCmd(_connectionHandle, _valueHandle, value, length);
-
-    memcpy(_value, value, length);
-    _valueLength = length;
+    if (length > (int)maxLength) {
+      // cap to MTU max length
+      length = maxLength;
+    }
 
-    return 1;
+    return ATT.writeValue(_connectionHandle, _valueHandle, this, value, length, false);
   }
 
   return 0;
@@ -159,40 +154,118 @@ bool BLERemoteCharacteristic::updatedValueRead()
   return result;
 }
 
-bool BLERemoteCharacteristic::read()
+bool BLERemoteCharacteristic::setValueQueue(int depth, int valueSize)
 {
-  if (!ATT.connected(_connectionHandle)) {
-    return false;
+  if (_queue) {
+    free(_queue);
+    _queue = NULL;
   }
-  
-  uint8_t resp[256];
 
-  int respLength = ATT.readReq(_connectionHandle, _valueHandle, resp);
+  _queueDepth = 0;
+  _queueValueSize = 0;
+  _queueHead = 0;
+  _queueCount = 0;
 
-  if (!respLength) {
-    _valueLength = 0;
+  if (depth <= 0) {
+    return true;
+  }
+
+  if (depth > 0xffff || valueSize < 0 || valueSize > BLE_REMOTE_MAX_VALUE_LENGTH) {
     return false;
   }
 
-  if (resp[0] == 0x01) {
-    // error
-    _valueLength = 0;
+  if ((size_t)depth > SIZE_MAX / (sizeof(QueuedValue) + valueSize)) {
+    // the size of the queue would wrap around, size_t is 16-bit on some targets
     return false;
   }
 
-  _valueLength = respLength - 1;
-  _value = (uint8_t*)realloc(_value, _valueLength);
+  // allocated once, receiving a value only copies it into the next slot
+  _queue = (uint8_t*)malloc(depth * (sizeof(QueuedValue) + valueSize));
 
-  if (_value == NULL) {
-    _valueLength = 0;
+  if (_queue == NULL) {
+    return false;
+  }
+
+  _queueDepth = depth;
+  _queueValueSize = valueSize;
+
+  return true;
+}
+
+int BLERemoteCharacteristic::valuesQueued()
+{
+  ATT.connected(_connectionHandle); // to force a poll
+
+  return _queueCount;
+}
+
+int BLERemoteCharacteristic::readNext(uint8_t buffer[], int length, unsigned long* timestamp)
+{
+  ATT.connected(_connectionHandle); // to force a poll
+
+  if (_queueCount == 0) {
+    return -1;
+  }
+
+  if (length < 0) {
+    length = 0;
+  }
+
+  uint8_t* slot = &_queue[_queueHead * (sizeof(QueuedValue) + _queueValueSize)];
+  QueuedValue* queuedValue = (QueuedValue*)slot;
+  int bytesRead = min(length, (int)queuedValue->length);
+
+  memcpy(buffer, &slot[sizeof(QueuedValue)], bytesRead);
+
+  if (timestamp) {
+    *timestamp = queuedValue->timestamp;
+  }
+
+  _queueHead = (_queueHead + 1) % _queueDepth;
+  _queueCount--;
+
+  return bytesRead;
+}
+
+unsigned long BLERemoteCharacteristic::droppedValues() const
+{
+  return _droppedValues;
+}
+
+unsigned long BLERemoteCharacteristic::truncatedValues() const
+{
+  return _truncatedValues;
+}
+
+bool BLERemoteCharacteristic::read()
+{
+  if (!ATT.connected(_connectionHandle)) {
     return false;
   }
 
-  memcpy(_value, &resp[1], _valueLength); 
+  // values longer than a response are read part by part with Read Blob Requests
+  if (ATT.readValue(_connectionHandle, _valueHandle, this, NULL, BLE_REMOTE_MAX_VALUE_LENGTH) < 0) {
+    _valueLength = 0;
+    return false;
+  }
 
   return true;
 }
 
+int BLERemoteCharacteristic::read(uint8_t buffer[], int length)
+{
+  if (!ATT.connected(_connectionHandle)) {
+    return -1;
+  }
+
+  if (length <= 0) {
+    return 0;
+  }
+
+  // the parts are received into buffer, the value is not kept
+  return ATT.readValue(_connectionHandle, _valueHandle, NULL, buffer, min(length, 0xffff));
+}
+
 bool BLERemoteCharacteristic::writeCccd(uint16_t value)
 {
   int numDescriptors = descriptorCount();
@@ -215,11 +288,86 @@ bool BLERemoteCharacteristic::writeCccd(uint16_t value)
   return false;
 }
 
+bool BLERemoteCharacteristic::readAsync(BLECharacteristicCompletionHandler handler)
+{
+  return ATT.readAsync(this, handler);
+}
+
+bool BLERemoteCharacteristic::writeValueAsync(const uint8_t value[], int length, BLECharacteristicCompletionHandler handler, bool withResponse)
+{
+  uint16_t maxLength = ATT.mtu(_connectionHandle) - 3;
+
+  if (length > (int)maxLength) {
+    // cap to MTU max length
+    length = maxLength;
+  }
+
+  if ((_properties & BLEWrite) && withResponse) {
+    return ATT.writeAsync(this, _valueHandle, value, length, true, handler);
+  } else if (_properties & BLEWriteWithoutResponse) {
+    return ATT.writeAsync(this, _valueHandle, value, length, false, handler);
+  }
+
+  return false;
+}
+
+bool BLERemoteCharacteristic::writeCccdAsync(uint16_t value, BLECharacteristicCompletionHandler handler)
+{
+  uint16_t handle = cccdHandle();
+
+  if (handle == 0x0000) {
+    return false;
+  }
+
+  return ATT.writeAsync(this, handle, (uint8_t*)&value, sizeof(value), true, handler);
+}
+
 uint16_t BLERemoteCharacteristic::valueHandle() const
 {
   return _valueHandle;
 }
 
+uint16_t BLERemoteCharacteristic::cccdHandle() const
+{
+  int numDescriptors = descriptorCount();
+
+  for (int i = 0; i < numDescriptors; i++) {
+    BLERemoteDescriptor* d = descriptor(i);
+
+    if (strcmp(d->uuid(), "2902") == 0) {
+      return d->handle();
+    }
+  }
+
+  if (_properties & (BLENotify | BLEIndicate)) {
+    // no CCCD descriptor found, fallback to _valueHandle + 1
+    return _valueHandle + 1;
+  }
+
+  return 0x0000;
+}
+
+bool BLERemoteCharacteristic::setValue(const uint8_t value[], int length)
+{
+  if (length == 0) {
+    _valueLength = 0;
+    return true;
+  }
+
+  _value = (uint8_t*)realloc(_value, length);
+
+  if (_value == NULL) {
+    // realloc failed
+    _valueLength = 0;
+    return false;
+  }
+
+  memcpy(_value, value, length);
+  _valueLength = length;
+
+  return true;
+}
+
 unsigned int BLERemoteCharacteristic::descriptorCount() const
 {
   return _descriptors.size();
@@ -246,12 +394,19 @@ void BLERemoteCharacteristic::addDescriptor(BLERemoteDescriptor* descriptor)
 
 void BLERemoteCharacteristic::writeValue(BLEDevice device, const uint8_t value[], int length)
 {
-  _valueLength = length;
-  _value = (uint8_t*)realloc(_value, _valueLength);
+  if (_queue) {
+    queueValue(value, length);
+  }
 
-  if (_value == NULL) {
-    _valueLength = 0;
-    return;
+  if (_value == NULL || _valueLength != length) {
+    // values of a characteristic usually keep their length, only resize when it changes
+    _valueLength = length;
+    _value = (uint8_t*)realloc(_value, _valueLength);
+
+    if (_value == NULL) {
+      _valueLength = 0;
+      return;
+    }
   }
 
   _valueUpdated = true;
@@ -262,3 +417,27 @@ void BLERemoteCharacteristic::writeValue(BLEDevice device, const uint8_t value[]
     _valueUpdatedEventHandler(device, BLECharacteristic(this));
   }
 }
+
+void BLERemoteCharacteristic::queueValue(const uint8_t value[], int length)
+{
+  if (_queueCount == _queueDepth) {
+    // full, the oldest value makes room for the newest one
+    _queueHead = (_queueHead + 1) % _queueDepth;
+    _queueCount--;
+    _droppedValues++;
+  }
+
+  uint8_t* slot = &_queue[((_queueHead + _queueCount) % _queueDepth) * (sizeof(QueuedValue) + _queueValueSize)];
+  QueuedValue* queuedValue = (QueuedValue*)slot;
+
+  queuedValue->timestamp = millis();
+  queuedValue->length = min(length, (int)_queueValueSize);
+
+  if (queuedValue->length < length) {
+    // only the first valueSize bytes fit in a slot
+    _truncatedValues++;
+  }
+  memcpy(&slot[sizeof(QueuedValue)], value, queuedValue->length);
+
+  _queueCount++;
+}
@@ -45,9 +45,20 @@ public:
   bool valueUpdated();
   bool updatedValueRead();
 
+  bool setValueQueue(int depth, int valueSize);
+  int valuesQueued();
+  int readNext(uint8_t buffer[], int length, unsigned long* timestamp = NULL);
+  unsigned long droppedValues() const;
+  unsigned long truncatedValues() const;
+
   bool read();
+  int read(uint8_t buffer[], int length);
   bool writeCccd(uint16_t value);
 
+  bool readAsync(BLECharacteristicCompletionHandler handler);
+  bool writeValueAsync(const uint8_t value[], int length, BLECharacteristicCompletionHandler handler, bool withResponse = true);
+  bool writeCccdAsync(uint16_t value, BLECharacteristicCompletionHandler handler);
+
   unsigned int descriptorCount() const;
   BLERemoteDescriptor* descriptor(unsigned int index) const;
 
@@ -55,14 +66,21 @@ public:
 
 protected:
   friend class ATTClass;
+  friend class BLERemoteDevice;
 
   uint16_t startHandle() const;
   uint16_t valueHandle() const;
+  uint16_t cccdHandle() const;
+
+  bool setValue(const uint8_t value[], int length);
 
   void addDescriptor(BLERemoteDescriptor* descriptor);
 
   void writeValue(BLEDevice device, const uint8_t value[], int length);
 
+private:
+  void queueValue(const uint8_t value[], int length);
+
 private:
   uint16_t _connectionHandle;
   uint16_t _startHandle;
@@ -76,6 +94,15 @@ private:
   bool _valueUpdated;
   bool _updatedValueRead;
 
+  // ring of received values, each slot holds a timestamp, a length and valueSize bytes
+  uint8_t* _queue;
+  uint16_t _queueDepth;
+  uint16_t _queueValueSize;
+  uint16_t _queueHead;
+  uint16_t _queueCount;
+  unsigned long _droppedValues;
+  unsigned long _truncatedValues;
+
   BLELinkedList<BLERemoteDescriptor*> _descriptors;
 
   BLECharacteristicEventHandler _valueUpdatedEventHandler;
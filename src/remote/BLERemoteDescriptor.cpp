@@ -76,15 +76,7 @@ int BLERemoteDescriptor::writeValue(const uint8_t value[], int length)
     return 0;
   }  
 
-  uint8_t resp[4];
-  int respLength = ATT.writeReq(_connectionHandle, _handle, value, length, resp);
-
-  if (!respLength) {
-    return 0;
-  }
-
-  if (resp[0] == 0x01) {
-    // error
+  if (!ATT.writeValue(_connectionHandle, _handle, NULL, value, length, true)) {
     return 0;
   }
 
@@ -100,30 +92,25 @@ bool BLERemoteDescriptor::read()
     return false;
   }
 
-  uint8_t resp[256];
-
-  int respLength = ATT.readReq(_connectionHandle, _handle, resp);
+  // the value of a Read Request
+  uint16_t size = ATT.mtu(_connectionHandle) - 1;
+  uint8_t* value = (uint8_t*)realloc(_value, size);
 
-  if (!respLength) {
+  if (value == NULL) {
     _valueLength = 0;
     return false;
   }
 
-  if (resp[0] == 0x01) {
-    // error
-    _valueLength = 0;
-    return false;
-  }
+  _value = value;
 
-  _valueLength = respLength - 1;
-  _value = (uint8_t*)realloc(_value, _valueLength);
+  int length = ATT.readValue(_connectionHandle, _handle, NULL, _value, size);
 
-  if (_value == NULL) {
+  if (length < 0) {
     _valueLength = 0;
     return false;
   }
 
-  memcpy(_value, &resp[1], _valueLength); 
+  _valueLength = length;
 
   return true;
 }
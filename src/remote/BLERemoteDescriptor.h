@@ -37,6 +37,8 @@ public:
 
 protected:
   friend class ATTClass;
+  friend class BLERemoteDevice;
+  friend class BLERemoteCharacteristic;
   uint16_t handle() const;
 
 private:
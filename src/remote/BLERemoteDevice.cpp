@@ -17,9 +17,56 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include "utility/BLEUuid.h"
+
 #include "BLERemoteDevice.h"
 
-BLERemoteDevice::BLERemoteDevice()
+// appends bytes to the image when they fit, returns the offset after them either way
+static int putBytes(uint8_t data[], int size, int offset, const void* bytes, int length)
+{
+  if (data != NULL && (offset + length) <= size) {
+    memcpy(&data[offset], bytes, length);
+  }
+
+  return offset + length;
+}
+
+static int putUuid(uint8_t data[], int size, int offset, const char* uuid)
+{
+  BLEUuid bleUuid(uuid);
+  uint8_t uuidLength = bleUuid.length();
+
+  offset = putBytes(data, size, offset, &uuidLength, sizeof(uuidLength));
+
+  return putBytes(data, size, offset, bleUuid.data(), uuidLength);
+}
+
+// reads bytes from the image, returns false past its end
+static bool getBytes(const uint8_t data[], int length, int& offset, void* bytes, int count)
+{
+  if ((offset + count) > length) {
+    return false;
+  }
+
+  memcpy(bytes, &data[offset], count);
+  offset += count;
+
+  return true;
+}
+
+static bool getUuid(const uint8_t data[], int length, int& offset, uint8_t uuid[16], uint8_t& uuidLength)
+{
+  if (!getBytes(data, length, offset, &uuidLength, sizeof(uuidLength)) || (uuidLength != 2 && uuidLength != 16)) {
+    return false;
+  }
+
+  return getBytes(data, length, offset, uuid, uuidLength);
+}
+
+BLERemoteDevice::BLERemoteDevice() :
+  _index(NULL),
+  _indexSize(0),
+  _indexValid(false)
 {
 }
 
@@ -33,6 +80,8 @@ void BLERemoteDevice::addService(BLERemoteService* service)
   service->retain();
 
   _services.add(service);
+
+  invalidateIndex();
 }
 
 unsigned int BLERemoteDevice::serviceCount() const
@@ -56,4 +105,233 @@ void BLERemoteDevice::clearServices()
   }
 
   _services.clear();
+
+  invalidateIndex();
+}
+
+int BLERemoteDevice::serialize(uint8_t data[], int size) const
+{
+  int offset = 0;
+  uint8_t count = serviceCount();
+
+  offset = putBytes(data, size, offset, &count, sizeof(count));
+
+  for (unsigned int i = 0; i < serviceCount(); i++) {
+    BLERemoteService* s = service(i);
+    uint16_t startHandle = s->startHandle();
+    uint16_t endHandle = s->endHandle();
+
+    offset = putBytes(data, size, offset, &startHandle, sizeof(startHandle));
+    offset = putBytes(data, size, offset, &endHandle, sizeof(endHandle));
+    offset = putUuid(data, size, offset, s->uuid());
+
+    count = s->characteristicCount();
+    offset = putBytes(data, size, offset, &count, sizeof(count));
+
+    for (unsigned int j = 0; j < s->characteristicCount(); j++) {
+      BLERemoteCharacteristic* c = s->characteristic(j);
+      uint16_t declarationHandle = c->startHandle();
+      uint8_t properties = c->properties();
+      uint16_t valueHandle = c->valueHandle();
+
+      offset = putBytes(data, size, offset, &declarationHandle, sizeof(declarationHandle));
+      offset = putBytes(data, size, offset, &properties, sizeof(properties));
+      offset = putBytes(data, size, offset, &valueHandle, sizeof(valueHandle));
+      offset = putUuid(data, size, offset, c->uuid());
+
+      count = c->descriptorCount();
+      offset = putBytes(data, size, offset, &count, sizeof(count));
+
+      for (unsigned int k = 0; k < c->descriptorCount(); k++) {
+        BLERemoteDescriptor* d = c->descriptor(k);
+        uint16_t handle = d->handle();
+
+        offset = putBytes(data, size, offset, &handle, sizeof(handle));
+        offset = putUuid(data, size, offset, d->uuid());
+      }
+    }
+  }
+
+  return offset;
+}
+
+bool BLERemoteDevice::deserialize(uint16_t connectionHandle, const uint8_t data[], int length)
+{
+  int offset = 0;
+  uint8_t serviceCount;
+  uint8_t uuid[16];
+  uint8_t uuidLength;
+
+  clearServices();
+
+  if (!getBytes(data, length, offset, &serviceCount, sizeof(serviceCount))) {
+    return false;
+  }
+
+  for (int i = 0; i < serviceCount; i++) {
+    uint16_t startHandle;
+    uint16_t endHandle;
+    uint8_t characteristicCount;
+
+    if (!getBytes(data, length, offset, &startHandle, sizeof(startHandle)) ||
+        !getBytes(data, length, offset, &endHandle, sizeof(endHandle)) ||
+        !getUuid(data, length, offset, uuid, uuidLength) ||
+        !getBytes(data, length, offset, &characteristicCount, sizeof(characteristicCount))) {
+      clearServices();
+      return false;
+    }
+
+    BLERemoteService* s = new BLERemoteService(uuid, uuidLength, startHandle, endHandle);
+
+    if (s == NULL) {
+      clearServices();
+      return false;
+    }
+
+    addService(s);
+
+    for (int j = 0; j < characteristicCount; j++) {
+      uint16_t declarationHandle;
+      uint8_t properties;
+      uint16_t valueHandle;
+      uint8_t descriptorCount;
+
+      if (!getBytes(data, length, offset, &declarationHandle, sizeof(declarationHandle)) ||
+          !getBytes(data, length, offset, &properties, sizeof(properties)) ||
+          !getBytes(data, length, offset, &valueHandle, sizeof(valueHandle)) ||
+          !getUuid(data, length, offset, uuid, uuidLength) ||
+          !getBytes(data, length, offset, &descriptorCount, sizeof(descriptorCount))) {
+        clearServices();
+        return false;
+      }
+
+      BLERemoteCharacteristic* c = new BLERemoteCharacteristic(uuid, uuidLength, connectionHandle, declarationHandle, properties, valueHandle);
+
+      if (c == NULL) {
+        clearServices();
+        return false;
+      }
+
+      s->addCharacteristic(c);
+
+      for (int k = 0; k < descriptorCount; k++) {
+        uint16_t handle;
+
+        if (!getBytes(data, length, offset, &handle, sizeof(handle)) ||
+            !getUuid(data, length, offset, uuid, uuidLength)) {
+          clearServices();
+          return false;
+        }
+
+        BLERemoteDescriptor* d = new BLERemoteDescriptor(uuid, uuidLength, connectionHandle, handle);
+
+        if (d == NULL) {
+          clearServices();
+          return false;
+        }
+
+        c->addDescriptor(d);
+      }
+    }
+  }
+
+  if (offset != length) {
+    clearServices();
+    return false;
+  }
+
+  return true;
+}
+
+BLERemoteCharacteristic* BLERemoteDevice::characteristicForValueHandle(uint16_t valueHandle)
+{
+  if (!_indexValid) {
+    buildIndex();
+  }
+
+  if (_index == NULL) {
+    // no memory for the index, walk the services
+    for (unsigned int i = 0; i < serviceCount(); i++) {
+      BLERemoteService* s = service(i);
+
+      for (unsigned int j = 0; j < s->characteristicCount(); j++) {
+        BLERemoteCharacteristic* c = s->characteristic(j);
+
+        if (c->valueHandle() == valueHandle) {
+          return c;
+        }
+      }
+    }
+
+    return NULL;
+  }
+
+  unsigned int low = 0;
+  unsigned int high = _indexSize;
+
+  while (low < high) {
+    unsigned int middle = (low + high) / 2;
+    uint16_t middleHandle = _index[middle]->valueHandle();
+
+    if (middleHandle == valueHandle) {
+      return _index[middle];
+    } else if (middleHandle < valueHandle) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return NULL;
+}
+
+void BLERemoteDevice::invalidateIndex()
+{
+  if (_index) {
+    free(_index);
+    _index = NULL;
+  }
+
+  _indexSize = 0;
+  _indexValid = false;
+}
+
+void BLERemoteDevice::buildIndex()
+{
+  unsigned int count = 0;
+
+  invalidateIndex();
+
+  for (unsigned int i = 0; i < serviceCount(); i++) {
+    count += service(i)->characteristicCount();
+  }
+
+  _indexValid = true;
+
+  if (count == 0) {
+    return;
+  }
+
+  _index = (BLERemoteCharacteristic**)malloc(count * sizeof(BLERemoteCharacteristic*));
+
+  if (_index == NULL) {
+    return;
+  }
+
+  for (unsigned int i = 0; i < serviceCount(); i++) {
+    BLERemoteService* s = service(i);
+
+    for (unsigned int j = 0; j < s->characteristicCount(); j++) {
+      BLERemoteCharacteristic* c = s->characteristic(j);
+      unsigned int k = _indexSize++;
+
+      // discovery runs in handle order, so this insertion sort rarely moves anything
+      while (k > 0 && _index[k - 1]->valueHandle() > c->valueHandle()) {
+        _index[k] = _index[k - 1];
+        k--;
+      }
+
+      _index[k] = c;
+    }
+  }
 }
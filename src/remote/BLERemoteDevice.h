@@ -36,8 +36,24 @@ public:
 
   void clearServices();
 
+  // compact image of the services, characteristics and descriptors, returns the length it needs
+  int serialize(uint8_t data[], int size) const;
+  bool deserialize(uint16_t connectionHandle, const uint8_t data[], int length);
+
+  // the characteristic with the value handle, looked up in an index sorted by value handle
+  BLERemoteCharacteristic* characteristicForValueHandle(uint16_t valueHandle);
+  // the index is built again on the next lookup, after characteristics were added
+  void invalidateIndex();
+
+private:
+  void buildIndex();
+
 private:
   BLELinkedList<BLERemoteService*> _services;
+
+  BLERemoteCharacteristic** _index;
+  unsigned int _indexSize;
+  bool _indexValid;
 };
 
 #endif
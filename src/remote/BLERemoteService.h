@@ -35,6 +35,7 @@ public:
 
 protected:
   friend class ATTClass;
+  friend class BLERemoteDevice;
 
   uint16_t startHandle() const;
   uint16_t endHandle() const;
@@ -63,6 +63,9 @@ extern "C" int strcasecmp(char const *a, char const *b);
 #define ATT_OP_HANDLE_NOTIFY      0x1b
 #define ATT_OP_HANDLE_IND         0x1d
 #define ATT_OP_HANDLE_CNF         0x1e
+#define ATT_OP_READ_MULTI_VAR_REQ  0x20
+#define ATT_OP_READ_MULTI_VAR_RESP 0x21
+#define ATT_OP_HANDLE_MULTI_NOTIFY 0x23
 #define ATT_OP_SIGNED_WRITE_CMD   0xd2
 
 #define ATT_ECODE_INVALID_HANDLE       0x01
@@ -82,6 +85,35 @@ extern "C" int strcasecmp(char const *a, char const *b);
 #define ATT_ECODE_INSUFF_ENC           0x0f
 #define ATT_ECODE_UNSUPP_GRP_TYPE      0x10
 #define ATT_ECODE_INSUFF_RESOURCES     0x11
+#define ATT_ECODE_DB_OUT_OF_SYNC       0x12
+#define ATT_ECODE_VALUE_NOT_ALLOWED    0x13
+
+#define ATT_DISCOVER_MTU             0
+#define ATT_DISCOVER_SERVICES        1
+#define ATT_DISCOVER_CHARACTERISTICS 2
+#define ATT_DISCOVER_DESCRIPTORS     3
+#define ATT_DISCOVER_HASH            4
+#define ATT_DISCOVER_CACHED          5
+
+// write progress: a Write Request, or prepared writes for values longer than a request
+#define ATT_WRITE_SINGLE  0
+#define ATT_WRITE_PREPARE 1
+#define ATT_WRITE_EXECUTE 2
+#define ATT_WRITE_CANCEL  3
+
+// what a discovery covers
+#define ATT_SCOPE_DATABASE        0
+#define ATT_SCOPE_SERVICES        1
+#define ATT_SCOPE_CHARACTERISTICS 2
+
+#define ATT_CLIENT_SUPPORTED_FEATURES_UUID 0x2b29
+#define ATT_DATABASE_HASH_UUID 0x2b2a
+// version of the GATT cache image, followed by the Database Hash and the attributes
+#define ATT_GATT_CACHE_VERSION 0x01
+
+// Client Supported Features bits
+#define ATT_CLIENT_FEATURE_ROBUST_CACHING 0x01
+#define ATT_CLIENT_FEATURE_MULTI_NOTIFY   0x04
 
 // #define _BLE_TRACE_
 
@@ -90,16 +122,42 @@ ATTClass::ATTClass() :
   _timeout(5000),
   _longWriteHandle(0x0000),
   _longWriteValue(NULL),
-  _longWriteValueLength(0)
+  _longWriteValueLength(0),
+  _operationsRunning(false),
+  _lazyDiscovery(false),
+  _notifyBatching(false),
+  _discoveryCacheNext(0),
+  _discoveryCacheVersion(0)
 {
+  for (int i = 0; i < ATT_DISCOVERY_CACHE_SIZE; i++) {
+    _discoveryCache[i].opcode = 0x00;
+    _discoveryCache[i].pdu = NULL;
+    _discoveryCache[i].length = 0;
+  }
+
   for (int i = 0; i < ATT_MAX_PEERS; i++) {
     _peers[i].connectionHandle = 0xffff;
     _peers[i].role = 0x00;
     _peers[i].addressType = 0x00;
     memset(_peers[i].address, 0x00, sizeof(_peers[i].address));
     _peers[i].mtu = 23;
+    _peers[i].txPhy = 0x01;
+    _peers[i].rxPhy = 0x01;
+    _peers[i].txDataLength = 27;
+    _peers[i].rxDataLength = 27;
     _peers[i].device = NULL;
     _peers[i].encryption = 0x0;
+    _peers[i].readMultipleVariable = true;
+    _peers[i].mtuExchanged = false;
+    _peers[i].pendingResp.op = 0x00;
+    _peers[i].pendingResp.buffer = NULL;
+    _peers[i].pendingResp.value = NULL;
+    _peers[i].pendingResp.length = 0;
+    _peers[i].indicationSent = false;
+    _peers[i].multipleNotifications = false;
+    _peers[i].clientFeatures = 0x00;
+    _peers[i].databaseVersion = 0;
+    _peers[i].outOfSyncSent = false;
   }
 
   memset(_eventHandlers, 0x00, sizeof(_eventHandlers));
@@ -110,12 +168,25 @@ ATTClass::~ATTClass()
   if (_longWriteValue) {
     free(_longWriteValue);
   }
+
+  clearDiscoveryCache();
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    clearIndications(i);
+    clearNotifications(i);
+  }
 }
 
 bool ATTClass::connect(uint8_t peerBdaddrType, uint8_t peerBdaddr[6])
 {
-  if (HCI.leCreateConn(0x0060, 0x0030, 0x00, peerBdaddrType, peerBdaddr, 0x00,
-                        0x0006, 0x000c, 0x0000, 0x00c8, 0x0004, 0x0006) != 0) {
+  // once extended commands are used, the controller refuses LE Create Connection
+  int result = HCI.extendedCommands() ?
+    HCI.leExtendedCreateConn(0x00, 0x00, peerBdaddrType, peerBdaddr, 0x0060, 0x0030,
+                             0x0006, 0x000c, 0x0000, 0x00c8, 0x0004, 0x0006) :
+    HCI.leCreateConn(0x0060, 0x0030, 0x00, peerBdaddrType, peerBdaddr, 0x00,
+                     0x0006, 0x000c, 0x0000, 0x00c8, 0x0004, 0x0006);
+
+  if (result != 0) {
     return false;
   }
 
@@ -165,67 +236,147 @@ bool ATTClass::discoverAttributes(uint8_t peerBdaddrType, uint8_t peerBdaddr[6],
     return false;
   }
 
-  // send MTU request
-  if (!exchangeMtu(connHandle)) {
-    return false;
-  }
-
-  // find the device entry for the peeer
-  BLERemoteDevice* device = NULL;
+  if (serviceUuidFilter != NULL) {
+    BLERemoteDevice* device = this->device(peerBdaddrType, peerBdaddr);
 
-  for (int i = 0; i < ATT_MAX_PEERS; i++) {
-    if (_peers[i].connectionHandle == connHandle) {
-      if (_peers[i].device == NULL) {
-        _peers[i].device = new BLERemoteDevice();
-      }
+    if (device != NULL) {
+      int serviceCount = device->serviceCount();
 
-      device = _peers[i].device;
+      for (int i = 0; i < serviceCount; i++) {
+        BLERemoteService* service = device->service(i);
 
-      break;
+        if (strcasecmp(service->uuid(), serviceUuidFilter) == 0) {
+          // found an existing service with same UUID
+          return true;
+        }
+      }
     }
   }
 
-  if (device == NULL) {
+  if (_operationsRunning) {
+    // called from a completion handler, the queue can't progress while waiting here
     return false;
   }
 
-  if (serviceUuidFilter == NULL) {
-    // clear existing services
-    device->clearServices();
-  } else {
-    int serviceCount = device->serviceCount();
-  
-    for (int i = 0; i < serviceCount; i++) {
-      BLERemoteService* service = device->service(i);
+  ATTOperation* operation = queueDiscovery(connHandle, serviceUuidFilter);
+  if (operation == NULL) {
+    return false;
+  }
 
-      if (strcasecmp(service->uuid(), serviceUuidFilter) == 0) {
-        // found an existing service with same UUID
-        return true;
-      }
-    }
+  return (waitForOperation(operation) == 1);
+}
+
+bool ATTClass::discoverAttributesAsync(uint8_t peerBdaddrType, uint8_t peerBdaddr[6], const char* serviceUuidFilter, BLEDeviceCompletionHandler handler)
+{
+  uint16_t connHandle = connectionHandle(peerBdaddrType, peerBdaddr);
+  if (connHandle == 0xffff) {
+    return false;
   }
 
-  // discover services
-  if (!discoverServices(connHandle, device, serviceUuidFilter)) {
+  ATTOperation* operation = queueDiscovery(connHandle, serviceUuidFilter);
+  if (operation == NULL) {
     return false;
   }
 
-  // discover characteristics
-  if (!discoverCharacteristics(connHandle, device)) {
+  operation->deviceHandler = handler;
+
+  runOperations();
+
+  return true;
+}
+
+void ATTClass::setLazyDiscovery(bool lazyDiscovery)
+{
+  _lazyDiscovery = lazyDiscovery;
+}
+
+bool ATTClass::discoverLazily(uint8_t peerBdaddrType, const uint8_t peerBdaddr[6], const char* serviceUuid, const char* characteristicUuid)
+{
+  if (!_lazyDiscovery || _operationsRunning) {
     return false;
   }
 
-  // discover descriptors
-  if (!discoverDescriptors(connHandle, device)) {
+  uint16_t connHandle = connectionHandle(peerBdaddrType, peerBdaddr);
+  if (connHandle == 0xffff) {
     return false;
   }
 
-  return true;
+  BLERemoteDevice* device = this->device(peerBdaddrType, peerBdaddr);
+
+  if (device == NULL || device->serviceCount() == 0) {
+    // only the services at first
+    ATTOperation* operation = queueDiscovery(connHandle, NULL);
+    if (operation == NULL) {
+      return false;
+    }
+
+    operation->scope = ATT_SCOPE_SERVICES;
+
+    if (waitForOperation(operation) != 1) {
+      return false;
+    }
+
+    device = this->device(peerBdaddrType, peerBdaddr);
+    if (device == NULL) {
+      return false;
+    }
+  }
+
+  for (unsigned int i = 0; i < device->serviceCount(); i++) {
+    BLERemoteService* service = device->service(i);
+
+    if (serviceUuid != NULL && strcasecmp(service->uuid(), serviceUuid) != 0) {
+      continue;
+    }
+
+    // a service without characteristics was not looked into yet
+    if (service->characteristicCount() == 0) {
+      ATTOperation* operation = queueOperation(connHandle, ATT_OPERATION_DISCOVER);
+      if (operation == NULL) {
+        return false;
+      }
+
+      operation->scope = ATT_SCOPE_CHARACTERISTICS;
+      operation->firstService = i;
+      operation->lastService = i + 1;
+
+      if (waitForOperation(operation) != 1) {
+        return false;
+      }
+    }
+
+    if (characteristicUuid == NULL) {
+      continue;
+    }
+
+    for (unsigned int j = 0; j < service->characteristicCount(); j++) {
+      if (strcasecmp(service->characteristic(j)->uuid(), characteristicUuid) == 0) {
+        return true;
+      }
+    }
+  }
+
+  return (characteristicUuid == NULL);
+}
+
+ATTOperation* ATTClass::queueDiscovery(uint16_t connectionHandle, const char* serviceUuidFilter)
+{
+  ATTOperation* operation = queueOperation(connectionHandle, ATT_OPERATION_DISCOVER);
+
+  if (operation != NULL && serviceUuidFilter != NULL) {
+    BLEUuid serviceUuid(serviceUuidFilter);
+
+    memcpy(operation->uuid, serviceUuid.data(), serviceUuid.length());
+    operation->uuidLength = serviceUuid.length();
+  }
+
+  return operation;
 }
 
 void ATTClass::setMaxMtu(uint16_t maxMtu)
 {
-  _maxMtu = maxMtu;
+  // the hold and request buffers are sized for ATT_MAX_MTU
+  _maxMtu = constrain(maxMtu, 23, ATT_MAX_MTU);
 }
 
 void ATTClass::setTimeout(unsigned long timeout)
@@ -255,6 +406,18 @@ void ATTClass::addConnection(uint16_t handle, uint8_t role, uint8_t peerBdaddrTy
   _peers[peerIndex].connectionHandle = handle;
   _peers[peerIndex].role = role;
   _peers[peerIndex].mtu = 23;
+  _peers[peerIndex].readMultipleVariable = true;
+  _peers[peerIndex].mtuExchanged = false;
+  _peers[peerIndex].multipleNotifications = false;
+  _peers[peerIndex].clientFeatures = 0x00;
+  _peers[peerIndex].databaseVersion = GATT.version();
+  _peers[peerIndex].outOfSyncSent = false;
+  _peers[peerIndex].pendingResp.op = 0x00;
+  // connections start on the 1M PHY with 27 bytes link layer payloads
+  _peers[peerIndex].txPhy = 0x01;
+  _peers[peerIndex].rxPhy = 0x01;
+  _peers[peerIndex].txDataLength = 27;
+  _peers[peerIndex].rxDataLength = 27;
   _peers[peerIndex].addressType = peerBdaddrType;
   memcpy(_peers[peerIndex].address, peerBdaddr, sizeof(_peers[peerIndex].address));
   uint8_t BDADDr[6];
@@ -270,12 +433,14 @@ void ATTClass::addConnection(uint16_t handle, uint8_t role, uint8_t peerBdaddrTy
     memset(&_peers[peerIndex].resolvedAddress, 0, 6);
   }
 
+  restoreCccdValues(peerIndex);
+
   if (_eventHandlers[BLEConnected]) {
     _eventHandlers[BLEConnected](BLEDevice(peerBdaddrType, peerBdaddr));
   }
 }
 
-void ATTClass::handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::handleData(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   uint8_t opcode = data[0];
 
@@ -288,6 +453,10 @@ void ATTClass::handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[
   Serial.print("data opcode: 0x");
   Serial.println(opcode, HEX);
 #endif
+  if (!changeAware(connectionHandle, opcode, dlen, data)) {
+    return;
+  }
+
   switch (opcode) {
     case ATT_OP_ERROR:
 #ifdef _BLE_TRACE_
@@ -324,6 +493,10 @@ void ATTClass::handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[
       findByTypeReq(connectionHandle, mtu, dlen, data);
       break;
 
+    case ATT_OP_FIND_BY_TYPE_RESP:
+      findByTypeResp(connectionHandle, dlen, data);
+      break;
+
     case ATT_OP_READ_BY_TYPE_REQ:
 #ifdef _BLE_TRACE_
       Serial.println("By type");
@@ -349,7 +522,18 @@ void ATTClass::handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[
       break;
 
     case ATT_OP_READ_RESP:
-      readResp(connectionHandle, dlen, data);
+    case ATT_OP_READ_BLOB_RESP:
+      readResp(connectionHandle, opcode, dlen, data);
+      break;
+
+    case ATT_OP_READ_MULTI_REQ:
+    case ATT_OP_READ_MULTI_VAR_REQ:
+      readMultipleReq(connectionHandle, mtu, opcode, dlen, data);
+      break;
+
+    case ATT_OP_READ_MULTI_RESP:
+    case ATT_OP_READ_MULTI_VAR_RESP:
+      readMultipleResp(connectionHandle, opcode, dlen, data);
       break;
 
     case ATT_OP_WRITE_REQ:
@@ -368,12 +552,21 @@ void ATTClass::handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[
       prepWriteReq(connectionHandle, mtu, dlen, data);
       break;
 
+    case ATT_OP_PREP_WRITE_RESP:
+      prepWriteResp(connectionHandle, dlen, data);
+      break;
+
     case ATT_OP_EXEC_WRITE_REQ:
       execWriteReq(connectionHandle, mtu, dlen, data);
       break;
 
+    case ATT_OP_EXEC_WRITE_RESP:
+      execWriteResp(connectionHandle, dlen, data);
+      break;
+
     case ATT_OP_HANDLE_NOTIFY:
     case ATT_OP_HANDLE_IND:
+    case ATT_OP_HANDLE_MULTI_NOTIFY:
       handleNotifyOrInd(connectionHandle, opcode, dlen, data);
       break;
 
@@ -381,7 +574,6 @@ void ATTClass::handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[
       handleCnf(connectionHandle, dlen, data);
       break;
 
-    case ATT_OP_READ_MULTI_REQ:
     case ATT_OP_SIGNED_WRITE_CMD:
     default:
 #ifdef _BLE_TRACE_
@@ -414,18 +606,13 @@ void ATTClass::removeConnection(uint16_t handle, uint8_t /*reason*/)
 
   BLEDevice bleDevice(_peers[peerIndex].addressType, _peers[peerIndex].address);
 
-  if (peerCount == 1) {
-    // clear CCCD values on disconnect
-    for (uint16_t i = 0; i < GATT.attributeCount(); i++) {
-      BLELocalAttribute* attribute = GATT.attribute(i);
-
-      if (attribute->type() == BLETypeCharacteristic) {
-        BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
+  failOperations(handle);
 
-        characteristic->writeCccdValue(bleDevice, 0x0000);
-      }
-    }
+  releaseCccdValues(peerIndex);
+  clearIndications(peerIndex);
+  clearNotifications(peerIndex);
 
+  if (peerCount == 1) {
     _longWriteHandle = 0x0000;
     _longWriteValueLength = 0;
   }
@@ -440,6 +627,7 @@ void ATTClass::removeConnection(uint16_t handle, uint8_t /*reason*/)
   memset(_peers[peerIndex].address, 0x00, sizeof(_peers[peerIndex].address));
   _peers[peerIndex].mtu = 23;
   _peers[peerIndex].encryption = PEER_ENCRYPTION::NO_ENCRYPTION;
+  _peers[peerIndex].pendingResp.op = 0x00;
   _peers[peerIndex].IOCap[0] = 0;
   _peers[peerIndex].IOCap[1] = 0;
   _peers[peerIndex].IOCap[2] = 0;
@@ -450,6 +638,43 @@ void ATTClass::removeConnection(uint16_t handle, uint8_t /*reason*/)
   _peers[peerIndex].device = NULL;
 }
 
+void ATTClass::updatePhy(uint16_t handle, uint8_t status, uint8_t txPhy, uint8_t rxPhy)
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle != handle) {
+      continue;
+    }
+
+    if (status == 0x00) {
+      _peers[i].txPhy = txPhy;
+      _peers[i].rxPhy = rxPhy;
+    }
+
+    // also reported when the request failed, the PHYs are unchanged then
+    if (_eventHandlers[BLEPhyUpdated]) {
+      _eventHandlers[BLEPhyUpdated](BLEDevice(_peers[i].addressType, _peers[i].address));
+    }
+    break;
+  }
+}
+
+void ATTClass::updateDataLength(uint16_t handle, uint16_t maxTxOctets, uint16_t maxRxOctets)
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle != handle) {
+      continue;
+    }
+
+    _peers[i].txDataLength = maxTxOctets;
+    _peers[i].rxDataLength = maxRxOctets;
+
+    if (_eventHandlers[BLEDataLengthChanged]) {
+      _eventHandlers[BLEDataLengthChanged](BLEDevice(_peers[i].addressType, _peers[i].address));
+    }
+    break;
+  }
+}
+
 uint16_t ATTClass::connectionHandle(uint8_t addressType, const uint8_t address[6]) const
 {
   for (int i = 0; i < ATT_MAX_PEERS; i++) {
@@ -538,6 +763,50 @@ uint16_t ATTClass::mtu(uint16_t handle) const
   return 23;
 }
 
+uint8_t ATTClass::txPhy(uint16_t handle) const
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == handle) {
+      return _peers[i].txPhy;
+    }
+  }
+
+  return 0;
+}
+
+uint8_t ATTClass::rxPhy(uint16_t handle) const
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == handle) {
+      return _peers[i].rxPhy;
+    }
+  }
+
+  return 0;
+}
+
+uint16_t ATTClass::txDataLength(uint16_t handle) const
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == handle) {
+      return _peers[i].txDataLength;
+    }
+  }
+
+  return 0;
+}
+
+uint16_t ATTClass::rxDataLength(uint16_t handle) const
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == handle) {
+      return _peers[i].rxDataLength;
+    }
+  }
+
+  return 0;
+}
+
 bool ATTClass::disconnect()
 {
   int numDisconnects = 0;
@@ -553,22 +822,20 @@ bool ATTClass::disconnect()
 
     numDisconnects++;
 
-    BLEDevice bleDevice(_peers[i].addressType, _peers[i].address);
-
-    // clear CCCD values on disconnect
-    for (uint16_t att = 0; att < GATT.attributeCount(); att++) {
-      BLELocalAttribute* attribute = GATT.attribute(att);
-
-      if (attribute->type() == BLETypeCharacteristic) {
-        BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
-
-        characteristic->writeCccdValue(bleDevice, 0x0000);
-      }
-    }
+    releaseCccdValues(i);
+    clearIndications(i);
+    clearNotifications(i);
 
     _longWriteHandle = 0x0000;
     _longWriteValueLength = 0;
 
+    // the queued operations fail, a request waiting for its response is dropped
+    failOperations(_peers[i].connectionHandle);
+    _peers[i].pendingResp.op = 0x00;
+    _peers[i].pendingResp.buffer = NULL;
+    _peers[i].pendingResp.value = NULL;
+    _peers[i].pendingResp.length = 0;
+
     _peers[i].connectionHandle = 0xffff;
     _peers[i].role = 0x00;
     _peers[i].addressType = 0x00;
@@ -601,27 +868,38 @@ BLEDevice ATTClass::central()
 int ATTClass::handleNotify(uint16_t handle, const uint8_t* value, int length)
 {
   int numNotifications = 0;
+  const GATTAttributeEntry* entry = GATT.attributeEntry(handle);
+
+  if (entry == NULL || entry->kind != GATT_ATTRIBUTE_CHARACTERISTIC_VALUE) {
+    return 0;
+  }
+
+  BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)entry->attribute;
 
   for (int i = 0; i < ATT_MAX_PEERS; i++) {
     if (_peers[i].connectionHandle == 0xffff) {
       continue;
     }
 
-    uint8_t notification[_peers[i].mtu];
-    uint16_t notificationLength = 0;
-
-    notification[0] = ATT_OP_HANDLE_NOTIFY;
-    notificationLength++;
+    uint8_t identity[6];
+    peerIdentity(i, identity);
 
-    memcpy(&notification[1], &handle, sizeof(handle));
-    notificationLength += sizeof(handle);
+    if ((characteristic->cccdValue(identity) & 0x0001) == 0) {
+      // not subscribed to notifications
+      continue;
+    }
 
-    length = min((uint16_t)(_peers[i].mtu - notificationLength), (uint16_t)length);
-    memcpy(&notification[notificationLength], value, length);
-    notificationLength += length;
+    length = min((uint16_t)(_peers[i].mtu - 3), (uint16_t)length);
 
-    /// TODO: Set encryption requirement on notify.
-    HCI.sendAclPkt(_peers[i].connectionHandle, ATT_CID, notificationLength, notification);
+    if (_notifyBatching) {
+      batchNotification(i, handle, value, length);
+    } else if (characteristic->_notifyCoalescing &&
+        (HCI.aclQueueDepth(_peers[i].connectionHandle) > 0 || pendingNotification(i, handle) != NULL)) {
+      // the link is not draining, only the latest value is kept until it does
+      queueNotification(i, characteristic, handle, value, length);
+    } else {
+      sendNotification(i, handle, value, length);
+    }
 
     numNotifications++;
   }
@@ -629,129 +907,489 @@ int ATTClass::handleNotify(uint16_t handle, const uint8_t* value, int length)
   return (numNotifications > 0) ? length : 0;
 }
 
-int ATTClass::handleInd(uint16_t handle, const uint8_t* value, int length)
+void ATTClass::sendNotification(int peerIndex, uint16_t handle, const uint8_t* value, uint16_t length)
 {
-  int numIndications = 0;
-
-  for (int i = 0; i < ATT_MAX_PEERS; i++) {
-    if (_peers[i].connectionHandle == 0xffff) {
-      continue;
-    }
-
-    uint8_t indication[_peers[i].mtu];
-    uint16_t indicationLength = 0;
+  uint8_t* notification = _pdu;
+  uint16_t notificationLength = 0;
 
-    indication[0] = ATT_OP_HANDLE_IND;
-    indicationLength++;
+  notification[0] = ATT_OP_HANDLE_NOTIFY;
+  notificationLength++;
 
-    memcpy(&indication[1], &handle, sizeof(handle));
-    indicationLength += sizeof(handle);
+  memcpy(&notification[1], &handle, sizeof(handle));
+  notificationLength += sizeof(handle);
 
-    length = min((uint16_t)(_peers[i].mtu - indicationLength), (uint16_t)length);
-    memcpy(&indication[indicationLength], value, length);
-    indicationLength += length;
+  memcpy(&notification[notificationLength], value, length);
+  notificationLength += length;
 
-    _cnf = false;
-
-    HCI.sendAclPkt(_peers[i].connectionHandle, ATT_CID, indicationLength, indication);
+  /// TODO: Set encryption requirement on notify.
+  HCI.sendAclPkt(_peers[peerIndex].connectionHandle, ATT_CID, notificationLength, notification);
+}
 
-    while (!_cnf) {
-      HCI.poll();
+ATTHandleValue* ATTClass::pendingNotification(int peerIndex, uint16_t handle)
+{
+  for (unsigned int i = 0; i < _peers[peerIndex].notifications.size(); i++) {
+    ATTHandleValue* notification = _peers[peerIndex].notifications.get(i);
 
-      if (!connected(_peers[i].addressType, _peers[i].address)) {
-        break;
-      }
+    if (notification->handle == handle) {
+      return notification;
     }
-
-    numIndications++;
   }
 
-  return (numIndications > 0) ? length : 0;
+  return NULL;
 }
 
-void ATTClass::error(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::queueNotification(int peerIndex, BLELocalCharacteristic* characteristic, uint16_t handle, const uint8_t* value, uint16_t length)
 {
-  if (dlen != 4) {
-    // drop
-    return;
-  } 
+  ATTHandleValue* notification = pendingNotification(peerIndex, handle);
 
-  struct __attribute__ ((packed)) AttError {
-    uint8_t opcode;
-    uint16_t handle;
-    uint8_t code;
-  } *attError = (AttError*)data;
+  if (notification != NULL) {
+    // replaced in place, the previous value is never sent
+    characteristic->_coalescedNotifications++;
+  } else {
+    notification = new ATTHandleValue();
+
+    notification->handle = handle;
+    notification->length = 0;
+    notification->value = NULL;
 
-  if (_pendingResp.connectionHandle == connectionHandle && (_pendingResp.op - 1) == attError->opcode) {
-    _pendingResp.buffer[0] = ATT_OP_ERROR;
-    memcpy(&_pendingResp.buffer[1], data, dlen);
-    _pendingResp.length = dlen + 1;
+    _peers[peerIndex].notifications.add(notification);
   }
-}
 
-void ATTClass::mtuReq(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
-{
-  uint16_t mtu = *(uint16_t*)data;
+  uint8_t* buffer = (uint8_t*)realloc(notification->value, length ? length : 1);
 
-  if (dlen != 2) {
-    sendError(connectionHandle, ATT_OP_MTU_REQ, 0x0000, ATT_ECODE_INVALID_PDU);
+  if (buffer == NULL) {
+    characteristic->_droppedNotifications++;
     return;
   }
 
-  if (mtu > _maxMtu) {
-    mtu = _maxMtu;
-  }
+  memcpy(buffer, value, length);
+
+  notification->value = buffer;
+  notification->length = length;
+}
 
+void ATTClass::sendPendingNotifications()
+{
   for (int i = 0; i < ATT_MAX_PEERS; i++) {
-    if (_peers[i].connectionHandle == connectionHandle) {
-      _peers[i].mtu = mtu;
-      break;
-    }
-  }
+    while (_peers[i].connectionHandle != 0xffff && _peers[i].notifications.size() &&
+           HCI.aclQueueDepth(_peers[i].connectionHandle) == 0) {
+      ATTHandleValue* notification = _peers[i].notifications.remove(0);
 
-  struct __attribute__ ((packed)) {
-    uint8_t op;
-    uint16_t mtu;
-  } mtuResp = { ATT_OP_MTU_RESP, mtu };
+      if (notification->value) {
+        sendNotification(i, notification->handle, notification->value, notification->length);
 
-  HCI.sendAclPkt(connectionHandle, ATT_CID, sizeof(mtuResp), &mtuResp);
+        free(notification->value);
+      }
+
+      delete notification;
+    }
+  }
 }
 
-int ATTClass::mtuReq(uint16_t connectionHandle, uint16_t mtu, uint8_t responseBuffer[])
+void ATTClass::clearNotifications(int peerIndex)
 {
-  struct __attribute__ ((packed)) {
-    uint8_t op;
-    uint16_t mtu;
-  } mtuReq = { ATT_OP_MTU_REQ, mtu };
+  BLELinkedList<ATTHandleValue*>* lists[] = { &_peers[peerIndex].notifications, &_peers[peerIndex].batch };
+
+  for (int l = 0; l < 2; l++) {
+    for (unsigned int i = 0; i < lists[l]->size(); i++) {
+      ATTHandleValue* notification = lists[l]->get(i);
+      const GATTAttributeEntry* entry = GATT.attributeEntry(notification->handle);
+
+      if (entry != NULL && entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC_VALUE) {
+        ((BLELocalCharacteristic*)entry->attribute)->_droppedNotifications++;
+      }
+
+      if (notification->value) {
+        free(notification->value);
+      }
 
-  return sendReq(connectionHandle, &mtuReq, sizeof(mtuReq), responseBuffer);
+      delete notification;
+    }
+
+    lists[l]->clear();
+  }
 }
 
-void ATTClass::mtuResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::beginNotificationBatch()
 {
-  uint16_t mtu = *(uint16_t*)data;
+  _notifyBatching = true;
+}
 
-  if (dlen != 2) {
-    return;
-  }
+void ATTClass::endNotificationBatch()
+{
+  _notifyBatching = false;
 
   for (int i = 0; i < ATT_MAX_PEERS; i++) {
-    if (_peers[i].connectionHandle == connectionHandle) {
-      _peers[i].mtu = mtu;
-      break;
+    if (_peers[i].connectionHandle != 0xffff) {
+      sendNotificationBatch(i);
     }
   }
-
-  if (connectionHandle == _pendingResp.connectionHandle && _pendingResp.op == ATT_OP_MTU_RESP) {
-    _pendingResp.buffer[0] = ATT_OP_MTU_RESP;
-    memcpy(&_pendingResp.buffer[1], data, dlen);
-    _pendingResp.length = dlen + 1;
-  }
 }
 
-void ATTClass::findInfoReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[])
+void ATTClass::batchNotification(int peerIndex, uint16_t handle, const uint8_t* value, uint16_t length)
 {
-  struct __attribute__ ((packed)) FindInfoReq {
+  ATTHandleValue* notification = NULL;
+
+  for (unsigned int i = 0; i < _peers[peerIndex].batch.size(); i++) {
+    if (_peers[peerIndex].batch.get(i)->handle == handle) {
+      // updated again in the same batch, only the latest value is sent
+      notification = _peers[peerIndex].batch.get(i);
+      break;
+    }
+  }
+
+  if (notification == NULL) {
+    notification = new ATTHandleValue();
+
+    notification->handle = handle;
+    notification->length = 0;
+    notification->value = NULL;
+
+    _peers[peerIndex].batch.add(notification);
+  }
+
+  uint8_t* buffer = (uint8_t*)realloc(notification->value, length ? length : 1);
+
+  if (buffer == NULL) {
+    return;
+  }
+
+  memcpy(buffer, value, length);
+
+  notification->value = buffer;
+  notification->length = length;
+}
+
+void ATTClass::sendNotificationBatch(int peerIndex)
+{
+  BLELinkedList<ATTHandleValue*>& batch = _peers[peerIndex].batch;
+  uint16_t mtu = _peers[peerIndex].mtu;
+  uint8_t* notification = _pdu;
+
+  while (batch.size()) {
+    uint16_t notificationLength = 0;
+    unsigned int count = 0;
+
+    notification[0] = ATT_OP_HANDLE_MULTI_NOTIFY;
+    notificationLength++;
+
+    // handle, length and value tuples, as many as fit in the MTU
+    while (_peers[peerIndex].multipleNotifications && count < batch.size()) {
+      ATTHandleValue* value = batch.get(count);
+
+      if ((notificationLength + 4 + value->length) > mtu) {
+        break;
+      }
+
+      memcpy(&notification[notificationLength], &value->handle, sizeof(value->handle));
+      memcpy(&notification[notificationLength + 2], &value->length, sizeof(value->length));
+      memcpy(&notification[notificationLength + 4], value->value, value->length);
+      notificationLength += 4 + value->length;
+
+      count++;
+    }
+
+    if (count < 2) {
+      // the PDU needs at least two values, fall back to a Handle Value Notification
+      count = 1;
+
+      ATTHandleValue* value = batch.get(0);
+
+      if (value->value) {
+        sendNotification(peerIndex, value->handle, value->value, value->length);
+      }
+    } else {
+      HCI.sendAclPkt(_peers[peerIndex].connectionHandle, ATT_CID, notificationLength, notification);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+      ATTHandleValue* value = batch.remove(0);
+
+      if (value->value) {
+        free(value->value);
+      }
+
+      delete value;
+    }
+  }
+}
+
+int ATTClass::handleInd(uint16_t handle, const uint8_t* value, int length)
+{
+  int numIndications = 0;
+  const GATTAttributeEntry* entry = GATT.attributeEntry(handle);
+
+  if (entry == NULL || entry->kind != GATT_ATTRIBUTE_CHARACTERISTIC_VALUE) {
+    return 0;
+  }
+
+  BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)entry->attribute;
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == 0xffff) {
+      continue;
+    }
+
+    uint8_t identity[6];
+    peerIdentity(i, identity);
+
+    if ((characteristic->cccdValue(identity) & 0x0002) == 0) {
+      // not subscribed to indications
+      continue;
+    }
+
+    if (_peers[i].indications.size() >= ATT_MAX_QUEUED_INDICATIONS) {
+      // the peer is not confirming, drop the value for it
+      continue;
+    }
+
+    ATTHandleValue* indication = new ATTHandleValue();
+
+    length = min((uint16_t)(_peers[i].mtu - 3), (uint16_t)length);
+
+    indication->handle = handle;
+    indication->length = length;
+    indication->value = (uint8_t*)malloc(length);
+
+    if (indication->value == NULL && length) {
+      delete indication;
+      continue;
+    }
+
+    memcpy(indication->value, value, length);
+
+    // sent right away when the connection has no indication waiting for a confirmation
+    _peers[i].indications.add(indication);
+    sendIndication(i);
+
+    numIndications++;
+  }
+
+  return (numIndications > 0) ? length : 0;
+}
+
+void ATTClass::sendIndication(int peerIndex)
+{
+  if (_peers[peerIndex].indicationSent || _peers[peerIndex].indications.size() == 0) {
+    return;
+  }
+
+  ATTHandleValue* indication = _peers[peerIndex].indications.get(0);
+
+  uint8_t* pdu = _pdu;
+  uint16_t pduLength = 0;
+
+  pdu[0] = ATT_OP_HANDLE_IND;
+  pduLength++;
+
+  memcpy(&pdu[1], &indication->handle, sizeof(indication->handle));
+  pduLength += sizeof(indication->handle);
+
+  memcpy(&pdu[pduLength], indication->value, indication->length);
+  pduLength += indication->length;
+
+  _peers[peerIndex].indicationSent = true;
+  _peers[peerIndex].indicationStart = millis();
+
+  HCI.sendAclPkt(_peers[peerIndex].connectionHandle, ATT_CID, pduLength, pdu);
+}
+
+void ATTClass::clearIndications(int peerIndex)
+{
+  for (unsigned int i = 0; i < _peers[peerIndex].indications.size(); i++) {
+    ATTHandleValue* indication = _peers[peerIndex].indications.get(i);
+
+    if (indication->value) {
+      free(indication->value);
+    }
+
+    delete indication;
+  }
+
+  _peers[peerIndex].indications.clear();
+  _peers[peerIndex].indicationSent = false;
+}
+
+void ATTClass::expireIndications()
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == 0xffff || !_peers[i].indicationSent ||
+        (millis() - _peers[i].indicationStart) < ATT_INDICATION_TIMEOUT) {
+      continue;
+    }
+
+    // the transaction timed out, no further ATT PDUs can be sent to the peer: the application
+    // gets a BLEDisconnected event instead of the confirmations
+    clearIndications(i);
+    HCI.disconnect(_peers[i].connectionHandle);
+  }
+}
+
+bool ATTClass::indicationsPending(uint16_t connectionHandle) const
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == connectionHandle) {
+      return (_peers[i].indications.size() > 0);
+    }
+  }
+
+  return false;
+}
+
+void ATTClass::error(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
+{
+  if (dlen != 4) {
+    // drop
+    return;
+  } 
+
+  handleResp(connectionHandle, ATT_OP_ERROR, dlen, data);
+}
+
+void ATTClass::mtuReq(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
+{
+  uint16_t mtu = *(uint16_t*)data;
+
+  if (dlen != 2) {
+    sendError(connectionHandle, ATT_OP_MTU_REQ, 0x0000, ATT_ECODE_INVALID_PDU);
+    return;
+  }
+
+  if (mtu > _maxMtu) {
+    mtu = _maxMtu;
+  }
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == connectionHandle) {
+      _peers[i].mtu = mtu;
+      break;
+    }
+  }
+
+  struct __attribute__ ((packed)) {
+    uint8_t op;
+    uint16_t mtu;
+  } mtuResp = { ATT_OP_MTU_RESP, mtu };
+
+  HCI.sendAclPkt(connectionHandle, ATT_CID, sizeof(mtuResp), &mtuResp);
+}
+
+int ATTClass::sendMtuReq(uint16_t connectionHandle, uint16_t mtu, uint8_t responseBuffer[])
+{
+  struct __attribute__ ((packed)) {
+    uint8_t op;
+    uint16_t mtu;
+  } mtuReq = { ATT_OP_MTU_REQ, mtu };
+
+  return sendReqAsync(connectionHandle, &mtuReq, sizeof(mtuReq), responseBuffer);
+}
+
+void ATTClass::mtuResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
+{
+  uint16_t mtu = *(uint16_t*)data;
+
+  if (dlen != 2) {
+    return;
+  }
+
+  // the MTU of the connection is the smaller one of both sides
+  if (mtu > _maxMtu) {
+    mtu = _maxMtu;
+  }
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == connectionHandle) {
+      _peers[i].mtu = mtu;
+      break;
+    }
+  }
+
+  handleResp(connectionHandle, ATT_OP_MTU_RESP, dlen, data);
+}
+
+uint16_t ATTClass::discoveryResp(uint8_t opcode, uint16_t startHandle, uint16_t endHandle, uint16_t type, uint16_t mtu, uint8_t response[])
+{
+  // only the declarations are cached, Read By Type requests for values are always served live
+  if (opcode == ATT_OP_READ_BY_TYPE_REQ && type != BLETypeCharacteristic) {
+    return readByTypePdu(startHandle, endHandle, type, mtu, response);
+  }
+
+  if (_discoveryCacheVersion != GATT.version()) {
+    // services changed
+    clearDiscoveryCache();
+    _discoveryCacheVersion = GATT.version();
+  }
+
+  // responses are built for the largest bucket that fits, so peers with similar MTUs share them
+  static const uint16_t mtuBuckets[] = { 512, 247, 185, 128, 64, 23 };
+
+  for (unsigned int i = 0; i < (sizeof(mtuBuckets) / sizeof(mtuBuckets[0])); i++) {
+    if (mtu >= mtuBuckets[i]) {
+      mtu = mtuBuckets[i];
+      break;
+    }
+  }
+
+  for (int i = 0; i < ATT_DISCOVERY_CACHE_SIZE; i++) {
+    if (_discoveryCache[i].opcode == opcode && _discoveryCache[i].startHandle == startHandle &&
+        _discoveryCache[i].endHandle == endHandle && _discoveryCache[i].type == type && _discoveryCache[i].mtu == mtu) {
+      memcpy(response, _discoveryCache[i].pdu, _discoveryCache[i].length);
+
+      return _discoveryCache[i].length;
+    }
+  }
+
+  uint16_t responseLength;
+
+  if (opcode == ATT_OP_FIND_INFO_REQ) {
+    responseLength = findInfoPdu(startHandle, endHandle, mtu, response);
+  } else if (opcode == ATT_OP_READ_BY_GROUP_REQ) {
+    responseLength = readByGroupPdu(startHandle, endHandle, type, mtu, response);
+  } else {
+    responseLength = readByTypePdu(startHandle, endHandle, type, mtu, response);
+  }
+
+  // replace the oldest entry, an empty response is cached as well
+  int index = _discoveryCacheNext;
+  uint8_t* pdu = (uint8_t*)realloc(_discoveryCache[index].pdu, responseLength ? responseLength : 1);
+
+  if (pdu == NULL) {
+    return responseLength;
+  }
+
+  memcpy(pdu, response, responseLength);
+
+  _discoveryCache[index].opcode = opcode;
+  _discoveryCache[index].startHandle = startHandle;
+  _discoveryCache[index].endHandle = endHandle;
+  _discoveryCache[index].type = type;
+  _discoveryCache[index].mtu = mtu;
+  _discoveryCache[index].length = responseLength;
+  _discoveryCache[index].pdu = pdu;
+
+  _discoveryCacheNext = (_discoveryCacheNext + 1) % ATT_DISCOVERY_CACHE_SIZE;
+
+  return responseLength;
+}
+
+void ATTClass::clearDiscoveryCache()
+{
+  for (int i = 0; i < ATT_DISCOVERY_CACHE_SIZE; i++) {
+    if (_discoveryCache[i].pdu) {
+      free(_discoveryCache[i].pdu);
+    }
+
+    _discoveryCache[i].opcode = 0x00;
+    _discoveryCache[i].pdu = NULL;
+    _discoveryCache[i].length = 0;
+  }
+
+  _discoveryCacheNext = 0;
+}
+
+void ATTClass::findInfoReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[])
+{
+  struct __attribute__ ((packed)) FindInfoReq {
     uint16_t startHandle;
     uint16_t endHandle;
   } *findInfoReq = (FindInfoReq*)data;
@@ -761,18 +1399,30 @@ void ATTClass::findInfoReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen
     return;
   }
 
-  uint8_t response[mtu];
+  uint8_t* response = _response;
+  uint16_t responseLength = discoveryResp(ATT_OP_FIND_INFO_REQ, findInfoReq->startHandle, findInfoReq->endHandle, 0x0000, mtu, response);
+
+  if (responseLength == 0) {
+    sendError(connectionHandle, ATT_OP_FIND_INFO_REQ, findInfoReq->startHandle, ATT_ECODE_ATTR_NOT_FOUND);
+  } else {
+    HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
+  }
+}
+
+uint16_t ATTClass::findInfoPdu(uint16_t startHandle, uint16_t endHandle, uint16_t mtu, uint8_t response[])
+{
   uint16_t responseLength;
 
   response[0] = ATT_OP_FIND_INFO_RESP;
   response[1] = 0x00;
   responseLength = 2;
 
-  for (uint16_t i = (findInfoReq->startHandle - 1); i < GATT.attributeCount() && i <= (findInfoReq->endHandle - 1); i++) {
-    BLELocalAttribute* attribute = GATT.attribute(i);
+  for (uint16_t i = (startHandle - 1); i < GATT.attributeCount() && i <= (endHandle - 1); i++) {
     uint16_t handle = (i + 1);
-    bool isValueHandle = (attribute->type() == BLETypeCharacteristic) && (((BLELocalCharacteristic*)attribute)->valueHandle() == handle);
-    bool isDescriptor = attribute->type() == BLETypeDescriptor;
+    const GATTAttributeEntry* entry = GATT.attributeEntry(handle);
+    BLELocalAttribute* attribute = entry->attribute;
+    bool isValueHandle = (entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC_VALUE);
+    bool isDescriptor = (entry->kind == GATT_ATTRIBUTE_DESCRIPTOR);
     int uuidLen = (isValueHandle || isDescriptor) ? attribute->uuidLength() : BLE_ATTRIBUTE_TYPE_SIZE;
     int infoType = (uuidLen == 2) ? 0x01 : 0x02;
 
@@ -795,7 +1445,7 @@ void ATTClass::findInfoReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen
       responseLength += uuidLen;
     } else {
       // add the type
-      uint16_t type = attribute->type();
+      uint16_t type = (entry->kind == GATT_ATTRIBUTE_SERVICE) ? BLETypeService : BLETypeCharacteristic;
 
       memcpy(&response[responseLength], &type, sizeof(type));
       responseLength += sizeof(type);
@@ -806,14 +1456,10 @@ void ATTClass::findInfoReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen
     }
   }
 
-  if (responseLength == 2) {
-    sendError(connectionHandle, ATT_OP_FIND_INFO_REQ, findInfoReq->startHandle, ATT_ECODE_ATTR_NOT_FOUND);
-  } else {
-    HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
-  }
+  return (responseLength == 2) ? 0 : responseLength;
 }
 
-int ATTClass::findInfoReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint8_t responseBuffer[])
+int ATTClass::sendFindInfoReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint8_t responseBuffer[])
 {
   struct __attribute__ ((packed)) {
     uint8_t op;
@@ -821,23 +1467,19 @@ int ATTClass::findInfoReq(uint16_t connectionHandle, uint16_t startHandle, uint1
     uint16_t endHandle;
   } findInfoReq = { ATT_OP_FIND_INFO_REQ, startHandle, endHandle };
 
-  return sendReq(connectionHandle, &findInfoReq, sizeof(findInfoReq), responseBuffer);
+  return sendReqAsync(connectionHandle, &findInfoReq, sizeof(findInfoReq), responseBuffer);
 }
 
-void ATTClass::findInfoResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::findInfoResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   if (dlen < 2) {
     return; // invalid, drop
   }
 
-  if (connectionHandle == _pendingResp.connectionHandle && _pendingResp.op == ATT_OP_FIND_INFO_RESP) {
-    _pendingResp.buffer[0] = ATT_OP_FIND_INFO_RESP;
-    memcpy(&_pendingResp.buffer[1], data, dlen);
-    _pendingResp.length = dlen + 1;
-  }
+  handleResp(connectionHandle, ATT_OP_FIND_INFO_RESP, dlen, data);
 }
 
-void ATTClass::findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[])
+void ATTClass::findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[])
 {
   struct __attribute__ ((packed)) FindByTypeReq {
     uint16_t startHandle;
@@ -853,7 +1495,7 @@ void ATTClass::findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dl
   uint16_t valueLength = dlen - sizeof(*findByTypeReq);
   uint8_t* value = &data[sizeof(*findByTypeReq)];
 
-  uint8_t response[mtu];
+  uint8_t* response = _response;
   uint16_t responseLength;
 
   response[0] = ATT_OP_FIND_BY_TYPE_RESP;
@@ -861,11 +1503,10 @@ void ATTClass::findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dl
 
   if (findByTypeReq->type == BLETypeService) {
     for (uint16_t i = (findByTypeReq->startHandle - 1); i < GATT.attributeCount() && i <= (findByTypeReq->endHandle - 1); i++) {
-      BLELocalAttribute* attribute = GATT.attribute(i);
-
-      if ((attribute->type() == findByTypeReq->type) && (attribute->uuidLength() == valueLength) && memcmp(attribute->uuidData(), value, valueLength) == 0) {
-        BLELocalService* service = (BLELocalService*)attribute;
+      const GATTAttributeEntry* entry = GATT.attributeEntry(i + 1);
+      BLELocalService* service = (BLELocalService*)GATT.attributeEntry(entry->serviceHandle)->attribute;
 
+      if ((entry->kind == GATT_ATTRIBUTE_SERVICE) && (service->uuidLength() == valueLength) && memcmp(service->uuidData(), value, valueLength) == 0) {
         // add the start handle
         uint16_t startHandle = service->startHandle();
         memcpy(&response[responseLength], &startHandle, sizeof(startHandle));
@@ -880,6 +1521,9 @@ void ATTClass::findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dl
       if ((responseLength + 4) > mtu) {
         break;
       }
+
+      // the rest of the service holds no service declarations, continue after it
+      i = service->endHandle() - 1;
     }
   }
 
@@ -890,7 +1534,32 @@ void ATTClass::findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dl
   }
 }
 
-void ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[])
+int ATTClass::findByTypeReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint16_t type, const uint8_t value[], uint8_t valueLength, uint8_t responseBuffer[])
+{
+  struct __attribute__ ((packed)) {
+    uint8_t op;
+    uint16_t startHandle;
+    uint16_t endHandle;
+    uint16_t type;
+    uint8_t value[16];
+  } findByTypeReq = { ATT_OP_FIND_BY_TYPE_REQ, startHandle, endHandle, type, { 0 } };
+
+  valueLength = min(valueLength, (uint8_t)sizeof(findByTypeReq.value));
+  memcpy(findByTypeReq.value, value, valueLength);
+
+  return sendReqAsync(connectionHandle, &findByTypeReq, 7 + valueLength, responseBuffer);
+}
+
+void ATTClass::findByTypeResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
+{
+  if (dlen < 4) {
+    return; // invalid, drop
+  }
+
+  handleResp(connectionHandle, ATT_OP_FIND_BY_TYPE_RESP, dlen, data);
+}
+
+void ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[])
 {
   struct __attribute__ ((packed)) ReadByGroupReq {
     uint16_t startHandle;
@@ -911,7 +1580,18 @@ void ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint8_t d
     return;
   }
 
-  uint8_t response[mtu];
+  uint8_t* response = _response;
+  uint16_t responseLength = discoveryResp(ATT_OP_READ_BY_GROUP_REQ, readByGroupReq->startHandle, readByGroupReq->endHandle, readByGroupReq->uuid, mtu, response);
+
+  if (responseLength == 0) {
+    sendError(connectionHandle, ATT_OP_READ_BY_GROUP_REQ, readByGroupReq->startHandle, ATT_ECODE_ATTR_NOT_FOUND);
+  } else {
+    HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
+  }
+}
+
+uint16_t ATTClass::readByGroupPdu(uint16_t startHandle, uint16_t endHandle, uint16_t type, uint16_t mtu, uint8_t response[])
+{
   uint16_t responseLength;
 
   response[0] = ATT_OP_READ_BY_GROUP_RESP;
@@ -921,15 +1601,19 @@ void ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint8_t d
   Serial.print("readByGroupReq: attrcount: ");
   Serial.println(GATT.attributeCount());
 #endif
-  for (uint16_t i = (readByGroupReq->startHandle - 1); i < GATT.attributeCount() && i <= (readByGroupReq->endHandle - 1); i++) {
-    BLELocalAttribute* attribute = GATT.attribute(i);
+  for (uint16_t i = (startHandle - 1); i < GATT.attributeCount() && i <= (endHandle - 1); i++) {
+    const GATTAttributeEntry* entry = GATT.attributeEntry(i + 1);
+    BLELocalService* service = (BLELocalService*)GATT.attributeEntry(entry->serviceHandle)->attribute;
+
+    // the rest of the service holds no service declarations, continue after it
+    i = service->endHandle() - 1;
 
-    if (readByGroupReq->uuid != attribute->type()) {
+    if (type != BLETypeService || entry->kind != GATT_ATTRIBUTE_SERVICE) {
       // not the type
       continue;
     }
 
-    int uuidLen = attribute->uuidLength();
+    int uuidLen = service->uuidLength();
     int infoSize = (uuidLen == 2) ? 6 : 20;
 
     if (response[1] == 0) {
@@ -941,8 +1625,6 @@ void ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint8_t d
       break;
     }
 
-    BLELocalService* service = (BLELocalService*)attribute;
-
     // add the start handle
     uint16_t startHandle = service->startHandle();
     memcpy(&response[responseLength], &startHandle, sizeof(startHandle));
@@ -962,11 +1644,7 @@ void ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint8_t d
     }
   }
 
-  if (responseLength == 2) {
-    sendError(connectionHandle, ATT_OP_READ_BY_GROUP_REQ, readByGroupReq->startHandle, ATT_ECODE_ATTR_NOT_FOUND);
-  } else {
-    HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
-  }
+  return (responseLength == 2) ? 0 : responseLength;
 }
 
 int ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint16_t uuid, uint8_t responseBuffer[])
@@ -978,23 +1656,19 @@ int ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t startHandle, ui
     uint16_t uuid;
   } readByGroupReq = { ATT_OP_READ_BY_GROUP_REQ, startHandle, endHandle, uuid };
 
-  return sendReq(connectionHandle, &readByGroupReq, sizeof(readByGroupReq), responseBuffer);
+  return sendReqAsync(connectionHandle, &readByGroupReq, sizeof(readByGroupReq), responseBuffer);
 }
 
-void ATTClass::readByGroupResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::readByGroupResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   if (dlen < 2) {
     return; // invalid, drop
   }
 
-  if (connectionHandle == _pendingResp.connectionHandle && _pendingResp.op == ATT_OP_READ_BY_GROUP_RESP) {
-    _pendingResp.buffer[0] = ATT_OP_READ_BY_GROUP_RESP;
-    memcpy(&_pendingResp.buffer[1], data, dlen);
-    _pendingResp.length = dlen + 1;
-  }
+  handleResp(connectionHandle, ATT_OP_READ_BY_GROUP_RESP, dlen, data);
 }
 
-void ATTClass::readOrReadBlobReq(uint16_t connectionHandle, uint16_t mtu, uint8_t opcode, uint8_t dlen, uint8_t data[])
+void ATTClass::readOrReadBlobReq(uint16_t connectionHandle, uint16_t mtu, uint8_t opcode, uint16_t dlen, uint8_t data[])
 {
   if (opcode == ATT_OP_READ_REQ) {
     if (dlen != sizeof(uint16_t)) {
@@ -1013,114 +1687,229 @@ void ATTClass::readOrReadBlobReq(uint16_t connectionHandle, uint16_t mtu, uint8_
   memcpy(&handle, data, sizeof(handle));
   uint16_t offset = (opcode == ATT_OP_READ_REQ) ? 0 : *(uint16_t*)&data[sizeof(handle)];
 
-  if ((uint16_t)(handle - 1) > GATT.attributeCount()) {
-    sendError(connectionHandle, opcode, handle, ATT_ECODE_ATTR_NOT_FOUND);
+  uint8_t* response = _response;
+  uint16_t responseLength;
+
+  response[0] = (opcode == ATT_OP_READ_REQ) ? ATT_OP_READ_RESP : ATT_OP_READ_BLOB_RESP;
+  responseLength = 1;
+
+  uint16_t valueLength;
+  uint8_t code = readAttribute(connectionHandle, handle, offset, &response[responseLength], mtu - responseLength, &valueLength, NULL);
+
+  if (code == ATT_ECODE_INSUFF_ENC) {
+    // If characteristic requires encryption send error & hold response until encrypted
+    holdResponse = true;
+    sendError(connectionHandle, opcode, handle, ATT_ECODE_INSUFF_ENC);
+  } else if (code != 0x00) {
+    sendError(connectionHandle, opcode, handle, code);
+    return;
+  }
+
+  responseLength += valueLength;
+
+  if(holdResponse){
+    memcpy(holdBuffer, response, responseLength);
+    holdBufferSize = responseLength;
+  }else{
+    HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
+  }
+}
+
+void ATTClass::readMultipleReq(uint16_t connectionHandle, uint16_t mtu, uint8_t opcode, uint16_t dlen, uint8_t data[])
+{
+  if (dlen < (2 * sizeof(uint16_t)) || (dlen % sizeof(uint16_t)) != 0) {
+    sendError(connectionHandle, opcode, 0x0000, ATT_ECODE_INVALID_PDU);
     return;
   }
 
-  uint8_t response[mtu];
+  // the variable length variant prefixes each value with its full length
+  bool variable = (opcode == ATT_OP_READ_MULTI_VAR_REQ);
+  uint8_t* response = _response;
   uint16_t responseLength;
 
-  response[0] = (opcode == ATT_OP_READ_REQ) ? ATT_OP_READ_RESP : ATT_OP_READ_BLOB_RESP;
+  response[0] = variable ? ATT_OP_READ_MULTI_VAR_RESP : ATT_OP_READ_MULTI_RESP;
   responseLength = 1;
 
-  BLELocalAttribute* attribute = GATT.attribute(handle - 1);
-  enum BLEAttributeType attributeType = attribute->type();
+  for (uint16_t i = 0; i < dlen; i += sizeof(uint16_t)) {
+    uint16_t handle;
+    memcpy(&handle, &data[i], sizeof(handle));
+
+    // values that don't fit are truncated, every handle is still checked
+    uint16_t prefixLength = variable ? sizeof(uint16_t) : 0;
+    bool fits = (responseLength + prefixLength) <= mtu;
+    uint16_t maxLength = fits ? (mtu - responseLength - prefixLength) : 0;
+    uint16_t valueLength;
+    uint16_t fullLength;
+    uint8_t code = readAttribute(connectionHandle, handle, 0, &response[fits ? (responseLength + prefixLength) : 0], maxLength, &valueLength, &fullLength);
+
+    if (code != 0x00) {
+      // no response is held for a multiple read, the peer retries once encrypted
+      sendError(connectionHandle, opcode, handle, code);
+      return;
+    }
+
+    if (!fits) {
+      continue;
+    }
+
+    if (variable) {
+      memcpy(&response[responseLength], &fullLength, sizeof(fullLength));
+    }
+
+    responseLength += prefixLength + valueLength;
+  }
+
+  HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
+}
+
+uint8_t ATTClass::readAttribute(uint16_t connectionHandle, uint16_t handle, uint16_t offset, uint8_t buffer[], uint16_t maxLength, uint16_t* valueLength, uint16_t* fullLength)
+{
+  uint16_t length = 0;
+  uint8_t code = 0x00;
+
+  *valueLength = 0;
+
+  const GATTAttributeEntry* entry = GATT.attributeEntry(handle);
 
-  if (attributeType == BLETypeService) {
+  if (entry == NULL) {
+    return ATT_ECODE_ATTR_NOT_FOUND;
+  }
+
+  BLELocalAttribute* attribute = entry->attribute;
+
+  if (entry->kind == GATT_ATTRIBUTE_SERVICE) {
     if (offset) {
-      sendError(connectionHandle, ATT_ECODE_ATTR_NOT_LONG, handle, ATT_ECODE_INVALID_PDU);
-      return;
+      return ATT_ECODE_ATTR_NOT_LONG;
     }
 
     BLELocalService* service = (BLELocalService*)attribute;
 
-    // add the UUID
-    uint8_t uuidLen = service->uuidLength();
-    memcpy(&response[responseLength], service->uuidData(), uuidLen);
-    responseLength += uuidLen;
-  } else if (attributeType == BLETypeCharacteristic) {
+    // the UUID
+    length = service->uuidLength();
+    *valueLength = min(maxLength, length);
+    memcpy(buffer, service->uuidData(), *valueLength);
+  } else if (entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC || entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC_VALUE) {
     BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
 
-    if (characteristic->handle() == handle) {
+    if (entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC) {
       if (offset) {
-        sendError(connectionHandle, opcode, handle, ATT_ECODE_ATTR_NOT_LONG);
-        return;
+        return ATT_ECODE_ATTR_NOT_LONG;
       }
 
-      // add the properties
-      response[responseLength++] = characteristic->properties();
-
-      // add the value handle
+      // the properties, value handle and UUID
+      uint8_t declaration[1 + sizeof(uint16_t) + 16];
       uint16_t valueHandle = characteristic->valueHandle();
-      memcpy(&response[responseLength], &valueHandle, sizeof(valueHandle));
-      responseLength += sizeof(valueHandle);
 
-      // add the UUID
-      uint8_t uuidLen = characteristic->uuidLength();
-      memcpy(&response[responseLength], characteristic->uuidData(), uuidLen);
-      responseLength += uuidLen;
+      declaration[0] = entry->properties;
+      memcpy(&declaration[1], &valueHandle, sizeof(valueHandle));
+      memcpy(&declaration[3], characteristic->uuidData(), characteristic->uuidLength());
+
+      length = 3 + characteristic->uuidLength();
+      *valueLength = min(maxLength, length);
+      memcpy(buffer, declaration, *valueLength);
     } else {
-      if ((characteristic->properties() & BLERead) == 0) {
-        sendError(connectionHandle, opcode, handle, ATT_ECODE_READ_NOT_PERM);
-        return;
-      }
-      // If characteristic requires encryption send error & hold response until encrypted
-      if ((characteristic->permissions() & (BLEPermission::BLEEncryption >> 8)) > 0 &&
-          (getPeerEncryption(connectionHandle) & PEER_ENCRYPTION::ENCRYPTED_AES)==0 ) {
-        holdResponse = true;
-        sendError(connectionHandle, opcode, handle, ATT_ECODE_INSUFF_ENC);
+      if ((entry->properties & BLERead) == 0) {
+        return ATT_ECODE_READ_NOT_PERM;
       }
 
-      uint16_t valueLength = characteristic->valueLength();
+      if (characteristic == GATT.clientSupportedFeaturesCharacteristic()) {
+        // each peer reads the features it enabled
+        uint8_t clientFeatures = 0x00;
 
-      if (offset >= valueLength) {
-        sendError(connectionHandle, opcode, handle, ATT_ECODE_INVALID_OFFSET);
-        return;
+        for (int i = 0; i < ATT_MAX_PEERS; i++) {
+          if (_peers[i].connectionHandle == connectionHandle) {
+            clientFeatures = _peers[i].clientFeatures;
+            break;
+          }
+        }
+
+        length = sizeof(clientFeatures);
+
+        if (offset > length) {
+          return ATT_ECODE_INVALID_OFFSET;
+        }
+
+        *valueLength = min(maxLength, length - offset);
+        memcpy(buffer, &clientFeatures + offset, *valueLength);
+      } else {
+        if (characteristic == GATT.databaseHashCharacteristic()) {
+          GATT.updateDatabaseHash();
+          setChangeAware(connectionHandle);
+        }
+
+        length = characteristic->valueLength();
+
+        if (offset > length) {
+          return ATT_ECODE_INVALID_OFFSET;
+        }
+
+        if ((characteristic->permissions() & (BLEPermission::BLEEncryption >> 8)) > 0 &&
+            (getPeerEncryption(connectionHandle) & PEER_ENCRYPTION::ENCRYPTED_AES)==0 ) {
+          // the value is still read, the caller may hold it until the link is encrypted
+          code = ATT_ECODE_INSUFF_ENC;
+        }
+
+        *valueLength = min(maxLength, length - offset);
+
+        for (int i = 0; i < ATT_MAX_PEERS; i++) {
+          if (_peers[i].connectionHandle == connectionHandle) {
+            characteristic->readValue(BLEDevice(_peers[i].addressType, _peers[i].address), offset, buffer, *valueLength);
+            break;
+          }
+        }
       }
+    }
+  } else if (entry->kind == GATT_ATTRIBUTE_DESCRIPTOR) {
+    BLELocalDescriptor* descriptor = (BLELocalDescriptor*)attribute;
+    const uint8_t* value = descriptor->value();
+    uint16_t cccdValue = 0x0000;
+
+    length = descriptor->valueSize();
 
-      valueLength = min(mtu - responseLength, valueLength - offset);
+    if (descriptor->uuidLength() == 2 && *((uint16_t*)(descriptor->uuidData())) == 0x2902) {
+      // each peer reads its own CCCD value
+      BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)GATT.attributeEntry(entry->characteristicHandle)->attribute;
 
       for (int i = 0; i < ATT_MAX_PEERS; i++) {
         if (_peers[i].connectionHandle == connectionHandle) {
-          characteristic->readValue(BLEDevice(_peers[i].addressType, _peers[i].address), offset, &response[responseLength], valueLength);
-          responseLength += valueLength;
+          uint8_t identity[6];
+
+          peerIdentity(i, identity);
+          cccdValue = characteristic->cccdValue(identity);
+          break;
         }
       }
-    }
-  } else if (attributeType == BLETypeDescriptor) {
-    BLELocalDescriptor* descriptor = (BLELocalDescriptor*)attribute;
-    
-    uint16_t valueLength = descriptor->valueSize();
 
-    if (offset >= valueLength) {
-      sendError(connectionHandle, opcode, handle, ATT_ECODE_INVALID_OFFSET);
-      return;
+      value = (const uint8_t*)&cccdValue;
+      length = sizeof(cccdValue);
     }
 
-    valueLength = min(mtu - responseLength, valueLength - offset);
+    if (offset > length) {
+      return ATT_ECODE_INVALID_OFFSET;
+    }
 
-    memcpy(&response[responseLength], descriptor->value() + offset, valueLength);
-    responseLength += valueLength;
+    *valueLength = min(maxLength, length - offset);
+    memcpy(buffer, value + offset, *valueLength);
   }
-  if(holdResponse){
-    memcpy(holdBuffer, response, responseLength);
-    holdBufferSize = responseLength;
-  }else{
-    HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
+
+  if (fullLength) {
+    *fullLength = length;
   }
+
+  return code;
 }
 
-void ATTClass::readResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::readResp(uint16_t connectionHandle, uint8_t opcode, uint16_t dlen, uint8_t data[])
 {
-  if (connectionHandle == _pendingResp.connectionHandle && _pendingResp.op == ATT_OP_READ_RESP) {
-    _pendingResp.buffer[0] = ATT_OP_READ_RESP;
-    memcpy(&_pendingResp.buffer[1], data, dlen);
-    _pendingResp.length = dlen + 1;
-  }
+  handleResp(connectionHandle, opcode, dlen, data);
+}
+
+void ATTClass::readMultipleResp(uint16_t connectionHandle, uint8_t opcode, uint16_t dlen, uint8_t data[])
+{
+  handleResp(connectionHandle, opcode, dlen, data);
 }
 
-void ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[])
+void ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[])
 {
   struct __attribute__ ((packed)) ReadByTypeReq {
     uint16_t startHandle;
@@ -1133,22 +1922,69 @@ void ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dl
     return;
   }
 
-  uint8_t response[mtu];
+  if (readByTypeReq->uuid == ATT_DATABASE_HASH_UUID) {
+    // computed on demand, and reading it resynchronizes a change-unaware client
+    GATT.updateDatabaseHash();
+    setChangeAware(connectionHandle);
+  }
+
+  uint8_t* response = _response;
+  uint16_t responseLength = discoveryResp(ATT_OP_READ_BY_TYPE_REQ, readByTypeReq->startHandle, readByTypeReq->endHandle, readByTypeReq->uuid, mtu, response);
+
+  if (readByTypeReq->uuid == ATT_CLIENT_SUPPORTED_FEATURES_UUID && responseLength >= 4) {
+    // each peer reads the features it enabled, as with a Read Request
+    uint16_t handle = response[2] | (response[3] << 8);
+
+    if (handle == GATT.clientSupportedFeaturesCharacteristic()->valueHandle()) {
+      uint8_t clientFeatures = 0x00;
+
+      for (int i = 0; i < ATT_MAX_PEERS; i++) {
+        if (_peers[i].connectionHandle == connectionHandle) {
+          clientFeatures = _peers[i].clientFeatures;
+          break;
+        }
+      }
+
+      response[1] = 2 + sizeof(clientFeatures);
+      response[4] = clientFeatures;
+      responseLength = 5;
+    }
+  } else if (readByTypeReq->uuid == 0x2902 && responseLength >= 4) {
+    // each peer reads its own CCCD value, as with a Read Request
+    uint16_t handle = response[2] | (response[3] << 8);
+    uint16_t valueLength = 0;
+
+    if (readAttribute(connectionHandle, handle, 0, &response[4], sizeof(uint16_t), &valueLength, NULL) == 0) {
+      response[1] = 2 + valueLength;
+      responseLength = 4 + valueLength;
+    }
+  }
+
+  if (responseLength == 0) {
+    sendError(connectionHandle, ATT_OP_READ_BY_TYPE_REQ, readByTypeReq->startHandle, ATT_ECODE_ATTR_NOT_FOUND);
+  } else {
+    HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
+  }
+}
+
+uint16_t ATTClass::readByTypePdu(uint16_t startHandle, uint16_t endHandle, uint16_t type, uint16_t mtu, uint8_t response[])
+{
   uint16_t responseLength;
 
   response[0] = ATT_OP_READ_BY_TYPE_RESP;
   response[1] = 0x00;
   responseLength = 2;
 
-  for (uint16_t i = (readByTypeReq->startHandle - 1); i < GATT.attributeCount() && i <= (readByTypeReq->endHandle - 1); i++) {
-    BLELocalAttribute* attribute = GATT.attribute(i);
+  for (uint16_t i = (startHandle - 1); i < GATT.attributeCount() && i <= (endHandle - 1); i++) {
     uint16_t handle = (i + 1);
+    const GATTAttributeEntry* entry = GATT.attributeEntry(handle);
+    BLELocalAttribute* attribute = entry->attribute;
 
-    if (attribute->type() == readByTypeReq->uuid) {
+    if (attribute->type() == type) {
       if (attribute->type() == BLETypeCharacteristic) {
         BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
 
-        if (characteristic->valueHandle() == handle) {
+        if (entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC_VALUE) {
           // value handle, skip
           continue;
         }
@@ -1170,7 +2006,7 @@ void ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dl
         responseLength += sizeof(handle);
 
         // add the properties
-        response[responseLength++] = characteristic->properties();
+        response[responseLength++] = entry->properties;
 
         // add the value handle
         uint16_t valueHandle = (handle + 1);
@@ -1187,45 +2023,43 @@ void ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dl
         if ((responseLength + typeSize) > mtu) {
           break;
         }
-      } else if (attribute->type() == 0x2902) {
-        BLELocalDescriptor* descriptor = (BLELocalDescriptor*)attribute;
-
-        // add the handle
-        memcpy(&response[responseLength], &handle, sizeof(handle));
-        responseLength += sizeof(handle);
-
-        // add the value
-        int valueSize = min((uint16_t)(mtu - responseLength), (uint16_t)descriptor->valueSize());
-        memcpy(&response[responseLength], descriptor->value(), valueSize);
-        responseLength += valueSize;
-
-        response[1] = 2 + valueSize;
-
-        break; // all done
       }
-    } else if (attribute->type() == BLETypeCharacteristic && attribute->uuidLength() == 2 && memcmp(&readByTypeReq->uuid, attribute->uuidData(), 2) == 0) {
+    } else if (entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC_VALUE && attribute->uuidLength() == 2 && memcmp(&type, attribute->uuidData(), 2) == 0) {
       BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
 
       // add the handle
       memcpy(&response[responseLength], &handle, sizeof(handle));
       responseLength += sizeof(handle);
 
-      // add the value
+      // add the value, the length field of the response limits it to 253 bytes
       int valueLength = min((uint16_t)(mtu - responseLength), (uint16_t)characteristic->valueLength());
+      valueLength = min(valueLength, 0xff - 2);
       memcpy(&response[responseLength], characteristic->value(), valueLength);
       responseLength += valueLength;
 
       response[1] = 2 + valueLength;
 
+      break; // all done
+    } else if (entry->kind == GATT_ATTRIBUTE_DESCRIPTOR && attribute->uuidLength() == 2 && memcmp(&type, attribute->uuidData(), 2) == 0) {
+      BLELocalDescriptor* descriptor = (BLELocalDescriptor*)attribute;
+
+      // add the handle
+      memcpy(&response[responseLength], &handle, sizeof(handle));
+      responseLength += sizeof(handle);
+
+      // add the value, readByTypeReq replaces a CCCD value with the one of the connection
+      int valueSize = min((uint16_t)(mtu - responseLength), (uint16_t)descriptor->valueSize());
+      valueSize = min(valueSize, 0xff - 2);
+      memcpy(&response[responseLength], descriptor->value(), valueSize);
+      responseLength += valueSize;
+
+      response[1] = 2 + valueSize;
+
       break; // all done
     }
   }
 
-  if (responseLength == 2) {
-    sendError(connectionHandle, ATT_OP_READ_BY_TYPE_REQ, readByTypeReq->startHandle, ATT_ECODE_ATTR_NOT_FOUND);
-  } else {
-    HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
-  }
+  return (responseLength == 2) ? 0 : responseLength;
 }
 
 int ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint16_t type, uint8_t responseBuffer[])
@@ -1237,23 +2071,19 @@ int ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t startHandle, uin
     uint16_t type;
   } readByTypeReq = { ATT_OP_READ_BY_TYPE_REQ, startHandle, endHandle, type };
 
-  return sendReq(connectionHandle, &readByTypeReq, sizeof(readByTypeReq), responseBuffer);
+  return sendReqAsync(connectionHandle, &readByTypeReq, sizeof(readByTypeReq), responseBuffer);
 }
 
-void ATTClass::readByTypeResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::readByTypeResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   if (dlen < 1) {
     return; // invalid, drop
   }
 
-  if (connectionHandle == _pendingResp.connectionHandle && _pendingResp.op == ATT_OP_READ_BY_TYPE_RESP) {
-    _pendingResp.buffer[0] = ATT_OP_READ_BY_TYPE_RESP;
-    memcpy(&_pendingResp.buffer[1], data, dlen);
-    _pendingResp.length = dlen + 1;
-  }
+  handleResp(connectionHandle, ATT_OP_READ_BY_TYPE_RESP, dlen, data);
 }
 
-void ATTClass::writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op, uint8_t dlen, uint8_t data[])
+void ATTClass::writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op, uint16_t dlen, uint8_t data[])
 {
   bool withResponse = (op == ATT_OP_WRITE_REQ);
 
@@ -1267,62 +2097,76 @@ void ATTClass::writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op
   uint16_t handle;
   memcpy(&handle, data, sizeof(handle));
 
-  if ((uint16_t)(handle - 1) > GATT.attributeCount()) {
+  const GATTAttributeEntry* entry = GATT.attributeEntry(handle);
+
+  if (entry == NULL) {
     if (withResponse) {
       sendError(connectionHandle, ATT_OP_WRITE_REQ, handle, ATT_ECODE_ATTR_NOT_FOUND);
     }
     return;
   }
 
-  uint8_t valueLength = dlen - sizeof(handle);
+  uint16_t valueLength = dlen - sizeof(handle);
   uint8_t* value = &data[sizeof(handle)];
 
-  BLELocalAttribute* attribute = GATT.attribute(handle - 1);
+  BLELocalAttribute* attribute = entry->attribute;
   bool holdResponse = false;
 
-  if (attribute->type() == BLETypeCharacteristic) {
+  if (entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC || entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC_VALUE) {
     BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
     
-    if (handle != characteristic->valueHandle() || 
-      withResponse ? ((characteristic->properties() & BLEWrite) == 0) : 
-                     ((characteristic->properties() & BLEWriteWithoutResponse) == 0)) {
+    if (entry->kind != GATT_ATTRIBUTE_CHARACTERISTIC_VALUE || 
+      (withResponse ? ((entry->properties & BLEWrite) == 0) : 
+                      ((entry->properties & BLEWriteWithoutResponse) == 0))) {
       if (withResponse) {
         sendError(connectionHandle, ATT_OP_WRITE_REQ, handle, ATT_ECODE_WRITE_NOT_PERM);
       }
       return;
     }
-    // Check permission
-    if((characteristic->permissions() &( BLEPermission::BLEEncryption >> 8)) > 0 && 
-       (getPeerEncryption(connectionHandle) & PEER_ENCRYPTION::ENCRYPTED_AES) == 0){
-      holdResponse = true;
-      sendError(connectionHandle, ATT_OP_WRITE_REQ, handle, ATT_ECODE_INSUFF_ENC);
-    }
 
-    for (int i = 0; i < ATT_MAX_PEERS; i++) {
-      if (_peers[i].connectionHandle == connectionHandle) {
-        if(holdResponse){
+    if (characteristic == GATT.clientSupportedFeaturesCharacteristic()) {
+      uint8_t code = writeClientFeatures(connectionHandle, value, valueLength);
+
+      if (code != 0x00) {
+        if (withResponse) {
+          sendError(connectionHandle, ATT_OP_WRITE_REQ, handle, code);
+        }
+        return;
+      }
+    } else {
+      // Check permission
+      if((characteristic->permissions() &( BLEPermission::BLEEncryption >> 8)) > 0 && 
+         (getPeerEncryption(connectionHandle) & PEER_ENCRYPTION::ENCRYPTED_AES) == 0){
+        holdResponse = true;
+        sendError(connectionHandle, ATT_OP_WRITE_REQ, handle, ATT_ECODE_INSUFF_ENC);
+      }
+
+      for (int i = 0; i < ATT_MAX_PEERS; i++) {
+        if (_peers[i].connectionHandle == connectionHandle) {
+          if(holdResponse){
           
-          writeBufferSize = 0;
-          memcpy(writeBuffer, &handle, 2);
-          writeBufferSize+=2;
+            writeBufferSize = 0;
+            memcpy(writeBuffer, &handle, 2);
+            writeBufferSize+=2;
 
-          writeBuffer[writeBufferSize++] = _peers[i].addressType;
+            writeBuffer[writeBufferSize++] = _peers[i].addressType;
 
-          memcpy(&writeBuffer[writeBufferSize], _peers[i].address, sizeof(_peers[i].address));
-          writeBufferSize += sizeof(_peers[i].address);
+            memcpy(&writeBuffer[writeBufferSize], _peers[i].address, sizeof(_peers[i].address));
+            writeBufferSize += sizeof(_peers[i].address);
           
-          writeBuffer[writeBufferSize] = valueLength;
-          writeBufferSize += sizeof(valueLength);
+            memcpy(&writeBuffer[writeBufferSize], &valueLength, sizeof(valueLength));
+            writeBufferSize += sizeof(valueLength);
 
-          memcpy(&writeBuffer[writeBufferSize], value, valueLength);
-          writeBufferSize += valueLength;
-        }else{
-          characteristic->writeValue(BLEDevice(_peers[i].addressType, _peers[i].address), value, valueLength);
+            memcpy(&writeBuffer[writeBufferSize], value, valueLength);
+            writeBufferSize += valueLength;
+          }else{
+            characteristic->writeValue(BLEDevice(_peers[i].addressType, _peers[i].address), value, valueLength);
+          }
+          break;
         }
-        break;
       }
     }
-  } else if (attribute->type() == BLETypeDescriptor) {
+  } else if (entry->kind == GATT_ATTRIBUTE_DESCRIPTOR) {
     BLELocalDescriptor* descriptor = (BLELocalDescriptor*)attribute;
 
     // only CCCD's are writable
@@ -1333,21 +2177,22 @@ void ATTClass::writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op
       return;
     }
 
-    // get the previous handle, should be the characteristic for the CCCD
-    attribute = GATT.attribute(handle - 2);
-
-    if (attribute->type() != BLETypeCharacteristic) {
+    if (valueLength != sizeof(uint16_t)) {
       if (withResponse) {
-        sendError(connectionHandle, ATT_OP_WRITE_REQ, handle, ATT_ECODE_WRITE_NOT_PERM);
+        sendError(connectionHandle, ATT_OP_WRITE_REQ, handle, ATT_ECODE_INVAL_ATTR_VALUE_LEN);
       }
       return;
     }
 
-    BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
+    // the characteristic the CCCD belongs to
+    BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)GATT.attributeEntry(entry->characteristicHandle)->attribute;
 
     for (int i = 0; i < ATT_MAX_PEERS; i++) {
       if (_peers[i].connectionHandle == connectionHandle) {
-        characteristic->writeCccdValue(BLEDevice(_peers[i].addressType, _peers[i].address), *((uint16_t*)value));
+        uint8_t identity[6];
+
+        peerIdentity(i, identity);
+        characteristic->writeCccdValue(BLEDevice(_peers[i].addressType, _peers[i].address), identity, *((uint16_t*)value));
         break;
       }
     }
@@ -1359,7 +2204,7 @@ void ATTClass::writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op
   }
 
   if (withResponse) {
-    uint8_t response[mtu];
+    uint8_t* response = _response;
     uint16_t responseLength;
 
     response[0] = ATT_OP_WRITE_RESP;
@@ -1382,13 +2227,12 @@ int ATTClass::processWriteBuffer(){
     uint16_t handle;
     uint8_t addressType;
     uint8_t address[6];
-    uint8_t valueLength;
+    uint16_t valueLength;
     uint8_t value[];
   } *writeBufferStruct = (WriteBuffer*)&ATT.writeBuffer;
   // uint8_t value[writeBufferStruct->valueLength];
   // memcpy(value, writeBufferStruct->value, writeBufferStruct->valueLength);
-  BLELocalAttribute* attribute = GATT.attribute(writeBufferStruct->handle-1);
-  BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
+  BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)GATT.attributeEntry(writeBufferStruct->handle)->attribute;
 #ifdef _BLE_TRACE_
   Serial.println("Writing value");
 #endif
@@ -1397,20 +2241,25 @@ int ATTClass::processWriteBuffer(){
   return 1;
 }
 
-void ATTClass::writeResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::writeResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   if (dlen != 0) {
     return; // drop
   }
 
-  if (connectionHandle == _pendingResp.connectionHandle && _pendingResp.op == ATT_OP_WRITE_RESP) {
-    _pendingResp.buffer[0] = ATT_OP_WRITE_RESP;
-    memcpy(&_pendingResp.buffer[1], data, dlen);
-    _pendingResp.length = dlen + 1;
+  handleResp(connectionHandle, ATT_OP_WRITE_RESP, dlen, data);
+}
+
+void ATTClass::prepWriteResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
+{
+  if (dlen < 4) {
+    return; // invalid, drop
   }
+
+  handleResp(connectionHandle, ATT_OP_PREP_WRITE_RESP, dlen, data);
 }
 
-void ATTClass::prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[])
+void ATTClass::prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[])
 {
   struct __attribute__ ((packed)) PrepWriteReq {
     uint16_t handle;
@@ -1425,26 +2274,21 @@ void ATTClass::prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dle
   uint16_t handle = prepWriteReq->handle;
   uint16_t offset = prepWriteReq->offset;
 
-  if ((uint16_t)(handle - 1) > GATT.attributeCount()) {
+  const GATTAttributeEntry* entry = GATT.attributeEntry(handle);
+
+  if (entry == NULL) {
     sendError(connectionHandle, ATT_OP_PREP_WRITE_REQ, handle, ATT_ECODE_ATTR_NOT_FOUND);
     return;
   }
 
-  BLELocalAttribute* attribute = GATT.attribute(handle - 1);
-
-  if (attribute->type() != BLETypeCharacteristic) {
+  if (entry->kind != GATT_ATTRIBUTE_CHARACTERISTIC_VALUE) {
     sendError(connectionHandle, ATT_OP_PREP_WRITE_REQ, handle, ATT_ECODE_ATTR_NOT_LONG);
     return;
   }
 
-  BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
-
-  if (handle != characteristic->valueHandle()) {
-    sendError(connectionHandle, ATT_OP_PREP_WRITE_REQ, handle, ATT_ECODE_ATTR_NOT_LONG);
-    return;
-  }
+  BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)entry->attribute;
 
-  if ((characteristic->properties() & BLEWrite) == 0) {
+  if ((entry->properties & BLEWrite) == 0) {
     sendError(connectionHandle, ATT_OP_PREP_WRITE_REQ, handle, ATT_ECODE_WRITE_NOT_PERM);
     return;
   }
@@ -1462,7 +2306,7 @@ void ATTClass::prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dle
     return;
   }
 
-  uint8_t valueLength = dlen - sizeof(PrepWriteReq);
+  uint16_t valueLength = dlen - sizeof(PrepWriteReq);
   uint8_t* value = &data[sizeof(PrepWriteReq)];
 
   if ((offset != _longWriteValueLength) || ((offset + valueLength) > (uint16_t)characteristic->valueSize())) {
@@ -1473,7 +2317,7 @@ void ATTClass::prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dle
   memcpy(_longWriteValue + offset, value, valueLength);
   _longWriteValueLength += valueLength;
 
-  uint8_t response[mtu];
+  uint8_t* response = _response;
   uint16_t responseLength;
 
   response[0] = ATT_OP_PREP_WRITE_RESP;
@@ -1483,7 +2327,7 @@ void ATTClass::prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dle
   HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
 }
 
-void ATTClass::execWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[])
+void ATTClass::execWriteReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[])
 {
   if (dlen != sizeof(uint8_t)) {
     sendError(connectionHandle, ATT_OP_EXEC_WRITE_REQ, 0x0000, ATT_ECODE_INVALID_PDU);
@@ -1493,7 +2337,7 @@ void ATTClass::execWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dle
   uint8_t flag = data[0];
 
   if (_longWriteHandle && (flag & 0x01)) {
-    BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)GATT.attribute(_longWriteHandle - 1);
+    BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)GATT.attributeEntry(_longWriteHandle)->attribute;
 
     for (int i = 0; i < ATT_MAX_PEERS; i++) {
       if (_peers[i].connectionHandle == connectionHandle) {
@@ -1501,357 +2345,1603 @@ void ATTClass::execWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dle
         break;
       }
     }
-  }
+  }
+
+  _longWriteHandle = 0x0000;
+  _longWriteValueLength = 0;
+
+  uint8_t* response = _response;
+  uint16_t responseLength;
+
+  response[0] = ATT_OP_EXEC_WRITE_RESP;
+  responseLength = 1;
+
+  HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
+}
+
+void ATTClass::execWriteResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
+{
+  if (dlen != 0) {
+    return; // drop
+  }
+
+  handleResp(connectionHandle, ATT_OP_EXEC_WRITE_RESP, dlen, data);
+}
+
+void ATTClass::handleNotifyOrInd(uint16_t connectionHandle, uint8_t opcode, uint16_t dlen, uint8_t data[])
+{
+  if (dlen < 2) {
+    return; // drop
+  }
+
+  int peerIndex = -1;
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == connectionHandle) {
+      peerIndex = i;
+      break;
+    }
+  }
+
+  if (opcode == ATT_OP_HANDLE_MULTI_NOTIFY) {
+    struct __attribute__ ((packed)) HandleLengthValue {
+      uint16_t handle;
+      uint16_t length;
+    };
+
+    for (uint16_t offset = 0; (offset + sizeof(HandleLengthValue)) <= dlen; ) {
+      HandleLengthValue* tuple = (HandleLengthValue*)&data[offset];
+
+      offset += sizeof(HandleLengthValue);
+
+      if (tuple->length > (dlen - offset)) {
+        break; // truncated, drop the rest
+      }
+
+      if (peerIndex != -1) {
+        handleValue(peerIndex, tuple->handle, &data[offset], tuple->length);
+      }
+
+      offset += tuple->length;
+    }
+
+    return;
+  }
+
+  struct __attribute__ ((packed)) HandleNotifyOrInd {
+    uint16_t handle;
+  } *handleNotifyOrInd = (HandleNotifyOrInd*)data;
+
+  if (peerIndex != -1) {
+    handleValue(peerIndex, handleNotifyOrInd->handle, &data[2], dlen - 2);
+  }
+
+  if (opcode == ATT_OP_HANDLE_IND) {
+    // send CNF for IND
+
+    uint8_t cnf = ATT_OP_HANDLE_CNF;
+
+    HCI.sendAclPkt(connectionHandle, ATT_CID, sizeof(cnf), &cnf);
+  }
+}
+
+void ATTClass::handleValue(int peerIndex, uint16_t handle, const uint8_t value[], uint16_t length)
+{
+  BLERemoteDevice* device = _peers[peerIndex].device;
+
+  if (!device) {
+    return;
+  }
+
+  BLERemoteCharacteristic* c = device->characteristicForValueHandle(handle);
+
+  if (c) {
+    c->writeValue(BLEDevice(_peers[peerIndex].addressType, _peers[peerIndex].address), value, length);
+  }
+}
+
+void ATTClass::handleCnf(uint16_t connectionHandle, uint16_t /*dlen*/, uint8_t /*data*/[])
+{
+  int peerIndex = -1;
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == connectionHandle) {
+      peerIndex = i;
+      break;
+    }
+  }
+
+  if (peerIndex == -1 || !_peers[peerIndex].indicationSent) {
+    // unexpected, drop
+    return;
+  }
+
+  ATTHandleValue* indication = _peers[peerIndex].indications.remove(0);
+
+  _peers[peerIndex].indicationSent = false;
+
+  // the next indication can go out before the application is told
+  sendIndication(peerIndex);
+
+  const GATTAttributeEntry* entry = GATT.attributeEntry(indication->handle);
+
+  if (entry != NULL && entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC_VALUE) {
+    BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)entry->attribute;
+
+    if (characteristic == GATT.servicesChangedCharacteristic()) {
+      // a client that confirmed Service Changed knows about the change
+      setChangeAware(connectionHandle);
+    }
+
+    characteristic->indicationConfirmed(BLEDevice(_peers[peerIndex].addressType, _peers[peerIndex].address));
+  }
+
+  if (indication->value) {
+    free(indication->value);
+  }
+
+  delete indication;
+}
+
+bool ATTClass::changeAware(uint16_t connectionHandle, uint8_t opcode, uint16_t dlen, uint8_t data[])
+{
+  switch (opcode) {
+    case ATT_OP_FIND_INFO_REQ:
+    case ATT_OP_FIND_BY_TYPE_REQ:
+    case ATT_OP_READ_BY_TYPE_REQ:
+    case ATT_OP_READ_REQ:
+    case ATT_OP_READ_BLOB_REQ:
+    case ATT_OP_READ_MULTI_REQ:
+    case ATT_OP_READ_MULTI_VAR_REQ:
+    case ATT_OP_READ_BY_GROUP_REQ:
+    case ATT_OP_WRITE_REQ:
+    case ATT_OP_WRITE_CMD:
+    case ATT_OP_PREP_WRITE_REQ:
+    case ATT_OP_EXEC_WRITE_REQ:
+    case ATT_OP_SIGNED_WRITE_CMD:
+      break;
+
+    default:
+      // the MTU exchange and anything sent by a server don't depend on the local database
+      return true;
+  }
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle != connectionHandle) {
+      continue;
+    }
+
+    // only clients with robust caching enabled are tracked
+    if ((_peers[i].clientFeatures & ATT_CLIENT_FEATURE_ROBUST_CACHING) == 0 || _peers[i].databaseVersion == GATT.version()) {
+      return true;
+    }
+
+    if (opcode == ATT_OP_READ_BY_TYPE_REQ && dlen == 6) {
+      uint16_t type;
+      memcpy(&type, &data[4], sizeof(type));
+
+      if (type == ATT_DATABASE_HASH_UUID) {
+        // let the client read the new hash, which makes it change-aware
+        return true;
+      }
+    }
+
+    if (opcode & 0x40) {
+      // commands from a change-unaware client are ignored
+      return false;
+    }
+
+    if (_peers[i].outOfSyncSent) {
+      // the client was told, the request after the error makes it change-aware
+      setChangeAware(connectionHandle);
+      return true;
+    }
+
+    _peers[i].outOfSyncSent = true;
+    sendError(connectionHandle, opcode, 0x0000, ATT_ECODE_DB_OUT_OF_SYNC);
+    return false;
+  }
+
+  return true;
+}
+
+void ATTClass::setChangeAware(uint16_t connectionHandle)
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == connectionHandle) {
+      _peers[i].databaseVersion = GATT.version();
+      _peers[i].outOfSyncSent = false;
+      break;
+    }
+  }
+}
+
+uint8_t ATTClass::writeClientFeatures(uint16_t connectionHandle, const uint8_t value[], uint16_t length)
+{
+  if (length == 0) {
+    return ATT_ECODE_INVAL_ATTR_VALUE_LEN;
+  }
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle != connectionHandle) {
+      continue;
+    }
+
+    // a client can't disable a feature once it enabled it
+    if (_peers[i].clientFeatures & ~value[0]) {
+      return ATT_ECODE_VALUE_NOT_ALLOWED;
+    }
+
+    if ((value[0] & ATT_CLIENT_FEATURE_ROBUST_CACHING) && (_peers[i].clientFeatures & ATT_CLIENT_FEATURE_ROBUST_CACHING) == 0) {
+      // the client is change-aware when it enables robust caching
+      _peers[i].databaseVersion = GATT.version();
+      _peers[i].outOfSyncSent = false;
+    }
+
+    // Enhanced ATT isn't supported, its bit is ignored
+    _peers[i].clientFeatures |= value[0] & (ATT_CLIENT_FEATURE_ROBUST_CACHING | ATT_CLIENT_FEATURE_MULTI_NOTIFY);
+    _peers[i].multipleNotifications = (_peers[i].clientFeatures & ATT_CLIENT_FEATURE_MULTI_NOTIFY) != 0;
+
+    return 0x00;
+  }
+
+  return ATT_ECODE_UNLIKELY;
+}
+
+void ATTClass::sendError(uint16_t connectionHandle, uint8_t opcode, uint16_t handle, uint8_t code)
+{
+  struct __attribute__ ((packed)) {
+    uint8_t op;
+    uint8_t opcode;
+    uint16_t handle;
+    uint8_t code;
+  } attError = { ATT_OP_ERROR, opcode, handle, code };
+
+  HCI.sendAclPkt(connectionHandle, ATT_CID, sizeof(attError), &attError);
+}
+
+
+ATTOperation* ATTClass::queueOperation(uint16_t connectionHandle, uint8_t type)
+{
+  ATTOperation* operation = new ATTOperation();
+
+  if (operation == NULL) {
+    return NULL;
+  }
+
+  memset(operation, 0x00, sizeof(ATTOperation));
+  operation->connectionHandle = connectionHandle;
+  operation->type = type;
+
+  _operations.add(operation);
+
+  return operation;
+}
+
+void ATTClass::runOperations()
+{
+  if (_operationsRunning) {
+    // called again from an operation or a completion handler
+    return;
+  }
+
+  _operationsRunning = true;
+
+  unsigned int i = 0;
+
+  while (i < _operations.size()) {
+    ATTOperation* operation = _operations.get(i);
+
+    // operations of a connection run one after the other, in order
+    bool first = true;
+
+    for (unsigned int j = 0; j < i; j++) {
+      if (_operations.get(j)->connectionHandle == operation->connectionHandle) {
+        first = false;
+        break;
+      }
+    }
+
+    if (!first) {
+      i++;
+      continue;
+    }
+
+    int peerIndex = -1;
+
+    for (int j = 0; j < ATT_MAX_PEERS; j++) {
+      if (_peers[j].connectionHandle == operation->connectionHandle) {
+        peerIndex = j;
+        break;
+      }
+    }
+
+    if (peerIndex == -1) {
+      completeOperation(operation, false);
+      continue;
+    }
+
+    bool expired = (millis() - _peers[peerIndex].pendingResp.start) >= _timeout;
+
+    if (!operation->started) {
+      if (_peers[peerIndex].pendingResp.op != 0x00 && (_peers[peerIndex].pendingResp.length != 0 || !expired)) {
+        // the bearer is busy with a request sent by sendReq
+        i++;
+        continue;
+      }
+
+      operation->started = true;
+
+      int result = startOperation(operation);
+
+      if (result <= 0) {
+        completeOperation(operation, result == 0);
+      }
+      continue;
+    }
+
+    if (_peers[peerIndex].pendingResp.op == 0x00) {
+      // the request was dropped
+      completeOperation(operation, false);
+      continue;
+    }
+
+    if (_peers[peerIndex].pendingResp.length == 0) {
+      if (expired) {
+        _peers[peerIndex].pendingResp.op = 0x00;
+        completeOperation(operation, false);
+        continue;
+      }
+
+      i++;
+      continue;
+    }
+
+    int respLength = reqResult(operation->connectionHandle);
+    int result;
+
+    switch (operation->type) {
+      case ATT_OPERATION_READ:
+        result = readPart(operation, respLength);
+        break;
+
+      case ATT_OPERATION_WRITE:
+        result = writePart(operation, respLength);
+        break;
+
+      case ATT_OPERATION_DISCOVER:
+        result = discoverResp(operation, respLength) ? discoverNext(operation) : -1;
+        break;
+
+      default:
+        result = -1;
+        break;
+    }
+
+    if (result <= 0) {
+      completeOperation(operation, result == 0);
+    }
+  }
+
+  _operationsRunning = false;
+}
+
+int ATTClass::startOperation(ATTOperation* operation)
+{
+  if (operation->type != ATT_OPERATION_WRITE_CMD) {
+    operation->response = (uint8_t*)malloc(ATT_MAX_MTU);
+
+    if (operation->response == NULL) {
+      return -1;
+    }
+  }
+
+  switch (operation->type) {
+    case ATT_OPERATION_READ:
+      return readReqAsync(operation->connectionHandle, operation->handle, operation->response) ? 1 : -1;
+
+    case ATT_OPERATION_WRITE:
+      if (operation->valueLength > (mtu(operation->connectionHandle) - 3)) {
+        // too long for a Write Request, written with prepared writes
+        operation->stage = ATT_WRITE_PREPARE;
+
+        return writeNext(operation);
+      }
+
+      return writeReqAsync(operation->connectionHandle, operation->handle, operation->value, operation->valueLength, operation->response) ? 1 : -1;
+
+    case ATT_OPERATION_WRITE_CMD:
+      writeCmd(operation->connectionHandle, operation->handle, operation->value, operation->valueLength);
+
+      if (operation->characteristic && !operation->characteristic->setValue(operation->value, operation->valueLength)) {
+        return -1;
+      }
+      return 0;
+
+    case ATT_OPERATION_DISCOVER:
+      for (int i = 0; i < ATT_MAX_PEERS; i++) {
+        if (_peers[i].connectionHandle == operation->connectionHandle) {
+          if (_peers[i].device == NULL) {
+            _peers[i].device = new BLERemoteDevice();
+          }
+
+          if (_peers[i].device == NULL) {
+            return -1;
+          }
+
+          if (operation->scope != ATT_SCOPE_CHARACTERISTICS && operation->uuidLength == 0) {
+            // clear existing services
+            _peers[i].device->clearServices();
+          }
+
+          if (operation->scope != ATT_SCOPE_CHARACTERISTICS) {
+            operation->firstService = _peers[i].device->serviceCount();
+          }
+          break;
+        }
+      }
+
+      if (operation->scope == ATT_SCOPE_CHARACTERISTICS) {
+        // of services found before
+        operation->stage = ATT_DISCOVER_CHARACTERISTICS;
+        operation->endHandle = 0x0000;
+      } else {
+        operation->stage = ATT_DISCOVER_MTU;
+        operation->handle = 0x0001;
+      }
+
+      return discoverNext(operation);
+
+    default:
+      return -1;
+  }
+}
+
+void ATTClass::completeOperation(ATTOperation* operation, bool success)
+{
+  for (unsigned int i = 0; i < _operations.size(); i++) {
+    if (_operations.get(i) == operation) {
+      _operations.remove(i);
+      break;
+    }
+  }
+
+  BLEDevice device;
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == operation->connectionHandle) {
+      device = BLEDevice(_peers[i].addressType, _peers[i].address);
+      break;
+    }
+  }
+
+  if (operation->characteristicHandler) {
+    operation->characteristicHandler(device, BLECharacteristic(operation->characteristic), success);
+  }
+
+  if (operation->deviceHandler) {
+    operation->deviceHandler(device, success);
+  }
+
+  // the characteristic of a waited operation is held by its waiter
+  if (operation->characteristic && !operation->waited && operation->characteristic->release() == 0) {
+    delete operation->characteristic;
+  }
+
+  if (operation->value) {
+    free(operation->value);
+  }
+
+  if (operation->response) {
+    free(operation->response);
+  }
+
+  if (operation->waited) {
+    operation->completed = true;
+    operation->succeeded = success;
+    return;
+  }
+
+  delete operation;
+}
+
+void ATTClass::failOperations(uint16_t connectionHandle)
+{
+  for (unsigned int i = 0; i < _operations.size();) {
+    ATTOperation* operation = _operations.get(i);
+
+    if (operation->connectionHandle == connectionHandle) {
+      completeOperation(operation, false);
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+}
+
+bool ATTClass::operationsPending(uint16_t connectionHandle) const
+{
+  for (unsigned int i = 0; i < _operations.size(); i++) {
+    if (_operations.get(i)->connectionHandle == connectionHandle) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+ATTOperation* ATTClass::queueRead(uint16_t connectionHandle, uint16_t handle, BLERemoteCharacteristic* characteristic, uint8_t buffer[], uint16_t size)
+{
+  if (!connected(connectionHandle)) {
+    return NULL;
+  }
+
+  ATTOperation* operation = queueOperation(connectionHandle, ATT_OPERATION_READ);
+  if (operation == NULL) {
+    return NULL;
+  }
+
+  operation->characteristic = characteristic;
+  operation->handle = handle;
+  operation->buffer = buffer;
+  operation->bufferSize = size;
+
+  return operation;
+}
+
+ATTOperation* ATTClass::queueWrite(uint16_t connectionHandle, uint16_t handle, BLERemoteCharacteristic* characteristic, const uint8_t* data, uint16_t dataLen, bool withResponse)
+{
+  if (!connected(connectionHandle)) {
+    return NULL;
+  }
+
+  // the value is kept until the operation runs
+  uint8_t* value = (uint8_t*)malloc(dataLen ? dataLen : 1);
+  if (value == NULL) {
+    return NULL;
+  }
+
+  ATTOperation* operation = queueOperation(connectionHandle, withResponse ? ATT_OPERATION_WRITE : ATT_OPERATION_WRITE_CMD);
+  if (operation == NULL) {
+    free(value);
+    return NULL;
+  }
+
+  memcpy(value, data, dataLen);
+
+  operation->characteristic = characteristic;
+  operation->handle = handle;
+  operation->value = value;
+  operation->valueLength = dataLen;
+
+  return operation;
+}
+
+bool ATTClass::readAsync(BLERemoteCharacteristic* characteristic, BLECharacteristicCompletionHandler handler)
+{
+  // a single Read Request
+  ATTOperation* operation = queueRead(characteristic->_connectionHandle, characteristic->valueHandle(), characteristic, NULL, mtu(characteristic->_connectionHandle) - 1);
+  if (operation == NULL) {
+    return false;
+  }
+
+  characteristic->retain();
+  operation->characteristicHandler = handler;
+
+  runOperations();
+
+  return true;
+}
+
+bool ATTClass::writeAsync(BLERemoteCharacteristic* characteristic, uint16_t handle, const uint8_t* data, uint16_t dataLen, bool withResponse, BLECharacteristicCompletionHandler handler)
+{
+  ATTOperation* operation = queueWrite(characteristic->_connectionHandle, handle, characteristic, data, dataLen, withResponse);
+  if (operation == NULL) {
+    return false;
+  }
+
+  characteristic->retain();
+  operation->characteristicHandler = handler;
+
+  runOperations();
+
+  return true;
+}
+
+int ATTClass::readValue(uint16_t connectionHandle, uint16_t handle, BLERemoteCharacteristic* characteristic, uint8_t buffer[], uint16_t size)
+{
+  if (_operationsRunning) {
+    // called from a completion handler, the queue can't progress while waiting here
+    return -1;
+  }
+
+  ATTOperation* operation = queueRead(connectionHandle, handle, characteristic, buffer, size);
+  if (operation == NULL) {
+    return -1;
+  }
+
+  int length = 0;
+
+  if (waitForOperation(operation, &length) != 1) {
+    return -1;
+  }
+
+  return length;
+}
+
+bool ATTClass::writeValue(uint16_t connectionHandle, uint16_t handle, BLERemoteCharacteristic* characteristic, const uint8_t* data, uint16_t dataLen, bool withResponse)
+{
+  if (_operationsRunning) {
+    // called from a completion handler, the queue can't progress while waiting here
+    return false;
+  }
+
+  ATTOperation* operation = queueWrite(connectionHandle, handle, characteristic, data, dataLen, withResponse);
+  if (operation == NULL) {
+    return false;
+  }
+
+  return (waitForOperation(operation) == 1);
+}
+
+int ATTClass::waitForOperation(ATTOperation* operation, int* valueLength)
+{
+  operation->waited = true;
+
+  // the operation completes on the last response, a timeout or a disconnection
+  while (!operation->completed) {
+    HCI.poll();
+  }
+
+  int result = operation->succeeded ? 1 : 0;
+
+  if (valueLength) {
+    *valueLength = operation->offset;
+  }
+
+  delete operation;
+
+  return result;
+}
+
+int ATTClass::readPart(ATTOperation* operation, int respLength)
+{
+  uint8_t* resp = operation->response;
+
+  if (resp[0] == ATT_OP_ERROR) {
+    if (respLength != 5 || operation->offset == 0 ||
+        (resp[4] != ATT_ECODE_ATTR_NOT_LONG && resp[4] != ATT_ECODE_INVALID_OFFSET)) {
+      return -1;
+    }
+
+    // the value ended with the previous part
+  } else {
+    uint16_t partLength = respLength - 1;
+    uint16_t length = min(partLength, (uint16_t)(operation->bufferSize - operation->offset));
+
+    if (operation->buffer == NULL) {
+      uint16_t valueSize = operation->offset + length;
+      uint8_t* value = (uint8_t*)realloc(operation->value, valueSize ? valueSize : 1);
+
+      if (value == NULL) {
+        return -1;
+      }
+
+      operation->value = value;
+    }
+
+    memcpy(&(operation->buffer ? operation->buffer : operation->value)[operation->offset], &resp[1], length);
+    operation->offset += length;
+
+    if (partLength == (mtu(operation->connectionHandle) - 1) && operation->offset < operation->bufferSize) {
+      // a full response, the value may continue: read it part by part with Read Blob Requests
+      return readBlobReqAsync(operation->connectionHandle, operation->handle, operation->offset, operation->response) ? 1 : -1;
+    }
+  }
+
+  if (operation->buffer == NULL && operation->characteristic && !operation->characteristic->setValue(operation->value, operation->offset)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int ATTClass::writeNext(ATTOperation* operation)
+{
+  if (operation->offset < operation->valueLength) {
+    // each part fills a request
+    uint16_t length = min((uint16_t)(mtu(operation->connectionHandle) - 5), (uint16_t)(operation->valueLength - operation->offset));
+
+    return prepWriteReqAsync(operation->connectionHandle, operation->handle, operation->offset, &operation->value[operation->offset], length, operation->response) ? 1 : -1;
+  }
+
+  // write the queued parts
+  operation->stage = ATT_WRITE_EXECUTE;
+
+  return execWriteReqAsync(operation->connectionHandle, 0x01, operation->response) ? 1 : -1;
+}
+
+int ATTClass::writePart(ATTOperation* operation, int respLength)
+{
+  uint8_t* resp = operation->response;
+
+  switch (operation->stage) {
+    case ATT_WRITE_PREPARE: {
+      uint16_t length = min((uint16_t)(mtu(operation->connectionHandle) - 5), (uint16_t)(operation->valueLength - operation->offset));
+
+      // the server echoes the part it queued
+      if (resp[0] != ATT_OP_PREP_WRITE_RESP || respLength != (5 + length) ||
+          memcmp(&resp[5], &operation->value[operation->offset], length) != 0) {
+        // cancel the queued parts
+        operation->stage = ATT_WRITE_CANCEL;
+
+        return execWriteReqAsync(operation->connectionHandle, 0x00, operation->response) ? 1 : -1;
+      }
+
+      operation->offset += length;
+
+      return writeNext(operation);
+    }
+
+    case ATT_WRITE_CANCEL:
+      return -1;
+
+    default:
+      if (resp[0] == ATT_OP_ERROR) {
+        return -1;
+      }
+      break;
+  }
+
+  if (operation->characteristic && operation->handle == operation->characteristic->valueHandle() &&
+      !operation->characteristic->setValue(operation->value, operation->valueLength)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int ATTClass::discoverNext(ATTOperation* operation)
+{
+  BLERemoteDevice* device = NULL;
+  int peerIndex = -1;
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == operation->connectionHandle) {
+      device = _peers[i].device;
+      peerIndex = i;
+      break;
+    }
+  }
+
+  if (device == NULL) {
+    return -1;
+  }
+
+  // send the next request, or move on to the next stage once a range is done
+  while (1) {
+    switch (operation->stage) {
+      case ATT_DISCOVER_MTU:
+        if (!_peers[peerIndex].mtuExchanged) {
+          _peers[peerIndex].mtuExchanged = true;
+
+          return sendMtuReq(operation->connectionHandle, _maxMtu, operation->response) ? 1 : -1;
+        }
+
+        operation->stage = (_storeGattCache || _getGattCache) ? ATT_DISCOVER_HASH : ATT_DISCOVER_SERVICES;
+        break;
+
+      case ATT_DISCOVER_HASH:
+        return readByTypeReq(operation->connectionHandle, 0x0001, 0xffff, ATT_DATABASE_HASH_UUID, operation->response) ? 1 : -1;
+
+      case ATT_DISCOVER_CACHED:
+        // restored from the cache, nothing to discover
+        return 0;
+
+      case ATT_DISCOVER_SERVICES:
+        if (operation->handle != 0x0000) {
+          if (operation->uuidLength) {
+            // only the services with the UUID
+            return findByTypeReq(operation->connectionHandle, operation->handle, 0xffff, BLETypeService, operation->uuid, operation->uuidLength, operation->response) ? 1 : -1;
+          }
+
+          return readByGroupReq(operation->connectionHandle, operation->handle, 0xffff, BLETypeService, operation->response) ? 1 : -1;
+        }
+
+        if (operation->scope == ATT_SCOPE_SERVICES) {
+          return 0;
+        }
+
+        // only the characteristics of the services found now are discovered
+        operation->stage = ATT_DISCOVER_CHARACTERISTICS;
+        operation->lastService = device->serviceCount();
+        operation->endHandle = 0x0000;
+        break;
+
+      case ATT_DISCOVER_CHARACTERISTICS:
+        if (operation->endHandle == 0x0000) {
+          if (operation->firstService >= operation->lastService) {
+            return 0;
+          }
+
+          // a single sweep over the services, each characteristic goes to the service holding it
+          operation->serviceIndex = operation->firstService;
+          operation->handle = device->service(operation->firstService)->startHandle();
+          operation->endHandle = device->service(operation->lastService - 1)->endHandle();
+        }
+
+        if (operation->handle == 0x0000 || operation->handle > operation->endHandle) {
+          operation->stage = ATT_DISCOVER_DESCRIPTORS;
+          operation->serviceIndex = operation->firstService;
+          operation->characteristicIndex = 0;
+          operation->handle = 0x0001;
+          break;
+        }
+
+        return readByTypeReq(operation->connectionHandle, operation->handle, operation->endHandle, BLETypeCharacteristic, operation->response) ? 1 : -1;
+
+      case ATT_DISCOVER_DESCRIPTORS: {
+        BLERemoteService* service = NULL;
+        BLERemoteCharacteristic* characteristic = NULL;
+
+        // skip the characteristics without descriptors, or with all of them found
+        while (operation->handle != 0x0000 && operation->serviceIndex < operation->lastService) {
+          service = device->service(operation->serviceIndex);
+
+          if (operation->characteristicIndex >= service->characteristicCount()) {
+            operation->serviceIndex++;
+            operation->characteristicIndex = 0;
+            continue;
+          }
+
+          characteristic = service->characteristic(operation->characteristicIndex);
+
+          if (max(operation->handle, (uint16_t)(characteristic->valueHandle() + 1)) <= descriptorsEndHandle(service, operation->characteristicIndex)) {
+            break;
+          }
+
+          characteristic = NULL;
+          operation->characteristicIndex++;
+        }
+
+        if (characteristic == NULL) {
+          // discovery complete, a whole database is kept for the next connection
+          if (operation->cacheable && operation->scope == ATT_SCOPE_DATABASE && operation->uuidLength == 0) {
+            storeGattCache(peerIndex, operation->databaseHash);
+          }
+          return 0;
+        }
+
+        uint16_t startHandle = max(operation->handle, (uint16_t)(characteristic->valueHandle() + 1));
+        uint16_t endHandle = descriptorsEndHandle(service, operation->characteristicIndex);
+        // Find Information responses hold this many handles with 16-bit types
+        uint16_t maxHandles = (mtu(operation->connectionHandle) - 2) / 4;
+        unsigned int serviceIndex = operation->serviceIndex;
+        unsigned int characteristicIndex = operation->characteristicIndex + 1;
+
+        // cover the descriptors of the next characteristics in the same request while they fit in a response,
+        // the declarations and values in between are skipped in the response
+        while (serviceIndex < operation->lastService) {
+          BLERemoteService* nextService = device->service(serviceIndex);
+
+          if (characteristicIndex >= nextService->characteristicCount()) {
+            serviceIndex++;
+            characteristicIndex = 0;
+
+            if (serviceIndex < operation->lastService && device->service(serviceIndex)->startHandle() != (nextService->endHandle() + 1)) {
+              // attributes of services that were not discovered would be in between
+              break;
+            }
+            continue;
+          }
+
+          BLERemoteCharacteristic* nextCharacteristic = nextService->characteristic(characteristicIndex);
+          uint16_t nextEndHandle = descriptorsEndHandle(nextService, characteristicIndex);
+
+          // the type of a value is the UUID of its characteristic, a 128-bit one ends the response
+          if (strlen(nextCharacteristic->uuid()) != 4 || (nextEndHandle - startHandle + 1) > maxHandles) {
+            break;
+          }
+
+          if (nextEndHandle > nextCharacteristic->valueHandle()) {
+            endHandle = nextEndHandle;
+          }
+
+          characteristicIndex++;
+        }
+
+        operation->handle = startHandle;
+        operation->endHandle = endHandle;
+
+        return sendFindInfoReq(operation->connectionHandle, startHandle, endHandle, operation->response) ? 1 : -1;
+      }
+
+      default:
+        return -1;
+    }
+  }
+}
+
+bool ATTClass::discoverResp(ATTOperation* operation, int respLength)
+{
+  BLERemoteDevice* device = NULL;
+  int peerIndex = -1;
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == operation->connectionHandle) {
+      device = _peers[i].device;
+      peerIndex = i;
+      break;
+    }
+  }
+
+  if (device == NULL) {
+    return false;
+  }
+
+  uint8_t* responseBuffer = operation->response;
+
+  switch (operation->stage) {
+    case ATT_DISCOVER_MTU:
+      // the MTU was updated by mtuResp, an error keeps the default MTU
+      return true;
+
+    case ATT_DISCOVER_HASH:
+      // handle and value of the Database Hash characteristic, a peer without one is always discovered
+      if (responseBuffer[0] == ATT_OP_READ_BY_TYPE_RESP && responseBuffer[1] == 18 && respLength >= 20) {
+        memcpy(operation->databaseHash, &responseBuffer[4], sizeof(operation->databaseHash));
+        operation->cacheable = true;
+
+        if (restoreGattCache(peerIndex, operation->databaseHash)) {
+          operation->stage = ATT_DISCOVER_CACHED;
+          return true;
+        }
+
+        operation->firstService = device->serviceCount();
+      }
+
+      operation->stage = ATT_DISCOVER_SERVICES;
+      return true;
+
+    case ATT_DISCOVER_SERVICES:
+      if (responseBuffer[0] == ATT_OP_FIND_BY_TYPE_RESP) {
+        // handles of the services with the UUID looked for
+        if (respLength < 5) {
+          return false;
+        }
+
+        for (int i = 1; (i + 4) <= respLength; i += 4) {
+          struct __attribute__ ((packed)) RawHandles {
+            uint16_t startHandle;
+            uint16_t endHandle;
+          } *rawHandles = (RawHandles*)&responseBuffer[i];
+
+          BLERemoteService* service = new BLERemoteService(operation->uuid, operation->uuidLength,
+                                                            rawHandles->startHandle,
+                                                            rawHandles->endHandle);
+
+          if (service == NULL) {
+            return false;
+          }
+
+          device->addService(service);
+
+          // 0x0000 after the last handle
+          operation->handle = rawHandles->endHandle + 1;
+        }
+      } else if (responseBuffer[0] != ATT_OP_READ_BY_GROUP_RESP) {
+        // attribute not found, no more services
+        operation->handle = 0x0000;
+        return true;
+      } else {
+        uint16_t lengthPerService = responseBuffer[1];
+        uint8_t uuidLen = lengthPerService - 4;
+
+        if (uuidLen != 2 && uuidLen != 16) {
+          return false;
+        }
+
+        if (respLength < (2 + lengthPerService)) {
+          // no progress possible
+          return false;
+        }
+
+        for (int i = 2; (i + lengthPerService) <= respLength; i += lengthPerService) {
+          struct __attribute__ ((packed)) RawService {
+            uint16_t startHandle;
+            uint16_t endHandle;
+            uint8_t uuid[16];
+          } *rawService = (RawService*)&responseBuffer[i];
+
+          if (operation->uuidLength == 0 ||
+              (uuidLen == operation->uuidLength && memcmp(rawService->uuid, operation->uuid, uuidLen) == 0)) {
+
+            BLERemoteService* service = new BLERemoteService(rawService->uuid, uuidLen,
+                                                              rawService->startHandle,
+                                                              rawService->endHandle);
+
+            if (service == NULL) {
+              return false;
+            }
+
+            device->addService(service);
+          }
+
+          // 0x0000 after the last handle
+          operation->handle = rawService->endHandle + 1;
+        }
+      }
+      return true;
+
+    case ATT_DISCOVER_CHARACTERISTICS:
+      if (responseBuffer[0] != ATT_OP_READ_BY_TYPE_RESP) {
+        operation->handle = 0x0000;
+        return true;
+      } else {
+        uint16_t lengthPerCharacteristic = responseBuffer[1];
+        uint8_t uuidLen = lengthPerCharacteristic - 5;
+
+        if (uuidLen != 2 && uuidLen != 16) {
+          return false;
+        }
+
+        if (respLength < (2 + lengthPerCharacteristic)) {
+          // no progress possible
+          return false;
+        }
+
+        for (int i = 2; (i + lengthPerCharacteristic) <= respLength; i += lengthPerCharacteristic) {
+          struct __attribute__ ((packed)) RawCharacteristic {
+            uint16_t startHandle;
+            uint8_t properties;
+            uint16_t valueHandle;
+            uint8_t uuid[16];
+          } *rawCharacteristic = (RawCharacteristic*)&responseBuffer[i];
+
+          operation->handle = rawCharacteristic->valueHandle + 1;
+
+          // characteristics come in handle order, so do the services
+          while (operation->serviceIndex < operation->lastService &&
+                 rawCharacteristic->startHandle > device->service(operation->serviceIndex)->endHandle()) {
+            operation->serviceIndex++;
+          }
+
+          if (operation->serviceIndex >= operation->lastService ||
+              rawCharacteristic->startHandle < device->service(operation->serviceIndex)->startHandle()) {
+            // between services that are not discovered
+            continue;
+          }
+
+          BLERemoteCharacteristic* characteristic = new BLERemoteCharacteristic(rawCharacteristic->uuid, uuidLen,
+                                                                                operation->connectionHandle,
+                                                                                rawCharacteristic->startHandle,
+                                                                                rawCharacteristic->properties,
+                                                                                rawCharacteristic->valueHandle);
+
+          if (characteristic == NULL) {
+            return false;
+          }
+
+          device->service(operation->serviceIndex)->addCharacteristic(characteristic);
+          device->invalidateIndex();
+        }
+      }
+      return true;
+
+    case ATT_DISCOVER_DESCRIPTORS:
+      if (responseBuffer[0] != ATT_OP_FIND_INFO_RESP) {
+        // none left in the range, 0x0000 after the last handle
+        operation->handle = operation->endHandle + 1;
+        return true;
+      } else {
+        // format 0x01: 16-bit UUIDs, 0x02: 128-bit UUIDs
+        uint8_t uuidLen = (responseBuffer[1] == 0x02) ? 16 : 2;
+        uint16_t lengthPerDescriptor = 2 + uuidLen;
+        unsigned int serviceIndex = operation->serviceIndex;
+        unsigned int characteristicIndex = operation->characteristicIndex;
+
+        if (respLength < (2 + lengthPerDescriptor)) {
+          // no progress possible
+          return false;
+        }
+
+        for (int i = 2; (i + lengthPerDescriptor) <= respLength; i += lengthPerDescriptor) {
+          struct __attribute__ ((packed)) RawDescriptor {
+            uint16_t handle;
+            uint8_t uuid[16];
+          } *rawDescriptor = (RawDescriptor*)&responseBuffer[i];
+
+          operation->handle = rawDescriptor->handle + 1;
+
+          // the characteristic the handle is after
+          BLERemoteCharacteristic* characteristic = NULL;
+
+          while (serviceIndex < operation->lastService) {
+            BLERemoteService* service = device->service(serviceIndex);
+
+            if (characteristicIndex >= service->characteristicCount()) {
+              serviceIndex++;
+              characteristicIndex = 0;
+              continue;
+            }
+
+            if (rawDescriptor->handle <= descriptorsEndHandle(service, characteristicIndex)) {
+              characteristic = service->characteristic(characteristicIndex);
+              break;
+            }
+
+            characteristicIndex++;
+          }
+
+          if (characteristic == NULL || rawDescriptor->handle <= characteristic->valueHandle()) {
+            // a declaration or a value
+            continue;
+          }
+
+          BLERemoteDescriptor* descriptor = new BLERemoteDescriptor(rawDescriptor->uuid, uuidLen,
+                                                                    operation->connectionHandle,
+                                                                    rawDescriptor->handle);
+
+          if (descriptor == NULL) {
+            return false;
+          }
+
+          characteristic->addDescriptor(descriptor);
+        }
+      }
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+uint16_t ATTClass::descriptorsEndHandle(BLERemoteService* service, unsigned int characteristicIndex) const
+{
+  // descriptors are between the value and the declaration of the next characteristic
+  if ((characteristicIndex + 1) < service->characteristicCount()) {
+    return service->characteristic(characteristicIndex + 1)->startHandle() - 1;
+  }
+
+  return service->endHandle();
+}
+
+void ATTClass::storeGattCache(int peerIndex, const uint8_t databaseHash[16])
+{
+  BLERemoteDevice* device = _peers[peerIndex].device;
+
+  if (!_storeGattCache || device == NULL) {
+    return;
+  }
+
+  int length = 1 + 16 + device->serialize(NULL, 0);
+
+  if (length > ATT_GATT_CACHE_SIZE) {
+    // too many attributes to be cached
+    return;
+  }
+
+  uint8_t* data = (uint8_t*)malloc(length);
+
+  if (data == NULL) {
+    return;
+  }
+
+  data[0] = ATT_GATT_CACHE_VERSION;
+  memcpy(&data[1], databaseHash, 16);
+  device->serialize(&data[17], length - 17);
+
+  uint8_t identity[6];
+  peerIdentity(peerIndex, identity);
+
+  _storeGattCache(identity, data, length);
+
+  free(data);
+}
+
+bool ATTClass::restoreGattCache(int peerIndex, const uint8_t databaseHash[16])
+{
+  BLERemoteDevice* device = _peers[peerIndex].device;
+
+  if (!_getGattCache || device == NULL) {
+    return false;
+  }
+
+  uint8_t* data = (uint8_t*)malloc(ATT_GATT_CACHE_SIZE);
+
+  if (data == NULL) {
+    return false;
+  }
+
+  uint8_t identity[6];
+  peerIdentity(peerIndex, identity);
+
+  int length = _getGattCache(identity, data, ATT_GATT_CACHE_SIZE);
+
+  // the cached attributes are only used while the database of the peer has the same hash
+  bool restored = length > 17 && length <= ATT_GATT_CACHE_SIZE &&
+                  data[0] == ATT_GATT_CACHE_VERSION && memcmp(&data[1], databaseHash, 16) == 0 &&
+                  device->deserialize(_peers[peerIndex].connectionHandle, &data[17], length - 17);
+
+  free(data);
+
+  return restored;
+}
+
+int ATTClass::sendReq(uint16_t connectionHandle, void* requestBuffer, int requestLength, uint8_t responseBuffer[])
+{
+  if (responseBuffer == NULL) {
+    // not waiting response
+    HCI.sendAclPkt(connectionHandle, ATT_CID, requestLength, requestBuffer);
+    return 0;
+  }
+
+  if (!sendReqAsync(connectionHandle, requestBuffer, requestLength, responseBuffer)) {
+    return 0;
+  }
+
+  while (reqPending(connectionHandle)) {
+  }
+
+  return reqResult(connectionHandle);
+}
+
+int ATTClass::sendReqAsync(uint16_t connectionHandle, void* requestBuffer, int requestLength, uint8_t responseBuffer[], uint8_t value[], uint16_t valueSize)
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle != connectionHandle) {
+      continue;
+    }
+
+    if (_peers[i].pendingResp.op != 0x00 &&
+        (_peers[i].pendingResp.length != 0 || (millis() - _peers[i].pendingResp.start) < _timeout)) {
+      // only one request can be outstanding on a bearer, and a response is kept until its result is read
+      return 0;
+    }
 
-  _longWriteHandle = 0x0000;
-  _longWriteValueLength = 0;
+    _peers[i].pendingResp.op = ((uint8_t*)requestBuffer)[0] + 1;
+    _peers[i].pendingResp.buffer = responseBuffer;
+    _peers[i].pendingResp.length = 0;
+    _peers[i].pendingResp.value = value;
+    _peers[i].pendingResp.valueSize = valueSize;
+    _peers[i].pendingResp.start = millis();
 
-  uint8_t response[mtu];
-  uint16_t responseLength;
+    HCI.sendAclPkt(connectionHandle, ATT_CID, requestLength, requestBuffer);
 
-  response[0] = ATT_OP_EXEC_WRITE_RESP;
-  responseLength = 1;
+    return 1;
+  }
 
-  HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
+  return 0;
 }
 
-void ATTClass::handleNotifyOrInd(uint16_t connectionHandle, uint8_t opcode, uint8_t dlen, uint8_t data[])
+bool ATTClass::reqPending(uint16_t connectionHandle)
 {
-  if (dlen < 2) {
-    return; // drop
-  }
+  HCI.poll();
 
-  struct __attribute__ ((packed)) HandleNotifyOrInd {
-    uint16_t handle;
-  } *handleNotifyOrInd = (HandleNotifyOrInd*)data;
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle != connectionHandle) {
+      continue;
+    }
 
-  uint16_t handle = handleNotifyOrInd->handle;
+    if (_peers[i].pendingResp.op == 0x00 || _peers[i].pendingResp.length != 0) {
+      return false;
+    }
 
-  for (int peer = 0; peer < ATT_MAX_PEERS; peer++) {
-    if (_peers[peer].connectionHandle != connectionHandle) {
-      continue;
+    if ((millis() - _peers[i].pendingResp.start) >= _timeout) {
+      // give up on this transaction, a late response is dropped
+      _peers[i].pendingResp.op = 0x00;
+      return false;
     }
 
-    BLERemoteDevice* device = _peers[peer].device;
+    return true;
+  }
 
-    if (!device) {
-      break;
+  return false;
+}
+
+int ATTClass::reqResult(uint16_t connectionHandle)
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle != connectionHandle) {
+      continue;
     }
 
-    int serviceCount = device->serviceCount();
+    if (_peers[i].pendingResp.op == 0x00 || _peers[i].pendingResp.length == 0) {
+      // timed out, or still waiting for the response
+      return 0;
+    }
 
-    for (int i = 0; i < serviceCount; i++) {
-      BLERemoteService* s = device->service(i);
+    _peers[i].pendingResp.op = 0x00;
 
-      if (s->startHandle() < handle && s->endHandle() >= handle) {
-        int characteristicCount = s->characteristicCount();
+    return _peers[i].pendingResp.length;
+  }
 
-        for (int j = 0; j < characteristicCount; j++) {
-          BLERemoteCharacteristic* c = s->characteristic(j);
+  return 0;
+}
 
-          if (c->valueHandle() == handle) {
-            c->writeValue(BLEDevice(_peers[peer].addressType, _peers[peer].address), &data[2], dlen - 2);
-          }
-        }
+void ATTClass::handleResp(uint16_t connectionHandle, uint8_t op, uint16_t dlen, uint8_t data[])
+{
+  // an error response completes the request it refers to
+  uint8_t respOp = (op == ATT_OP_ERROR) ? (data[0] + 1) : op;
 
-        break;
-      }
-    }
+  if ((dlen + 1) > ATT_MAX_MTU) {
+    return;
   }
 
-  if (opcode == ATT_OP_HANDLE_IND) {
-    // send CNF for IND
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle != connectionHandle) {
+      continue;
+    }
 
-    uint8_t cnf = ATT_OP_HANDLE_CNF;
+    if (_peers[i].pendingResp.op == respOp && _peers[i].pendingResp.length == 0) {
+      _peers[i].pendingResp.buffer[0] = op;
 
-    HCI.sendAclPkt(connectionHandle, ATT_CID, sizeof(cnf), &cnf);
+      if (_peers[i].pendingResp.value != NULL && op != ATT_OP_ERROR) {
+        memcpy(_peers[i].pendingResp.value, data, min(dlen, _peers[i].pendingResp.valueSize));
+      } else {
+        memcpy(&_peers[i].pendingResp.buffer[1], data, dlen);
+      }
+      _peers[i].pendingResp.length = dlen + 1;
+    }
+    break;
   }
 }
 
-void ATTClass::handleCnf(uint16_t /*connectionHandle*/, uint8_t /*dlen*/, uint8_t /*data*/[])
+void ATTClass::setEventHandler(BLEDeviceEvent event, BLEDeviceEventHandler eventHandler)
 {
-  _cnf = true;
+  if (event < (sizeof(_eventHandlers) / (sizeof(_eventHandlers[0])))) {
+    _eventHandlers[event] = eventHandler;
+  }
 }
 
-void ATTClass::sendError(uint16_t connectionHandle, uint8_t opcode, uint16_t handle, uint8_t code)
+int ATTClass::readReq(uint16_t connectionHandle, uint16_t handle, uint8_t responseBuffer[])
 {
   struct __attribute__ ((packed)) {
     uint8_t op;
-    uint8_t opcode;
     uint16_t handle;
-    uint8_t code;
-  } attError = { ATT_OP_ERROR, opcode, handle, code };
+  } readReq = { ATT_OP_READ_REQ, handle };
 
-  HCI.sendAclPkt(connectionHandle, ATT_CID, sizeof(attError), &attError);
+  return sendReq(connectionHandle, &readReq, sizeof(readReq), responseBuffer);
 }
 
-
-bool ATTClass::exchangeMtu(uint16_t connectionHandle)
+int ATTClass::readMultipleReq(uint16_t connectionHandle, uint8_t opcode, const uint16_t handles[], int count, uint8_t responseBuffer[])
 {
-  uint8_t responseBuffer[_maxMtu];
+  int length = 1 + count * sizeof(uint16_t);
 
-  if (!mtuReq(connectionHandle, _maxMtu, responseBuffer)) {
-    return false;
+  if (length > ATT_MAX_MTU) {
+    return 0;
   }
 
-  return true;
+  _pdu[0] = opcode;
+  memmove(&_pdu[1], handles, count * sizeof(uint16_t));
+
+  return sendReq(connectionHandle, _pdu, length, responseBuffer);
 }
 
-bool ATTClass::discoverServices(uint16_t connectionHandle, BLERemoteDevice* device, const char* serviceUuidFilter)
+bool ATTClass::readMultiple(uint16_t connectionHandle, BLERemoteCharacteristic* characteristics[], int count)
 {
-  uint16_t reqStartHandle = 0x0001;
-  uint16_t reqEndHandle = 0xffff;
-
-  uint8_t responseBuffer[_maxMtu];
-
-  BLEUuid serviceUuid(serviceUuidFilter);
-
-  while (reqEndHandle == 0xffff) {
-    int respLength = readByGroupReq(connectionHandle, reqStartHandle, reqEndHandle, BLETypeService, responseBuffer);
+  int peerIndex = -1;
 
-    if (respLength == 0) {
-      return false;
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == connectionHandle) {
+      peerIndex = i;
+      break;
     }
+  }
 
-    if (responseBuffer[0] == ATT_OP_READ_BY_GROUP_RESP) {
-      uint16_t lengthPerService = responseBuffer[1];
-      uint8_t uuidLen = lengthPerService - 4;
-
-      for (int i = 2; i < respLength; i += lengthPerService) {
-        struct __attribute__ ((packed)) RawService {
-          uint16_t startHandle;
-          uint16_t endHandle;
-          uint8_t uuid[16];
-        } *rawService = (RawService*)&responseBuffer[i];
-
-        if (serviceUuidFilter == NULL || 
-            (uuidLen == serviceUuid.length() && memcmp(rawService->uuid, serviceUuid.data(), uuidLen) == 0)) {
-        
-          BLERemoteService* service = new BLERemoteService(rawService->uuid, uuidLen,
-                                                            rawService->startHandle,
-                                                            rawService->endHandle);
+  if (peerIndex == -1) {
+    return false;
+  }
 
-          if (service == NULL) {
-            return false;
-          }
+  uint8_t* responseBuffer = (uint8_t*)malloc(ATT_MAX_MTU);
 
-          device->addService(service);
+  if (responseBuffer == NULL) {
+    return false;
+  }
 
-        }
+  bool success = true;
+  int index = 0;
 
-        reqStartHandle = rawService->endHandle + 1;
+  while (index < count) {
+    // as many handles as fit in a request
+    int batch = min(count - index, (_peers[peerIndex].mtu - 1) / (int)sizeof(uint16_t));
 
-        if (reqStartHandle == 0x0000) {
-          reqEndHandle = 0x0000;
-        }
-      }
-    } else {
-      reqEndHandle = 0x0000;
+    if (batch < 2 || !_peers[peerIndex].readMultipleVariable) {
+      // a single value, or a peer that doesn't support Read Multiple Variable Length
+      success &= characteristics[index]->read();
+      index++;
+      continue;
     }
-  }
-
-  return true;
-}
 
-bool ATTClass::discoverCharacteristics(uint16_t connectionHandle, BLERemoteDevice* device)
-{
-  uint16_t reqStartHandle = 0x0001;
-  uint16_t reqEndHandle = 0xffff;
+    // the handles are put where the request is built
+    uint16_t* handles = (uint16_t*)&_pdu[1];
 
-  uint8_t responseBuffer[_maxMtu];
+    for (int i = 0; i < batch; i++) {
+      uint16_t handle = characteristics[index + i]->valueHandle();
 
-  int serviceCount = device->serviceCount();
-  
-  for (int i = 0; i < serviceCount; i++) {
-    BLERemoteService* service = device->service(i);
+      memcpy(&handles[i], &handle, sizeof(handle));
+    }
 
-    reqStartHandle = service->startHandle();
-    reqEndHandle = service->endHandle();
+    int respLength = readMultipleReq(connectionHandle, ATT_OP_READ_MULTI_VAR_REQ, handles, batch, responseBuffer);
 
-    while (1) {
-      int respLength = readByTypeReq(connectionHandle, reqStartHandle, reqEndHandle, BLETypeCharacteristic, responseBuffer);
+    if (respLength == 0) {
+      success = false;
+      break;
+    }
 
-      if (respLength == 0) {
-        return false;
+    if (responseBuffer[0] == ATT_OP_ERROR) {
+      if (respLength == 5 && responseBuffer[4] == ATT_ECODE_REQ_NOT_SUPP) {
+        _peers[peerIndex].readMultipleVariable = false;
+        continue;
       }
 
-      if (responseBuffer[0] == ATT_OP_READ_BY_TYPE_RESP) {
-        uint16_t lengthPerCharacteristic = responseBuffer[1];
-        uint8_t uuidLen = lengthPerCharacteristic - 5;
-
-        for (int i = 2; i < respLength; i += lengthPerCharacteristic) {
-          struct __attribute__ ((packed)) RawCharacteristic {
-            uint16_t startHandle;
-            uint8_t properties;
-            uint16_t valueHandle;
-            uint8_t uuid[16];
-          } *rawCharacteristic = (RawCharacteristic*)&responseBuffer[i];
+      // one of the values can't be read, read them one by one to find out which
+      for (int i = 0; i < batch; i++) {
+        success &= characteristics[index + i]->read();
+      }
 
-          BLERemoteCharacteristic* characteristic = new BLERemoteCharacteristic(rawCharacteristic->uuid, uuidLen,
-                                                                                connectionHandle,
-                                                                                rawCharacteristic->startHandle,
-                                                                                rawCharacteristic->properties,
-                                                                                rawCharacteristic->valueHandle);
+      index += batch;
+      continue;
+    }
 
-          if (characteristic == NULL) {
-            return false;
-          }
+    // length value tuples, the response may end with a truncated value
+    int offset = 1;
+    int values = 0;
 
-          service->addCharacteristic(characteristic);
+    while (values < batch && (offset + (int)sizeof(uint16_t)) <= respLength) {
+      uint16_t length;
+      memcpy(&length, &responseBuffer[offset], sizeof(length));
+      offset += sizeof(length);
 
-          reqStartHandle = rawCharacteristic->valueHandle + 1;
-        }
-      } else {
+      if ((offset + length) > respLength) {
         break;
       }
-    }
-  }
 
-  return true;
-}
-
-bool ATTClass::discoverDescriptors(uint16_t connectionHandle, BLERemoteDevice* device)
-{
-  uint16_t reqStartHandle = 0x0001;
-  uint16_t reqEndHandle = 0xffff;
-
-  uint8_t responseBuffer[_maxMtu];
+      success &= characteristics[index + values]->setValue(&responseBuffer[offset], length);
+      offset += length;
+      values++;
+    }
 
-  int serviceCount = device->serviceCount();  
+    if (values == 0) {
+      // the first value doesn't fit in a response
+      success &= characteristics[index]->read();
+      values = 1;
+    }
 
-  for (int i = 0; i < serviceCount; i++) {
-    BLERemoteService* service = device->service(i);
+    index += values;
+  }
 
-    uint16_t serviceEndHandle = service->endHandle();
+  free(responseBuffer);
 
-    int characteristicCount = service->characteristicCount();
+  return success;
+}
 
-    for (int j = 0; j < characteristicCount; j++) {
-      BLERemoteCharacteristic* characteristic = service->characteristic(j);
-      BLERemoteCharacteristic* nextCharacteristic = (j == (characteristicCount - 1)) ? NULL : service->characteristic(j + 1);
+int ATTClass::writeReq(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint16_t dataLen, uint8_t responseBuffer[])
+{
+  if (dataLen > (ATT_MAX_MTU - 3)) {
+    return 0;
+  }
 
-      reqStartHandle = characteristic->valueHandle() + 1;
-      reqEndHandle = nextCharacteristic ? nextCharacteristic->valueHandle() : serviceEndHandle;
+  _pdu[0] = ATT_OP_WRITE_REQ;
+  memcpy(&_pdu[1], &handle, sizeof(handle));
+  memcpy(&_pdu[3], data, dataLen);
 
-      if (reqStartHandle > reqEndHandle) {
-        continue;
-      }
+  return sendReq(connectionHandle, _pdu, 3 + dataLen, responseBuffer);
+}
 
-      while (1) {
-        int respLength = findInfoReq(connectionHandle, reqStartHandle, reqEndHandle, responseBuffer);
+int ATTClass::readBlobReq(uint16_t connectionHandle, uint16_t handle, uint16_t offset, uint8_t value[], uint16_t size)
+{
+  struct __attribute__ ((packed)) {
+    uint8_t op;
+    uint16_t handle;
+    uint16_t offset;
+  } readBlobReq = { (uint8_t)(offset ? ATT_OP_READ_BLOB_REQ : ATT_OP_READ_REQ), handle, offset };
 
-        if (respLength == 0) {
-          return false;
-        }
+  uint8_t responseBuffer[5];
 
-        if (responseBuffer[0] == ATT_OP_FIND_INFO_RESP) {
-          uint16_t lengthPerDescriptor = responseBuffer[1] * 4;
-          uint8_t uuidLen = 2;
+  // the first part is read with a Read Request, the offset is left out
+  if (!sendReqAsync(connectionHandle, &readBlobReq, offset ? sizeof(readBlobReq) : 3, responseBuffer, value, size)) {
+    return -1;
+  }
 
-          for (int i = 2; i < respLength; i += lengthPerDescriptor) {
-            struct __attribute__ ((packed)) RawDescriptor {
-              uint16_t handle;
-              uint8_t uuid[16];
-            } *rawDescriptor = (RawDescriptor*)&responseBuffer[i];
+  while (reqPending(connectionHandle)) {
+  }
 
-            BLERemoteDescriptor* descriptor = new BLERemoteDescriptor(rawDescriptor->uuid, uuidLen,
-                                                                      connectionHandle,
-                                                                      rawDescriptor->handle);
+  int respLength = reqResult(connectionHandle);
 
-            if (descriptor == NULL) {
-              return false;
-            }
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == connectionHandle) {
+      _peers[i].pendingResp.value = NULL;
+      break;
+    }
+  }
 
-            characteristic->addDescriptor(descriptor);
+  if (respLength == 0) {
+    return -1;
+  }
 
-            reqStartHandle = rawDescriptor->handle + 1;
-          }
-        } else {
-          break;
-        }
-      }
+  if (responseBuffer[0] == ATT_OP_ERROR) {
+    if (respLength == 5 && offset > 0 &&
+        (responseBuffer[4] == ATT_ECODE_ATTR_NOT_LONG || responseBuffer[4] == ATT_ECODE_INVALID_OFFSET)) {
+      // the value ended with the previous part
+      return 0;
     }
+
+    return -1;
   }
 
-  return true;
+  return min(respLength - 1, (int)size);
 }
 
-int ATTClass::sendReq(uint16_t connectionHandle, void* requestBuffer, int requestLength, uint8_t responseBuffer[])
+int ATTClass::readReqAsync(uint16_t connectionHandle, uint16_t handle, uint8_t responseBuffer[])
 {
-  _pendingResp.connectionHandle = connectionHandle;
-  _pendingResp.op = ((uint8_t*)requestBuffer)[0] + 1;
-  _pendingResp.buffer = responseBuffer;
-  _pendingResp.length = 0;
+  struct __attribute__ ((packed)) {
+    uint8_t op;
+    uint16_t handle;
+  } readReq = { ATT_OP_READ_REQ, handle };
 
-  HCI.sendAclPkt(connectionHandle, ATT_CID, requestLength, requestBuffer);
+  return sendReqAsync(connectionHandle, &readReq, sizeof(readReq), responseBuffer);
+}
 
-  if (responseBuffer == NULL) {
-    // not waiting response
+int ATTClass::writeReqAsync(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint16_t dataLen, uint8_t responseBuffer[])
+{
+  if (dataLen > (ATT_MAX_MTU - 3)) {
     return 0;
-  } 
-
-  for (unsigned long start = millis(); (millis() - start) < _timeout;) {
-    HCI.poll();
-
-    if (!connected(connectionHandle)) {
-      break;
-    }
-
-    if (_pendingResp.length != 0) {
-      _pendingResp.connectionHandle = 0xffff;
-      return _pendingResp.length;
-    }
   }
 
-  _pendingResp.connectionHandle = 0xffff;
-  return 0;
-}
+  _pdu[0] = ATT_OP_WRITE_REQ;
+  memcpy(&_pdu[1], &handle, sizeof(handle));
+  memcpy(&_pdu[3], data, dataLen);
 
-void ATTClass::setEventHandler(BLEDeviceEvent event, BLEDeviceEventHandler eventHandler)
-{
-  if (event < (sizeof(_eventHandlers) / (sizeof(_eventHandlers[0])))) {
-    _eventHandlers[event] = eventHandler;
-  }
+  return sendReqAsync(connectionHandle, _pdu, 3 + dataLen, responseBuffer);
 }
 
-int ATTClass::readReq(uint16_t connectionHandle, uint16_t handle, uint8_t responseBuffer[])
+int ATTClass::readBlobReqAsync(uint16_t connectionHandle, uint16_t handle, uint16_t offset, uint8_t responseBuffer[])
 {
   struct __attribute__ ((packed)) {
     uint8_t op;
     uint16_t handle;
-  } readReq = { ATT_OP_READ_REQ, handle };
+    uint16_t offset;
+  } readBlobReq = { ATT_OP_READ_BLOB_REQ, handle, offset };
 
-  return sendReq(connectionHandle, &readReq, sizeof(readReq), responseBuffer);
+  return sendReqAsync(connectionHandle, &readBlobReq, sizeof(readBlobReq), responseBuffer);
 }
 
-int ATTClass::writeReq(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint8_t dataLen, uint8_t responseBuffer[])
+int ATTClass::prepWriteReqAsync(uint16_t connectionHandle, uint16_t handle, uint16_t offset, const uint8_t* data, uint16_t dataLen, uint8_t responseBuffer[])
 {
-  struct __attribute__ ((packed)) {
-    uint8_t op;
-    uint16_t handle;
-    uint8_t data[255];
-  } writeReq;
+  if (dataLen > (ATT_MAX_MTU - 5)) {
+    return 0;
+  }
 
-  writeReq.op = ATT_OP_WRITE_REQ;
-  writeReq.handle = handle;
-  memcpy(writeReq.data, data, dataLen);
+  _pdu[0] = ATT_OP_PREP_WRITE_REQ;
+  memcpy(&_pdu[1], &handle, sizeof(handle));
+  memcpy(&_pdu[3], &offset, sizeof(offset));
+  memcpy(&_pdu[5], data, dataLen);
 
-  return sendReq(connectionHandle, &writeReq, 3 + dataLen, responseBuffer);
+  return sendReqAsync(connectionHandle, _pdu, 5 + dataLen, responseBuffer);
 }
 
-void ATTClass::writeCmd(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint8_t dataLen)
+int ATTClass::execWriteReqAsync(uint16_t connectionHandle, uint8_t flags, uint8_t responseBuffer[])
 {
   struct __attribute__ ((packed)) {
     uint8_t op;
-    uint16_t handle;
-    uint8_t data[255];
-  } writeReq;
+    uint8_t flags;
+  } execWriteReq = { ATT_OP_EXEC_WRITE_REQ, flags };
+
+  return sendReqAsync(connectionHandle, &execWriteReq, sizeof(execWriteReq), responseBuffer);
+}
+
+void ATTClass::writeCmd(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint16_t dataLen)
+{
+  if (dataLen > (ATT_MAX_MTU - 3)) {
+    return;
+  }
 
-  writeReq.op = ATT_OP_WRITE_CMD;
-  writeReq.handle = handle;
-  memcpy(writeReq.data, data, dataLen);
+  _pdu[0] = ATT_OP_WRITE_CMD;
+  memcpy(&_pdu[1], &handle, sizeof(handle));
+  memcpy(&_pdu[3], data, dataLen);
 
-  sendReq(connectionHandle, &writeReq, 3 + dataLen, NULL);
+  sendReq(connectionHandle, _pdu, 3 + dataLen, NULL);
 }
 
 // Set encryption state for a peer
@@ -1931,6 +4021,79 @@ int ATTClass::getPeerAddrWithType(uint16_t connectionHandle, uint8_t peerAddr[])
   }
   return 0;
 }
+void ATTClass::deviceIdentity(const BLEDevice& device, uint8_t identity[6]) const
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle != 0xffff && _peers[i].addressType == device._addressType &&
+        memcmp(_peers[i].address, device._address, sizeof(_peers[i].address)) == 0) {
+      peerIdentity(i, identity);
+      return;
+    }
+  }
+
+  // not connected, in the same byte order as the address of a peer
+  for (int k = 0; k < 6; k++) {
+    identity[5 - k] = device._address[k];
+  }
+}
+
+// The resolved address of a peer, or its address, as used to look up its LTK
+void ATTClass::peerIdentity(int peerIndex, uint8_t identity[6]) const
+{
+  for (int k = 0; k < 6; k++) {
+    if (_peers[peerIndex].resolvedAddress[k] != 0) {
+      memcpy(identity, _peers[peerIndex].resolvedAddress, 6);
+      return;
+    }
+  }
+
+  for (int k = 0; k < 6; k++) {
+    identity[5 - k] = _peers[peerIndex].address[k];
+  }
+}
+
+void ATTClass::releaseCccdValues(int peerIndex)
+{
+  BLEDevice bleDevice(_peers[peerIndex].addressType, _peers[peerIndex].address);
+  uint8_t identity[6];
+  uint8_t ltk[16];
+
+  peerIdentity(peerIndex, identity);
+
+  // the CCCD values of bonded peers are kept for when they reconnect
+  bool bonded = HCI.getLTK(identity, ltk);
+
+  for (uint16_t handle = 1; handle <= GATT.attributeCount(); handle++) {
+    const GATTAttributeEntry* entry = GATT.attributeEntry(handle);
+
+    if (entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC) {
+      BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)entry->attribute;
+
+      if (bonded) {
+        characteristic->setCccdActive(bleDevice, identity, false);
+      } else {
+        characteristic->writeCccdValue(bleDevice, identity, 0x0000);
+      }
+    }
+  }
+}
+
+void ATTClass::restoreCccdValues(int peerIndex)
+{
+  BLEDevice bleDevice(_peers[peerIndex].addressType, _peers[peerIndex].address);
+  uint8_t identity[6];
+
+  peerIdentity(peerIndex, identity);
+
+  for (uint16_t handle = 1; handle <= GATT.attributeCount(); handle++) {
+    const GATTAttributeEntry* entry = GATT.attributeEntry(handle);
+
+    if (entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC) {
+      ((BLELocalCharacteristic*)entry->attribute)->setCccdActive(bleDevice, identity, true);
+    }
+  }
+}
+
 // Get the resolved address for a peer if it exists
 int ATTClass::getPeerResolvedAddress(uint16_t connectionHandle, uint8_t resolvedAddress[]){
   for(int i=0; i<ATT_MAX_PEERS; i++)
@@ -25,6 +25,8 @@
 #include "BLEDevice.h"
 #include "keyDistribution.h"
 
+#include "utility/BLELinkedList.h"
+
 #define ATT_CID       0x0004
 #define BLE_CTL       0x0008
 
@@ -36,6 +38,42 @@
 #define ATT_MAX_PEERS 8
 #endif
 
+#ifndef ATT_MAX_MTU
+#ifdef __AVR__
+#define ATT_MAX_MTU 23
+#else
+#define ATT_MAX_MTU 517 // 512 bytes attribute value + ATT header
+#endif
+#endif
+
+// indications waiting for confirmation per connection, further values are dropped for the peer
+#ifndef ATT_MAX_QUEUED_INDICATIONS
+#define ATT_MAX_QUEUED_INDICATIONS 8
+#endif
+
+// the ATT transaction timeout of an indication, the peer is disconnected when it doesn't confirm in time
+#ifndef ATT_INDICATION_TIMEOUT
+#define ATT_INDICATION_TIMEOUT 30000
+#endif
+
+// number of serialised discovery responses kept by the server
+#ifndef ATT_DISCOVERY_CACHE_SIZE
+#ifdef __AVR__
+#define ATT_DISCOVERY_CACHE_SIZE 2
+#else
+#define ATT_DISCOVERY_CACHE_SIZE 16
+#endif
+#endif
+
+// largest image of the attributes of a peer handed to the GATT cache callbacks
+#ifndef ATT_GATT_CACHE_SIZE
+#ifdef __AVR__
+#define ATT_GATT_CACHE_SIZE 128
+#else
+#define ATT_GATT_CACHE_SIZE 1024
+#endif
+#endif
+
 enum PEER_ENCRYPTION {
   NO_ENCRYPTION         = 0,
   PAIRING_REQUEST       = 1 << 0,
@@ -47,7 +85,66 @@ enum PEER_ENCRYPTION {
   ENCRYPTED_AES         = 1 << 7
 };
 
+class BLELocalCharacteristic;
 class BLERemoteDevice;
+class BLERemoteCharacteristic;
+class BLERemoteService;
+
+enum ATTOperationType {
+  ATT_OPERATION_READ      = 0,
+  ATT_OPERATION_WRITE     = 1,
+  ATT_OPERATION_WRITE_CMD = 2,
+  ATT_OPERATION_DISCOVER  = 3
+};
+
+// client operation queued on a connection, run when the operations before it completed
+struct ATTOperation {
+  uint16_t connectionHandle;
+  uint8_t type;
+  bool started;
+
+  // attribute to read or write, or the handle range discovery continues from
+  uint16_t handle;
+  uint16_t endHandle;
+
+  // discovery progress: stage, service and characteristic being discovered
+  uint8_t stage;
+  // what the discovery covers, and the services found by it: firstService up to lastService
+  uint8_t scope;
+  uint16_t firstService;
+  uint16_t lastService;
+  uint16_t serviceIndex;
+  uint16_t characteristicIndex;
+  uint8_t uuid[16];
+  uint8_t uuidLength;
+  // Database Hash of the peer, when it has one the attributes can be cached
+  uint8_t databaseHash[16];
+  bool cacheable;
+
+  uint8_t* value;
+  uint16_t valueLength;
+  uint8_t* response;
+  // read: bytes received so far, up to bufferSize, into buffer or else into value
+  // long write: bytes of value prepared so far
+  uint16_t offset;
+  uint8_t* buffer;
+  uint16_t bufferSize;
+
+  BLERemoteCharacteristic* characteristic;
+  BLECharacteristicCompletionHandler characteristicHandler;
+  BLEDeviceCompletionHandler deviceHandler;
+  // a waited operation is kept once completed, until its waiter read the outcome and deleted it
+  bool waited;
+  bool completed;
+  bool succeeded;
+};
+
+// value notified or indicated to a peer, waiting to be sent or confirmed
+struct ATTHandleValue {
+  uint16_t handle;
+  uint16_t length;
+  uint8_t* value;
+};
 
 class ATTClass {
 public:
@@ -66,10 +163,13 @@ public:
                     uint16_t latency, uint16_t supervisionTimeout,
                     uint8_t masterClockAccuracy);
 
-  virtual void handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
+  virtual void handleData(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
 
   virtual void removeConnection(uint16_t handle, uint8_t reason);
 
+  virtual void updatePhy(uint16_t handle, uint8_t status, uint8_t txPhy, uint8_t rxPhy);
+  virtual void updateDataLength(uint16_t handle, uint16_t maxTxOctets, uint16_t maxRxOctets);
+
   virtual uint16_t connectionHandle(uint8_t addressType, const uint8_t address[6]) const;
   virtual BLERemoteDevice* device(uint8_t addressType, const uint8_t address[6]) const;
   virtual bool connected() const;
@@ -78,19 +178,54 @@ public:
   virtual bool paired() const;
   virtual bool paired(uint16_t handle) const;
   virtual uint16_t mtu(uint16_t handle) const;
+  virtual uint8_t txPhy(uint16_t handle) const;
+  virtual uint8_t rxPhy(uint16_t handle) const;
+  virtual uint16_t txDataLength(uint16_t handle) const;
+  virtual uint16_t rxDataLength(uint16_t handle) const;
 
   virtual bool disconnect();
 
   virtual BLEDevice central();
 
   virtual int handleNotify(uint16_t handle, const uint8_t* value, int length);
+  virtual void sendPendingNotifications();
+  // notifications between begin and end are packed into Multiple Handle Value Notifications
+  virtual void beginNotificationBatch();
+  virtual void endNotificationBatch();
+  // queued per connection, the characteristic gets a BLEIndicationConfirmed event for each peer
   virtual int handleInd(uint16_t handle, const uint8_t* value, int length);
+  virtual bool indicationsPending(uint16_t connectionHandle) const;
+  virtual void expireIndications();
 
   virtual void setEventHandler(BLEDeviceEvent event, BLEDeviceEventHandler eventHandler);
 
   virtual int readReq(uint16_t connectionHandle, uint16_t handle, uint8_t responseBuffer[]);
-  virtual int writeReq(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint8_t dataLen, uint8_t responseBuffer[]);
-  virtual void writeCmd(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint8_t dataLen);
+  virtual int writeReq(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint16_t dataLen, uint8_t responseBuffer[]);
+  virtual void writeCmd(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint16_t dataLen);
+  virtual bool readMultiple(uint16_t connectionHandle, BLERemoteCharacteristic* characteristics[], int count);
+  // long values: the part read at offset is received straight into value, returns its length, 0 past the end or -1
+  virtual int readBlobReq(uint16_t connectionHandle, uint16_t handle, uint16_t offset, uint8_t value[], uint16_t size);
+
+  // one request can be outstanding per connection, requests on different connections run in parallel
+  // the value of a read response can be received straight into value, set before the request goes out
+  virtual int sendReqAsync(uint16_t connectionHandle, void* requestBuffer, int requestLength, uint8_t responseBuffer[], uint8_t value[] = NULL, uint16_t valueSize = 0);
+  virtual int readReqAsync(uint16_t connectionHandle, uint16_t handle, uint8_t responseBuffer[]);
+  virtual int writeReqAsync(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint16_t dataLen, uint8_t responseBuffer[]);
+  virtual bool reqPending(uint16_t connectionHandle);
+  virtual int reqResult(uint16_t connectionHandle);
+
+  virtual bool readAsync(BLERemoteCharacteristic* characteristic, BLECharacteristicCompletionHandler handler);
+  virtual bool writeAsync(BLERemoteCharacteristic* characteristic, uint16_t handle, const uint8_t* data, uint16_t dataLen, bool withResponse, BLECharacteristicCompletionHandler handler);
+  // queued behind the pending operations of the connection and waited for, characteristic can be NULL
+  // read returns the length read into buffer, or kept by the characteristic when buffer is NULL, -1 on error
+  virtual int readValue(uint16_t connectionHandle, uint16_t handle, BLERemoteCharacteristic* characteristic, uint8_t buffer[], uint16_t size);
+  virtual bool writeValue(uint16_t connectionHandle, uint16_t handle, BLERemoteCharacteristic* characteristic, const uint8_t* data, uint16_t dataLen, bool withResponse);
+  virtual bool discoverAttributesAsync(uint8_t peerBdaddrType, uint8_t peerBdaddr[6], const char* serviceUuidFilter, BLEDeviceCompletionHandler handler);
+  // with lazy discovery enabled, discovers the services, then the characteristics of a service once it's looked for
+  virtual void setLazyDiscovery(bool lazyDiscovery);
+  virtual bool discoverLazily(uint8_t peerBdaddrType, const uint8_t peerBdaddr[6], const char* serviceUuid, const char* characteristicUuid);
+  virtual bool operationsPending(uint16_t connectionHandle) const;
+  virtual void runOperations();
   virtual int setPeerEncryption(uint16_t connectionHandle, uint8_t encryption);
   uint8_t getPeerEncryption(uint16_t connectionHandle);
   uint16_t getPeerEncrptingConnectionHandle();
@@ -99,47 +234,101 @@ public:
   virtual int setPeerIOCap(uint16_t connectionHandle, uint8_t IOCap[]);
   virtual int getPeerIOCap(uint16_t connectionHandle, uint8_t IOCap[]);
   virtual int getPeerResolvedAddress(uint16_t connectionHandle, uint8_t* resolvedAddress);
-  uint8_t holdBuffer[64];
-  uint8_t writeBuffer[64];
-  uint8_t holdBufferSize;
-  uint8_t writeBufferSize;
+  // address CCCD values of a device are kept by: its resolved address, or its address
+  virtual void deviceIdentity(const BLEDevice& device, uint8_t identity[6]) const;
+  uint8_t holdBuffer[ATT_MAX_MTU];
+  uint8_t writeBuffer[ATT_MAX_MTU + 8];
+  uint16_t holdBufferSize;
+  uint16_t writeBufferSize;
   virtual int processWriteBuffer();
   KeyDistribution remoteKeyDistribution;
   KeyDistribution localKeyDistribution;
   uint8_t peerIRK[16];
+  // attributes discovered on peers, kept by identity address and Database Hash
+  int (*_storeGattCache)(uint8_t* address, uint8_t* data, int length) = 0;
+  int (*_getGattCache)(uint8_t* address, uint8_t* data, int size) = 0;
   /// This is just a random number... Not sure it has use unless privacy mode is active.
   uint8_t localIRK[16] = {0x54,0x83,0x63,0x7c,0xc5,0x1e,0xf7,0xec,0x32,0xdd,0xad,0x51,0x89,0x4b,0x9e,0x07};
 private:
-  virtual void error(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual void mtuReq(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual int mtuReq(uint16_t connectionHandle, uint16_t mtu, uint8_t responseBuffer[]);
-  virtual void mtuResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual void findInfoReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[]);
-  virtual int findInfoReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint8_t responseBuffer[]);
-  virtual void findInfoResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual void findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[]);
-  virtual void readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[]);
+  virtual void error(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void mtuReq(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual int sendMtuReq(uint16_t connectionHandle, uint16_t mtu, uint8_t responseBuffer[]);
+  virtual void mtuResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void findInfoReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[]);
+  virtual uint16_t findInfoPdu(uint16_t startHandle, uint16_t endHandle, uint16_t mtu, uint8_t response[]);
+  virtual int sendFindInfoReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint8_t responseBuffer[]);
+  virtual void findInfoResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[]);
+  virtual int findByTypeReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint16_t type, const uint8_t value[], uint8_t valueLength, uint8_t responseBuffer[]);
+  virtual void findByTypeResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[]);
+  virtual uint16_t readByTypePdu(uint16_t startHandle, uint16_t endHandle, uint16_t type, uint16_t mtu, uint8_t response[]);
   virtual int readByTypeReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint16_t type, uint8_t responseBuffer[]);
-  virtual void readByTypeResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual void readOrReadBlobReq(uint16_t connectionHandle, uint16_t mtu, uint8_t opcode, uint8_t dlen, uint8_t data[]);
-  virtual void readResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual void readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[]);
+  virtual void readByTypeResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void readOrReadBlobReq(uint16_t connectionHandle, uint16_t mtu, uint8_t opcode, uint16_t dlen, uint8_t data[]);
+  virtual void readResp(uint16_t connectionHandle, uint8_t opcode, uint16_t dlen, uint8_t data[]);
+  virtual void readMultipleReq(uint16_t connectionHandle, uint16_t mtu, uint8_t opcode, uint16_t dlen, uint8_t data[]);
+  virtual int readMultipleReq(uint16_t connectionHandle, uint8_t opcode, const uint16_t handles[], int count, uint8_t responseBuffer[]);
+  virtual void readMultipleResp(uint16_t connectionHandle, uint8_t opcode, uint16_t dlen, uint8_t data[]);
+  virtual uint8_t readAttribute(uint16_t connectionHandle, uint16_t handle, uint16_t offset, uint8_t buffer[], uint16_t maxLength, uint16_t* valueLength, uint16_t* fullLength);
+  virtual void readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[]);
+  virtual uint16_t readByGroupPdu(uint16_t startHandle, uint16_t endHandle, uint16_t type, uint16_t mtu, uint8_t response[]);
   virtual int readByGroupReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint16_t uuid, uint8_t responseBuffer[]);
-  virtual void readByGroupResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual void writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op, uint8_t dlen, uint8_t data[]);
-  virtual void writeResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual void prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[]);
-  virtual void execWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[]);
-  virtual void handleNotifyOrInd(uint16_t connectionHandle, uint8_t opcode, uint8_t dlen, uint8_t data[]);
-  virtual void handleCnf(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
+  virtual void readByGroupResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op, uint16_t dlen, uint8_t data[]);
+  virtual void writeResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[]);
+  virtual void prepWriteResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void execWriteReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[]);
+  virtual void execWriteResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void handleNotifyOrInd(uint16_t connectionHandle, uint8_t opcode, uint16_t dlen, uint8_t data[]);
+  virtual void handleValue(int peerIndex, uint16_t handle, const uint8_t value[], uint16_t length);
+  virtual void handleCnf(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
   virtual void sendError(uint16_t connectionHandle, uint8_t opcode, uint16_t handle, uint8_t code);
+  virtual bool changeAware(uint16_t connectionHandle, uint8_t opcode, uint16_t dlen, uint8_t data[]);
+  virtual void setChangeAware(uint16_t connectionHandle);
+  virtual uint8_t writeClientFeatures(uint16_t connectionHandle, const uint8_t value[], uint16_t length);
+
+  virtual uint16_t discoveryResp(uint8_t opcode, uint16_t startHandle, uint16_t endHandle, uint16_t type, uint16_t mtu, uint8_t response[]);
+  virtual void clearDiscoveryCache();
 
-  virtual bool exchangeMtu(uint16_t connectionHandle);
-  virtual bool discoverServices(uint16_t connectionHandle, BLERemoteDevice* device, const char* serviceUuidFilter);
-  virtual bool discoverCharacteristics(uint16_t connectionHandle, BLERemoteDevice* device);
-  virtual bool discoverDescriptors(uint16_t connectionHandle, BLERemoteDevice* device);
+  virtual ATTOperation* queueOperation(uint16_t connectionHandle, uint8_t type);
+  virtual ATTOperation* queueDiscovery(uint16_t connectionHandle, const char* serviceUuidFilter);
+  virtual ATTOperation* queueRead(uint16_t connectionHandle, uint16_t handle, BLERemoteCharacteristic* characteristic, uint8_t buffer[], uint16_t size);
+  virtual ATTOperation* queueWrite(uint16_t connectionHandle, uint16_t handle, BLERemoteCharacteristic* characteristic, const uint8_t* data, uint16_t dataLen, bool withResponse);
+  virtual int startOperation(ATTOperation* operation);
+  virtual void completeOperation(ATTOperation* operation, bool success);
+  virtual void failOperations(uint16_t connectionHandle);
+
+  // the length read by a read operation is returned in valueLength
+  virtual int waitForOperation(ATTOperation* operation, int* valueLength = NULL);
+  virtual int readPart(ATTOperation* operation, int respLength);
+  virtual int writeNext(ATTOperation* operation);
+  virtual int writePart(ATTOperation* operation, int respLength);
+  virtual int readBlobReqAsync(uint16_t connectionHandle, uint16_t handle, uint16_t offset, uint8_t responseBuffer[]);
+  virtual int prepWriteReqAsync(uint16_t connectionHandle, uint16_t handle, uint16_t offset, const uint8_t* data, uint16_t dataLen, uint8_t responseBuffer[]);
+  virtual int execWriteReqAsync(uint16_t connectionHandle, uint8_t flags, uint8_t responseBuffer[]);
+  virtual int discoverNext(ATTOperation* operation);
+  virtual bool discoverResp(ATTOperation* operation, int respLength);
+  virtual uint16_t descriptorsEndHandle(BLERemoteService* service, unsigned int characteristicIndex) const;
+  virtual void storeGattCache(int peerIndex, const uint8_t databaseHash[16]);
+  virtual bool restoreGattCache(int peerIndex, const uint8_t databaseHash[16]);
 
   virtual int sendReq(uint16_t connectionHandle, void* requestBuffer, int requestLength, uint8_t responseBuffer[]);
+  virtual void handleResp(uint16_t connectionHandle, uint8_t op, uint16_t dlen, uint8_t data[]);
+
+  virtual void sendNotification(int peerIndex, uint16_t handle, const uint8_t* value, uint16_t length);
+  virtual ATTHandleValue* pendingNotification(int peerIndex, uint16_t handle);
+  virtual void queueNotification(int peerIndex, BLELocalCharacteristic* characteristic, uint16_t handle, const uint8_t* value, uint16_t length);
+  virtual void clearNotifications(int peerIndex);
+  virtual void batchNotification(int peerIndex, uint16_t handle, const uint8_t* value, uint16_t length);
+  virtual void sendNotificationBatch(int peerIndex);
+  virtual void sendIndication(int peerIndex);
+  virtual void clearIndications(int peerIndex);
+
+  virtual void peerIdentity(int peerIndex, uint8_t identity[6]) const;
+  virtual void releaseCccdValues(int peerIndex);
+  virtual void restoreCccdValues(int peerIndex);
 
 private:
   uint16_t _maxMtu;
@@ -151,25 +340,68 @@ private:
     uint8_t address[6];
     uint8_t resolvedAddress[6];
     uint16_t mtu;
+    uint8_t txPhy;
+    uint8_t rxPhy;
+    uint16_t txDataLength;
+    uint16_t rxDataLength;
     BLERemoteDevice* device;
     uint8_t encryption;
     uint8_t IOCap[3];
+    bool readMultipleVariable;
+    // the MTU is only exchanged once per connection
+    bool mtuExchanged;
+    struct {
+      uint8_t op;
+      uint8_t* buffer;
+      uint16_t length;
+      unsigned long start;
+      // when set, the value of a read response goes here instead of after the opcode in buffer
+      uint8_t* value;
+      uint16_t valueSize;
+    } pendingResp;
+    // the first one was sent at indicationStart when indicationSent is set
+    BLELinkedList<ATTHandleValue*> indications;
+    bool indicationSent;
+    unsigned long indicationStart;
+    // latest value of each coalescing characteristic, sent when the ACL queue of the connection drains
+    BLELinkedList<ATTHandleValue*> notifications;
+    // values notified since beginNotificationBatch, in order of their first update
+    BLELinkedList<ATTHandleValue*> batch;
+    bool multipleNotifications;
+    // Client Supported Features written by the peer, and the database version it last saw
+    uint8_t clientFeatures;
+    uint16_t databaseVersion;
+    bool outOfSyncSent;
   } _peers[ATT_MAX_PEERS];
 
-  volatile bool _cnf;
+  // requests, notifications and indications are built here, HCI copies them before it polls
+  uint8_t _pdu[ATT_MAX_MTU];
+  // responses of the server, built while the attribute callbacks run
+  uint8_t _response[ATT_MAX_MTU];
 
   uint16_t _longWriteHandle;
   uint8_t* _longWriteValue;
   uint16_t _longWriteValueLength;
 
+  BLELinkedList<ATTOperation*> _operations;
+  bool _operationsRunning;
+  bool _lazyDiscovery;
+  bool _notifyBatching;
+
+  // discovery responses for the static part of the database, keyed by request and MTU bucket
   struct {
-    uint16_t connectionHandle;
-    uint8_t op;
-    uint8_t* buffer;
-    uint8_t length;
-  } _pendingResp;
+    uint8_t opcode;
+    uint16_t startHandle;
+    uint16_t endHandle;
+    uint16_t type;
+    uint16_t mtu;
+    uint16_t length;
+    uint8_t* pdu;
+  } _discoveryCache[ATT_DISCOVERY_CACHE_SIZE];
+  uint8_t _discoveryCacheNext;
+  uint16_t _discoveryCacheVersion;
 
-  BLEDeviceEventHandler _eventHandlers[2];
+  BLEDeviceEventHandler _eventHandlers[BLEDeviceLastEvent];
 };
 
 extern ATTClass& ATT;
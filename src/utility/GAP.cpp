@@ -19,22 +19,45 @@
 
 #include "BLEUuid.h"
 #include "HCI.h"
+#include "BLEAdvertisingSet.h"
 
 #include "GAP.h"
 
 #define GAP_MAX_DISCOVERED_QUEUE_SIZE 32
 
 #define GAP_ADV_IND (0x00)
+#define GAP_ADV_DIRECT_IND (0x01)
 #define GAP_ADV_SCAN_IND (0x02)
 #define GAP_ADV_NONCONN_IND (0x03)
 
+// extended advertising event properties
+#define GAP_ADV_PROP_CONNECTABLE (0x0001)
+#define GAP_ADV_PROP_SCANNABLE   (0x0002)
+#define GAP_ADV_PROP_LEGACY      (0x0010)
+
+// extended advertising report event type
+#define GAP_EXT_ADV_LEGACY (0x0010)
+
 GAPClass::GAPClass() :
   _advertising(false),
   _scanning(false),
+  _extendedScanning(false),
+  _scanPhys(0),
   _advertisingInterval(160),
   _connectable(true),
-  _discoverEventHandler(NULL)
+  _maxAdvertisingSets(0),
+  _discoverEventHandler(NULL),
+  _periodicSyncEstablishedEventHandler(NULL),
+  _periodicReportEventHandler(NULL),
+  _periodicSyncLostEventHandler(NULL)
 {
+  for (int i = 0; i < GAP_MAX_ADVERTISING_SETS; i++) {
+    _advertisingSets[i] = NULL;
+  }
+
+  for (int i = 0; i < GAP_MAX_PERIODIC_SYNCS; i++) {
+    _periodicSyncs[i].device = NULL;
+  }
 }
 
 GAPClass::~GAPClass()
@@ -79,11 +102,235 @@ void GAPClass::stopAdvertise()
 {
   _advertising = false;
 
-  HCI.leSetAdvertiseEnable(0x00);
+  if (!HCI.extendedCommands()) {
+    HCI.leSetAdvertiseEnable(0x00);
+  }
+
+  bool advertisingSets = false;
+
+  for (int i = 0; i < GAP_MAX_ADVERTISING_SETS; i++) {
+    if (_advertisingSets[i] && _advertisingSets[i]->_enabled) {
+      if (_advertisingSets[i]->_periodicMaxInterval) {
+        HCI.leSetPeriodicAdvertisingEnable(0x00, i);
+      }
+
+      _advertisingSets[i]->_enabled = false;
+      _advertisingSets[i]->_terminated = false;
+      advertisingSets = true;
+    }
+  }
+
+  if (advertisingSets) {
+    HCI.leSetExtendedAdvertisingEnable(0x00, 0, NULL);
+  }
+}
+
+int GAPClass::advertise(BLEAdvertisingSet* advertisingSets[], int numAdvertisingSets)
+{
+  uint8_t handles[GAP_MAX_ADVERTISING_SETS];
+  uint8_t numEnabled = 0;
+
+  if (numAdvertisingSets <= 0 || numAdvertisingSets > GAP_MAX_ADVERTISING_SETS) {
+    return 0;
+  }
+
+  for (int i = 0; i < numAdvertisingSets; i++) {
+    if (!addAdvertisingSet(*advertisingSets[i])) {
+      return 0;
+    }
+
+    if (advertisingSets[i]->_periodicMaxInterval &&
+        (advertisingSets[i]->_connectable || advertisingSets[i]->_legacy)) {
+      // periodic advertising needs a non connectable extended set
+      return 0;
+    }
+
+    if (advertisingSets[i]->_enabled) {
+      if (advertisingSets[i]->_periodicMaxInterval) {
+        HCI.leSetPeriodicAdvertisingEnable(0x00, advertisingSets[i]->_handle);
+      }
+
+      handles[numEnabled++] = advertisingSets[i]->_handle;
+    }
+  }
+
+  // the parameters of an enabled set can't change
+  if (numEnabled) {
+    HCI.leSetExtendedAdvertisingEnable(0x00, numEnabled, handles);
+  }
+
+  for (int i = 0; i < numAdvertisingSets; i++) {
+    BLEAdvertisingSet* advertisingSet = advertisingSets[i];
+    uint16_t eventProperties = 0;
+
+    advertisingSet->_enabled = false;
+    advertisingSet->_terminated = false;
+
+    if (advertisingSet->_connectable) {
+      eventProperties |= GAP_ADV_PROP_CONNECTABLE;
+    }
+
+    if (advertisingSet->_legacy) {
+      // legacy connectable advertising is always scannable (ADV_IND)
+      eventProperties |= GAP_ADV_PROP_LEGACY;
+
+      if (advertisingSet->_connectable) {
+        eventProperties |= GAP_ADV_PROP_SCANNABLE;
+      }
+    }
+
+    // the commands take the PHY number, 3 being Coded
+    uint8_t primaryPhy = (advertisingSet->_primaryPhy == BLEPhyCoded) ? 0x03 : 0x01;
+    uint8_t secondaryPhy = (advertisingSet->_secondaryPhy == BLEPhyCoded) ? 0x03 : advertisingSet->_secondaryPhy;
+
+    // the public address unless the set has its own random one
+    uint8_t ownBdaddrType = advertisingSet->_randomAddress ? 0x01 : 0x00;
+
+    // all channels, no filter, the handle as advertising SID
+    if (HCI.leSetExtendedAdvertisingParameters(advertisingSet->_handle, eventProperties,
+                                               advertisingSet->_minInterval, advertisingSet->_maxInterval,
+                                               0x07, ownBdaddrType, 0x00, advertisingSet->_txPower,
+                                               primaryPhy, secondaryPhy, advertisingSet->_handle) != 0) {
+      return 0;
+    }
+
+    if (advertisingSet->_randomAddress &&
+        HCI.leSetAdvertisingSetRandomAddress(advertisingSet->_handle, advertisingSet->_address) != 0) {
+      return 0;
+    }
+
+    advertisingSet->updateData();
+
+    if (HCI.leSetExtendedAdvertisingData(advertisingSet->_handle, advertisingSet->dataLength(), advertisingSet->data()) != 0) {
+      return 0;
+    }
+
+    if (advertisingSet->_periodicMaxInterval) {
+      // the periodic train starts with the extended advertising that announces it
+      if (HCI.leSetPeriodicAdvertisingParameters(advertisingSet->_handle, advertisingSet->_periodicMinInterval,
+                                                 advertisingSet->_periodicMaxInterval, 0x0000) != 0) {
+        return 0;
+      }
+
+      if (updatePeriodicAdvertisingData(*advertisingSet) != 0) {
+        return 0;
+      }
+
+      if (HCI.leSetPeriodicAdvertisingEnable(0x01, advertisingSet->_handle) != 0) {
+        return 0;
+      }
+    }
+
+    handles[i] = advertisingSet->_handle;
+  }
+
+  if (HCI.leSetExtendedAdvertisingEnable(0x01, numAdvertisingSets, handles) != 0) {
+    return 0;
+  }
+
+  for (int i = 0; i < numAdvertisingSets; i++) {
+    advertisingSets[i]->_enabled = true;
+  }
+
+  return 1;
+}
+
+void GAPClass::stopAdvertise(BLEAdvertisingSet& advertisingSet)
+{
+  if (advertisingSet._handle < 0) {
+    return;
+  }
+
+  uint8_t handle = advertisingSet._handle;
+
+  if (advertisingSet._enabled && advertisingSet._periodicMaxInterval) {
+    HCI.leSetPeriodicAdvertisingEnable(0x00, handle);
+  }
+
+  advertisingSet._enabled = false;
+  advertisingSet._terminated = false;
+
+  HCI.leSetExtendedAdvertisingEnable(0x00, 1, &handle);
+}
+
+int GAPClass::updateAdvertisingSetData(BLEAdvertisingSet& advertisingSet)
+{
+  if (!advertisingSet._enabled) {
+    // sent when the set is advertised
+    return 1;
+  }
+
+  if (advertisingSet._periodicMaxInterval && advertisingSet._periodicData) {
+    return (updatePeriodicAdvertisingData(advertisingSet) == 0);
+  }
+
+  advertisingSet.updateData();
+
+  return (HCI.leSetExtendedAdvertisingData(advertisingSet._handle, advertisingSet.dataLength(), advertisingSet.data()) == 0);
+}
+
+int GAPClass::updatePeriodicAdvertisingData(BLEAdvertisingSet& advertisingSet)
+{
+  BLEAdvertisingData* periodicData = advertisingSet._periodicData;
+
+  if (periodicData == NULL) {
+    return HCI.leSetPeriodicAdvertisingData(advertisingSet._handle, 0, NULL);
+  }
+
+  periodicData->updateData();
+
+  return HCI.leSetPeriodicAdvertisingData(advertisingSet._handle, periodicData->dataLength(), periodicData->data());
+}
+
+void GAPClass::removeAdvertisingSet(BLEAdvertisingSet& advertisingSet)
+{
+  if (advertisingSet._handle < 0) {
+    return;
+  }
+
+  stopAdvertise(advertisingSet);
+
+  HCI.leRemoveAdvertisingSet(advertisingSet._handle);
+
+  _advertisingSets[advertisingSet._handle] = NULL;
+  advertisingSet._handle = -1;
+}
+
+int GAPClass::addAdvertisingSet(BLEAdvertisingSet& advertisingSet)
+{
+  if (advertisingSet._handle >= 0) {
+    return 1;
+  }
+
+  if (_maxAdvertisingSets == 0) {
+    // fails if the controller does not support extended advertising
+    if (HCI.leReadNumberOfSupportedAdvertisingSets(_maxAdvertisingSets) != 0) {
+      _maxAdvertisingSets = 0;
+      return 0;
+    }
+  }
+
+  for (int i = 0; i < GAP_MAX_ADVERTISING_SETS && i < _maxAdvertisingSets; i++) {
+    if (_advertisingSets[i] == NULL) {
+      _advertisingSets[i] = &advertisingSet;
+      advertisingSet._handle = i;
+
+      return 1;
+    }
+  }
+
+  return 0;
 }
 
 int GAPClass::scan(bool withDuplicates)
 {
+  // once extended commands are used, the controller refuses the legacy scanning commands
+  uint8_t scanPhys = _scanPhys ? _scanPhys : (HCI.extendedCommands() ? (uint8_t)BLEPhy1M : 0);
+
+  if (scanPhys) {
+    return extendedScan(scanPhys, withDuplicates);
+  }
+
   HCI.leSetScanEnable(false, true);
 
   // active scan, 20 ms scan interval (N * 0.625), 20 ms scan window (N * 0.625), public own address type, no filter
@@ -133,11 +380,35 @@ int GAPClass::scanForAddress(String address, bool withDuplicates)
   return scan(withDuplicates);
 }
 
+int GAPClass::extendedScan(uint8_t scanPhys, bool withDuplicates)
+{
+  HCI.leSetExtendedScanEnable(false, true);
+
+  // active scan on each PHY, same timings as legacy scanning
+  if (HCI.leSetExtendedScanParameters(0x00, 0x00, scanPhys, 0x01, 0x0020, 0x0020) != 0) {
+    return 0;
+  }
+
+  _scanning = true;
+  _extendedScanning = true;
+
+  if (HCI.leSetExtendedScanEnable(true, !withDuplicates) != 0) {
+    return 0;
+  }
+
+  return 1;
+}
+
 void GAPClass::stopScan()
 {
-  HCI.leSetScanEnable(false, false);
+  if (_extendedScanning) {
+    HCI.leSetExtendedScanEnable(false, false);
+  } else {
+    HCI.leSetScanEnable(false, false);
+  }
 
   _scanning = false;
+  _extendedScanning = false;
 
   for (unsigned int i = 0; i < _discoveredDevices.size(); i++) {
     BLEDevice* device = _discoveredDevices.get(i);
@@ -180,10 +451,22 @@ void GAPClass::setConnectable(bool connectable)
   _connectable = connectable;
 }
 
+void GAPClass::setScanPhy(uint8_t scanPhys)
+{
+  // extended scanning is limited to the primary advertising PHYs
+  _scanPhys = scanPhys & (BLEPhy1M | BLEPhyCoded);
+}
+
 void GAPClass::setEventHandler(BLEDeviceEvent event, BLEDeviceEventHandler eventHandler)
 {
   if (event == BLEDiscovered) {
     _discoverEventHandler = eventHandler;
+  } else if (event == BLEPeriodicSyncEstablished) {
+    _periodicSyncEstablishedEventHandler = eventHandler;
+  } else if (event == BLEPeriodicReport) {
+    _periodicReportEventHandler = eventHandler;
+  } else if (event == BLEPeriodicSyncLost) {
+    _periodicSyncLostEventHandler = eventHandler;
   }
 }
 
@@ -206,39 +489,84 @@ void GAPClass::handleLeAdvertisingReport(uint8_t type, uint8_t addressType, uint
     return;
   }
 
-  BLEDevice* discoveredDevice = NULL;
-  int discoveredIndex = -1;
+  int discoveredIndex;
+  BLEDevice* discoveredDevice = findOrAddDiscoveredDevice(addressType, address, discoveredIndex);
+
+  if (type != 0x04) {
+    discoveredDevice->setAdvertisementData(type, eirLength, eirData, rssi);
+  } else {
+    discoveredDevice->setScanResponseData(eirLength, eirData, rssi);
+  }
+
+  reportDiscoveredDevice(discoveredIndex);
+}
+
+void GAPClass::handleLeExtendedAdvertisingReport(uint16_t eventType, uint8_t sid, uint8_t addressType, uint8_t address[6],
+                                                  uint8_t dataLength, uint8_t data[], int8_t rssi)
+{
+  if (eventType & GAP_EXT_ADV_LEGACY) {
+    // legacy PDUs reported by extended scanning
+    uint8_t type;
+
+    switch (eventType & 0x1f) {
+      case 0x13: type = GAP_ADV_IND; break;
+      case 0x15: type = GAP_ADV_DIRECT_IND; break;
+      case 0x12: type = GAP_ADV_SCAN_IND; break;
+      case 0x10: type = GAP_ADV_NONCONN_IND; break;
+      default: type = 0x04; break;
+    }
+
+    handleLeAdvertisingReport(type, addressType, address, dataLength, data, rssi);
+    return;
+  }
+
+  if (!_scanning) {
+    return;
+  }
+
+  // the chains of the sets of an advertiser may interleave, they are told apart by the SID,
+  // scan responses don't carry it
+  int chainSid = ((eventType & 0x0008) || sid > 0x0f) ? -1 : sid;
+
+  int discoveredIndex;
+  BLEDevice* discoveredDevice = findOrAddDiscoveredDevice(addressType, address, discoveredIndex, chainSid);
+
+  // chained reports are reassembled in the discovered device
+  discoveredDevice->setExtendedAdvertisementData(eventType, sid, dataLength, data, rssi);
+
+  reportDiscoveredDevice(discoveredIndex);
+}
 
+BLEDevice* GAPClass::findOrAddDiscoveredDevice(uint8_t addressType, uint8_t address[6], int& discoveredIndex, int sid)
+{
   for (unsigned int i = 0; i < _discoveredDevices.size(); i++) {
     BLEDevice* device = _discoveredDevices.get(i);
 
-    if (device->hasAddress(addressType, address)) {
-      discoveredDevice = device;
+    if (device->hasAddress(addressType, address) && (sid < 0 || device->advertisingSid() == sid)) {
       discoveredIndex = i;
 
-      break;
+      return device;
     }
   }
 
-  if (discoveredDevice == NULL) {
-    if (_discoveredDevices.size() >= GAP_MAX_DISCOVERED_QUEUE_SIZE) {
-      BLEDevice* device_first = _discoveredDevices.remove(0);
-      if (device_first != NULL) {
-        delete device_first;
-      }
+  if (_discoveredDevices.size() >= GAP_MAX_DISCOVERED_QUEUE_SIZE) {
+    BLEDevice* device_first = _discoveredDevices.remove(0);
+    if (device_first != NULL) {
+      delete device_first;
     }
+  }
 
-    discoveredDevice = new BLEDevice(addressType, address);
+  BLEDevice* discoveredDevice = new BLEDevice(addressType, address);
 
-    _discoveredDevices.add(discoveredDevice);
-    discoveredIndex = _discoveredDevices.size() - 1;
-  }
+  _discoveredDevices.add(discoveredDevice);
+  discoveredIndex = _discoveredDevices.size() - 1;
 
-  if (type != 0x04) {
-    discoveredDevice->setAdvertisementData(type, eirLength, eirData, rssi);
-  } else {
-    discoveredDevice->setScanResponseData(eirLength, eirData, rssi);
-  }
+  return discoveredDevice;
+}
+
+void GAPClass::reportDiscoveredDevice(int discoveredIndex)
+{
+  BLEDevice* discoveredDevice = _discoveredDevices.get(discoveredIndex);
 
   if (discoveredDevice->discovered() && _discoverEventHandler) {
     // remove from list and report as discovered
@@ -253,6 +581,188 @@ void GAPClass::handleLeAdvertisingReport(uint8_t type, uint8_t addressType, uint
   }
 }
 
+int GAPClass::syncToPeriodic(const BLEDevice& device, uint8_t sid)
+{
+  int index = -1;
+
+  for (int i = 0; i < GAP_MAX_PERIODIC_SYNCS; i++) {
+    if (_periodicSyncs[i].device == NULL) {
+      if (index == -1) {
+        index = i;
+      }
+    } else if (!_periodicSyncs[i].established) {
+      // the controller creates one sync at a time
+      return 0;
+    }
+  }
+
+  if (index == -1) {
+    return 0;
+  }
+
+  BLEDevice* syncDevice = new BLEDevice(device._addressType, (uint8_t*)device._address);
+
+  syncDevice->_advertisingSid = sid;
+
+  // no filter list, report every periodic advertisement, 10 s sync timeout
+  if (HCI.lePeriodicAdvertisingCreateSync(0x00, sid, device._addressType, syncDevice->_address, 0x0000, 1000) != 0) {
+    delete syncDevice;
+
+    return 0;
+  }
+
+  _periodicSyncs[index].device = syncDevice;
+  _periodicSyncs[index].handle = 0xffff;
+  _periodicSyncs[index].established = false;
+
+  return 1;
+}
+
+void GAPClass::stopPeriodicSync(const BLEDevice& device)
+{
+  for (int i = 0; i < GAP_MAX_PERIODIC_SYNCS; i++) {
+    BLEDevice* syncDevice = _periodicSyncs[i].device;
+
+    if (syncDevice == NULL) {
+      continue;
+    }
+
+    if (device._periodicSyncHandle != 0xffff) {
+      // a device reported by the sync
+      if (!_periodicSyncs[i].established || _periodicSyncs[i].handle != device._periodicSyncHandle) {
+        continue;
+      }
+    } else if ((device._advertisingSid <= 0x0f && syncDevice->_advertisingSid != device._advertisingSid) ||
+               !samePeriodicAdvertiser(*syncDevice, device._addressType, device._address)) {
+      // the scanned device, all its syncs when its SID is not known
+      continue;
+    }
+
+    if (_periodicSyncs[i].established) {
+      HCI.lePeriodicAdvertisingTerminateSync(_periodicSyncs[i].handle);
+    } else {
+      HCI.lePeriodicAdvertisingCreateSyncCancel();
+    }
+
+    removePeriodicSync(i);
+  }
+}
+
+bool GAPClass::samePeriodicAdvertiser(const BLEDevice& syncDevice, uint8_t addressType, const uint8_t address[6])
+{
+  // the controller may report the identity address types (0x02, 0x03) for a public or random address
+  return ((syncDevice._addressType & 0x01) == (addressType & 0x01)) &&
+         (memcmp(syncDevice._address, address, sizeof(syncDevice._address)) == 0);
+}
+
+void GAPClass::removePeriodicSync(int index)
+{
+  delete _periodicSyncs[index].device;
+
+  _periodicSyncs[index].device = NULL;
+}
+
+void GAPClass::handleLePeriodicSyncEstablished(uint8_t status, uint16_t syncHandle, uint8_t sid,
+                                               uint8_t addressType, uint8_t address[6])
+{
+  for (int i = 0; i < GAP_MAX_PERIODIC_SYNCS; i++) {
+    BLEDevice* syncDevice = _periodicSyncs[i].device;
+
+    if (syncDevice == NULL || _periodicSyncs[i].established ||
+        syncDevice->_advertisingSid != sid || !samePeriodicAdvertiser(*syncDevice, addressType, address)) {
+      continue;
+    }
+
+    if (status != 0x00) {
+      BLEDevice device = *syncDevice;
+
+      removePeriodicSync(i);
+
+      if (_periodicSyncLostEventHandler) {
+        _periodicSyncLostEventHandler(device);
+      }
+      return;
+    }
+
+    _periodicSyncs[i].handle = syncHandle;
+    _periodicSyncs[i].established = true;
+    syncDevice->_periodicSyncHandle = syncHandle;
+
+    if (_periodicSyncEstablishedEventHandler) {
+      _periodicSyncEstablishedEventHandler(*syncDevice);
+    }
+    return;
+  }
+}
+
+void GAPClass::handleLePeriodicAdvertisingReport(uint16_t syncHandle, uint8_t dataStatus,
+                                                 uint8_t dataLength, uint8_t data[], int8_t rssi)
+{
+  for (int i = 0; i < GAP_MAX_PERIODIC_SYNCS; i++) {
+    BLEDevice* syncDevice = _periodicSyncs[i].device;
+
+    if (syncDevice == NULL || !_periodicSyncs[i].established || _periodicSyncs[i].handle != syncHandle) {
+      continue;
+    }
+
+    // reassembled like a non scannable extended advertisement
+    syncDevice->setExtendedAdvertisementData(dataStatus << 5, syncDevice->_advertisingSid, dataLength, data, rssi);
+
+    if (syncDevice->discovered() && _periodicReportEventHandler) {
+      _periodicReportEventHandler(*syncDevice);
+    }
+    return;
+  }
+}
+
+void GAPClass::handleLePeriodicSyncLost(uint16_t syncHandle)
+{
+  for (int i = 0; i < GAP_MAX_PERIODIC_SYNCS; i++) {
+    if (_periodicSyncs[i].device == NULL || !_periodicSyncs[i].established || _periodicSyncs[i].handle != syncHandle) {
+      continue;
+    }
+
+    BLEDevice device = *_periodicSyncs[i].device;
+
+    removePeriodicSync(i);
+
+    if (_periodicSyncLostEventHandler) {
+      _periodicSyncLostEventHandler(device);
+    }
+    return;
+  }
+}
+
+void GAPClass::handleLeAdvertisingSetTerminated(uint8_t status, uint8_t advertisingHandle, uint16_t /*connectionHandle*/)
+{
+  if (advertisingHandle >= GAP_MAX_ADVERTISING_SETS || _advertisingSets[advertisingHandle] == NULL) {
+    return;
+  }
+
+  BLEAdvertisingSet* advertisingSet = _advertisingSets[advertisingHandle];
+
+  if (status == 0x00) {
+    // a connection was created
+    advertisingSet->_terminated = true;
+  } else {
+    advertisingSet->_enabled = false;
+  }
+}
+
+uint8_t GAPClass::advertisingSetsToResume(uint8_t handles[])
+{
+  uint8_t numSets = 0;
+
+  for (int i = 0; i < GAP_MAX_ADVERTISING_SETS; i++) {
+    if (_advertisingSets[i] && _advertisingSets[i]->_enabled && _advertisingSets[i]->_terminated) {
+      _advertisingSets[i]->_terminated = false;
+      handles[numSets++] = i;
+    }
+  }
+
+  return numSets;
+}
+
 bool GAPClass::matchesScanFilter(const BLEDevice& device)
 {
   if (_scanAddressFilter.length() > 0 && !(_scanAddressFilter.equalsIgnoreCase(device.address()))) {
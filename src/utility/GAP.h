@@ -24,6 +24,24 @@
 
 #include "BLEDevice.h"
 
+#ifndef GAP_MAX_ADVERTISING_SETS
+#ifdef __AVR__
+#define GAP_MAX_ADVERTISING_SETS 1
+#else
+#define GAP_MAX_ADVERTISING_SETS 4
+#endif
+#endif
+
+#ifndef GAP_MAX_PERIODIC_SYNCS
+#ifdef __AVR__
+#define GAP_MAX_PERIODIC_SYNCS 1
+#else
+#define GAP_MAX_PERIODIC_SYNCS 4
+#endif
+#endif
+
+class BLEAdvertisingSet;
+
 class GAPClass {
 public:
   GAPClass();
@@ -33,6 +51,13 @@ public:
   virtual int advertise(uint8_t* advData, uint8_t advDataLength, uint8_t* scanData, uint8_t scanDataLength);
   virtual void stopAdvertise();
 
+  // Extended advertising, all the sets are enabled with a single command
+  virtual int advertise(BLEAdvertisingSet* advertisingSets[], int numAdvertisingSets);
+  virtual void stopAdvertise(BLEAdvertisingSet& advertisingSet);
+  virtual void removeAdvertisingSet(BLEAdvertisingSet& advertisingSet);
+  // Send the data of an advertising set again, if it is advertising
+  virtual int updateAdvertisingSetData(BLEAdvertisingSet& advertisingSet);
+
   virtual int scan(bool withDuplicates);
   virtual int scanForName(String name, bool withDuplicates);
   virtual int scanForUuid(String uuid, bool withDuplicates);
@@ -40,8 +65,14 @@ public:
   virtual void stopScan();
   virtual BLEDevice available();
 
+  // Periodic advertising synchronization, the advertiser must be found by an ongoing scan
+  virtual int syncToPeriodic(const BLEDevice& device, uint8_t sid);
+  virtual void stopPeriodicSync(const BLEDevice& device);
+
   virtual void setAdvertisingInterval(uint16_t advertisingInterval);
   virtual void setConnectable(bool connectable);
+  // Scan with extended scanning on the PHYs of the mask (BLEPhy1M, BLEPhyCoded), 0 for legacy scanning
+  virtual void setScanPhy(uint8_t scanPhys);
 
   virtual void setEventHandler(BLEDeviceEvent event, BLEDeviceEventHandler eventHandler);
 
@@ -50,20 +81,55 @@ protected:
 
   virtual void handleLeAdvertisingReport(uint8_t type, uint8_t addressType, uint8_t address[6],
                                   uint8_t eirLength, uint8_t eirData[], int8_t rssi);
+  virtual void handleLeExtendedAdvertisingReport(uint16_t eventType, uint8_t sid, uint8_t addressType, uint8_t address[6],
+                                                 uint8_t dataLength, uint8_t data[], int8_t rssi);
+  virtual void handleLePeriodicSyncEstablished(uint8_t status, uint16_t syncHandle, uint8_t sid,
+                                               uint8_t addressType, uint8_t address[6]);
+  virtual void handleLePeriodicAdvertisingReport(uint16_t syncHandle, uint8_t dataStatus,
+                                                 uint8_t dataLength, uint8_t data[], int8_t rssi);
+  virtual void handleLePeriodicSyncLost(uint16_t syncHandle);
+  virtual void handleLeAdvertisingSetTerminated(uint8_t status, uint8_t advertisingHandle, uint16_t connectionHandle);
+  // Handles of the sets stopped by a connection, to enable again once it ends
+  virtual uint8_t advertisingSetsToResume(uint8_t handles[]);
 
 private:
   virtual bool matchesScanFilter(const BLEDevice& device);
+  virtual int extendedScan(uint8_t scanPhys, bool withDuplicates);
+  // sid also has to match unless it is -1
+  virtual BLEDevice* findOrAddDiscoveredDevice(uint8_t addressType, uint8_t address[6], int& discoveredIndex, int sid = -1);
+  virtual void reportDiscoveredDevice(int discoveredIndex);
+  virtual int addAdvertisingSet(BLEAdvertisingSet& advertisingSet);
+  virtual int updatePeriodicAdvertisingData(BLEAdvertisingSet& advertisingSet);
+  virtual bool samePeriodicAdvertiser(const BLEDevice& syncDevice, uint8_t addressType, const uint8_t address[6]);
+  virtual void removePeriodicSync(int index);
 
 private:
   bool _advertising;
   bool _scanning;
+  bool _extendedScanning;
+  uint8_t _scanPhys;
 
   uint16_t _advertisingInterval;
   bool _connectable;
 
+  // indexed by advertising handle
+  BLEAdvertisingSet* _advertisingSets[GAP_MAX_ADVERTISING_SETS];
+  // number of sets the controller supports, 0 until known
+  uint8_t _maxAdvertisingSets;
+
   BLEDeviceEventHandler _discoverEventHandler;
   BLELinkedList<BLEDevice*> _discoveredDevices;
 
+  // periodic advertising trains, at most one waiting to be established
+  struct {
+    BLEDevice* device;
+    uint16_t handle;
+    bool established;
+  } _periodicSyncs[GAP_MAX_PERIODIC_SYNCS];
+  BLEDeviceEventHandler _periodicSyncEstablishedEventHandler;
+  BLEDeviceEventHandler _periodicReportEventHandler;
+  BLEDeviceEventHandler _periodicSyncLostEventHandler;
+
   String _scanNameFilter;
   String _scanUuidFilter;
   String _scanAddressFilter;
@@ -25,14 +25,32 @@
 
 #include "BLEProperty.h"
 
+#include "btct.h"
+
 #include "GATT.h"
 
+static int putBytes(uint8_t data[], int size, int offset, const void* bytes, int length)
+{
+  if (data != NULL && (offset + length) <= size) {
+    memcpy(&data[offset], bytes, length);
+  }
+
+  return offset + length;
+}
+
 GATTClass::GATTClass() :
+  _attributes(NULL),
+  _attributeCount(0),
+  _attributeCapacity(0),
+  _version(0),
+  _databaseHashVersion(0xffff),
   _genericAccessService(NULL),
   _deviceNameCharacteristic(NULL),
   _appearanceCharacteristic(NULL),
   _genericAttributeService(NULL),
-  _servicesChangedCharacteristic(NULL)
+  _servicesChangedCharacteristic(NULL),
+  _clientSupportedFeaturesCharacteristic(NULL),
+  _databaseHashCharacteristic(NULL)
 {
 }
 
@@ -48,16 +66,22 @@ void GATTClass::begin()
   _appearanceCharacteristic = new BLELocalCharacteristic("2a01", BLERead, 2);
   _genericAttributeService = new BLELocalService("1801");
   _servicesChangedCharacteristic = new BLELocalCharacteristic("2a05", BLEIndicate, 4);
+  _clientSupportedFeaturesCharacteristic = new BLELocalCharacteristic("2b29", BLERead | BLEWrite, 1);
+  _databaseHashCharacteristic = new BLELocalCharacteristic("2b2a", BLERead, 16);
 
   _genericAccessService->retain();
   _deviceNameCharacteristic->retain();
   _appearanceCharacteristic->retain();
   _genericAttributeService->retain();
   _servicesChangedCharacteristic->retain();
+  _clientSupportedFeaturesCharacteristic->retain();
+  _databaseHashCharacteristic->retain();
 
   _genericAccessService->addCharacteristic(_deviceNameCharacteristic);
   _genericAccessService->addCharacteristic(_appearanceCharacteristic);
   _genericAttributeService->addCharacteristic(_servicesChangedCharacteristic);
+  _genericAttributeService->addCharacteristic(_clientSupportedFeaturesCharacteristic);
+  _genericAttributeService->addCharacteristic(_databaseHashCharacteristic);
 
   setDeviceName("Arduino");
   setAppearance(0x000);
@@ -95,7 +119,23 @@ void GATTClass::end()
     _servicesChangedCharacteristic = NULL;
   }
 
+  if (_clientSupportedFeaturesCharacteristic && _clientSupportedFeaturesCharacteristic->release() == 0) {
+    delete(_clientSupportedFeaturesCharacteristic);
+    _clientSupportedFeaturesCharacteristic = NULL;
+  }
+
+  if (_databaseHashCharacteristic && _databaseHashCharacteristic->release() == 0) {
+    delete(_databaseHashCharacteristic);
+    _databaseHashCharacteristic = NULL;
+  }
+
   clearAttributes();
+
+  if (_attributes) {
+    free(_attributes);
+    _attributes = NULL;
+  }
+  _attributeCapacity = 0;
 }
 
 void GATTClass::setDeviceName(const char* deviceName)
@@ -119,37 +159,96 @@ void GATTClass::addService(BLEService& service)
 
 unsigned int GATTClass::attributeCount() const
 {
-  return _attributes.size();
+  return _attributeCount;
 }
 
 BLELocalAttribute* GATTClass::attribute(unsigned int index) const
 {
-  return _attributes.get(index);
+  if (index >= _attributeCount) {
+    return NULL;
+  }
+
+  return _attributes[index].attribute;
+}
+
+uint16_t GATTClass::version() const
+{
+  return _version;
+}
+
+BLELocalCharacteristic* GATTClass::servicesChangedCharacteristic() const
+{
+  return _servicesChangedCharacteristic;
+}
+
+BLELocalCharacteristic* GATTClass::clientSupportedFeaturesCharacteristic() const
+{
+  return _clientSupportedFeaturesCharacteristic;
+}
+
+BLELocalCharacteristic* GATTClass::databaseHashCharacteristic() const
+{
+  return _databaseHashCharacteristic;
+}
+
+void GATTClass::updateDatabaseHash()
+{
+  if (_databaseHashCharacteristic == NULL || _databaseHashVersion == _version) {
+    return;
+  }
+
+  int length = databaseHashInput(NULL, 0);
+  uint8_t* data = (uint8_t*)malloc(length ? length : 1);
+
+  if (data == NULL) {
+    return;
+  }
+
+  databaseHashInput(data, length);
+
+  // Core Specification Vol 3, Part G, 7.3: AES-CMAC with a zero key
+  uint8_t key[16];
+  uint8_t mac[16];
+  uint8_t hash[16];
+
+  memset(key, 0x00, sizeof(key));
+  btct.AES_CMAC(key, data, length, mac);
+  free(data);
+
+  // the CMAC is most significant octet first, the characteristic value is sent least significant first
+  for (int i = 0; i < 16; i++) {
+    hash[i] = mac[15 - i];
+  }
+
+  _databaseHashCharacteristic->writeValue(hash, sizeof(hash));
+  _databaseHashVersion = _version;
+}
+
+const GATTAttributeEntry* GATTClass::attributeEntry(uint16_t handle) const
+{
+  if (handle == 0x0000 || handle > _attributeCount) {
+    return NULL;
+  }
+
+  return &_attributes[handle - 1];
 }
 
 uint16_t GATTClass::serviceUuidForCharacteristic(BLELocalCharacteristic* characteristic) const
 {
   uint16_t serviceUuid = 0x0000;
 
-  BLELocalService* lastService = NULL;
+  const GATTAttributeEntry* entry = attributeEntry(characteristic->handle());
 
-  for (unsigned int i = 0; i < attributeCount(); i++) {
-    BLELocalAttribute* a = attribute(i);
-    uint16_t attributeType = a->type();
-
-    if (attributeType == BLETypeService) {
-      lastService = (BLELocalService*)a;
-    } else if (a == characteristic) {
-      break;
-    }
+  if (entry == NULL || entry->attribute != characteristic) {
+    return serviceUuid;
   }
 
-  if (lastService) {
-    if (lastService->uuidLength() == 2) {
-      serviceUuid = *(uint16_t*)(lastService->uuidData());
-    } else {
-      serviceUuid = *(uint16_t*)(lastService->uuidData() + 10);
-    }
+  BLELocalAttribute* service = _attributes[entry->serviceHandle - 1].attribute;
+
+  if (service->uuidLength() == 2) {
+    serviceUuid = *(uint16_t*)(service->uuidData());
+  } else {
+    serviceUuid = *(uint16_t*)(service->uuidData() + 10);
   }
 
   return serviceUuid;
@@ -157,33 +256,108 @@ uint16_t GATTClass::serviceUuidForCharacteristic(BLELocalCharacteristic* charact
 
 void GATTClass::addService(BLELocalService* service)
 {
-  service->retain();
-  _attributes.add(service);
-  _services.add(service);
+  // declaration, then declaration and value of each characteristic, then its descriptors
+  unsigned int count = 1;
 
-  uint16_t startHandle = attributeCount();
+  for (unsigned int i = 0; i < service->characteristicCount(); i++) {
+    count += 2 + service->characteristic(i)->descriptorCount();
+  }
+
+  if (!reserveAttributes(count)) {
+    // no room for the whole service, it is left out without handles
+    return;
+  }
+
+  uint16_t startHandle = attributeCount() + 1;
+
+  addAttribute(service, GATT_ATTRIBUTE_SERVICE, startHandle, 0x0000, 0x00);
+  _services.add(service);
 
   for (unsigned int i = 0; i < service->characteristicCount(); i++) {
     BLELocalCharacteristic* characteristic = service->characteristic(i);
+    uint16_t characteristicHandle = attributeCount() + 1;
+    uint8_t properties = characteristic->properties();
+
+    addAttribute(characteristic, GATT_ATTRIBUTE_CHARACTERISTIC, startHandle, characteristicHandle, properties);
+    characteristic->setHandle(characteristicHandle);
 
-    characteristic->retain();
-    _attributes.add(characteristic);
-    characteristic->setHandle(attributeCount());
-    
     // add the characteristic again to make space of the characteristic value handle
-    characteristic->retain();
-    _attributes.add(characteristic);
+    addAttribute(characteristic, GATT_ATTRIBUTE_CHARACTERISTIC_VALUE, startHandle, characteristicHandle, properties);
 
     for (unsigned int j = 0; j < characteristic->descriptorCount(); j++) {
       BLELocalDescriptor* descriptor = characteristic->descriptor(j);
 
-      descriptor->retain();
-      _attributes.add(descriptor);
+      addAttribute(descriptor, GATT_ATTRIBUTE_DESCRIPTOR, startHandle, characteristicHandle, 0x00);
       descriptor->setHandle(attributeCount());
     }
   }
 
   service->setHandles(startHandle, attributeCount());
+
+  // invalidates anything derived from the layout of the database
+  _version++;
+
+  if (_servicesChangedCharacteristic) {
+    // Core Specification Vol 3, Part G, 7.1: indicate the affected handle range to the subscribed clients
+    uint16_t range[2] = { startHandle, (uint16_t)attributeCount() };
+
+    _servicesChangedCharacteristic->writeValue((uint8_t*)range, sizeof(range));
+  }
+}
+
+bool GATTClass::reserveAttributes(unsigned int count)
+{
+  unsigned int needed = _attributeCount + count;
+
+  if (needed > 0xffff) {
+    // past the last attribute handle
+    return false;
+  }
+
+  if (needed <= _attributeCapacity) {
+    return true;
+  }
+
+  // grow the table geometrically, so building it stays linear in the number of attributes
+  unsigned int capacity = _attributeCapacity ? _attributeCapacity : 16;
+
+  while (capacity < needed) {
+    capacity *= 2;
+  }
+
+  if (capacity > 0xffff) {
+    capacity = 0xffff;
+  }
+
+  GATTAttributeEntry* attributes = (GATTAttributeEntry*)realloc(_attributes, capacity * sizeof(GATTAttributeEntry));
+
+  if (attributes == NULL) {
+    return false;
+  }
+
+  _attributes = attributes;
+  _attributeCapacity = capacity;
+
+  return true;
+}
+
+bool GATTClass::addAttribute(BLELocalAttribute* attribute, uint8_t kind, uint16_t serviceHandle, uint16_t characteristicHandle, uint8_t properties)
+{
+  if (!reserveAttributes(1)) {
+    return false;
+  }
+
+  GATTAttributeEntry* entry = &_attributes[_attributeCount++];
+
+  attribute->retain();
+
+  entry->attribute = attribute;
+  entry->serviceHandle = serviceHandle;
+  entry->characteristicHandle = characteristicHandle;
+  entry->kind = kind;
+  entry->properties = properties;
+
+  return true;
 }
 
 void GATTClass::clearAttributes()
@@ -195,7 +369,8 @@ void GATTClass::clearAttributes()
       delete a;
     }
   }
-  _attributes.clear();
+  _attributeCount = 0;
+  _version++;
 
   for (unsigned int i = 0; i < _services.size(); i++) {
     _services.get(i)->clear();
@@ -204,6 +379,54 @@ void GATTClass::clearAttributes()
 
 }
 
+// Core Specification Vol 3, Part G, 7.3.1: the hashed attributes in handle order, only sized when data is NULL
+int GATTClass::databaseHashInput(uint8_t data[], int size) const
+{
+  int length = 0;
+
+  for (uint16_t handle = 1; handle <= _attributeCount; handle++) {
+    const GATTAttributeEntry* entry = &_attributes[handle - 1];
+    BLELocalAttribute* attribute = entry->attribute;
+    uint16_t type;
+
+    if (entry->kind == GATT_ATTRIBUTE_SERVICE) {
+      type = BLETypeService;
+
+      length = putBytes(data, size, length, &handle, sizeof(handle));
+      length = putBytes(data, size, length, &type, sizeof(type));
+      length = putBytes(data, size, length, attribute->uuidData(), attribute->uuidLength());
+    } else if (entry->kind == GATT_ATTRIBUTE_CHARACTERISTIC) {
+      uint16_t valueHandle = handle + 1;
+
+      type = BLETypeCharacteristic;
+
+      length = putBytes(data, size, length, &handle, sizeof(handle));
+      length = putBytes(data, size, length, &type, sizeof(type));
+      length = putBytes(data, size, length, &entry->properties, sizeof(entry->properties));
+      length = putBytes(data, size, length, &valueHandle, sizeof(valueHandle));
+      length = putBytes(data, size, length, attribute->uuidData(), attribute->uuidLength());
+    } else if (entry->kind == GATT_ATTRIBUTE_DESCRIPTOR && attribute->uuidLength() == 2) {
+      type = *(uint16_t*)attribute->uuidData();
+
+      // only the descriptors defined by GATT take part, and only Extended Properties with its value
+      if (type < 0x2900 || type > 0x2905) {
+        continue;
+      }
+
+      length = putBytes(data, size, length, &handle, sizeof(handle));
+      length = putBytes(data, size, length, &type, sizeof(type));
+
+      if (type == 0x2900) {
+        BLELocalDescriptor* descriptor = (BLELocalDescriptor*)attribute;
+
+        length = putBytes(data, size, length, descriptor->value(), descriptor->valueSize());
+      }
+    }
+  }
+
+  return length;
+}
+
 #if !defined(FAKE_GATT)
 GATTClass GATTObj;
 GATTClass& GATT = GATTObj;
@@ -28,6 +28,22 @@
 
 #include "BLEService.h"
 
+enum GATTAttributeKind {
+  GATT_ATTRIBUTE_SERVICE              = 0,
+  GATT_ATTRIBUTE_CHARACTERISTIC       = 1,
+  GATT_ATTRIBUTE_CHARACTERISTIC_VALUE = 2,
+  GATT_ATTRIBUTE_DESCRIPTOR           = 3
+};
+
+// one entry per handle, the entry for handle n is at index n - 1
+struct GATTAttributeEntry {
+  BLELocalAttribute* attribute;
+  uint16_t serviceHandle;        // service declaration the attribute belongs to
+  uint16_t characteristicHandle; // characteristic declaration, 0x0000 for services
+  uint8_t  kind;
+  uint8_t  properties;           // characteristic properties, 0x00 for services and descriptors
+};
+
 class GATTClass {
 public:
   GATTClass();
@@ -46,6 +62,13 @@ protected:
 
   virtual unsigned int attributeCount() const;
   virtual BLELocalAttribute* attribute(unsigned int index) const;
+  virtual const GATTAttributeEntry* attributeEntry(uint16_t handle) const;
+  virtual uint16_t version() const;
+
+  virtual BLELocalCharacteristic* servicesChangedCharacteristic() const;
+  virtual BLELocalCharacteristic* clientSupportedFeaturesCharacteristic() const;
+  virtual BLELocalCharacteristic* databaseHashCharacteristic() const;
+  virtual void updateDatabaseHash();
 
 protected:
   friend class BLELocalCharacteristic;
@@ -55,10 +78,18 @@ protected:
 private:
   virtual void addService(BLELocalService* service);
 
+  virtual bool reserveAttributes(unsigned int count);
+  virtual bool addAttribute(BLELocalAttribute* attribute, uint8_t kind, uint16_t serviceHandle, uint16_t characteristicHandle, uint8_t properties);
   virtual void clearAttributes();
 
+  virtual int databaseHashInput(uint8_t data[], int size) const;
+
 private:
-  BLELinkedList<BLELocalAttribute*> _attributes;
+  GATTAttributeEntry* _attributes;
+  uint16_t            _attributeCount;
+  uint16_t            _attributeCapacity;
+  uint16_t            _version;
+  uint16_t            _databaseHashVersion;
   BLELinkedList<BLELocalService*>   _services;
 
   BLELocalService*              _genericAccessService;
@@ -66,6 +97,8 @@ private:
   BLELocalCharacteristic*       _appearanceCharacteristic;
   BLELocalService*              _genericAttributeService;
   BLELocalCharacteristic*       _servicesChangedCharacteristic;
+  BLELocalCharacteristic*       _clientSupportedFeaturesCharacteristic;
+  BLELocalCharacteristic*       _databaseHashCharacteristic;
 };
 
 extern GATTClass& GATT;
@@ -71,9 +71,35 @@
 #define OCF_LE_CREATE_CONN                0x000d
 #define OCF_LE_CANCEL_CONN                0x000e
 #define OCF_LE_CONN_UPDATE                0x0013
+#define OCF_LE_SET_DATA_LENGTH            0x0022
+#define OCF_LE_READ_DEFAULT_DATA_LENGTH   0x0023
+#define OCF_LE_WRITE_DEFAULT_DATA_LENGTH  0x0024
+#define OCF_LE_READ_PHY                   0x0030
+#define OCF_LE_SET_DEFAULT_PHY            0x0031
+#define OCF_LE_SET_PHY                    0x0032
+#define OCF_LE_SET_ADV_SET_RANDOM_ADDRESS 0x0035
+#define OCF_LE_SET_EXT_ADV_PARAMETERS     0x0036
+#define OCF_LE_SET_EXT_ADV_DATA           0x0037
+#define OCF_LE_SET_EXT_SCAN_RESPONSE_DATA 0x0038
+#define OCF_LE_SET_EXT_ADV_ENABLE         0x0039
+#define OCF_LE_READ_MAX_ADV_DATA_LENGTH   0x003a
+#define OCF_LE_READ_NUM_ADV_SETS          0x003b
+#define OCF_LE_REMOVE_ADV_SET             0x003c
+#define OCF_LE_CLEAR_ADV_SETS             0x003d
+#define OCF_LE_SET_PERIODIC_ADV_PARAMETERS 0x003e
+#define OCF_LE_SET_PERIODIC_ADV_DATA      0x003f
+#define OCF_LE_SET_PERIODIC_ADV_ENABLE    0x0040
+#define OCF_LE_SET_EXT_SCAN_PARAMETERS    0x0041
+#define OCF_LE_SET_EXT_SCAN_ENABLE        0x0042
+#define OCF_LE_EXT_CREATE_CONN            0x0043
+#define OCF_LE_PERIODIC_CREATE_SYNC       0x0044
+#define OCF_LE_PERIODIC_CREATE_SYNC_CANCEL 0x0045
+#define OCF_LE_PERIODIC_TERMINATE_SYNC    0x0046
 
 #define HCI_OE_USER_ENDED_CONNECTION 0x13
 
+#define HCI_COMMAND_TIMEOUT 1000
+
 String metaEventToString(LE_META_EVENT event)
 {
   switch(event){
@@ -82,7 +108,14 @@ String metaEventToString(LE_META_EVENT event)
     case LONG_TERM_KEY_REQUEST: return F("LE_LONG_TERM_KEY_REQUEST");
     case READ_LOCAL_P256_COMPLETE: return F("READ_LOCAL_P256_COMPLETE");
     case GENERATE_DH_KEY_COMPLETE: return F("GENERATE_DH_KEY_COMPLETE");
+    case DATA_LENGTH_CHANGE: return F("DATA_LENGTH_CHANGE");
     case ENHANCED_CONN_COMPLETE: return F("ENHANCED_CONN_COMPLETE");
+    case PHY_UPDATE_COMPLETE: return F("PHY_UPDATE_COMPLETE");
+    case EXTENDED_ADVERTISING_REPORT: return F("EXTENDED_ADVERTISING_REPORT");
+    case PERIODIC_SYNC_ESTABLISHED: return F("PERIODIC_SYNC_ESTABLISHED");
+    case PERIODIC_ADVERTISING_REPORT: return F("PERIODIC_ADVERTISING_REPORT");
+    case PERIODIC_SYNC_LOST: return F("PERIODIC_SYNC_LOST");
+    case ADVERTISING_SET_TERMINATED: return F("ADVERTISING_SET_TERMINATED");
     default: return "event unknown";
   }
 }
@@ -98,12 +131,70 @@ String commandToString(LE_COMMAND command){
   }
 }
 
+struct HCICommandResult {
+  bool done;
+  int status;
+  uint8_t responseLen;
+  uint8_t response[HCI_COMMAND_RESPONSE_SIZE];
+};
+
+// Outcome of commands queued back to back, the first failure wins
+struct HCICommandSequenceResult {
+  int pending;
+  int status;
+};
+
+// the PHY number of commands and events (1M, 2M, Coded) to the bit mask of the API, 0 when unknown
+static uint8_t phyMask(uint8_t phy)
+{
+  return (phy >= 1 && phy <= 3) ? (1 << (phy - 1)) : 0;
+}
+
+static void commandSequenceResultHandler(uint16_t /*opcode*/, int status, uint8_t /*responseLen*/, uint8_t /*response*/[], void* context)
+{
+  HCICommandSequenceResult* result = (HCICommandSequenceResult*)context;
+
+  result->pending--;
+
+  if (result->status == 0) {
+    result->status = status;
+  }
+}
+
+static void commandResultHandler(uint16_t /*opcode*/, int status, uint8_t responseLen, uint8_t response[], void* context)
+{
+  HCICommandResult* result = (HCICommandResult*)context;
+
+  if (responseLen > sizeof(result->response)) {
+    responseLen = sizeof(result->response);
+  }
+
+  result->done = true;
+  result->status = status;
+  result->responseLen = responseLen;
+  memcpy(result->response, response, responseLen);
+}
+
 HCIClass::HCIClass() :
   _debug(NULL),
   _recvIndex(0),
+  _cmdResponseLen(0),
+  _commandCount(0),
+  _cmdCredits(1),
   _pendingPkt(0),
-  _l2CapPduBufferSize(0)
+  _aclNextConnection(0)
 {
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    _aclConnections[i].handle = 0xffff;
+    _aclConnections[i].txQueueCount = 0;
+    _aclConnections[i].rxPool = -1;
+  }
+
+  for (int i = 0; i < HCI_L2CAP_REASSEMBLY_BUFFERS; i++) {
+    _l2CapPool[i].data = NULL;
+    _l2CapPool[i].size = 0;
+    _l2CapPool[i].used = false;
+  }
 }
 
 HCIClass::~HCIClass()
@@ -114,6 +205,18 @@ int HCIClass::begin()
 {
   _recvIndex = 0;
 
+  while (_commandCount) {
+    removeCommand(0);
+  }
+  // the host may send one command before the controller reports its credits
+  _cmdCredits = 1;
+  _extendedCommands = false;
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    removeAclConnection(_aclConnections[i].handle);
+  }
+  _pendingPkt = 0;
+
   return HCITransport.begin();
 }
 
@@ -139,78 +242,125 @@ void HCIClass::poll(unsigned long timeout)
 
   HCITransport.lockForRead();
   while (HCITransport.available()) {
-    byte b = HCITransport.read();
-
-    if (_recvIndex >= (int)sizeof(_recvBuffer)) {
-        _recvIndex = 0;
-        if (_debug) {
-            HCITransport.unlockForRead();
-            _debug->println("_recvBuffer overflow");
-            HCITransport.lockForRead();
-        }
-    }
-
-    _recvBuffer[_recvIndex++] = b;
+    int frameLength = recvFrameLength();
 
-    if (_recvBuffer[0] == HCI_ACLDATA_PKT) {
-      if (_recvIndex > 5 && _recvIndex >= (5 + (_recvBuffer[3] + (_recvBuffer[4] << 8)))) {
+    if (frameLength < 0) {
+      // not the start of a packet we know, skip it
+      if (_debug) {
         HCITransport.unlockForRead();
-        if (_debug) {
-          dumpPkt("HCI ACLDATA RX <- ", _recvIndex, _recvBuffer);
-        }
-#ifdef ARDUINO_AVR_UNO_WIFI_REV2
-        digitalWrite(NINA_RTS, HIGH);
-#endif
-        int pktLen = _recvIndex - 1;
-        _recvIndex = 0;
-
-        handleAclDataPkt(pktLen, &_recvBuffer[1]);
-
-#ifdef ARDUINO_AVR_UNO_WIFI_REV2
-        digitalWrite(NINA_RTS, LOW);
-#endif
+        _debug->println(_recvBuffer[0], HEX);
         HCITransport.lockForRead();
       }
-    } else if (_recvBuffer[0] == HCI_EVENT_PKT) {
-      if (_recvIndex > 3 && _recvIndex >= (3 + _recvBuffer[2])) {
+      _recvIndex = 0;
+      continue;
+    }
+
+    if (frameLength > (int)sizeof(_recvBuffer)) {
+      _recvIndex = 0;
+      if (_debug) {
         HCITransport.unlockForRead();
-        if (_debug) {
-          dumpPkt("HCI EVENT RX <- ", _recvIndex, _recvBuffer);
-        }
-#ifdef ARDUINO_AVR_UNO_WIFI_REV2
-        digitalWrite(NINA_RTS, HIGH);
-#endif
-        // received full event
-        int pktLen = _recvIndex - 1;
-        _recvIndex = 0;
+        _debug->println("_recvBuffer overflow");
+        HCITransport.lockForRead();
+      }
+      continue;
+    }
+
+    // read the rest of what is known of the current packet in one go
+    size_t count = HCITransport.readBytes(&_recvBuffer[_recvIndex], frameLength - _recvIndex);
+
+    if (count == 0) {
+      break;
+    }
+
+    _recvIndex += count;
 
-        handleEventPkt(pktLen, &_recvBuffer[1]);
+    if (_recvIndex < frameLength || recvFrameLength() != frameLength) {
+      // incomplete, or only the header is complete and now the payload length is known
+      continue;
+    }
 
+    // received full packet, it is parsed in place in _recvBuffer
+    HCITransport.unlockForRead();
 #ifdef ARDUINO_AVR_UNO_WIFI_REV2
-        digitalWrite(NINA_RTS, LOW);
+    digitalWrite(NINA_RTS, HIGH);
 #endif
-        HCITransport.lockForRead();
+    int pktLen = _recvIndex - 1;
+    _recvIndex = 0;
+
+    if (_recvBuffer[0] == HCI_ACLDATA_PKT) {
+      if (_debug) {
+        dumpPkt("HCI ACLDATA RX <- ", pktLen + 1, _recvBuffer);
       }
-    } else {
-      _recvIndex = 0;
 
+      handleAclDataPkt(pktLen, &_recvBuffer[1]);
+    } else {
       if (_debug) {
-        HCITransport.unlockForRead();
-        _debug->println(b, HEX);
-        HCITransport.lockForRead();
+        dumpPkt("HCI EVENT RX <- ", pktLen + 1, _recvBuffer);
       }
+
+      handleEventPkt(pktLen, &_recvBuffer[1]);
     }
+
+#ifdef ARDUINO_AVR_UNO_WIFI_REV2
+    digitalWrite(NINA_RTS, LOW);
+#endif
+    HCITransport.lockForRead();
   }
 
 #ifdef ARDUINO_AVR_UNO_WIFI_REV2
   digitalWrite(NINA_RTS, HIGH);
 #endif
   HCITransport.unlockForRead();
+
+  flushCommands();
+  flushAclQueues();
+  checkL2CapReassembly();
+
+  // continue the queued ATT client operations with the responses received
+  ATT.runOperations();
+  ATT.sendPendingNotifications();
+  ATT.expireIndications();
+}
+
+int HCIClass::recvFrameLength()
+{
+  // length of the H4 packet being received, as far as the bytes received so far tell
+  if (_recvIndex == 0) {
+    return 1;
+  }
+
+  switch (_recvBuffer[0]) {
+    case HCI_ACLDATA_PKT:
+      if (_recvIndex < 5) {
+        return 5;
+      }
+      return 5 + (_recvBuffer[3] | (_recvBuffer[4] << 8));
+
+    case HCI_EVENT_PKT:
+      if (_recvIndex < 3) {
+        return 3;
+      }
+      return 3 + _recvBuffer[2];
+
+    default:
+      return -1;
+  }
 }
 
 int HCIClass::reset()
 {
-  return sendCommand(OGF_HOST_CTL << 10 | OCF_RESET);
+  int result = sendCommand(OGF_HOST_CTL << 10 | OCF_RESET);
+
+  if (result == 0) {
+    _extendedCommands = false;
+  }
+
+  return result;
+}
+
+bool HCIClass::extendedCommands()
+{
+  return _extendedCommands;
 }
 
 int HCIClass::readLocalVersion(uint8_t& hciVer, uint16_t& hciRev, uint8_t& lmpVer, uint16_t& manufacturer, uint16_t& lmpSubVer)
@@ -297,12 +447,11 @@ int HCIClass::readLeBufferSize(uint16_t& pktLen, uint8_t& maxPkt)
       uint8_t maxPkt;
     } *leBufferSize = (HCILeBufferSize*)_cmdResponse;
 
-    pktLen = leBufferSize->pktLen;
+    _aclPktLen = pktLen = leBufferSize->pktLen;
     _maxPkt = maxPkt = leBufferSize->maxPkt;
 
-#ifndef __AVR__
-    ATT.setMaxMtu(pktLen - 9); // max pkt len - ACL header size
-#endif
+    // outgoing PDUs are fragmented to pktLen, the MTU is not bound to it
+    ATT.setMaxMtu(ATT_MAX_MTU);
   }
 
   return result;
@@ -444,6 +593,44 @@ int HCIClass::leCreateConn(uint16_t interval, uint16_t window, uint8_t initiator
   return sendCommand(OGF_LE_CTL << 10 | OCF_LE_CREATE_CONN, sizeof(leCreateConnData), &leCreateConnData);
 }
 
+int HCIClass::leExtendedCreateConn(uint8_t initiatorFilter, uint8_t ownBdaddrType, uint8_t peerBdaddrType, uint8_t peerBdaddr[6],
+                                    uint16_t interval, uint16_t window, uint16_t minInterval, uint16_t maxInterval,
+                                    uint16_t latency, uint16_t supervisionTimeout, uint16_t minCeLength, uint16_t maxCeLength)
+{
+  struct __attribute__ ((packed)) HCILeExtendedCreateConnData {
+    uint8_t initiatorFilter;
+    uint8_t ownBdaddrType;
+    uint8_t peerBdaddrType;
+    uint8_t peerBdaddr[6];
+    uint8_t phys;
+    // parameters of the 1M PHY, the only one initiated on
+    uint16_t interval;
+    uint16_t window;
+    uint16_t minInterval;
+    uint16_t maxInterval;
+    uint16_t latency;
+    uint16_t supervisionTimeout;
+    uint16_t minCeLength;
+    uint16_t maxCeLength;
+  } leExtendedCreateConnData;
+
+  leExtendedCreateConnData.initiatorFilter = initiatorFilter;
+  leExtendedCreateConnData.ownBdaddrType = ownBdaddrType;
+  leExtendedCreateConnData.peerBdaddrType = peerBdaddrType;
+  memcpy(leExtendedCreateConnData.peerBdaddr, peerBdaddr, sizeof(leExtendedCreateConnData.peerBdaddr));
+  leExtendedCreateConnData.phys = 0x01;
+  leExtendedCreateConnData.interval = interval;
+  leExtendedCreateConnData.window = window;
+  leExtendedCreateConnData.minInterval = minInterval;
+  leExtendedCreateConnData.maxInterval = maxInterval;
+  leExtendedCreateConnData.latency = latency;
+  leExtendedCreateConnData.supervisionTimeout = supervisionTimeout;
+  leExtendedCreateConnData.minCeLength = minCeLength;
+  leExtendedCreateConnData.maxCeLength = maxCeLength;
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_EXT_CREATE_CONN, sizeof(leExtendedCreateConnData), &leExtendedCreateConnData);
+}
+
 int HCIClass::leCancelConn()
 {
   return sendCommand(OGF_LE_CTL << 10 | OCF_LE_CANCEL_CONN, 0, NULL);
@@ -472,6 +659,368 @@ int HCIClass::leConnUpdate(uint16_t handle, uint16_t minInterval, uint16_t maxIn
 
   return sendCommand(OGF_LE_CTL << 10 | OCF_LE_CONN_UPDATE, sizeof(leConnUpdateData), &leConnUpdateData);
 }
+
+int HCIClass::leSetDataLength(uint16_t handle, uint16_t txOctets, uint16_t txTime)
+{
+  struct __attribute__ ((packed)) HCILeSetDataLength {
+    uint16_t handle;
+    uint16_t txOctets;
+    uint16_t txTime;
+  } leSetDataLengthData = { handle, txOctets, txTime };
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_DATA_LENGTH, sizeof(leSetDataLengthData), &leSetDataLengthData);
+}
+
+int HCIClass::leReadSuggestedDefaultDataLength(uint16_t& txOctets, uint16_t& txTime)
+{
+  int result = sendCommand(OGF_LE_CTL << 10 | OCF_LE_READ_DEFAULT_DATA_LENGTH);
+
+  if (result == 0) {
+    struct __attribute__ ((packed)) HCILeDefaultDataLength {
+      uint16_t txOctets;
+      uint16_t txTime;
+    } *leDefaultDataLength = (HCILeDefaultDataLength*)_cmdResponse;
+
+    txOctets = leDefaultDataLength->txOctets;
+    txTime = leDefaultDataLength->txTime;
+  }
+
+  return result;
+}
+
+int HCIClass::leWriteSuggestedDefaultDataLength(uint16_t txOctets, uint16_t txTime)
+{
+  struct __attribute__ ((packed)) HCILeDefaultDataLength {
+    uint16_t txOctets;
+    uint16_t txTime;
+  } leDefaultDataLength = { txOctets, txTime };
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_WRITE_DEFAULT_DATA_LENGTH, sizeof(leDefaultDataLength), &leDefaultDataLength);
+}
+
+int HCIClass::leReadPhy(uint16_t handle, uint8_t& txPhy, uint8_t& rxPhy)
+{
+  int result = sendCommand(OGF_LE_CTL << 10 | OCF_LE_READ_PHY, sizeof(handle), &handle);
+
+  if (result == 0) {
+    struct __attribute__ ((packed)) HCILeReadPhy {
+      uint16_t handle;
+      uint8_t txPhy;
+      uint8_t rxPhy;
+    } *leReadPhy = (HCILeReadPhy*)_cmdResponse;
+
+    // the command returns the PHY number, 3 being Coded
+    txPhy = phyMask(leReadPhy->txPhy);
+    rxPhy = phyMask(leReadPhy->rxPhy);
+  }
+
+  return result;
+}
+
+int HCIClass::leSetDefaultPhy(uint8_t allPhys, uint8_t txPhys, uint8_t rxPhys)
+{
+  struct __attribute__ ((packed)) HCILeSetDefaultPhy {
+    uint8_t allPhys;
+    uint8_t txPhys;
+    uint8_t rxPhys;
+  } leSetDefaultPhyData = { allPhys, txPhys, rxPhys };
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_DEFAULT_PHY, sizeof(leSetDefaultPhyData), &leSetDefaultPhyData);
+}
+
+int HCIClass::leSetPhy(uint16_t handle, uint8_t allPhys, uint8_t txPhys, uint8_t rxPhys, uint16_t phyOptions)
+{
+  struct __attribute__ ((packed)) HCILeSetPhy {
+    uint16_t handle;
+    uint8_t allPhys;
+    uint8_t txPhys;
+    uint8_t rxPhys;
+    uint16_t phyOptions;
+  } leSetPhyData = { handle, allPhys, txPhys, rxPhys, phyOptions };
+
+  // only a Command Status is returned, the PHY Update Complete event follows
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_PHY, sizeof(leSetPhyData), &leSetPhyData);
+}
+
+int HCIClass::leSetAdvertisingSetRandomAddress(uint8_t handle, uint8_t address[6])
+{
+  struct __attribute__ ((packed)) HCILeSetAdvertisingSetRandomAddress {
+    uint8_t handle;
+    uint8_t address[6];
+  } leSetAdvertisingSetRandomAddress;
+
+  leSetAdvertisingSetRandomAddress.handle = handle;
+  memcpy(leSetAdvertisingSetRandomAddress.address, address, sizeof(leSetAdvertisingSetRandomAddress.address));
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_ADV_SET_RANDOM_ADDRESS, sizeof(leSetAdvertisingSetRandomAddress), &leSetAdvertisingSetRandomAddress);
+}
+
+int HCIClass::leSetExtendedAdvertisingParameters(uint8_t handle, uint16_t eventProperties,
+                                 uint32_t minInterval, uint32_t maxInterval, uint8_t chanMap,
+                                 uint8_t ownBdaddrType, uint8_t filter, int8_t txPower,
+                                 uint8_t primaryPhy, uint8_t secondaryPhy, uint8_t sid)
+{
+  struct __attribute__ ((packed)) HCILeExtendedAdvertisingParameters {
+    uint8_t handle;
+    uint16_t eventProperties;
+    uint8_t minInterval[3];
+    uint8_t maxInterval[3];
+    uint8_t chanMap;
+    uint8_t ownBdaddrType;
+    uint8_t peerBdaddrType;
+    uint8_t peerBdaddr[6];
+    uint8_t filter;
+    int8_t txPower;
+    uint8_t primaryPhy;
+    uint8_t secondaryMaxSkip;
+    uint8_t secondaryPhy;
+    uint8_t sid;
+    uint8_t scanRequestNotification;
+  } leExtendedAdvertisingParameters;
+
+  memset(&leExtendedAdvertisingParameters, 0x00, sizeof(leExtendedAdvertisingParameters));
+
+  leExtendedAdvertisingParameters.handle = handle;
+  leExtendedAdvertisingParameters.eventProperties = eventProperties;
+  // the intervals are 24 bit values
+  memcpy(leExtendedAdvertisingParameters.minInterval, &minInterval, 3);
+  memcpy(leExtendedAdvertisingParameters.maxInterval, &maxInterval, 3);
+  leExtendedAdvertisingParameters.chanMap = chanMap;
+  leExtendedAdvertisingParameters.ownBdaddrType = ownBdaddrType;
+  leExtendedAdvertisingParameters.filter = filter;
+  leExtendedAdvertisingParameters.txPower = txPower;
+  leExtendedAdvertisingParameters.primaryPhy = primaryPhy;
+  leExtendedAdvertisingParameters.secondaryPhy = secondaryPhy;
+  leExtendedAdvertisingParameters.sid = sid;
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_EXT_ADV_PARAMETERS, sizeof(leExtendedAdvertisingParameters), &leExtendedAdvertisingParameters);
+}
+
+int HCIClass::leSetExtendedAdvertisingData(uint8_t handle, uint16_t length, uint8_t data[])
+{
+  return leSetExtendedData(OCF_LE_SET_EXT_ADV_DATA, handle, length, data);
+}
+
+int HCIClass::leSetExtendedScanResponseData(uint8_t handle, uint16_t length, uint8_t data[])
+{
+  return leSetExtendedData(OCF_LE_SET_EXT_SCAN_RESPONSE_DATA, handle, length, data);
+}
+
+int HCIClass::leSetExtendedData(uint16_t ocf, uint8_t handle, uint16_t length, uint8_t data[])
+{
+  // handle, operation, [fragment preference,] length and data: the periodic
+  // advertising data command has no fragment preference
+  uint8_t command[255];
+  uint8_t headerLength = (ocf == OCF_LE_SET_PERIODIC_ADV_DATA) ? 3 : 4;
+
+  HCICommandSequenceResult result = { 0, 0 };
+  uint16_t offset = 0;
+
+  // the fragments are queued back to back, only the last one is waited for
+  do {
+    uint16_t fragmentLength = length - offset;
+
+    if (fragmentLength > (sizeof(command) - headerLength)) {
+      fragmentLength = sizeof(command) - headerLength;
+    }
+
+    command[0] = handle;
+
+    if (offset == 0) {
+      // complete data or first fragment
+      command[1] = (fragmentLength == length) ? 0x03 : 0x01;
+    } else {
+      // last or intermediate fragment
+      command[1] = ((offset + fragmentLength) == length) ? 0x02 : 0x00;
+    }
+
+    if (headerLength == 4) {
+      command[2] = 0x01;
+    }
+
+    command[headerLength - 1] = fragmentLength;
+    memcpy(&command[headerLength], &data[offset], fragmentLength);
+
+    while (_commandCount >= HCI_COMMAND_QUEUE_SIZE) {
+      poll();
+    }
+
+    if (sendCommandAsync(OGF_LE_CTL << 10 | ocf, headerLength + fragmentLength, command,
+                         commandSequenceResultHandler, &result) != 0) {
+      result.status = -1;
+      break;
+    }
+
+    result.pending++;
+    offset += fragmentLength;
+  } while (offset < length);
+
+  // the command engine expires the fragments the controller never answers
+  while (result.pending) {
+    poll();
+  }
+
+  return result.status;
+}
+
+int HCIClass::leSetExtendedAdvertisingEnable(uint8_t enable, uint8_t numSets, uint8_t handles[])
+{
+  struct __attribute__ ((packed)) HCILeExtendedAdvertisingSet {
+    uint8_t handle;
+    uint16_t duration;
+    uint8_t maxEvents;
+  };
+
+  uint8_t leExtendedAdvertisingEnable[2 + numSets * sizeof(HCILeExtendedAdvertisingSet)];
+  HCILeExtendedAdvertisingSet* sets = (HCILeExtendedAdvertisingSet*)&leExtendedAdvertisingEnable[2];
+
+  leExtendedAdvertisingEnable[0] = enable;
+  leExtendedAdvertisingEnable[1] = numSets;
+
+  for (int i = 0; i < numSets; i++) {
+    // advertise until disabled
+    sets[i].handle = handles[i];
+    sets[i].duration = 0;
+    sets[i].maxEvents = 0;
+  }
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_EXT_ADV_ENABLE, sizeof(leExtendedAdvertisingEnable), leExtendedAdvertisingEnable);
+}
+
+int HCIClass::leReadMaximumAdvertisingDataLength(uint16_t& length)
+{
+  int result = sendCommand(OGF_LE_CTL << 10 | OCF_LE_READ_MAX_ADV_DATA_LENGTH);
+
+  if (result == 0) {
+    length = _cmdResponse[0] | (_cmdResponse[1] << 8);
+  }
+
+  return result;
+}
+
+int HCIClass::leReadNumberOfSupportedAdvertisingSets(uint8_t& numSets)
+{
+  int result = sendCommand(OGF_LE_CTL << 10 | OCF_LE_READ_NUM_ADV_SETS);
+
+  if (result == 0) {
+    numSets = _cmdResponse[0];
+  }
+
+  return result;
+}
+
+int HCIClass::leRemoveAdvertisingSet(uint8_t handle)
+{
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_REMOVE_ADV_SET, sizeof(handle), &handle);
+}
+
+int HCIClass::leClearAdvertisingSets()
+{
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_CLEAR_ADV_SETS);
+}
+
+int HCIClass::leSetPeriodicAdvertisingParameters(uint8_t handle, uint16_t minInterval, uint16_t maxInterval, uint16_t properties)
+{
+  struct __attribute__ ((packed)) HCILePeriodicAdvertisingParameters {
+    uint8_t handle;
+    uint16_t minInterval;
+    uint16_t maxInterval;
+    uint16_t properties;
+  } lePeriodicAdvertisingParameters = { handle, minInterval, maxInterval, properties };
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_PERIODIC_ADV_PARAMETERS, sizeof(lePeriodicAdvertisingParameters), &lePeriodicAdvertisingParameters);
+}
+
+int HCIClass::leSetPeriodicAdvertisingData(uint8_t handle, uint16_t length, uint8_t data[])
+{
+  return leSetExtendedData(OCF_LE_SET_PERIODIC_ADV_DATA, handle, length, data);
+}
+
+int HCIClass::leSetPeriodicAdvertisingEnable(uint8_t enable, uint8_t handle)
+{
+  struct __attribute__ ((packed)) HCILePeriodicAdvertisingEnable {
+    uint8_t enable;
+    uint8_t handle;
+  } lePeriodicAdvertisingEnable = { enable, handle };
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_PERIODIC_ADV_ENABLE, sizeof(lePeriodicAdvertisingEnable), &lePeriodicAdvertisingEnable);
+}
+
+int HCIClass::leSetExtendedScanParameters(uint8_t ownBdaddrType, uint8_t filter, uint8_t phys,
+                                          uint8_t type, uint16_t interval, uint16_t window)
+{
+  struct __attribute__ ((packed)) HCILeExtendedScanPhy {
+    uint8_t type;
+    uint16_t interval;
+    uint16_t window;
+  };
+
+  uint8_t numPhys = ((phys & 0x01) ? 1 : 0) + ((phys & 0x04) ? 1 : 0);
+  uint8_t leExtendedScanParameters[3 + numPhys * sizeof(HCILeExtendedScanPhy)];
+  HCILeExtendedScanPhy* scanPhys = (HCILeExtendedScanPhy*)&leExtendedScanParameters[3];
+
+  leExtendedScanParameters[0] = ownBdaddrType;
+  leExtendedScanParameters[1] = filter;
+  leExtendedScanParameters[2] = phys & 0x05;
+
+  // one entry per PHY of the mask, in bit order
+  for (int i = 0; i < numPhys; i++) {
+    scanPhys[i].type = type;
+    scanPhys[i].interval = interval;
+    scanPhys[i].window = window;
+  }
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_EXT_SCAN_PARAMETERS, sizeof(leExtendedScanParameters), leExtendedScanParameters);
+}
+
+int HCIClass::leSetExtendedScanEnable(uint8_t enabled, uint8_t duplicates)
+{
+  struct __attribute__ ((packed)) HCILeExtendedScanEnable {
+    uint8_t enabled;
+    uint8_t duplicates;
+    uint16_t duration;
+    uint16_t period;
+  } leExtendedScanEnable = { enabled, duplicates, 0, 0 };
+
+  // scan until disabled
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_EXT_SCAN_ENABLE, sizeof(leExtendedScanEnable), &leExtendedScanEnable);
+}
+
+int HCIClass::lePeriodicAdvertisingCreateSync(uint8_t options, uint8_t sid, uint8_t addressType, uint8_t address[6],
+                                              uint16_t skip, uint16_t timeout)
+{
+  struct __attribute__ ((packed)) HCILePeriodicAdvertisingCreateSync {
+    uint8_t options;
+    uint8_t sid;
+    uint8_t addressType;
+    uint8_t address[6];
+    uint16_t skip;
+    uint16_t timeout;
+    uint8_t cteType;
+  } lePeriodicAdvertisingCreateSync;
+
+  lePeriodicAdvertisingCreateSync.options = options;
+  lePeriodicAdvertisingCreateSync.sid = sid;
+  lePeriodicAdvertisingCreateSync.addressType = addressType;
+  memcpy(lePeriodicAdvertisingCreateSync.address, address, sizeof(lePeriodicAdvertisingCreateSync.address));
+  lePeriodicAdvertisingCreateSync.skip = skip;
+  lePeriodicAdvertisingCreateSync.timeout = timeout;
+  lePeriodicAdvertisingCreateSync.cteType = 0x00;
+
+  // only a Command Status is returned, the Periodic Advertising Sync Established event follows
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_PERIODIC_CREATE_SYNC, sizeof(lePeriodicAdvertisingCreateSync), &lePeriodicAdvertisingCreateSync);
+}
+
+int HCIClass::lePeriodicAdvertisingCreateSyncCancel()
+{
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_PERIODIC_CREATE_SYNC_CANCEL);
+}
+
+int HCIClass::lePeriodicAdvertisingTerminateSync(uint16_t syncHandle)
+{
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_PERIODIC_TERMINATE_SYNC, sizeof(syncHandle), &syncHandle);
+}
+
 void HCIClass::saveNewAddress(uint8_t addressType, uint8_t* address, uint8_t* peerIrk, uint8_t* localIrk){
   (void)addressType;
   (void)localIrk;
@@ -633,40 +1182,327 @@ int HCIClass::tryResolveAddress(uint8_t* BDAddr, uint8_t* address){
   return 0;
 }
 
-int HCIClass::sendAclPkt(uint16_t handle, uint8_t cid, uint8_t plen, void* data)
+int HCIClass::sendAclPkt(uint16_t handle, uint16_t cid, uint16_t plen, void* data)
 {
-  while (_pendingPkt >= _maxPkt) {
-    poll();
-  }
-
   struct __attribute__ ((packed)) HCIACLHdr {
     uint8_t pktType;
     uint16_t handle;
     uint16_t dlen;
     uint16_t plen;
     uint16_t cid;
-  } aclHdr = { HCI_ACLDATA_PKT, handle, uint8_t(plen + 4), plen, cid };
+  } aclHdr = { HCI_ACLDATA_PKT, handle, uint16_t(plen + 4), plen, cid };
+
+  // the L2CAP header, the payload follows it in the fragments
+  uint8_t* l2capHdr = (uint8_t*)&aclHdr.plen;
+  uint16_t aclPktLen = _aclPktLen ? min(_aclPktLen, (uint16_t)HCI_ACL_MAX_PKT_LEN) : HCI_ACL_MIN_PKT_LEN;
+  int index = aclConnectionIndex(handle);
+
+  if (index < 0) {
+    // not a connection we know about, just wait for free controller buffers
+    for (uint16_t offset = 0; offset < aclHdr.dlen;) {
+      while (_pendingPkt >= _maxPkt) {
+        poll();
+      }
 
-  uint8_t txBuffer[sizeof(aclHdr) + plen];
-  memcpy(txBuffer, &aclHdr, sizeof(aclHdr));
-  memcpy(&txBuffer[sizeof(aclHdr)], data, plen);
+      offset += writeAclFragment(index, handle, l2capHdr, (uint8_t*)data, aclHdr.dlen, offset);
+    }
 
-  if (_debug) {
-    dumpPkt("HCI ACLDATA TX -> ", sizeof(aclHdr) + plen, txBuffer);
+    return 0;
   }
-#ifdef _BLE_TRACE_
-  Serial.print("Data tx -> ");
-  for(int i=0; i< sizeof(aclHdr) + plen;i++){
+
+  if (_aclConnections[index].txQueueCount == 0 && aclCanSend(index) && aclHdr.dlen <= aclPktLen) {
+    writeAclFragment(index, handle, l2capHdr, (uint8_t*)data, aclHdr.dlen, 0);
+
+    return 0;
+  }
+
+  // the whole L2CAP PDU is queued, it is copied before polling so the caller may reuse its buffer
+  uint16_t length = sizeof(aclHdr) + plen;
+  uint8_t* pkt = (uint8_t*)malloc(length);
+
+  if (pkt != NULL) {
+    memcpy(pkt, &aclHdr, sizeof(aclHdr));
+    memcpy(&pkt[sizeof(aclHdr)], data, plen);
+  }
+
+  if (_aclConnections[index].txQueueCount >= HCI_ACL_TX_QUEUE_SIZE) {
+    // the peer doesn't keep up, only its own sender has to wait
+    _aclConnections[index].stalls++;
+
+    while (_aclConnections[index].handle == handle && _aclConnections[index].txQueueCount >= HCI_ACL_TX_QUEUE_SIZE) {
+      poll();
+    }
+
+    if (_aclConnections[index].handle != handle) {
+      // disconnected in the meantime
+      if (pkt != NULL) {
+        free(pkt);
+      }
+
+      return -1;
+    }
+  }
+
+  if (pkt == NULL) {
+    // no memory to queue it, wait for the queue to drain and send it directly
+    for (uint16_t offset = 0; offset < aclHdr.dlen;) {
+      while (_aclConnections[index].handle == handle && (_aclConnections[index].txQueueCount || !aclCanSend(index))) {
+        poll();
+      }
+
+      if (_aclConnections[index].handle != handle) {
+        return -1;
+      }
+
+      offset += writeAclFragment(index, handle, l2capHdr, (uint8_t*)data, aclHdr.dlen, offset);
+    }
+
+    return 0;
+  }
+
+  int tail = (_aclConnections[index].txQueueHead + _aclConnections[index].txQueueCount) % HCI_ACL_TX_QUEUE_SIZE;
+  _aclConnections[index].txQueue[tail] = pkt;
+  _aclConnections[index].txQueueCount++;
+
+  // start with the fragments the controller has room for
+  flushAclQueues();
+
+  return 0;
+}
+
+int HCIClass::aclPendingPackets(uint16_t handle)
+{
+  int index = aclConnectionIndex(handle);
+
+  if (index < 0) {
+    return 0;
+  }
+
+  return _aclConnections[index].pendingPkt;
+}
+
+int HCIClass::aclQueueDepth(uint16_t handle)
+{
+  int index = aclConnectionIndex(handle);
+
+  if (index < 0) {
+    return 0;
+  }
+
+  return _aclConnections[index].txQueueCount;
+}
+
+unsigned long HCIClass::aclStallCount(uint16_t handle)
+{
+  int index = aclConnectionIndex(handle);
+
+  if (index < 0) {
+    return 0;
+  }
+
+  return _aclConnections[index].stalls;
+}
+
+void HCIClass::addAclConnection(uint16_t handle)
+{
+  int index = aclConnectionIndex(handle);
+
+  if (index < 0) {
+    index = aclConnectionIndex(0xffff);
+  }
+
+  if (index < 0) {
+    return;
+  }
+
+  _aclConnections[index].handle = handle;
+  _aclConnections[index].pendingPkt = 0;
+  _aclConnections[index].txQueueHead = 0;
+  _aclConnections[index].txQueueCount = 0;
+  _aclConnections[index].txOffset = 0;
+  _aclConnections[index].stalls = 0;
+  _aclConnections[index].rxPool = -1;
+  _aclConnections[index].rxDropped = 0;
+}
+
+void HCIClass::removeAclConnection(uint16_t handle)
+{
+  int index = aclConnectionIndex(handle);
+
+  if (index < 0 || handle == 0xffff) {
+    return;
+  }
+
+  while (_aclConnections[index].txQueueCount) {
+    free(_aclConnections[index].txQueue[_aclConnections[index].txQueueHead]);
+
+    _aclConnections[index].txQueueHead = (_aclConnections[index].txQueueHead + 1) % HCI_ACL_TX_QUEUE_SIZE;
+    _aclConnections[index].txQueueCount--;
+  }
+  _aclConnections[index].txOffset = 0;
+
+  // the controller drops the packets of a closed connection without reporting them
+  if (_aclConnections[index].pendingPkt < _pendingPkt) {
+    _pendingPkt -= _aclConnections[index].pendingPkt;
+  } else {
+    _pendingPkt = 0;
+  }
+
+  if (_aclConnections[index].rxPool >= 0) {
+    stopL2CapReassembly(index, false);
+  }
+
+  _aclConnections[index].handle = 0xffff;
+  _aclConnections[index].pendingPkt = 0;
+}
+
+unsigned long HCIClass::l2capDropCount(uint16_t handle)
+{
+  int index = aclConnectionIndex(handle);
+
+  if (index < 0) {
+    return 0;
+  }
+
+  return _aclConnections[index].rxDropped;
+}
+
+int HCIClass::aclConnectionIndex(uint16_t handle)
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_aclConnections[i].handle == handle) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+void HCIClass::writeAclPkt(int connectionIndex, uint8_t pkt[], uint16_t length)
+{
+  if (_debug) {
+    dumpPkt("HCI ACLDATA TX -> ", length, pkt);
+  }
+#ifdef _BLE_TRACE_
+  Serial.print("Data tx -> ");
+  for(int i=0; i< length;i++){
     Serial.print(" 0x");
-    Serial.print(txBuffer[i],HEX);
+    Serial.print(pkt[i],HEX);
   }
   Serial.println(".");
 #endif
 
   _pendingPkt++;
-  HCITransport.write(txBuffer, sizeof(aclHdr) + plen);
 
-  return 0;
+  if (connectionIndex >= 0) {
+    _aclConnections[connectionIndex].pendingPkt++;
+  }
+
+  HCITransport.write(pkt, length);
+}
+
+uint16_t HCIClass::writeAclFragment(int connectionIndex, uint16_t handle, uint8_t l2capHdr[], uint8_t data[], uint16_t dlen, uint16_t offset)
+{
+  struct __attribute__ ((packed)) HCIACLHdr {
+    uint8_t pktType;
+    uint16_t handle;
+    uint16_t dlen;
+  } fragmentHdr = {
+    HCI_ACLDATA_PKT,
+    // the first fragment starts the PDU, the following ones continue it
+    uint16_t((handle & 0x0fff) | (offset ? 0x1000 : 0x0000)),
+    0
+  };
+
+  uint16_t aclPktLen = _aclPktLen ? min(_aclPktLen, (uint16_t)HCI_ACL_MAX_PKT_LEN) : HCI_ACL_MIN_PKT_LEN;
+  fragmentHdr.dlen = min((uint16_t)(dlen - offset), aclPktLen);
+
+  uint8_t* fragment = &_aclTxBuffer[sizeof(fragmentHdr)];
+  uint16_t length = fragmentHdr.dlen;
+
+  memcpy(_aclTxBuffer, &fragmentHdr, sizeof(fragmentHdr));
+
+  // the fragment may start in the 4 byte L2CAP header
+  if (offset < 4) {
+    uint16_t hdrLength = min((uint16_t)(4 - offset), length);
+
+    memcpy(fragment, &l2capHdr[offset], hdrLength);
+    fragment += hdrLength;
+    length -= hdrLength;
+    offset += hdrLength;
+  }
+
+  if (length) {
+    memcpy(fragment, &data[offset - 4], length);
+  }
+
+  writeAclPkt(connectionIndex, _aclTxBuffer, sizeof(fragmentHdr) + fragmentHdr.dlen);
+
+  return fragmentHdr.dlen;
+}
+
+bool HCIClass::aclCanSend(int connectionIndex)
+{
+  if (_pendingPkt >= _maxPkt) {
+    return false;
+  }
+
+  // the controller buffers are shared by the connections sending, so a slow peer can't hold all of them
+  int connections = 1;
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (i != connectionIndex && _aclConnections[i].handle != 0xffff &&
+        (_aclConnections[i].pendingPkt || _aclConnections[i].txQueueCount)) {
+      connections++;
+    }
+  }
+
+  int share = _maxPkt / connections;
+
+  if (share < 1) {
+    share = 1;
+  }
+
+  return _aclConnections[connectionIndex].pendingPkt < share;
+}
+
+void HCIClass::flushAclQueues()
+{
+  while (_pendingPkt < _maxPkt) {
+    int index = -1;
+
+    // round robin over the connections with queued packets and a free share of the buffers, one fragment each
+    for (int n = 0; n < ATT_MAX_PEERS; n++) {
+      int i = (_aclNextConnection + n) % ATT_MAX_PEERS;
+
+      if (_aclConnections[i].txQueueCount && aclCanSend(i)) {
+        index = i;
+        break;
+      }
+    }
+
+    if (index < 0) {
+      break;
+    }
+
+    uint8_t* pkt = _aclConnections[index].txQueue[_aclConnections[index].txQueueHead];
+
+    _aclNextConnection = (index + 1) % ATT_MAX_PEERS;
+    uint16_t dlen = pkt[3] | (pkt[4] << 8);
+
+    _aclConnections[index].txOffset += writeAclFragment(index, pkt[1] | (pkt[2] << 8), &pkt[5], &pkt[9], dlen, _aclConnections[index].txOffset);
+
+    if (_aclConnections[index].txOffset < dlen) {
+      // more fragments to come
+      continue;
+    }
+
+    _aclConnections[index].txQueueHead = (_aclConnections[index].txQueueHead + 1) % HCI_ACL_TX_QUEUE_SIZE;
+    _aclConnections[index].txQueueCount--;
+    _aclConnections[index].txOffset = 0;
+
+    free(pkt);
+  }
 }
 
 int HCIClass::disconnect(uint16_t handle)
@@ -690,6 +1526,94 @@ void HCIClass::noDebug()
 }
 
 int HCIClass::sendCommand(uint16_t opcode, uint8_t plen, void* parameters)
+{
+  HCICommandResult result;
+
+  result.done = false;
+  result.status = -1;
+  result.responseLen = 0;
+
+  for (unsigned long start = millis(); _commandCount >= HCI_COMMAND_QUEUE_SIZE && millis() < (start + HCI_COMMAND_TIMEOUT);) {
+    poll();
+  }
+
+  if (sendCommandAsync(opcode, plen, parameters, commandResultHandler, &result) != 0) {
+    return -1;
+  }
+
+  // the command engine expires the command if the controller never answers
+  while (!result.done) {
+    poll();
+  }
+
+  _cmdResponseLen = result.responseLen;
+  memcpy(_cmdResponse, result.response, result.responseLen);
+
+  return result.status;
+}
+
+int HCIClass::sendCommandAsync(uint16_t opcode, uint8_t plen, void* parameters,
+                               HCICommandCompleteHandler handler, void* context)
+{
+  if (_commandCount >= HCI_COMMAND_QUEUE_SIZE) {
+#ifdef _BLE_TRACE_
+    Serial.println("HCI command queue full");
+#endif
+    return -1;
+  }
+
+  bool queued = false;
+
+  for (int i = 0; i < _commandCount; i++) {
+    if (!_commands[i].sent) {
+      queued = true;
+      break;
+    }
+  }
+
+  uint8_t* storedParameters = NULL;
+
+  // only keep a copy of the parameters if the command has to wait for a credit
+  if ((queued || _cmdCredits == 0) && plen) {
+    storedParameters = (uint8_t*)malloc(plen);
+
+    if (storedParameters == NULL) {
+      return -1;
+    }
+
+    memcpy(storedParameters, parameters, plen);
+  }
+
+  int index = _commandCount++;
+
+  _commands[index].opcode = opcode;
+  _commands[index].plen = plen;
+  _commands[index].parameters = storedParameters;
+  _commands[index].sent = false;
+  _commands[index].time = millis();
+  _commands[index].handler = handler;
+  _commands[index].context = context;
+
+  if (!queued && _cmdCredits > 0) {
+    _commands[index].sent = true;
+
+    writeCommand(opcode, plen, (uint8_t*)parameters);
+  }
+
+  return 0;
+}
+
+int HCIClass::pendingCommands()
+{
+  return _commandCount;
+}
+
+uint8_t HCIClass::commandCredits()
+{
+  return _cmdCredits;
+}
+
+void HCIClass::writeCommand(uint16_t opcode, uint8_t plen, uint8_t parameters[])
 {
   struct __attribute__ ((packed)) {
     uint8_t pktType;
@@ -712,19 +1636,110 @@ int HCIClass::sendCommand(uint16_t opcode, uint8_t plen, void* parameters)
   }
   Serial.println("");
 #endif
+
+  if (_cmdCredits > 0) {
+    _cmdCredits--;
+  }
+
   HCITransport.write(txBuffer, sizeof(pktHdr) + plen);
+}
+
+void HCIClass::flushCommands()
+{
+  unsigned long now = millis();
 
-  _cmdCompleteOpcode = 0xffff;
-  _cmdCompleteStatus = -1;
+  for (int i = 0; i < _commandCount; i++) {
+    if ((now - _commands[i].time) < HCI_COMMAND_TIMEOUT) {
+      continue;
+    }
 
-  for (unsigned long start = millis(); _cmdCompleteOpcode != opcode && millis() < (start + 1000);) {
-    poll();
+#ifdef _BLE_TRACE_
+    Serial.print("HCI command timeout, opcode: 0x");
+    Serial.println(_commands[i].opcode, HEX);
+#endif
+    uint16_t opcode = _commands[i].opcode;
+    HCICommandCompleteHandler handler = _commands[i].handler;
+    void* context = _commands[i].context;
+
+    if (_commands[i].sent && _cmdCredits == 0) {
+      // the answer is lost, don't let it stall the commands behind it
+      _cmdCredits = 1;
+    }
+
+    removeCommand(i);
+
+    if (handler) {
+      handler(opcode, -1, 0, NULL, context);
+    }
+
+    // the handler might have changed the queue, start over
+    i = -1;
+  }
+
+  for (int i = 0; i < _commandCount && _cmdCredits > 0; i++) {
+    if (_commands[i].sent) {
+      continue;
+    }
+
+    _commands[i].sent = true;
+    _commands[i].time = now;
+
+    writeCommand(_commands[i].opcode, _commands[i].plen, _commands[i].parameters);
+
+    if (_commands[i].parameters) {
+      free(_commands[i].parameters);
+      _commands[i].parameters = NULL;
+    }
+  }
+}
+
+void HCIClass::removeCommand(int index)
+{
+  if (_commands[index].parameters) {
+    free(_commands[index].parameters);
+  }
+
+  _commandCount--;
+
+  for (int i = index; i < _commandCount; i++) {
+    _commands[i] = _commands[i + 1];
+  }
+}
+
+void HCIClass::handleCmdComplete(uint8_t ncmd, uint16_t opcode, int status, uint8_t responseLen, uint8_t response[])
+{
+  _cmdCredits = ncmd;
+
+  if (status == 0x00 && (opcode >> 10) == OGF_LE_CTL &&
+      (opcode & 0x3ff) >= OCF_LE_SET_ADV_SET_RANDOM_ADDRESS && (opcode & 0x3ff) <= OCF_LE_PERIODIC_TERMINATE_SYNC) {
+    // from now on the controller rejects the legacy advertising, scanning and connection commands
+    _extendedCommands = true;
+  }
+
+  HCICommandCompleteHandler handler = NULL;
+  void* context = NULL;
+  bool found = false;
+
+  // opcode 0x0000 only reports new credits
+  for (int i = 0; opcode != 0x0000 && i < _commandCount; i++) {
+    if (_commands[i].sent && _commands[i].opcode == opcode) {
+      handler = _commands[i].handler;
+      context = _commands[i].context;
+      found = true;
+
+      removeCommand(i);
+      break;
+    }
   }
 
-  return _cmdCompleteStatus;
+  flushCommands();
+
+  if (found && handler) {
+    handler(opcode, status, responseLen, response, context);
+  }
 }
 
-void HCIClass::handleAclDataPkt(uint8_t /*plen*/, uint8_t pdata[])
+void HCIClass::handleAclDataPkt(uint16_t /*plen*/, uint8_t pdata[])
 {
   struct __attribute__ ((packed)) HCIACLHdr {
     uint16_t connectionHandleWithFlags;
@@ -748,78 +1763,108 @@ void HCIClass::handleAclDataPkt(uint8_t /*plen*/, uint8_t pdata[])
   Serial.println(aclHeader->dlen, DEC);
 #endif
 
+  int index = aclConnectionIndex(connectionHandle);
+
   // Pointer to the L2CAP PDU (might be reconstructed from multiple fragments)
   uint8_t *l2CapPdu;
-  uint8_t l2CapPduSize;
+  // Reassembly buffer holding the PDU, if any
+  int8_t pool = -1;
+
+  // L2CAP header at the start of l2CapPdu
+  struct __attribute__ ((packed)) HCIL2CapHdr {
+    uint16_t len; // size of the L2CAP SDU
+    uint16_t cid;
+  } *l2CapHeader;
 
   if (pbFlag == 0b10) {
     // "First automatically flushable packet" = Start of our L2CAP PDU
-
-    l2CapPdu = aclSdu;
-    l2CapPduSize = aclHeader->dlen;
-  } else if (pbFlag == 0b01) {
-    // "Continuing Fragment" = Continued L2CAP PDU
+    if (index >= 0 && _aclConnections[index].rxPool >= 0) {
 #ifdef _BLE_TRACE_
-    Serial.print("Continued packet. Appending to L2CAP PDU buffer (previously ");
-    Serial.print(_l2CapPduBufferSize, DEC);
-    Serial.println(" bytes in buffer)");
+      Serial.print("Warning: Discarding ");
+      Serial.print(_aclConnections[index].rxLength, DEC);
+      Serial.println(" bytes of incomplete L2CAP PDU");
 #endif
-    // If we receive a fragment, we always need to append it to the L2CAP PDU buffer
-    memcpy(&_l2CapPduBuffer[_l2CapPduBufferSize], aclSdu, aclHeader->dlen);
-    _l2CapPduBufferSize += aclHeader->dlen;
+      stopL2CapReassembly(index, true);
+    }
 
-    l2CapPdu = _l2CapPduBuffer;
-    l2CapPduSize = _l2CapPduBufferSize;
-  } else {
-    // I don't think other values are allowed for BLE
+    if (aclHeader->dlen < sizeof(HCIL2CapHdr)) {
 #ifdef _BLE_TRACE_
-    Serial.println("Invalid pbFlag, discarding packet");
+      Serial.println("Fragment too short for the L2CAP header, discarding packet");
 #endif
-    return;
-  }
+      if (index >= 0) {
+        _aclConnections[index].rxDropped++;
+      }
+      return;
+    }
 
-  // We now have a valid L2CAP header in l2CapPdu and can parse the headers
-  struct __attribute__ ((packed)) HCIL2CapHdr {
-    uint16_t len; // size of the L2CAP SDU
-    uint16_t cid;
-  } *l2CapHeader = (HCIL2CapHdr*)l2CapPdu;
+    l2CapPdu = aclSdu;
+    l2CapHeader = (HCIL2CapHdr*)l2CapPdu;
 
+    // -4 because the buffer is the L2CAP PDU (with L2CAP header). The len field is only the L2CAP SDU (without L2CAP header).
+    if (aclHeader->dlen - 4 != l2CapHeader->len) {
 #ifdef _BLE_TRACE_
-  Serial.print("Received ");
-  Serial.print(l2CapPduSize - 4, DEC);
-  Serial.print("B/");
-  Serial.print(l2CapHeader->len, DEC);
-  Serial.print("B of the L2CAP SDU. CID = ");
-  Serial.println(l2CapHeader->cid, HEX);
+      Serial.println("L2CAP SDU incomplete, storing first packet to the reassembly buffer");
 #endif
-
-  // -4 because the buffer is the L2CAP PDU (with L2CAP header). The len field is only the L2CAP SDU (without L2CAP header).
-  if (l2CapPduSize - 4 != l2CapHeader->len) {
+      // We need to wait for the missing parts of the L2CAP SDU
+      if (index < 0 || !startL2CapReassembly(index, l2CapPdu, aclHeader->dlen, l2CapHeader->len + 4)) {
 #ifdef _BLE_TRACE_
-    Serial.println("L2CAP SDU incomplete");
+        Serial.println("Can't reassemble L2CAP PDU, discarding packet");
 #endif
-
-    // If this is a first packet, we have not copied it into the buffer yet
-    if (pbFlag == 0b10) {
-#ifdef _BLE_TRACE_
-      Serial.println("Storing first packet to L2CAP PDU buffer");
-      if (_l2CapPduBufferSize != 0) {
-        Serial.print("Warning: Discarding ");
-        Serial.print(_l2CapPduBufferSize, DEC);
-        Serial.println(" bytes from buffer");
+        if (index >= 0) {
+          _aclConnections[index].rxDropped++;
+        }
       }
+      return;
+    }
+  } else if (pbFlag == 0b01) {
+    // "Continuing Fragment" = Continued L2CAP PDU
+    if (index < 0 || _aclConnections[index].rxPool < 0) {
+#ifdef _BLE_TRACE_
+      Serial.println("Continuing fragment without start, discarding packet");
+#endif
+      return;
+    }
+#ifdef _BLE_TRACE_
+    Serial.print("Continued packet. Appending to L2CAP PDU buffer (previously ");
+    Serial.print(_aclConnections[index].rxLength, DEC);
+    Serial.println(" bytes in buffer)");
 #endif
+    if (_aclConnections[index].rxLength + aclHeader->dlen > _aclConnections[index].rxPduSize) {
+#ifdef _BLE_TRACE_
+      Serial.println("L2CAP PDU longer than announced, discarding it");
+#endif
+      stopL2CapReassembly(index, true);
+      return;
+    }
 
-      memcpy(_l2CapPduBuffer, l2CapPdu, l2CapPduSize);
-      _l2CapPduBufferSize = l2CapPduSize;
+    pool = _aclConnections[index].rxPool;
+    memcpy(&_l2CapPool[pool].data[_aclConnections[index].rxLength], aclSdu, aclHeader->dlen);
+    _aclConnections[index].rxLength += aclHeader->dlen;
+
+    if (_aclConnections[index].rxLength < _aclConnections[index].rxPduSize) {
+      // We need to wait for the missing parts of the L2CAP SDU
+      return;
     }
 
-    // We need to wait for the missing parts of the L2CAP SDU
+    l2CapPdu = _l2CapPool[pool].data;
+    l2CapHeader = (HCIL2CapHdr*)l2CapPdu;
+
+    // the connection can start a new PDU while this one is handled,
+    // the pool buffer is released once it is done
+    _aclConnections[index].rxPool = -1;
+  } else {
+    // I don't think other values are allowed for BLE
+#ifdef _BLE_TRACE_
+    Serial.println("Invalid pbFlag, discarding packet");
+#endif
     return;
   }
 
 #ifdef _BLE_TRACE_
-    Serial.println("L2CAP SDU complete");
+  Serial.print("L2CAP SDU complete, ");
+  Serial.print(l2CapHeader->len, DEC);
+  Serial.print("B. CID = ");
+  Serial.println(l2CapHeader->cid, HEX);
 #endif
 
   if (l2CapHeader->cid == ATT_CID) {
@@ -854,12 +1899,106 @@ void HCIClass::handleAclDataPkt(uint8_t /*plen*/, uint8_t pdata[])
     sendAclPkt(connectionHandle, 0x0005, sizeof(l2capRejectCid), &l2capRejectCid);
   }
 
-  // We have processed everything in the buffer. Discard the contents.
-  _l2CapPduBufferSize = 0;
+  // We have processed everything in the buffer. Give it back to the pool.
+  if (pool >= 0) {
+    _l2CapPool[pool].used = false;
+  }
 }
 
-void HCIClass::handleNumCompPkts(uint16_t /*handle*/, uint16_t numPkts)
+bool HCIClass::startL2CapReassembly(int connectionIndex, uint8_t pdu[], uint16_t length, uint16_t pduSize)
 {
+  // the peer can't send more than the negotiated ATT MTU, or the 65 bytes of the largest SMP PDU
+  uint16_t maxSduSize = ATT.mtu(_aclConnections[connectionIndex].handle);
+
+  if (maxSduSize < 65) {
+    maxSduSize = 65;
+  }
+
+  if (pduSize > maxSduSize + 4) {
+    return false;
+  }
+
+  if (length > pduSize) {
+    // the fragment is longer than the PDU it announces, and than the buffer sized for it
+    return false;
+  }
+
+  int pool = -1;
+
+  for (int i = 0; i < HCI_L2CAP_REASSEMBLY_BUFFERS; i++) {
+    if (!_l2CapPool[i].used) {
+      pool = i;
+
+      // prefer a buffer that is already large enough
+      if (_l2CapPool[i].size >= pduSize) {
+        break;
+      }
+    }
+  }
+
+  if (pool < 0) {
+    return false;
+  }
+
+  if (_l2CapPool[pool].size < pduSize) {
+    // size it for the connection MTU, so it doesn't have to grow for the next PDU
+    uint8_t* data = (uint8_t*)realloc(_l2CapPool[pool].data, maxSduSize + 4);
+
+    if (data == NULL) {
+      return false;
+    }
+
+    _l2CapPool[pool].data = data;
+    _l2CapPool[pool].size = maxSduSize + 4;
+  }
+
+  _l2CapPool[pool].used = true;
+  memcpy(_l2CapPool[pool].data, pdu, length);
+
+  _aclConnections[connectionIndex].rxPool = pool;
+  _aclConnections[connectionIndex].rxLength = length;
+  _aclConnections[connectionIndex].rxPduSize = pduSize;
+  _aclConnections[connectionIndex].rxTime = millis();
+
+  return true;
+}
+
+void HCIClass::stopL2CapReassembly(int connectionIndex, bool dropped)
+{
+  _l2CapPool[_aclConnections[connectionIndex].rxPool].used = false;
+  _aclConnections[connectionIndex].rxPool = -1;
+
+  if (dropped) {
+    _aclConnections[connectionIndex].rxDropped++;
+  }
+}
+
+void HCIClass::checkL2CapReassembly()
+{
+  unsigned long now = millis();
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_aclConnections[i].rxPool >= 0 && (now - _aclConnections[i].rxTime) >= HCI_L2CAP_REASSEMBLY_TIMEOUT) {
+#ifdef _BLE_TRACE_
+      Serial.println("L2CAP reassembly timeout, discarding PDU");
+#endif
+      stopL2CapReassembly(i, true);
+    }
+  }
+}
+
+void HCIClass::handleNumCompPkts(uint16_t handle, uint16_t numPkts)
+{
+  int index = aclConnectionIndex(handle);
+
+  if (index >= 0) {
+    if (numPkts && _aclConnections[index].pendingPkt > numPkts) {
+      _aclConnections[index].pendingPkt -= numPkts;
+    } else {
+      _aclConnections[index].pendingPkt = 0;
+    }
+  }
+
   if (numPkts && _pendingPkt > numPkts) {
     _pendingPkt -= numPkts;
   } else {
@@ -886,12 +2025,35 @@ void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
       uint8_t reason;
     } *disconnComplete = (DisconnComplete*)&pdata[sizeof(HCIEventHdr)];
 
+    removeAclConnection(disconnComplete->handle);
     ATT.removeConnection(disconnComplete->handle, disconnComplete->reason);
     L2CAPSignaling.removeConnection(disconnComplete->handle, disconnComplete->reason);
 
     if (GAP.advertising())
     {
-      HCI.leSetAdvertiseEnable(0x01);
+      uint8_t enable = 0x01;
+
+      sendCommandAsync(OGF_LE_CTL << 10 | OCF_LE_SET_ADVERTISE_ENABLE, sizeof(enable), &enable);
+    }
+
+    // like legacy advertising, the sets stopped by a connection resume when it ends
+    uint8_t handles[GAP_MAX_ADVERTISING_SETS];
+    uint8_t numSets = GAP.advertisingSetsToResume(handles);
+
+    if (numSets)
+    {
+      uint8_t leExtendedAdvertisingEnable[2 + GAP_MAX_ADVERTISING_SETS * 4];
+
+      leExtendedAdvertisingEnable[0] = 0x01;
+      leExtendedAdvertisingEnable[1] = numSets;
+
+      for (int i = 0; i < numSets; i++) {
+        // handle, no duration and no maximum number of events
+        leExtendedAdvertisingEnable[2 + i * 4] = handles[i];
+        memset(&leExtendedAdvertisingEnable[3 + i * 4], 0x00, 3);
+      }
+
+      sendCommandAsync(OGF_LE_CTL << 10 | OCF_LE_SET_EXT_ADV_ENABLE, 2 + numSets * 4, leExtendedAdvertisingEnable);
     }
   }
   else if (eventHdr->evt == EVT_ENCRYPTION_CHANGE)
@@ -994,11 +2156,8 @@ void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
     Serial.print("E status: 0x");
     Serial.println(cmdCompleteHeader->status, HEX);
 #endif
-    _cmdCompleteOpcode = cmdCompleteHeader->opcode;
-    _cmdCompleteStatus = cmdCompleteHeader->status;
-    _cmdResponseLen = pdata[1] - sizeof(CmdComplete);
-    _cmdResponse = &pdata[sizeof(HCIEventHdr) + sizeof(CmdComplete)];
-
+    handleCmdComplete(cmdCompleteHeader->ncmd, cmdCompleteHeader->opcode, cmdCompleteHeader->status,
+                      pdata[1] - sizeof(CmdComplete), &pdata[sizeof(HCIEventHdr) + sizeof(CmdComplete)]);
   }
   else if (eventHdr->evt == EVT_CMD_STATUS)
   {
@@ -1016,9 +2175,7 @@ void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
     Serial.print("F opcode: 0x");
     Serial.println(cmdStatusHeader->opcode, HEX);
 #endif
-    _cmdCompleteOpcode = cmdStatusHeader->opcode;
-    _cmdCompleteStatus = cmdStatusHeader->status;
-    _cmdResponseLen = 0;
+    handleCmdComplete(cmdStatusHeader->ncmd, cmdStatusHeader->opcode, cmdStatusHeader->status, 0, NULL);
   }
   else if (eventHdr->evt == EVT_NUM_COMP_PKTS)
   {
@@ -1037,6 +2194,9 @@ void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
 #endif
       data += 2;
     }
+
+    // hand the freed controller buffers to the queued packets
+    flushAclQueues();
   }
   else if(eventHdr->evt == 0x10)
   {
@@ -1075,6 +2235,8 @@ void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
         } *leConnectionComplete = (EvtLeConnectionComplete*)&pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
 
         if (leConnectionComplete->status == 0x00) {
+          addAclConnection(leConnectionComplete->handle);
+
           ATT.addConnection(leConnectionComplete->handle,
                             leConnectionComplete->role,
                             leConnectionComplete->peerBdaddrType,
@@ -1124,6 +2286,8 @@ void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
         } *leConnectionComplete = (EvtLeConnectionComplete*)&pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
 
         if (leConnectionComplete->status == 0x00) {
+          addAclConnection(leConnectionComplete->handle);
+
           ATT.addConnection(leConnectionComplete->handle,
                             leConnectionComplete->role,
                             leConnectionComplete->peerBdaddrType,
@@ -1150,20 +2314,31 @@ void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
         break;
       }
       case ADVERTISING_REPORT:{
+        // controllers may batch several reports, each one has its own data length and ends with the RSSI
         struct __attribute__ ((packed)) EvtLeAdvertisingReport {
-          uint8_t status;
           uint8_t type;
           uint8_t peerBdaddrType;
           uint8_t peerBdaddr[6];
           uint8_t eirLength;
-          uint8_t eirData[31];
-        } *leAdvertisingReport = (EvtLeAdvertisingReport*)&pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
+          uint8_t eirData[];
+        } *leAdvertisingReport;
 
-        if(leAdvertisingReport->eirLength > sizeof(leAdvertisingReport->eirData)){
-          return ;
-        }
+        uint8_t* reports = &pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
+        uint8_t* reportsEnd = &pdata[sizeof(HCIEventHdr) + eventHdr->plen];
+        uint8_t numReports = *reports++;
+
+        for (uint8_t i = 0; i < numReports; i++) {
+          if (reports + sizeof(EvtLeAdvertisingReport) > reportsEnd) {
+            break;
+          }
+
+          leAdvertisingReport = (EvtLeAdvertisingReport*)reports;
+
+          if (leAdvertisingReport->eirLength > 31 || &leAdvertisingReport->eirData[leAdvertisingReport->eirLength] >= reportsEnd) {
+            // malformed, the following reports can't be located
+            break;
+          }
 
-        if (leAdvertisingReport->status == 0x01) {
           // last byte is RSSI
           int8_t rssi = leAdvertisingReport->eirData[leAdvertisingReport->eirLength];
 
@@ -1173,9 +2348,177 @@ void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
                                         leAdvertisingReport->eirLength,
                                         leAdvertisingReport->eirData,
                                         rssi);
+
+          reports = &leAdvertisingReport->eirData[leAdvertisingReport->eirLength + 1];
         }
         break;
       }
+      case EXTENDED_ADVERTISING_REPORT:{
+        struct __attribute__ ((packed)) EvtLeExtendedAdvertisingReport {
+          uint16_t eventType;
+          uint8_t peerBdaddrType;
+          uint8_t peerBdaddr[6];
+          uint8_t primaryPhy;
+          uint8_t secondaryPhy;
+          uint8_t sid;
+          int8_t txPower;
+          int8_t rssi;
+          uint16_t periodicInterval;
+          uint8_t directBdaddrType;
+          uint8_t directBdaddr[6];
+          uint8_t dataLength;
+          uint8_t data[];
+        } *leExtendedAdvertisingReport;
+
+        uint8_t* reports = &pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
+        uint8_t* reportsEnd = &pdata[sizeof(HCIEventHdr) + eventHdr->plen];
+        uint8_t numReports = *reports++;
+
+        for (uint8_t i = 0; i < numReports; i++) {
+          if (reports + sizeof(EvtLeExtendedAdvertisingReport) > reportsEnd) {
+            break;
+          }
+
+          leExtendedAdvertisingReport = (EvtLeExtendedAdvertisingReport*)reports;
+
+          if (&leExtendedAdvertisingReport->data[leExtendedAdvertisingReport->dataLength] > reportsEnd) {
+            // malformed, the following reports can't be located
+            break;
+          }
+
+          GAP.handleLeExtendedAdvertisingReport(leExtendedAdvertisingReport->eventType,
+                                                leExtendedAdvertisingReport->sid,
+                                                leExtendedAdvertisingReport->peerBdaddrType,
+                                                leExtendedAdvertisingReport->peerBdaddr,
+                                                leExtendedAdvertisingReport->dataLength,
+                                                leExtendedAdvertisingReport->data,
+                                                leExtendedAdvertisingReport->rssi);
+
+          reports = &leExtendedAdvertisingReport->data[leExtendedAdvertisingReport->dataLength];
+        }
+        break;
+      }
+      case PERIODIC_SYNC_ESTABLISHED:{
+        struct __attribute__ ((packed)) EvtLePeriodicSyncEstablished {
+          uint8_t status;
+          uint16_t syncHandle;
+          uint8_t sid;
+          uint8_t addressType;
+          uint8_t address[6];
+          uint8_t phy;
+          uint16_t interval;
+          uint8_t clockAccuracy;
+        } *lePeriodicSyncEstablished = (EvtLePeriodicSyncEstablished*)&pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
+
+#ifdef _BLE_TRACE_
+        Serial.print("Periodic sync established, status: ");
+        Serial.print(lePeriodicSyncEstablished->status, HEX);
+        Serial.print(" handle: ");
+        Serial.println(lePeriodicSyncEstablished->syncHandle, HEX);
+#endif
+        GAP.handleLePeriodicSyncEstablished(lePeriodicSyncEstablished->status, lePeriodicSyncEstablished->syncHandle,
+                                            lePeriodicSyncEstablished->sid, lePeriodicSyncEstablished->addressType,
+                                            lePeriodicSyncEstablished->address);
+        break;
+      }
+      case PERIODIC_ADVERTISING_REPORT:{
+        struct __attribute__ ((packed)) EvtLePeriodicAdvertisingReport {
+          uint16_t syncHandle;
+          int8_t txPower;
+          int8_t rssi;
+          uint8_t cteType;
+          uint8_t dataStatus;
+          uint8_t dataLength;
+          uint8_t data[];
+        } *lePeriodicAdvertisingReport = (EvtLePeriodicAdvertisingReport*)&pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
+
+        uint8_t* reportEnd = &pdata[sizeof(HCIEventHdr) + eventHdr->plen];
+
+        if ((uint8_t*)lePeriodicAdvertisingReport + sizeof(EvtLePeriodicAdvertisingReport) > reportEnd ||
+            &lePeriodicAdvertisingReport->data[lePeriodicAdvertisingReport->dataLength] > reportEnd) {
+          // malformed
+          break;
+        }
+
+        GAP.handleLePeriodicAdvertisingReport(lePeriodicAdvertisingReport->syncHandle,
+                                              lePeriodicAdvertisingReport->dataStatus,
+                                              lePeriodicAdvertisingReport->dataLength,
+                                              lePeriodicAdvertisingReport->data,
+                                              lePeriodicAdvertisingReport->rssi);
+        break;
+      }
+      case PERIODIC_SYNC_LOST:{
+        struct __attribute__ ((packed)) EvtLePeriodicSyncLost {
+          uint16_t syncHandle;
+        } *lePeriodicSyncLost = (EvtLePeriodicSyncLost*)&pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
+
+        GAP.handleLePeriodicSyncLost(lePeriodicSyncLost->syncHandle);
+        break;
+      }
+      case DATA_LENGTH_CHANGE:{
+        struct __attribute__ ((packed)) EvtLeDataLengthChange {
+          uint16_t handle;
+          uint16_t maxTxOctets;
+          uint16_t maxTxTime;
+          uint16_t maxRxOctets;
+          uint16_t maxRxTime;
+        } *leDataLengthChange = (EvtLeDataLengthChange*)&pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
+
+#ifdef _BLE_TRACE_
+        Serial.print("Data length changed, tx: ");
+        Serial.print(leDataLengthChange->maxTxOctets);
+        Serial.print(" rx: ");
+        Serial.println(leDataLengthChange->maxRxOctets);
+#endif
+        ATT.updateDataLength(leDataLengthChange->handle, leDataLengthChange->maxTxOctets, leDataLengthChange->maxRxOctets);
+        break;
+      }
+      case PHY_UPDATE_COMPLETE:{
+        struct __attribute__ ((packed)) EvtLePhyUpdateComplete {
+          uint8_t status;
+          uint16_t handle;
+          uint8_t txPhy;
+          uint8_t rxPhy;
+        } *lePhyUpdateComplete = (EvtLePhyUpdateComplete*)&pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
+
+#ifdef _BLE_TRACE_
+        Serial.print("PHY update complete, status: ");
+        Serial.print(lePhyUpdateComplete->status, HEX);
+        Serial.print(" tx: ");
+        Serial.print(lePhyUpdateComplete->txPhy);
+        Serial.print(" rx: ");
+        Serial.println(lePhyUpdateComplete->rxPhy);
+#endif
+        // the event has the PHY number, the API uses the same bit masks as the commands
+        uint8_t txPhy = 0;
+        uint8_t rxPhy = 0;
+
+        if (lePhyUpdateComplete->status == 0x00) {
+          txPhy = phyMask(lePhyUpdateComplete->txPhy);
+          rxPhy = phyMask(lePhyUpdateComplete->rxPhy);
+        }
+
+        ATT.updatePhy(lePhyUpdateComplete->handle, lePhyUpdateComplete->status, txPhy, rxPhy);
+        break;
+      }
+      case ADVERTISING_SET_TERMINATED:{
+        struct __attribute__ ((packed)) EvtLeAdvertisingSetTerminated {
+          uint8_t status;
+          uint8_t advertisingHandle;
+          uint16_t connectionHandle;
+          uint8_t numCompletedEvents;
+        } *leAdvertisingSetTerminated = (EvtLeAdvertisingSetTerminated*)&pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
+
+#ifdef _BLE_TRACE_
+        Serial.print("Advertising set terminated, status: ");
+        Serial.print(leAdvertisingSetTerminated->status, HEX);
+        Serial.print(" handle: ");
+        Serial.println(leAdvertisingSetTerminated->advertisingHandle);
+#endif
+        GAP.handleLeAdvertisingSetTerminated(leAdvertisingSetTerminated->status, leAdvertisingSetTerminated->advertisingHandle,
+                                             leAdvertisingSetTerminated->connectionHandle);
+        break;
+      }
       case LONG_TERM_KEY_REQUEST:{
         struct __attribute__ ((packed)) LTKRequest
         {
@@ -1252,7 +2595,7 @@ void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
 #ifdef _BLE_TRACE_
           Serial.println("LTK not found, rejecting");
 #endif
-          sendCommand(OGF_LE_CTL << 10 | LE_COMMAND::LONG_TERM_KEY_NEGATIVE_REPLY,2, &ltkRequest->connectionHandle);
+          sendCommandAsync(OGF_LE_CTL << 10 | LE_COMMAND::LONG_TERM_KEY_NEGATIVE_REPLY,2, &ltkRequest->connectionHandle);
         }
         break;
       }
@@ -1292,7 +2635,7 @@ void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
 
         remoteConnParamReqReply.minLength = 0x000F;
         remoteConnParamReqReply.maxLength = 0x0FFF;
-        sendCommand(OGF_LE_CTL << 10 | 0x20, sizeof(RemoteConnParamReqReply), &remoteConnParamReqReply);
+        sendCommandAsync(OGF_LE_CTL << 10 | 0x20, sizeof(RemoteConnParamReqReply), &remoteConnParamReqReply);
         break;
       }
       case READ_LOCAL_P256_COMPLETE:{
@@ -1369,7 +2712,7 @@ void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
           // Send Pairing confirm response
           HCI.sendAclPkt(connectionHandle, SECURITY_CID, sizeof(pairingConfirm), &pairingConfirm);
 
-          HCI.sendCommand( (OGF_LE_CTL << 10) | LE_COMMAND::GENERATE_DH_KEY_V1, sizeof(HCI.remotePublicKeyBuffer), HCI.remotePublicKeyBuffer);
+          HCI.sendCommandAsync( (OGF_LE_CTL << 10) | LE_COMMAND::GENERATE_DH_KEY_V1, sizeof(HCI.remotePublicKeyBuffer), HCI.remotePublicKeyBuffer);
         }else{
 #ifdef _BLE_TRACE_
           Serial.print("Key read error: 0x");
@@ -1533,12 +2876,12 @@ AuthReq HCIClass::localAuthreq(){
   return LOCAL_AUTHREQ;
 }
 
-void HCIClass::dumpPkt(const char* prefix, uint8_t plen, uint8_t pdata[])
+void HCIClass::dumpPkt(const char* prefix, uint16_t plen, uint8_t pdata[])
 {
   if (_debug) {
     _debug->print(prefix);
 
-    for (uint8_t i = 0; i < plen; i++) {
+    for (uint16_t i = 0; i < plen; i++) {
       byte b = pdata[i];
 
       if (b < 16) {
@@ -23,6 +23,7 @@
 #include <Arduino.h>
 #include "bitDescriptions.h"
 
+#include "ATT.h"
 #include "L2CAPSignaling.h"
 
 #define OGF_LINK_CTL           0x01
@@ -31,6 +32,45 @@
 #define OGF_STATUS_PARAM       0x05
 #define OGF_LE_CTL             0x08
 
+#ifndef HCI_COMMAND_QUEUE_SIZE
+#ifdef __AVR__
+#define HCI_COMMAND_QUEUE_SIZE 2
+#else
+#define HCI_COMMAND_QUEUE_SIZE 8
+#endif
+#endif
+
+#define HCI_COMMAND_RESPONSE_SIZE 64
+
+#ifndef HCI_ACL_TX_QUEUE_SIZE
+#ifdef __AVR__
+#define HCI_ACL_TX_QUEUE_SIZE 2
+#else
+#define HCI_ACL_TX_QUEUE_SIZE 8
+#endif
+#endif
+
+// Buffers shared by the connections to reassemble fragmented L2CAP PDUs
+#ifndef HCI_L2CAP_REASSEMBLY_BUFFERS
+#define HCI_L2CAP_REASSEMBLY_BUFFERS ATT_MAX_PEERS
+#endif
+
+#ifndef HCI_L2CAP_REASSEMBLY_TIMEOUT
+#define HCI_L2CAP_REASSEMBLY_TIMEOUT 5000
+#endif
+
+// Smallest LE ACL data packet a controller supports, used until it reports its own
+#define HCI_ACL_MIN_PKT_LEN 27
+
+// Largest LE ACL data packet written, bigger controller buffers are filled up to it
+#ifndef HCI_ACL_MAX_PKT_LEN
+#ifdef __AVR__
+#define HCI_ACL_MAX_PKT_LEN 27
+#else
+#define HCI_ACL_MAX_PKT_LEN 251
+#endif
+#endif
+
 enum LE_COMMAND {
   ENCRYPT                      = 0x0017,
   RANDOM                       = 0x0018,
@@ -47,11 +87,22 @@ enum LE_META_EVENT {
   REMOTE_CONN_PARAM_REQ     = 0x06,
   READ_LOCAL_P256_COMPLETE  = 0x08,
   GENERATE_DH_KEY_COMPLETE  = 0x09,
+  DATA_LENGTH_CHANGE        = 0x07,
   ENHANCED_CONN_COMPLETE    = 0x0A,
+  PHY_UPDATE_COMPLETE       = 0x0C,
+  EXTENDED_ADVERTISING_REPORT = 0x0D,
+  PERIODIC_SYNC_ESTABLISHED = 0x0E,
+  PERIODIC_ADVERTISING_REPORT = 0x0F,
+  PERIODIC_SYNC_LOST        = 0x10,
+  ADVERTISING_SET_TERMINATED = 0x12,
 };
 String metaEventToString(LE_META_EVENT event);
 String commandToString(LE_COMMAND command);
 
+// Called once the controller has acknowledged a command with a Command Complete or
+// Command Status event. status is -1 if the controller never answered.
+typedef void (*HCICommandCompleteHandler)(uint16_t opcode, int status, uint8_t responseLen, uint8_t response[], void* context);
+
 class HCIClass {
 public:
   HCIClass();
@@ -64,6 +115,8 @@ public:
   virtual void poll(unsigned long timeout);
 
   virtual int reset();
+  // true once the controller only accepts the extended advertising, scanning and connection commands
+  virtual bool extendedCommands();
   virtual int readLocalVersion(uint8_t& hciVer, uint16_t& hciRev, uint8_t& lmpVer,
                        uint16_t& manufacturer, uint16_t& lmpSubVer);
 
@@ -93,6 +146,46 @@ public:
                   uint16_t supervisionTimeout, uint16_t minCeLength, uint16_t maxCeLength);
   virtual int leConnUpdate(uint16_t handle, uint16_t minInterval, uint16_t maxInterval, 
                   uint16_t latency, uint16_t supervisionTimeout);
+  // Data Length Extension, the result is reported with a Data Length Change event
+  virtual int leSetDataLength(uint16_t handle, uint16_t txOctets, uint16_t txTime);
+  virtual int leReadSuggestedDefaultDataLength(uint16_t& txOctets, uint16_t& txTime);
+  virtual int leWriteSuggestedDefaultDataLength(uint16_t txOctets, uint16_t txTime);
+  // PHY selection, phys are bit masks of 0x01 (1M), 0x02 (2M) and 0x04 (Coded)
+  virtual int leReadPhy(uint16_t handle, uint8_t& txPhy, uint8_t& rxPhy);
+  virtual int leSetDefaultPhy(uint8_t allPhys, uint8_t txPhys, uint8_t rxPhys);
+  virtual int leSetPhy(uint16_t handle, uint8_t allPhys, uint8_t txPhys, uint8_t rxPhys, uint16_t phyOptions);
+  // Extended advertising, phys are PHY numbers: 0x01 (1M), 0x02 (2M) and 0x03 (Coded)
+  virtual int leSetAdvertisingSetRandomAddress(uint8_t handle, uint8_t address[6]);
+  virtual int leSetExtendedAdvertisingParameters(uint8_t handle, uint16_t eventProperties,
+                                 uint32_t minInterval, uint32_t maxInterval, uint8_t chanMap,
+                                 uint8_t ownBdaddrType, uint8_t filter, int8_t txPower,
+                                 uint8_t primaryPhy, uint8_t secondaryPhy, uint8_t sid);
+  // Data longer than one command is sent in fragments, up to 1650 bytes
+  virtual int leSetExtendedAdvertisingData(uint8_t handle, uint16_t length, uint8_t data[]);
+  virtual int leSetExtendedScanResponseData(uint8_t handle, uint16_t length, uint8_t data[]);
+  // Enable or disable several sets with one command, no sets disables all of them
+  virtual int leSetExtendedAdvertisingEnable(uint8_t enable, uint8_t numSets, uint8_t handles[]);
+  virtual int leReadMaximumAdvertisingDataLength(uint16_t& length);
+  virtual int leReadNumberOfSupportedAdvertisingSets(uint8_t& numSets);
+  virtual int leRemoveAdvertisingSet(uint8_t handle);
+  virtual int leClearAdvertisingSets();
+  // Periodic advertising of an extended advertising set, interval in units of 1.25 ms
+  virtual int leSetPeriodicAdvertisingParameters(uint8_t handle, uint16_t minInterval, uint16_t maxInterval, uint16_t properties);
+  virtual int leSetPeriodicAdvertisingData(uint8_t handle, uint16_t length, uint8_t data[]);
+  virtual int leSetPeriodicAdvertisingEnable(uint8_t enable, uint8_t handle);
+  // Extended scanning, phys is a mask of 0x01 (1M) and 0x04 (Coded), each one scanned with the same parameters
+  virtual int leSetExtendedScanParameters(uint8_t ownBdaddrType, uint8_t filter, uint8_t phys,
+                                          uint8_t type, uint16_t interval, uint16_t window);
+  virtual int leSetExtendedScanEnable(uint8_t enabled, uint8_t duplicates);
+  // Synchronization to a periodic advertising train, timeout in units of 10 ms
+  virtual int lePeriodicAdvertisingCreateSync(uint8_t options, uint8_t sid, uint8_t addressType, uint8_t address[6],
+                                              uint16_t skip, uint16_t timeout);
+  virtual int lePeriodicAdvertisingCreateSyncCancel();
+  virtual int lePeriodicAdvertisingTerminateSync(uint16_t syncHandle);
+  // Connection on the 1M PHY, once the extended commands are used
+  virtual int leExtendedCreateConn(uint8_t initiatorFilter, uint8_t ownBdaddrType, uint8_t peerBdaddrType, uint8_t peerBdaddr[6],
+                                   uint16_t interval, uint16_t window, uint16_t minInterval, uint16_t maxInterval,
+                                   uint16_t latency, uint16_t supervisionTimeout, uint16_t minCeLength, uint16_t maxCeLength);
   virtual int leCancelConn();
   virtual int leEncrypt(uint8_t* Key, uint8_t* plaintext, uint8_t* status, uint8_t* ciphertext);
   // Generate a 64 bit random number
@@ -111,7 +204,13 @@ public:
   virtual void writeLK(uint8_t peerAddress[], uint8_t LK[]);
   virtual int tryResolveAddress(uint8_t* BDAddr, uint8_t* address);
 
-  virtual int sendAclPkt(uint16_t handle, uint8_t cid, uint8_t plen, void* data);
+  virtual int sendAclPkt(uint16_t handle, uint16_t cid, uint16_t plen, void* data);
+  // ACL flow control statistics of a connection
+  virtual int aclPendingPackets(uint16_t handle);
+  virtual int aclQueueDepth(uint16_t handle);
+  virtual unsigned long aclStallCount(uint16_t handle);
+  // Number of incoming L2CAP PDUs of a connection that could not be reassembled
+  virtual unsigned long l2capDropCount(uint16_t handle);
 
   virtual int disconnect(uint16_t handle);
 
@@ -120,6 +219,11 @@ public:
 
   // TODO: Send command be private again & use ATT implementation of send command within ATT.
   virtual int sendCommand(uint16_t opcode, uint8_t plen = 0, void* parameters = NULL);
+  // Queue a command without waiting for its completion, returns 0 on success
+  virtual int sendCommandAsync(uint16_t opcode, uint8_t plen = 0, void* parameters = NULL,
+                               HCICommandCompleteHandler handler = NULL, void* context = NULL);
+  virtual int pendingCommands();
+  virtual uint8_t commandCredits();
   uint8_t remotePublicKeyBuffer[64];
   uint8_t localPublicKeyBuffer[64];
   uint8_t remoteDHKeyCheckBuffer[16];
@@ -140,27 +244,91 @@ public:
 
 private:
 
-  virtual void handleAclDataPkt(uint8_t plen, uint8_t pdata[]);
+  virtual int recvFrameLength();
+  virtual void handleAclDataPkt(uint16_t plen, uint8_t pdata[]);
   virtual void handleNumCompPkts(uint16_t handle, uint16_t numPkts);
+
+  virtual void addAclConnection(uint16_t handle);
+  virtual void removeAclConnection(uint16_t handle);
+  virtual int aclConnectionIndex(uint16_t handle);
+  virtual void writeAclPkt(int connectionIndex, uint8_t pkt[], uint16_t length);
+  virtual uint16_t writeAclFragment(int connectionIndex, uint16_t handle, uint8_t l2capHdr[], uint8_t data[], uint16_t dlen, uint16_t offset);
+  virtual bool aclCanSend(int connectionIndex);
+  virtual void flushAclQueues();
+
+  virtual bool startL2CapReassembly(int connectionIndex, uint8_t pdu[], uint16_t length, uint16_t pduSize);
+  virtual void stopL2CapReassembly(int connectionIndex, bool dropped);
+  virtual void checkL2CapReassembly();
+  virtual int leSetExtendedData(uint16_t ocf, uint8_t handle, uint16_t length, uint8_t data[]);
   virtual void handleEventPkt(uint8_t plen, uint8_t pdata[]);
+  virtual void handleCmdComplete(uint8_t ncmd, uint16_t opcode, int status, uint8_t responseLen, uint8_t response[]);
+
+  virtual void writeCommand(uint16_t opcode, uint8_t plen, uint8_t parameters[]);
+  virtual void flushCommands();
+  virtual void removeCommand(int index);
 
-  virtual void dumpPkt(const char* prefix, uint8_t plen, uint8_t pdata[]);
+  virtual void dumpPkt(const char* prefix, uint16_t plen, uint8_t pdata[]);
 
   Stream* _debug;
 
   int _recvIndex;
   uint8_t _recvBuffer[3 + 255];
 
-  uint16_t _cmdCompleteOpcode;
-  int _cmdCompleteStatus;
   uint8_t _cmdResponseLen;
-  uint8_t* _cmdResponse;
+  uint8_t _cmdResponse[HCI_COMMAND_RESPONSE_SIZE];
 
+  // Commands in submission order, the ones already sent to the controller
+  // wait for their Command Complete/Status event, the others for a credit
+  struct {
+    uint16_t opcode;
+    uint8_t plen;
+    uint8_t* parameters;
+    bool sent;
+    unsigned long time;
+    HCICommandCompleteHandler handler;
+    void* context;
+  } _commands[HCI_COMMAND_QUEUE_SIZE];
+  uint8_t _commandCount;
+  // Num_HCI_Command_Packets, the number of commands the controller can accept
+  uint8_t _cmdCredits;
+  // an extended advertising, scanning or connection command succeeded since the last reset
+  bool _extendedCommands;
+
+  // controller LE ACL buffers: total and in use by all connections
   uint8_t _maxPkt;
   uint8_t _pendingPkt;
+  // size of the controller LE ACL buffers, outgoing L2CAP PDUs are fragmented to it
+  uint16_t _aclPktLen;
+  // the ACL packet being written to the transport
+  uint8_t _aclTxBuffer[5 + HCI_ACL_MAX_PKT_LEN];
+
+  struct {
+    uint16_t handle;
+    // packets given to the controller and not reported completed yet
+    uint8_t pendingPkt;
+    // H4 ACL packets holding a whole L2CAP PDU, waiting for controller buffers
+    uint8_t* txQueue[HCI_ACL_TX_QUEUE_SIZE];
+    uint8_t txQueueHead;
+    uint8_t txQueueCount;
+    // bytes of the PDU at the head of the queue already given to the controller
+    uint16_t txOffset;
+    unsigned long stalls;
+    // L2CAP PDU being reassembled, index in _l2CapPool or -1
+    int8_t rxPool;
+    uint16_t rxLength;
+    uint16_t rxPduSize;
+    unsigned long rxTime;
+    unsigned long rxDropped;
+  } _aclConnections[ATT_MAX_PEERS];
+  // round robin position of the TX scheduler
+  uint8_t _aclNextConnection;
 
-  uint8_t _l2CapPduBuffer[255];
-  uint8_t _l2CapPduBufferSize;
+  // kept allocated once used, they only grow with the MTU of the connections
+  struct {
+    uint8_t* data;
+    uint16_t size;
+    bool used;
+  } _l2CapPool[HCI_L2CAP_REASSEMBLY_BUFFERS];
 };
 
 extern HCIClass& HCI;
@@ -280,6 +280,17 @@ int HCICordioTransportClass::read()
   return _rxBuf.read_char();
 }
 
+size_t HCICordioTransportClass::readBytes(uint8_t data[], size_t length)
+{
+  size_t count = 0;
+
+  while (count < length && _rxBuf.available()) {
+    data[count++] = _rxBuf.read_char();
+  }
+
+  return count;
+}
+
 void HCICordioTransportClass::lockForRead() {
   mbed::CriticalSectionLock::enable();
 }
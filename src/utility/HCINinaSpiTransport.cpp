@@ -198,6 +198,12 @@ int HCINinaSpiTransportClass::read()
   return res;
 }
 
+size_t HCINinaSpiTransportClass::readBytes(uint8_t data[], size_t length)
+{
+  // a single SPI transaction for the whole chunk
+  return BleDrv::bleRead(data, length);
+}
+
 size_t HCINinaSpiTransportClass::write(const uint8_t* data, size_t length)
 {
   return BleDrv::bleWrite(data, length);
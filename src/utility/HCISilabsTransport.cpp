@@ -93,6 +93,17 @@ int HCISilabsTransportClass::read()
   return buf.read_char();
 }
 
+size_t HCISilabsTransportClass::readBytes(uint8_t data[], size_t length)
+{
+  size_t count = 0;
+
+  while (count < length && buf.available()) {
+    data[count++] = buf.read_char();
+  }
+
+  return count;
+}
+
 size_t HCISilabsTransportClass::write(const uint8_t* data, size_t len)
 {
   int ret = 0;
@@ -33,6 +33,18 @@ public:
   virtual int peek() = 0;
   virtual int read() = 0;
 
+  // Bulk read of up to length bytes, returns the number of bytes copied into data
+  // The default implementation falls back to reading byte by byte
+  virtual size_t readBytes(uint8_t data[], size_t length) {
+    size_t count = 0;
+
+    while (count < length && available()) {
+      data[count++] = read();
+    }
+
+    return count;
+  }
+
   // Some transports require a lock to use available/peek/read
   // These methods allow to keep the lock while reading an unknown number of bytes
   // These methods might disable interrupts. Only keep the lock as long as necessary.
@@ -73,6 +73,17 @@ int HCIUartTransportClass::read()
   return _uart->read();
 }
 
+size_t HCIUartTransportClass::readBytes(uint8_t data[], size_t length)
+{
+  size_t count = 0;
+
+  while (count < length && _uart->available()) {
+    data[count++] = _uart->read();
+  }
+
+  return count;
+}
+
 size_t HCIUartTransportClass::write(const uint8_t* data, size_t length)
 {
 #ifdef ARDUINO_AVR_UNO_WIFI_REV2
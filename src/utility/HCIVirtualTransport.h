@@ -45,6 +45,7 @@ public:
   virtual int available();
   virtual int peek();
   virtual int read();
+  virtual size_t readBytes(uint8_t data[], size_t length);
 
   virtual size_t write(const uint8_t* data, size_t length);
 };
\ No newline at end of file
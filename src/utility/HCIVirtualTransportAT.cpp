@@ -95,6 +95,28 @@ int HCIVirtualTransportATClass::read()
   return -1;
 }
 
+size_t HCIVirtualTransportATClass::readBytes(uint8_t data[], size_t length)
+{
+  size_t count = 0;
+
+  if (length && !buf.available()) {
+    // fetch the next chunk from the modem
+    int c = read();
+
+    if (c < 0) {
+      return 0;
+    }
+
+    data[count++] = c;
+  }
+
+  while (count < length && buf.available()) {
+    data[count++] = buf.read_char();
+  }
+
+  return count;
+}
+
 size_t HCIVirtualTransportATClass::write(const uint8_t* data, size_t length)
 {
   std::string res = "";
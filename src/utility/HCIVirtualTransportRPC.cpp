@@ -99,6 +99,16 @@ int HCIVirtualTransportRPCClass::read() {
   return -1;
 }
 
+size_t HCIVirtualTransportRPCClass::readBytes(uint8_t data[], size_t length) {
+  size_t count = 0;
+
+  while (count < length && rxbuf.available()) {
+    data[count++] = rxbuf.read_char();
+  }
+
+  return count;
+}
+
 size_t HCIVirtualTransportRPCClass::write(const uint8_t* data, size_t length) {
   if (!initialized) {
     return 0;
@@ -212,6 +212,16 @@ int HCIVirtualTransportZephyrClass::read() {
   return -1;
 }
 
+size_t HCIVirtualTransportZephyrClass::readBytes(uint8_t data[], size_t length) {
+  size_t count = 0;
+
+  while (count < length && rxbuf.available()) {
+    data[count++] = rxbuf.read_char();
+  }
+
+  return count;
+}
+
 size_t HCIVirtualTransportZephyrClass::write(const uint8_t* data, size_t length) {
   enum bt_buf_type type = bt_buf_type_from_h4(data[0], BT_BUF_OUT);
   struct net_buf *buf = bt_buf_get_tx(type, K_FOREVER, &data[1], length - 1);
@@ -84,7 +84,7 @@ void L2CAPSignalingClass::addConnection(uint16_t handle, uint8_t role, uint8_t /
   }
 }
 
-void L2CAPSignalingClass::handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void L2CAPSignalingClass::handleData(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   struct __attribute__ ((packed)) L2CAPSignalingHdr {
     uint8_t code;
@@ -113,7 +113,7 @@ void L2CAPSignalingClass::handleData(uint16_t connectionHandle, uint8_t dlen, ui
     connectionParameterUpdateResponse(connectionHandle, identifier, length, data);
   }
 }
-void L2CAPSignalingClass::handleSecurityData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void L2CAPSignalingClass::handleSecurityData(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   struct __attribute__ ((packed)) L2CAPSignalingHdr {
     uint8_t code;
@@ -332,7 +332,7 @@ void L2CAPSignalingClass::handleSecurityData(uint16_t connectionHandle, uint8_t
     }
     
     memcpy(HCI.remotePublicKeyBuffer,&generateDHKeyCommand,sizeof(generateDHKeyCommand));
-    HCI.sendCommand( (OGF_LE_CTL << 10 )| LE_COMMAND::READ_LOCAL_P256, 0);
+    HCI.sendCommandAsync( (OGF_LE_CTL << 10 )| LE_COMMAND::READ_LOCAL_P256, 0);
   }
   else if(code == CONNECTION_PAIRING_DHKEY_CHECK)
   {
@@ -61,9 +61,9 @@ public:
                     uint16_t latency, uint16_t supervisionTimeout,
                     uint8_t masterClockAccuracy);
 
-  virtual void handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
+  virtual void handleData(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
 
-  virtual void handleSecurityData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
+  virtual void handleSecurityData(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
 
   virtual void removeConnection(uint8_t handle, uint16_t reason);
 
@@ -3,6 +3,7 @@
 #include "HCI.h"
 #include "ArduinoBLE.h"
 BluetoothCryptoToolbox::BluetoothCryptoToolbox(){}
+BluetoothCryptoToolbox::~BluetoothCryptoToolbox(){}
 //    In step 1, AES-128 with key K is applied to an all-zero input block.
 //    In step 2, K1 is derived through the following operation:
 //    If the most significant bit of L is equal to 0, K1 is the left-shift
@@ -384,4 +385,7 @@ void BluetoothCryptoToolbox::xor_128(unsigned char *a, unsigned char *b, unsigne
         out[i] = a[i] ^ b[i];
     }
 }
-BluetoothCryptoToolbox btct;
+#if !defined(FAKE_BTCT)
+BluetoothCryptoToolbox btctObj;
+BluetoothCryptoToolbox& btct = btctObj;
+#endif
@@ -6,9 +6,10 @@
 class BluetoothCryptoToolbox{
 public:
     BluetoothCryptoToolbox();
+    virtual ~BluetoothCryptoToolbox();
     void printBytes(uint8_t bytes[], uint8_t length);
     void generateSubkey(uint8_t* K, uint8_t* K1, uint8_t* K2);
-    void AES_CMAC ( unsigned char *key, unsigned char *input, int length,
+    virtual void AES_CMAC ( unsigned char *key, unsigned char *input, int length,
                   unsigned char *mac );
     int f5(uint8_t DHKey[],uint8_t N_master[], uint8_t N_slave[],
             uint8_t BD_ADDR_master[], uint8_t BD_ADDR_slave[], uint8_t MacKey[], uint8_t LTK[]);
@@ -26,5 +27,5 @@ private:
     void xor_128(unsigned char *a, unsigned char *b, unsigned char *out);
     void padding ( unsigned char *lastb, unsigned char *pad, int length );
 };
-extern BluetoothCryptoToolbox btct;
+extern BluetoothCryptoToolbox& btct;
 #endif
\ No newline at end of file